@@ -16,7 +16,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <glib/gi18n.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "mongo-bson-stream.h"
 
@@ -31,12 +40,40 @@ G_DEFINE_TYPE(MongoBsonStream, mongo_bson_stream, G_TYPE_OBJECT)
  * contains #MongoBson documents sequentially one after another.
  * This is the case for backups of Mongo performed with the
  * mongodump command.
+ *
+ * For large files, mongo_bson_stream_load_from_mapped_file() maps the
+ * file into memory. Documents returned by mongo_bson_stream_next() are
+ * then views into the mapping rather than copies. A mapped stream can
+ * also be processed on several threads at once with
+ * mongo_bson_stream_scan_parallel().
  */
 
+#define DEFAULT_CHUNK_SIZE (4 * 1024 * 1024)
+#define MAX_DOCUMENT_SIZE  (16 * 1024 * 1024)
+
+typedef struct
+{
+   guint     index;
+   gsize     offset;
+   gsize     length;
+   gboolean  done;
+   gpointer  result;
+} Chunk;
+
+typedef struct
+{
+   GMappedFile              *mapped;
+   MongoBsonStreamChunkFunc  chunk_func;
+   gpointer                  user_data;
+   GAsyncQueue              *finished;
+} Scan;
+
 struct _MongoBsonStreamPrivate
 {
    GInputStream *stream;
    GIOChannel *channel;
+   GMappedFile *mapped;
+   gsize mapped_offset;
 };
 
 /**
@@ -76,7 +113,7 @@ mongo_bson_stream_load_from_channel (MongoBsonStream  *stream,
 
    priv = stream->priv;
 
-   if (priv->stream || priv->channel) {
+   if (priv->stream || priv->channel || priv->mapped) {
       g_set_error(error, MONGO_BSON_STREAM_ERROR,
                   MONGO_BSON_STREAM_ERROR_ALREADY_LOADED,
                   _("Cannot load stream, one is already loaded."));
@@ -115,7 +152,7 @@ mongo_bson_stream_load_from_file (MongoBsonStream  *stream,
 
    priv = stream->priv;
 
-   if (priv->stream || priv->channel) {
+   if (priv->stream || priv->channel || priv->mapped) {
       g_set_error(error, MONGO_BSON_STREAM_ERROR,
                   MONGO_BSON_STREAM_ERROR_ALREADY_LOADED,
                   _("Cannot load stream, one is already loaded."));
@@ -131,6 +168,336 @@ mongo_bson_stream_load_from_file (MongoBsonStream  *stream,
    return TRUE;
 }
 
+/**
+ * mongo_bson_stream_load_from_mapped_file:
+ * @stream: (in): A #MongoBsonStream.
+ * @filename: (in): The path of a file containing the BSON stream.
+ * @error: (out): A location for a #GError, or %NULL.
+ *
+ * Maps @filename into memory to be used for iterating BSON documents.
+ * Documents returned from mongo_bson_stream_next() point into the
+ * mapping and keep it alive, so no reads or copies are performed per
+ * document. The file must not be modified while it is mapped.
+ *
+ * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
+ */
+gboolean
+mongo_bson_stream_load_from_mapped_file (MongoBsonStream  *stream,
+                                         const gchar      *filename,
+                                         GError          **error)
+{
+   MongoBsonStreamPrivate *priv;
+   GMappedFile *mapped;
+
+   g_return_val_if_fail(MONGO_IS_BSON_STREAM(stream), FALSE);
+   g_return_val_if_fail(filename, FALSE);
+
+   priv = stream->priv;
+
+   if (priv->stream || priv->channel || priv->mapped) {
+      g_set_error(error, MONGO_BSON_STREAM_ERROR,
+                  MONGO_BSON_STREAM_ERROR_ALREADY_LOADED,
+                  _("Cannot load stream, one is already loaded."));
+      return FALSE;
+   }
+
+   if (!(mapped = g_mapped_file_new(filename, FALSE, error))) {
+      return FALSE;
+   }
+
+#if defined(HAVE_MADVISE) && defined(MADV_SEQUENTIAL)
+   /*
+    * Documents are consumed front to back, let the kernel read ahead
+    * aggressively and drop pages behind us.
+    */
+   if (g_mapped_file_get_length(mapped)) {
+      madvise(g_mapped_file_get_contents(mapped),
+              g_mapped_file_get_length(mapped),
+              MADV_SEQUENTIAL);
+   }
+#endif
+
+   priv->mapped = mapped;
+   priv->mapped_offset = 0;
+
+   return TRUE;
+}
+
+/*
+ * Reads the length of the document at @offset and checks that it fits
+ * within the mapping. Returns 0 if there is no valid document there.
+ */
+static guint32
+mongo_bson_stream_peek_mapped (const guint8 *data,
+                               gsize         length,
+                               gsize         offset)
+{
+   guint32 doc_len;
+
+   if ((length - offset) < sizeof doc_len) {
+      return 0;
+   }
+
+   memcpy(&doc_len, data + offset, sizeof doc_len);
+   doc_len = GUINT32_FROM_LE(doc_len);
+
+   /*
+    * Sanity check to make sure it is less than 16 MB and
+    * greater than 5 bytes (minimum required).
+    */
+   if (doc_len > MAX_DOCUMENT_SIZE || doc_len <= 5) {
+      return 0;
+   }
+
+   if (doc_len > (length - offset)) {
+      return 0;
+   }
+
+   return doc_len;
+}
+
+/*
+ * Returns a view of the next document within the mapped file.
+ */
+static MongoBson *
+mongo_bson_stream_next_mapped (MongoBsonStream *stream)
+{
+   MongoBsonStreamPrivate *priv;
+   MongoBson *bson;
+   guint32 doc_len;
+   guint8 *data;
+
+   priv = stream->priv;
+
+   data = (guint8 *)g_mapped_file_get_contents(priv->mapped);
+   doc_len = mongo_bson_stream_peek_mapped(data,
+                                           g_mapped_file_get_length(priv->mapped),
+                                           priv->mapped_offset);
+   if (!doc_len) {
+      return NULL;
+   }
+
+   bson = mongo_bson_new_from_static_data(data + priv->mapped_offset,
+                                          doc_len,
+                                          (GDestroyNotify)g_mapped_file_unref,
+                                          g_mapped_file_ref(priv->mapped));
+   priv->mapped_offset += doc_len;
+
+   return bson;
+}
+
+static void
+mongo_bson_stream_scan_worker (gpointer data,
+                               gpointer user_data)
+{
+   GMappedFile *mapped;
+   GPtrArray *documents;
+   guint8 *contents;
+   guint32 doc_len;
+   Chunk *chunk = data;
+   Scan *scan = user_data;
+   gsize offset;
+
+   /*
+    * The documents only borrow the mapping for the duration of
+    * chunk_func, so a single reference covers the whole chunk instead
+    * of every worker bumping the mapping's refcount per document.
+    */
+   mapped = g_mapped_file_ref(scan->mapped);
+   contents = (guint8 *)g_mapped_file_get_contents(mapped);
+   documents = g_ptr_array_new_with_free_func(
+      (GDestroyNotify)mongo_bson_unref);
+
+   /*
+    * Chunk boundaries were computed from validated document lengths.
+    */
+   for (offset = chunk->offset;
+        offset < (chunk->offset + chunk->length);
+        offset += doc_len) {
+      memcpy(&doc_len, contents + offset, sizeof doc_len);
+      doc_len = GUINT32_FROM_LE(doc_len);
+      g_ptr_array_add(documents,
+                      mongo_bson_new_from_static_data(contents + offset,
+                                                      doc_len,
+                                                      NULL,
+                                                      NULL));
+   }
+
+   chunk->result = scan->chunk_func(documents, scan->user_data);
+   g_ptr_array_unref(documents);
+   g_mapped_file_unref(mapped);
+
+   g_async_queue_push(scan->finished, chunk);
+}
+
+/**
+ * mongo_bson_stream_scan_parallel:
+ * @stream: (in): A #MongoBsonStream.
+ * @n_threads: The number of worker threads, or 0 for one per processor.
+ * @chunk_size: The target size of each chunk in bytes, or 0 for a default.
+ * @ordered: If @merge_func should see results in file order.
+ * @chunk_func: (scope call): A #MongoBsonStreamChunkFunc.
+ * @merge_func: (scope call) (allow-none): A #MongoBsonStreamMergeFunc.
+ * @user_data: (closure): User data for @chunk_func and @merge_func.
+ * @error: (out): A location for a #GError, or %NULL.
+ *
+ * Splits the remaining documents of a stream loaded with
+ * mongo_bson_stream_load_from_mapped_file() into chunks of whole
+ * documents and calls @chunk_func for each chunk on a pool of
+ * @n_threads threads. The documents passed to @chunk_func are views that
+ * borrow the mapping and are only valid until @chunk_func returns.
+ *
+ * The value returned from @chunk_func is passed to @merge_func on the
+ * calling thread. If @ordered is %TRUE, results are merged in the order
+ * the chunks appear in the file; otherwise they are merged as soon as
+ * each chunk completes.
+ *
+ * This function blocks until every chunk has been merged. The stream is
+ * positioned after the last document that was scanned. If a corrupt or
+ * truncated document is found, the documents before it are still
+ * scanned, but %MONGO_BSON_STREAM_ERROR_CORRUPT is returned.
+ *
+ * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
+ */
+gboolean
+mongo_bson_stream_scan_parallel (MongoBsonStream           *stream,
+                                 guint                      n_threads,
+                                 gsize                      chunk_size,
+                                 gboolean                   ordered,
+                                 MongoBsonStreamChunkFunc   chunk_func,
+                                 MongoBsonStreamMergeFunc   merge_func,
+                                 gpointer                   user_data,
+                                 GError                   **error)
+{
+   MongoBsonStreamPrivate *priv;
+   GThreadPool *pool;
+   GPtrArray *chunks;
+   guint8 *data;
+   guint32 doc_len;
+   Chunk *chunk = NULL;
+   Scan scan;
+   gsize length;
+   gsize offset;
+   guint next_merge = 0;
+   guint i;
+
+   g_return_val_if_fail(MONGO_IS_BSON_STREAM(stream), FALSE);
+   g_return_val_if_fail(chunk_func, FALSE);
+
+   priv = stream->priv;
+
+   if (!priv->mapped) {
+      g_set_error(error, MONGO_BSON_STREAM_ERROR,
+                  MONGO_BSON_STREAM_ERROR_NOT_MAPPED,
+                  _("Parallel scans require a mapped file."));
+      return FALSE;
+   }
+
+   if (!n_threads) {
+#if GLIB_CHECK_VERSION(2, 36, 0)
+      n_threads = g_get_num_processors();
+#else
+      n_threads = 4;
+#endif
+   }
+
+   if (!chunk_size) {
+      chunk_size = DEFAULT_CHUNK_SIZE;
+   }
+
+   data = (guint8 *)g_mapped_file_get_contents(priv->mapped);
+   length = g_mapped_file_get_length(priv->mapped);
+
+   /*
+    * Hop over the document lengths to find document aligned chunk
+    * boundaries. This is cheap compared to what the workers do.
+    */
+   chunks = g_ptr_array_new_with_free_func(g_free);
+   for (offset = priv->mapped_offset;
+        (doc_len = mongo_bson_stream_peek_mapped(data, length, offset));
+        offset += doc_len) {
+      if (!chunk || (chunk->length >= chunk_size)) {
+         chunk = g_new0(Chunk, 1);
+         chunk->index = chunks->len;
+         chunk->offset = offset;
+         g_ptr_array_add(chunks, chunk);
+      }
+      chunk->length += doc_len;
+   }
+
+   if (!chunks->len) {
+      g_ptr_array_unref(chunks);
+      goto finish;
+   }
+
+   scan.mapped = priv->mapped;
+   scan.chunk_func = chunk_func;
+   scan.user_data = user_data;
+   scan.finished = g_async_queue_new();
+
+   if (!(pool = g_thread_pool_new(mongo_bson_stream_scan_worker,
+                                  &scan,
+                                  MIN(n_threads, chunks->len),
+                                  TRUE,
+                                  error))) {
+      g_async_queue_unref(scan.finished);
+      g_ptr_array_unref(chunks);
+      return FALSE;
+   }
+
+   for (i = 0; i < chunks->len; i++) {
+      g_thread_pool_push(pool, g_ptr_array_index(chunks, i), NULL);
+   }
+
+   for (i = 0; i < chunks->len; i++) {
+      chunk = g_async_queue_pop(scan.finished);
+      chunk->done = TRUE;
+
+      if (!ordered) {
+         if (merge_func) {
+            merge_func(chunk->result, user_data);
+         }
+         continue;
+      }
+
+      /*
+       * Merge every chunk that is now in order.
+       */
+      while (next_merge < chunks->len) {
+         chunk = g_ptr_array_index(chunks, next_merge);
+         if (!chunk->done) {
+            break;
+         }
+         if (merge_func) {
+            merge_func(chunk->result, user_data);
+         }
+         next_merge++;
+      }
+   }
+
+   g_thread_pool_free(pool, FALSE, TRUE);
+   g_async_queue_unref(scan.finished);
+   g_ptr_array_unref(chunks);
+
+finish:
+   priv->mapped_offset = offset;
+
+   /*
+    * The length of the document at @offset was invalid or ran past the
+    * end of the file.
+    */
+   if (offset < length) {
+      g_set_error(error, MONGO_BSON_STREAM_ERROR,
+                  MONGO_BSON_STREAM_ERROR_CORRUPT,
+                  _("Corrupt or truncated document at offset %"
+                    G_GSIZE_FORMAT "."),
+                  offset);
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
 static gboolean
 mongo_bson_stream_read_channel (MongoBsonStream *stream,
                                 guint8          *buffer,
@@ -260,7 +627,9 @@ mongo_bson_stream_read (MongoBsonStream *stream,
  * mongo_bson_stream_next:
  * @stream: (in): A #MongoBsonStream.
  *
- * Gets the next #MongoBson document found in the stream.
+ * Gets the next #MongoBson document found in the stream. If the stream
+ * was loaded with mongo_bson_stream_load_from_mapped_file(), the document
+ * is a view into the mapped file.
  *
  * Returns: (transfer full): A #MongoBson if successful; otherwise %NULL.
  */
@@ -274,9 +643,14 @@ mongo_bson_stream_next (MongoBsonStream *stream)
 
    g_return_val_if_fail(MONGO_IS_BSON_STREAM(stream), NULL);
    g_return_val_if_fail(stream->priv->stream ||
-                        stream->priv->channel,
+                        stream->priv->channel ||
+                        stream->priv->mapped,
                         NULL);
 
+   if (stream->priv->mapped) {
+      return mongo_bson_stream_next_mapped(stream);
+   }
+
    if (!mongo_bson_stream_read(stream,
                                (guint8 *)&doc_len_le,
                                sizeof doc_len_le,
@@ -290,7 +664,7 @@ mongo_bson_stream_next (MongoBsonStream *stream)
     * Sanity check to make sure it is less than 16 MB and
     * greater than 5 bytes (minimum required).
     */
-   if (doc_len > (1024 * 1024 * 16) || doc_len <= 5) {
+   if (doc_len > MAX_DOCUMENT_SIZE || doc_len <= 5) {
       return NULL;
    }
 
@@ -328,6 +702,11 @@ mongo_bson_stream_finalize (GObject *object)
       stream->priv->channel = NULL;
    }
 
+   if (stream->priv->mapped) {
+      g_mapped_file_unref(stream->priv->mapped);
+      stream->priv->mapped = NULL;
+   }
+
    G_OBJECT_CLASS(mongo_bson_stream_parent_class)->finalize(object);
 }
 
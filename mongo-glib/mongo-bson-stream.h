@@ -46,8 +46,35 @@ typedef enum   _MongoBsonStreamError   MongoBsonStreamError;
 enum _MongoBsonStreamError
 {
    MONGO_BSON_STREAM_ERROR_ALREADY_LOADED = 1,
+   MONGO_BSON_STREAM_ERROR_NOT_MAPPED,
+   MONGO_BSON_STREAM_ERROR_CORRUPT,
 };
 
+/**
+ * MongoBsonStreamChunkFunc:
+ * @documents: (element-type MongoBson): The documents of the chunk.
+ * @user_data: User data provided to mongo_bson_stream_scan_parallel().
+ *
+ * Called from a worker thread for each chunk of a parallel scan.
+ * @documents and the documents in it are only valid for the duration of
+ * the call; copy any #MongoBson that must outlive it with mongo_bson_dup().
+ *
+ * Returns: A result that is passed to the #MongoBsonStreamMergeFunc.
+ */
+typedef gpointer (*MongoBsonStreamChunkFunc) (GPtrArray *documents,
+                                              gpointer   user_data);
+
+/**
+ * MongoBsonStreamMergeFunc:
+ * @result: The result of a #MongoBsonStreamChunkFunc.
+ * @user_data: User data provided to mongo_bson_stream_scan_parallel().
+ *
+ * Called from the thread running mongo_bson_stream_scan_parallel() for
+ * the result of each chunk.
+ */
+typedef void (*MongoBsonStreamMergeFunc) (gpointer result,
+                                          gpointer user_data);
+
 struct _MongoBsonStream
 {
    GObject parent;
@@ -75,7 +102,18 @@ gboolean         mongo_bson_stream_load_from_file    (MongoBsonStream  *stream,
 gboolean         mongo_bson_stream_load_from_channel (MongoBsonStream  *stream,
                                                       GIOChannel       *channel,
                                                       GError          **error);
+gboolean         mongo_bson_stream_load_from_mapped_file (MongoBsonStream  *stream,
+                                                          const gchar      *filename,
+                                                          GError          **error);
 MongoBson       *mongo_bson_stream_next              (MongoBsonStream  *stream);
+gboolean         mongo_bson_stream_scan_parallel     (MongoBsonStream           *stream,
+                                                      guint                      n_threads,
+                                                      gsize                      chunk_size,
+                                                      gboolean                   ordered,
+                                                      MongoBsonStreamChunkFunc   chunk_func,
+                                                      MongoBsonStreamMergeFunc   merge_func,
+                                                      gpointer                   user_data,
+                                                      GError                   **error);
 
 G_END_DECLS
 
@@ -52,7 +52,7 @@
  * modified UTF-8.
  */
 
-#define ITER_IS_TYPE(iter, type) (GPOINTER_TO_INT(iter->user_data5) == type)
+#define ITER_IS_TYPE(iter, type) (iter->flags == type)
 
 const gchar *
 utf8_check (const gchar *str,
@@ -69,6 +69,124 @@ utf8_check (const gchar *str,
 #endif
 }
 
+/*
+ * MongoBsonReal is the allocation behind every #MongoBson. @alloc is
+ * the size of the allocation at @bson.data, or 0 if @bson.data points
+ * into memory owned by somebody else. That memory is kept alive until
+ * @notify is called with @notify_data. @shared holds memory that was
+ * handed out by _mongo_bson_share() and must no longer be written to.
+ */
+typedef struct
+{
+   MongoBson       bson;
+   volatile gint   ref_count;
+   gsize           alloc;
+   GDestroyNotify  notify;
+   gpointer        notify_data;
+   GBytes         *shared;
+} MongoBsonReal;
+
+#define BSON_IS_VIEW(b) (((MongoBsonReal *)(b))->alloc == 0)
+
+static MongoBson *
+mongo_bson_alloc (const guint8 *data,
+                  gsize         length)
+{
+   MongoBsonReal *real;
+
+   real = g_slice_new0(MongoBsonReal);
+   real->ref_count = 1;
+   real->alloc = MAX(32, length);
+   real->bson.data = g_malloc(real->alloc);
+   real->bson.len = length;
+   memcpy(real->bson.data, data, length);
+
+   return &real->bson;
+}
+
+/*
+ * Makes sure there is room for @needed more bytes at the end of @bson.
+ * A view is copied into a new allocation the first time it is modified.
+ * The memory it was viewing stays alive until @bson is freed since other
+ * views may have been created from it.
+ */
+static void
+mongo_bson_grow (MongoBson *bson,
+                 gsize      needed)
+{
+   MongoBsonReal *real = (MongoBsonReal *)bson;
+   guint8 *data;
+   gsize alloc;
+
+   if ((bson->len + needed) <= real->alloc) {
+      return;
+   }
+
+   alloc = MAX(32, real->alloc);
+   while (alloc < (bson->len + needed)) {
+      alloc <<= 1;
+   }
+
+   if (BSON_IS_VIEW(bson)) {
+      data = g_malloc(alloc);
+      memcpy(data, bson->data, bson->len);
+      bson->data = data;
+   } else {
+      bson->data = g_realloc(bson->data, alloc);
+   }
+
+   real->alloc = alloc;
+}
+
+static void
+mongo_bson_write (MongoBson    *bson,
+                  const guint8 *data,
+                  gsize         length)
+{
+   mongo_bson_grow(bson, length);
+   memcpy(bson->data + bson->len, data, length);
+   bson->len += length;
+}
+
+/*
+ * Hands out the document in @bson as a #GBytes that stays unchanged
+ * whatever is done to @bson afterwards. Memory owned by @bson is moved
+ * into the #GBytes and @bson becomes a view of it, so the next change
+ * to @bson copies it first (see mongo_bson_grow()).
+ */
+GBytes *
+_mongo_bson_share (MongoBson *bson)
+{
+   MongoBsonReal *real = (MongoBsonReal *)bson;
+
+   g_return_val_if_fail(bson, NULL);
+
+   if (!BSON_IS_VIEW(bson)) {
+      /*
+       * Shared before and modified since. The previous memory is still
+       * in use, so fall back to a copy.
+       */
+      if (real->shared) {
+         return g_bytes_new(bson->data, bson->len);
+      }
+      real->shared = g_bytes_new_take(bson->data, bson->len);
+      real->alloc = 0;
+   }
+
+   if (real->shared) {
+      return g_bytes_ref(real->shared);
+   }
+
+   /*
+    * Views are never written to and the memory they point at stays
+    * alive until @bson is freed.
+    */
+   return g_bytes_new_with_free_func(bson->data,
+                                     bson->len,
+                                     (GDestroyNotify)mongo_bson_unref,
+                                     mongo_bson_ref(bson));
+}
+
 /**
  * mongo_bson_new_from_data:
  * @buffer: (array length=length): The buffer to create a #MongoBson.
@@ -83,7 +201,6 @@ MongoBson *
 mongo_bson_new_from_data (const guint8 *buffer,
                           gsize         length)
 {
-   GByteArray *bson;
    guint32 bson_len;
 
    g_return_val_if_fail(buffer != NULL, NULL);
@@ -98,10 +215,55 @@ mongo_bson_new_from_data (const guint8 *buffer,
       return NULL;
    }
 
-   bson = g_byte_array_sized_new(length);
-   g_byte_array_append(bson, buffer, length);
+   return mongo_bson_alloc(buffer, length);
+}
 
-   return (MongoBson *)bson;
+/**
+ * mongo_bson_new_from_static_data:
+ * @buffer: (array length=length): A buffer containing a BSON document.
+ * @length: The length of @buffer.
+ * @notify: (allow-none): A #GDestroyNotify or %NULL.
+ * @notify_data: Data for @notify.
+ *
+ * Creates a new #MongoBson that points at @buffer instead of copying it.
+ * @buffer must remain valid until @notify is called with @notify_data,
+ * which happens when the #MongoBson is freed. This can be used to hand
+ * out documents that live inside a larger buffer, such as a reply from
+ * the server, by passing a reference to that buffer as @notify_data.
+ *
+ * The resulting #MongoBson is a view and @buffer is never written to.
+ * Appending to it will first copy the document into memory owned by
+ * the #MongoBson.
+ *
+ * Returns: (transfer full): A new #MongoBson that should be freed
+ *   with mongo_bson_unref().
+ */
+MongoBson *
+mongo_bson_new_from_static_data (guint8         *buffer,
+                                 gsize           length,
+                                 GDestroyNotify  notify,
+                                 gpointer        notify_data)
+{
+   MongoBsonReal *real;
+   guint32 bson_len;
+
+   g_return_val_if_fail(buffer != NULL, NULL);
+   g_return_val_if_fail(length >= 5, NULL);
+
+   memcpy(&bson_len, buffer, sizeof bson_len);
+   bson_len = GUINT32_FROM_LE(bson_len);
+   if (bson_len != length) {
+      return NULL;
+   }
+
+   real = g_slice_new0(MongoBsonReal);
+   real->ref_count = 1;
+   real->bson.data = buffer;
+   real->bson.len = length;
+   real->notify = notify;
+   real->notify_data = notify_data;
+
+   return &real->bson;
 }
 
 /**
@@ -119,6 +281,7 @@ MongoBson *
 mongo_bson_new_take_data (guint8 *buffer,
                           gsize   length)
 {
+   MongoBsonReal *real;
    guint32 bson_len;
 
    g_return_val_if_fail(buffer, NULL);
@@ -134,7 +297,13 @@ mongo_bson_new_take_data (guint8 *buffer,
       return NULL;
    }
 
-   return (MongoBson *)g_byte_array_new_take(buffer, length);
+   real = g_slice_new0(MongoBsonReal);
+   real->ref_count = 1;
+   real->alloc = length;
+   real->bson.data = buffer;
+   real->bson.len = length;
+
+   return &real->bson;
 }
 
 /**
@@ -150,11 +319,8 @@ MongoBson *
 mongo_bson_new_empty (void)
 {
    static const guint8 empty_bson[] = { 5, 0, 0, 0, 0 };
-   GByteArray *ar;
 
-   ar = g_byte_array_new();
-   g_byte_array_append(ar, empty_bson, G_N_ELEMENTS(empty_bson));
-   return (MongoBson *)ar;
+   return mongo_bson_alloc(empty_bson, G_N_ELEMENTS(empty_bson));
 }
 
 /**
@@ -192,13 +358,8 @@ mongo_bson_new (void)
 MongoBson *
 mongo_bson_dup (const MongoBson *bson)
 {
-   GByteArray *copy;
-   GByteArray *ar;
-
-   if ((ar = (GByteArray *)bson)) {
-      copy = g_byte_array_sized_new(ar->len);
-      g_byte_array_append(copy, ar->data, ar->len);
-      return (MongoBson *)copy;
+   if (bson) {
+      return mongo_bson_alloc(bson->data, bson->len);
    }
 
    return NULL;
@@ -215,7 +376,13 @@ mongo_bson_dup (const MongoBson *bson)
 MongoBson *
 mongo_bson_ref (MongoBson *bson)
 {
-   return (MongoBson *)g_byte_array_ref((GByteArray *)bson);
+   MongoBsonReal *real = (MongoBsonReal *)bson;
+
+   g_return_val_if_fail(bson, NULL);
+   g_return_val_if_fail(real->ref_count > 0, NULL);
+
+   g_atomic_int_inc(&real->ref_count);
+   return bson;
 }
 
 /**
@@ -229,7 +396,23 @@ mongo_bson_ref (MongoBson *bson)
 void
 mongo_bson_unref (MongoBson *bson)
 {
-   g_byte_array_unref((GByteArray *)bson);
+   MongoBsonReal *real = (MongoBsonReal *)bson;
+
+   g_return_if_fail(bson);
+   g_return_if_fail(real->ref_count > 0);
+
+   if (g_atomic_int_dec_and_test(&real->ref_count)) {
+      if (!BSON_IS_VIEW(bson)) {
+         g_free(bson->data);
+      }
+      if (real->shared) {
+         g_bytes_unref(real->shared);
+      }
+      if (real->notify) {
+         real->notify(real->notify_data);
+      }
+      g_slice_free(MongoBsonReal, real);
+   }
 }
 
 /**
@@ -243,9 +426,8 @@ mongo_bson_unref (MongoBson *bson)
 gboolean
 mongo_bson_get_empty (MongoBson *bson)
 {
-   GByteArray *ar = (GByteArray *)bson;
-   g_return_val_if_fail(ar, FALSE);
-   return (ar->len == 5);
+   g_return_val_if_fail(bson, FALSE);
+   return (bson->len == 5);
 }
 
 /**
@@ -333,8 +515,8 @@ mongo_bson_append (MongoBson    *bson,
                    gsize         len2)
 {
    const guint8 trailing = 0;
-   GByteArray *buf = (GByteArray *)bson;
    gint32 doc_len;
+   gsize key_len;
 
    g_return_if_fail(bson);
    g_return_if_fail(type);
@@ -344,36 +526,43 @@ mongo_bson_append (MongoBson    *bson,
    g_return_if_fail(data2 || !len2);
    g_return_if_fail(!data2 || data1);
 
+   /*
+    * Make room for the whole field up front so that a view is only
+    * copied once.
+    */
+   key_len = strlen(key) + 1;
+   mongo_bson_grow(bson, key_len + len1 + len2 + 1);
+
    /*
     * Overwrite our trailing byte with the type for this key.
     */
-   buf->data[buf->len - 1] = type;
+   bson->data[bson->len - 1] = type;
 
    /*
     * Append the field name as a BSON cstring.
     */
-   g_byte_array_append(buf, (guint8 *)key, strlen(key) + 1);
+   mongo_bson_write(bson, (guint8 *)key, key_len);
 
    /*
     * Append the data sections if needed.
     */
    if (data1) {
-      g_byte_array_append(buf, data1, len1);
+      mongo_bson_write(bson, data1, len1);
       if (data2) {
-         g_byte_array_append(buf, data2, len2);
+         mongo_bson_write(bson, data2, len2);
       }
    }
 
    /*
     * Append our trailing byte.
     */
-   g_byte_array_append(buf, &trailing, 1);
+   mongo_bson_write(bson, &trailing, 1);
 
    /*
     * Update the document length of the buffer.
     */
-   doc_len = GUINT32_TO_LE(buf->len);
-   memcpy(buf->data, &doc_len, sizeof doc_len);
+   doc_len = GUINT32_TO_LE(bson->len);
+   memcpy(bson->data, &doc_len, sizeof doc_len);
 }
 
 /**
@@ -708,6 +897,39 @@ mongo_bson_iter_init (MongoBsonIter   *iter,
    iter->user_data1 = bson->data;
    iter->user_data2 = GINT_TO_POINTER(bson->len);
    iter->user_data3 = GINT_TO_POINTER(3); /* End of size buffer */
+
+   /*
+    * Views never change their buffer, so sub-documents can be handed
+    * out as views too as long as they hold a reference on @bson.
+    */
+   if (BSON_IS_VIEW(bson)) {
+      iter->user_data5 = (MongoBson *)bson;
+   }
+}
+
+/**
+ * mongo_bson_iter_init_from_data:
+ * @iter: an uninitialized #MongoBsonIter.
+ * @data: (array length=length): A buffer containing a BSON document.
+ * @length: The length of @data.
+ *
+ * Initializes a #MongoBsonIter for iterating through a BSON document
+ * stored in @data without creating a #MongoBson. @data must remain valid
+ * for as long as @iter is in use.
+ */
+void
+mongo_bson_iter_init_from_data (MongoBsonIter *iter,
+                                const guint8  *data,
+                                gsize          length)
+{
+   g_return_if_fail(iter != NULL);
+   g_return_if_fail(data != NULL);
+   g_return_if_fail(length >= 5);
+
+   memset(iter, 0, sizeof *iter);
+   iter->user_data1 = (guint8 *)data;
+   iter->user_data2 = GSIZE_TO_POINTER(length);
+   iter->user_data3 = GINT_TO_POINTER(3); /* End of size buffer */
 }
 
 /**
@@ -801,7 +1023,14 @@ mongo_bson_iter_get_value_document (MongoBsonIter *iter,
          return NULL;
       }
       buffer = iter->user_data6;
-      ret = mongo_bson_new_from_data(buffer, array_len);
+      if (iter->user_data5) {
+         ret = mongo_bson_new_from_static_data((guint8 *)buffer,
+                                               array_len,
+                                               (GDestroyNotify)mongo_bson_unref,
+                                               mongo_bson_ref(iter->user_data5));
+      } else {
+         ret = mongo_bson_new_from_data(buffer, array_len);
+      }
       RETURN(ret);
    }
 
@@ -820,10 +1049,11 @@ mongo_bson_iter_get_value_document (MongoBsonIter *iter,
  * mongo_bson_iter_get_value_array:
  * @iter: (in): A #MongoBsonIter.
  *
- * Fetches the array document current pointed to by @iter. This makes a
- * copy of the document and returns a new #MongoBson instance. For more
- * optimized cases, you may want to use mongo_bson_iter_recurse() to avoid
- * copying the memory if only iteration is needed.
+ * Fetches the array document current pointed to by @iter. If @iter was
+ * created from a view (see mongo_bson_new_from_static_data()), the result
+ * is a view into the same buffer. Otherwise the document is copied. For
+ * more optimized cases, you may want to use mongo_bson_iter_recurse() to
+ * avoid creating a #MongoBson if only iteration is needed.
  *
  * Returns: (transfer full): A #MongoBson.
  */
@@ -880,9 +1110,10 @@ mongo_bson_iter_get_value_boolean (MongoBsonIter *iter)
  * @iter: (in): A #MongoBsonIter.
  *
  * Fetches the current value pointed to by @iter if it is a
- * %MONGO_BSON_DOCUMENT. The document is copied and returned as a new
- * #MongoBson instance. If you simply need to iterate the child document,
- * you may want to use mongo_bson_iter_recurse().
+ * %MONGO_BSON_DOCUMENT. If @iter was created from a view (see
+ * mongo_bson_new_from_static_data()), the result is a view into the same
+ * buffer. Otherwise the document is copied. If you simply need to iterate
+ * the child document, you may want to use mongo_bson_iter_recurse().
  *
  * Returns: (transfer full): A #MongoBson if successful; otherwise %NULL.
  */
@@ -1130,9 +1361,9 @@ mongo_bson_iter_get_value_type (MongoBsonIter *iter)
    MongoBsonType type;
 
    g_return_val_if_fail(iter != NULL, 0);
-   g_return_val_if_fail(iter->user_data5 != NULL, 0);
+   g_return_val_if_fail(iter->flags != 0, 0);
 
-   type = GPOINTER_TO_INT(iter->user_data5);
+   type = iter->flags;
 
    switch (type) {
    case MONGO_BSON_DOUBLE:
@@ -1203,6 +1434,7 @@ mongo_bson_iter_recurse (MongoBsonIter *iter,
       child->user_data1 = iter->user_data6;
       child->user_data2 = GINT_TO_POINTER(GINT_FROM_LE(buflen));
       child->user_data3 = GINT_TO_POINTER(3); /* End of size buffer */
+      child->user_data5 = iter->user_data5;
       return TRUE;
    }
 
@@ -1260,7 +1492,7 @@ mongo_bson_iter_next (MongoBsonIter *iter)
    rawbuf_len = GPOINTER_TO_SIZE(iter->user_data2);
    offset = GPOINTER_TO_SIZE(iter->user_data3);
    key = (const gchar *)iter->user_data4;
-   type = GPOINTER_TO_INT(iter->user_data5);
+   type = iter->flags;
    value1 = (const guint8 *)iter->user_data6;
    value2 = (const guint8 *)iter->user_data7;
 
@@ -1397,7 +1629,7 @@ mongo_bson_iter_next (MongoBsonIter *iter)
 success:
    iter->user_data3 = GSIZE_TO_POINTER(offset);
    iter->user_data4 = (gpointer)key;
-   iter->user_data5 = GINT_TO_POINTER(type);
+   iter->flags = type;
    iter->user_data6 = (gpointer)value1;
    iter->user_data7 = (gpointer)value2;
    RETURN(TRUE);
@@ -1564,17 +1796,16 @@ void
 mongo_bson_join (MongoBson       *bson,
                  const MongoBson *other)
 {
-   GByteArray *ar = (GByteArray *)bson;
    guint32 new_size;
 
    g_return_if_fail(bson);
    g_return_if_fail(other);
 
    if (other->len > 5) {
-      g_byte_array_remove_index(ar, ar->len - 1);
-      g_byte_array_append(ar, other->data + 4, other->len - 4);
+      mongo_bson_grow(bson, other->len - 5);
+      bson->len--;
+      mongo_bson_write(bson, other->data + 4, other->len - 4);
+      new_size = GUINT32_TO_LE(bson->len);
+      memcpy(bson->data, &new_size, sizeof new_size);
    }
-
-   new_size = GUINT32_TO_LE(ar->len);
-   memcpy(bson->data, &new_size, sizeof new_size);
 }
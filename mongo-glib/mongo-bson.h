@@ -256,10 +256,10 @@ struct _MongoBsonIter
    gpointer user_data2; /* Raw buffer length */
    gpointer user_data3; /* Offset */
    gpointer user_data4; /* Key */
-   gpointer user_data5; /* Type */
+   gpointer user_data5; /* Parent view */
    gpointer user_data6; /* Value1 */
    gpointer user_data7; /* Value2 */
-   gint32   flags;
+   gint32   flags;      /* Type */
    gint32   reserved1;
 };
 
@@ -271,6 +271,10 @@ MongoBson     *mongo_bson_new_from_data            (const guint8    *buffer,
                                                     gsize            length);
 MongoBson     *mongo_bson_new_take_data            (guint8          *buffer,
                                                     gsize            length);
+MongoBson     *mongo_bson_new_from_static_data     (guint8          *buffer,
+                                                    gsize            length,
+                                                    GDestroyNotify   notify,
+                                                    gpointer         notify_data);
 MongoBson     *mongo_bson_dup                      (const MongoBson *bson);
 MongoBson     *mongo_bson_ref                      (MongoBson       *bson);
 void           mongo_bson_unref                    (MongoBson       *bson);
@@ -317,6 +321,9 @@ void           mongo_bson_join                     (MongoBson       *bson,
                                                     const MongoBson *other);
 void           mongo_bson_iter_init                (MongoBsonIter   *iter,
                                                     const MongoBson *bson);
+void           mongo_bson_iter_init_from_data      (MongoBsonIter   *iter,
+                                                    const guint8    *data,
+                                                    gsize            length);
 gboolean       mongo_bson_iter_init_find           (MongoBsonIter   *iter,
                                                     const MongoBson *bson,
                                                     const gchar     *key);
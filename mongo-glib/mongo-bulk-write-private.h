@@ -0,0 +1,58 @@
+/* mongo-bulk-write-private.h
+ *
+ * Copyright (C) 2012 Christian Hergert <chris@dronelabs.com>
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MONGO_BULK_WRITE_PRIVATE_H
+#define MONGO_BULK_WRITE_PRIVATE_H
+
+#include "mongo-bulk-write.h"
+#include "mongo-operation.h"
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+   MongoOperation        oper;
+   guint                 flags;
+   MongoBson            *selector;
+   MongoBson            *document;
+   MongoBulkWriteStatus  status;
+   GError               *error;
+   MongoBson            *reply;
+} MongoBulkWriteOp;
+
+struct _MongoBulkWrite
+{
+   volatile gint  ref_count;
+   gboolean       ordered;
+   gboolean       executing;
+   GArray        *ops;
+};
+
+#define mongo_bulk_write_index(b,i) \
+   (&g_array_index((b)->ops, MongoBulkWriteOp, (i)))
+
+void mongo_bulk_write_complete (MongoBulkWrite *bulk,
+                                guint           first,
+                                guint           n_ops,
+                                const GError   *error,
+                                MongoBson      *reply);
+void mongo_bulk_write_reset    (MongoBulkWrite *bulk);
+
+G_END_DECLS
+
+#endif /* MONGO_BULK_WRITE_PRIVATE_H */
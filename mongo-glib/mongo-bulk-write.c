@@ -0,0 +1,391 @@
+/* mongo-bulk-write.c
+ *
+ * Copyright (C) 2012 Christian Hergert <chris@dronelabs.com>
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mongo-bulk-write-private.h"
+#include "mongo-flags.h"
+
+/**
+ * SECTION:mongo-bulk-write
+ * @title: MongoBulkWrite
+ * @short_description: Batches of insert, update, and delete operations.
+ *
+ * #MongoBulkWrite collects a sequence of write operations to be executed
+ * with mongo_collection_bulk_write_async(). Consecutive inserts are sent
+ * as a single wire message, so large batches of mixed operations need far
+ * fewer round trips than issuing each write individually.
+ *
+ * An ordered bulk write executes its operations one message at a time and
+ * stops at the first failure. An unordered bulk write pipelines a bounded
+ * number of messages and continues past failures.
+ *
+ * Once executed, the outcome of each operation may be inspected with
+ * mongo_bulk_write_get_status() and mongo_bulk_write_get_error().
+ *
+ * Documents are referenced, not copied, when added to a #MongoBulkWrite.
+ * They must not be modified until the bulk write has been executed.
+ */
+
+static void
+mongo_bulk_write_op_clear (MongoBulkWriteOp *op)
+{
+   mongo_clear_bson(&op->selector);
+   mongo_clear_bson(&op->document);
+   mongo_clear_bson(&op->reply);
+   g_clear_error(&op->error);
+}
+
+/**
+ * mongo_bulk_write_new:
+ * @ordered: If the operations must be executed in order.
+ *
+ * Creates a new, empty #MongoBulkWrite.
+ *
+ * Returns: (transfer full): A #MongoBulkWrite.
+ */
+MongoBulkWrite *
+mongo_bulk_write_new (gboolean ordered)
+{
+   MongoBulkWrite *bulk;
+
+   bulk = g_slice_new0(MongoBulkWrite);
+   bulk->ref_count = 1;
+   bulk->ordered = !!ordered;
+   bulk->ops = g_array_new(FALSE, TRUE, sizeof(MongoBulkWriteOp));
+
+   return bulk;
+}
+
+/**
+ * mongo_bulk_write_ref:
+ * @bulk: (in): A #MongoBulkWrite.
+ *
+ * Increments the reference count of @bulk by one.
+ *
+ * Returns: (transfer full): @bulk.
+ */
+MongoBulkWrite *
+mongo_bulk_write_ref (MongoBulkWrite *bulk)
+{
+   g_return_val_if_fail(bulk, NULL);
+   g_return_val_if_fail(bulk->ref_count > 0, NULL);
+
+   g_atomic_int_inc(&bulk->ref_count);
+   return bulk;
+}
+
+/**
+ * mongo_bulk_write_unref:
+ * @bulk: (in): A #MongoBulkWrite.
+ *
+ * Decrements the reference count of @bulk by one. When the reference
+ * count reaches zero, the operations and their results are released.
+ */
+void
+mongo_bulk_write_unref (MongoBulkWrite *bulk)
+{
+   guint i;
+
+   g_return_if_fail(bulk);
+   g_return_if_fail(bulk->ref_count > 0);
+
+   if (g_atomic_int_dec_and_test(&bulk->ref_count)) {
+      for (i = 0; i < bulk->ops->len; i++) {
+         mongo_bulk_write_op_clear(mongo_bulk_write_index(bulk, i));
+      }
+      g_array_free(bulk->ops, TRUE);
+      g_slice_free(MongoBulkWrite, bulk);
+   }
+}
+
+/**
+ * mongo_bulk_write_get_type:
+ *
+ * Retrieve the #GType for the #MongoBulkWrite boxed type.
+ *
+ * Returns: A #GType.
+ */
+GType
+mongo_bulk_write_get_type (void)
+{
+   static GType type_id;
+   static gsize initialized;
+
+   if (g_once_init_enter(&initialized)) {
+      type_id = g_boxed_type_register_static("MongoBulkWrite",
+         (GBoxedCopyFunc)mongo_bulk_write_ref,
+         (GBoxedFreeFunc)mongo_bulk_write_unref);
+      g_once_init_leave(&initialized, TRUE);
+   }
+
+   return type_id;
+}
+
+/**
+ * mongo_bulk_write_get_ordered:
+ * @bulk: (in): A #MongoBulkWrite.
+ *
+ * Checks if the operations in @bulk are executed in order, stopping at
+ * the first failure.
+ *
+ * Returns: %TRUE if @bulk is ordered.
+ */
+gboolean
+mongo_bulk_write_get_ordered (MongoBulkWrite *bulk)
+{
+   g_return_val_if_fail(bulk, FALSE);
+   return bulk->ordered;
+}
+
+/**
+ * mongo_bulk_write_get_n_ops:
+ * @bulk: (in): A #MongoBulkWrite.
+ *
+ * Fetches the number of operations that have been added to @bulk.
+ *
+ * Returns: The number of operations.
+ */
+guint
+mongo_bulk_write_get_n_ops (MongoBulkWrite *bulk)
+{
+   g_return_val_if_fail(bulk, 0);
+   return bulk->ops->len;
+}
+
+static void
+mongo_bulk_write_append (MongoBulkWrite  *bulk,
+                         MongoOperation   oper,
+                         guint            flags,
+                         const MongoBson *selector,
+                         const MongoBson *document)
+{
+   MongoBulkWriteOp op = { 0 };
+
+   g_assert(bulk);
+
+   op.oper = oper;
+   op.flags = flags;
+   op.selector = selector ? mongo_bson_ref((MongoBson *)selector) : NULL;
+   op.document = document ? mongo_bson_ref((MongoBson *)document) : NULL;
+   op.status = MONGO_BULK_WRITE_PENDING;
+
+   g_array_append_val(bulk->ops, op);
+}
+
+/**
+ * mongo_bulk_write_insert:
+ * @bulk: (in): A #MongoBulkWrite.
+ * @document: (in): A #MongoBson to insert.
+ *
+ * Adds an insert of @document to @bulk.
+ */
+void
+mongo_bulk_write_insert (MongoBulkWrite  *bulk,
+                         const MongoBson *document)
+{
+   g_return_if_fail(bulk);
+   g_return_if_fail(!bulk->executing);
+   g_return_if_fail(document);
+
+   mongo_bulk_write_append(bulk, MONGO_OPERATION_INSERT, MONGO_INSERT_NONE,
+                           NULL, document);
+}
+
+/**
+ * mongo_bulk_write_update:
+ * @bulk: (in): A #MongoBulkWrite.
+ * @selector: (in): A #MongoBson.
+ * @update: (in): A #MongoBson to apply to documents matching @selector.
+ * @multi: If all matching documents should be updated.
+ *
+ * Adds an update of the documents matching @selector to @bulk.
+ */
+void
+mongo_bulk_write_update (MongoBulkWrite  *bulk,
+                         const MongoBson *selector,
+                         const MongoBson *update,
+                         gboolean         multi)
+{
+   g_return_if_fail(bulk);
+   g_return_if_fail(!bulk->executing);
+   g_return_if_fail(selector);
+   g_return_if_fail(update);
+
+   mongo_bulk_write_append(bulk, MONGO_OPERATION_UPDATE,
+                           multi ? MONGO_UPDATE_MULTI_UPDATE : MONGO_UPDATE_NONE,
+                           selector, update);
+}
+
+/**
+ * mongo_bulk_write_upsert:
+ * @bulk: (in): A #MongoBulkWrite.
+ * @selector: (in): A #MongoBson.
+ * @update: (in): A #MongoBson to apply to the document matching @selector.
+ *
+ * Adds an update of the document matching @selector to @bulk. If no
+ * document matches, one is inserted.
+ */
+void
+mongo_bulk_write_upsert (MongoBulkWrite  *bulk,
+                         const MongoBson *selector,
+                         const MongoBson *update)
+{
+   g_return_if_fail(bulk);
+   g_return_if_fail(!bulk->executing);
+   g_return_if_fail(selector);
+   g_return_if_fail(update);
+
+   mongo_bulk_write_append(bulk, MONGO_OPERATION_UPDATE, MONGO_UPDATE_UPSERT,
+                           selector, update);
+}
+
+/**
+ * mongo_bulk_write_delete:
+ * @bulk: (in): A #MongoBulkWrite.
+ * @selector: (in): A #MongoBson.
+ * @single: If only the first matching document should be removed.
+ *
+ * Adds a removal of the documents matching @selector to @bulk.
+ */
+void
+mongo_bulk_write_delete (MongoBulkWrite  *bulk,
+                         const MongoBson *selector,
+                         gboolean         single)
+{
+   g_return_if_fail(bulk);
+   g_return_if_fail(!bulk->executing);
+   g_return_if_fail(selector);
+
+   mongo_bulk_write_append(bulk, MONGO_OPERATION_DELETE,
+                           single ? MONGO_DELETE_SINGLE_REMOVE : MONGO_DELETE_NONE,
+                           selector, NULL);
+}
+
+/**
+ * mongo_bulk_write_get_status:
+ * @bulk: (in): A #MongoBulkWrite.
+ * @op: (in): The index of the operation.
+ *
+ * Fetches the outcome of the operation at index @op, in the order the
+ * operations were added.
+ *
+ * The status is tracked per message rather than per operation. The
+ * server reports a single error for an insert message without saying
+ * which document caused it, so every insert sent in the same message is
+ * marked %MONGO_BULK_WRITE_FAILED when any of them fails, even though
+ * the others may have been written.
+ *
+ * Returns: A #MongoBulkWriteStatus.
+ */
+MongoBulkWriteStatus
+mongo_bulk_write_get_status (MongoBulkWrite *bulk,
+                             guint           op)
+{
+   g_return_val_if_fail(bulk, MONGO_BULK_WRITE_PENDING);
+   g_return_val_if_fail(op < bulk->ops->len, MONGO_BULK_WRITE_PENDING);
+
+   return mongo_bulk_write_index(bulk, op)->status;
+}
+
+/**
+ * mongo_bulk_write_get_error:
+ * @bulk: (in): A #MongoBulkWrite.
+ * @op: (in): The index of the operation.
+ *
+ * Fetches the error for the operation at index @op if it failed. Inserts
+ * that were sent in the same message share the same error.
+ *
+ * Returns: (transfer none): A #GError or %NULL.
+ */
+const GError *
+mongo_bulk_write_get_error (MongoBulkWrite *bulk,
+                            guint           op)
+{
+   g_return_val_if_fail(bulk, NULL);
+   g_return_val_if_fail(op < bulk->ops->len, NULL);
+
+   return mongo_bulk_write_index(bulk, op)->error;
+}
+
+/**
+ * mongo_bulk_write_get_reply:
+ * @bulk: (in): A #MongoBulkWrite.
+ * @op: (in): The index of the operation.
+ *
+ * Fetches the getlasterror reply for an update or upsert operation, which
+ * contains the number of documents affected and any upserted id.
+ *
+ * Returns: (transfer none): A #MongoBson or %NULL.
+ */
+MongoBson *
+mongo_bulk_write_get_reply (MongoBulkWrite *bulk,
+                            guint           op)
+{
+   g_return_val_if_fail(bulk, NULL);
+   g_return_val_if_fail(op < bulk->ops->len, NULL);
+
+   return mongo_bulk_write_index(bulk, op)->reply;
+}
+
+/*
+ * Records the outcome of the @n_ops operations starting at @first, which
+ * were sent to the server as a single message.
+ */
+void
+mongo_bulk_write_complete (MongoBulkWrite *bulk,
+                           guint           first,
+                           guint           n_ops,
+                           const GError   *error,
+                           MongoBson      *reply)
+{
+   MongoBulkWriteOp *op;
+   guint i;
+
+   g_assert(bulk);
+   g_assert(first + n_ops <= bulk->ops->len);
+
+   for (i = first; i < first + n_ops; i++) {
+      op = mongo_bulk_write_index(bulk, i);
+      if (error) {
+         op->status = MONGO_BULK_WRITE_FAILED;
+         op->error = g_error_copy(error);
+      } else {
+         op->status = MONGO_BULK_WRITE_SUCCEEDED;
+         op->reply = reply ? mongo_bson_ref(reply) : NULL;
+      }
+   }
+}
+
+/*
+ * Clears the results of a previous execution so that @bulk may be
+ * executed again.
+ */
+void
+mongo_bulk_write_reset (MongoBulkWrite *bulk)
+{
+   MongoBulkWriteOp *op;
+   guint i;
+
+   g_assert(bulk);
+
+   for (i = 0; i < bulk->ops->len; i++) {
+      op = mongo_bulk_write_index(bulk, i);
+      op->status = MONGO_BULK_WRITE_PENDING;
+      mongo_clear_bson(&op->reply);
+      g_clear_error(&op->error);
+   }
+}
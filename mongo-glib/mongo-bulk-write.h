@@ -0,0 +1,79 @@
+/* mongo-bulk-write.h
+ *
+ * Copyright (C) 2012 Christian Hergert <chris@dronelabs.com>
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined (MONGO_INSIDE) && !defined (MONGO_COMPILATION)
+#error "Only <mongo-glib/mongo-glib.h> can be included directly."
+#endif
+
+#ifndef MONGO_BULK_WRITE_H
+#define MONGO_BULK_WRITE_H
+
+#include <glib-object.h>
+
+#include "mongo-bson.h"
+
+G_BEGIN_DECLS
+
+#define MONGO_TYPE_BULK_WRITE (mongo_bulk_write_get_type())
+
+typedef struct _MongoBulkWrite MongoBulkWrite;
+
+/**
+ * MongoBulkWriteStatus:
+ * @MONGO_BULK_WRITE_PENDING: The operation has not been executed.
+ * @MONGO_BULK_WRITE_SUCCEEDED: The operation was acknowledged.
+ * @MONGO_BULK_WRITE_FAILED: The operation failed.
+ *
+ * #MongoBulkWriteStatus describes the outcome of an individual operation
+ * within a #MongoBulkWrite.
+ */
+typedef enum
+{
+   MONGO_BULK_WRITE_PENDING   = 0,
+   MONGO_BULK_WRITE_SUCCEEDED = 1,
+   MONGO_BULK_WRITE_FAILED    = 2,
+} MongoBulkWriteStatus;
+
+GType                 mongo_bulk_write_get_type    (void) G_GNUC_CONST;
+MongoBulkWrite       *mongo_bulk_write_new         (gboolean         ordered);
+MongoBulkWrite       *mongo_bulk_write_ref         (MongoBulkWrite  *bulk);
+void                  mongo_bulk_write_unref       (MongoBulkWrite  *bulk);
+gboolean              mongo_bulk_write_get_ordered (MongoBulkWrite  *bulk);
+guint                 mongo_bulk_write_get_n_ops   (MongoBulkWrite  *bulk);
+void                  mongo_bulk_write_insert      (MongoBulkWrite  *bulk,
+                                                    const MongoBson *document);
+void                  mongo_bulk_write_update      (MongoBulkWrite  *bulk,
+                                                    const MongoBson *selector,
+                                                    const MongoBson *update,
+                                                    gboolean         multi);
+void                  mongo_bulk_write_upsert      (MongoBulkWrite  *bulk,
+                                                    const MongoBson *selector,
+                                                    const MongoBson *update);
+void                  mongo_bulk_write_delete      (MongoBulkWrite  *bulk,
+                                                    const MongoBson *selector,
+                                                    gboolean         single);
+MongoBulkWriteStatus  mongo_bulk_write_get_status  (MongoBulkWrite  *bulk,
+                                                    guint            op);
+const GError         *mongo_bulk_write_get_error   (MongoBulkWrite  *bulk,
+                                                    guint            op);
+MongoBson            *mongo_bulk_write_get_reply   (MongoBulkWrite  *bulk,
+                                                    guint            op);
+
+G_END_DECLS
+
+#endif /* MONGO_BULK_WRITE_H */
@@ -18,6 +18,7 @@
 
 #include <glib/gi18n.h>
 
+#include "mongo-bulk-write-private.h"
 #include "mongo-connection.h"
 #include "mongo-collection.h"
 #include "mongo-debug.h"
@@ -52,6 +53,37 @@ enum
    LAST_PROP
 };
 
+/*
+ * Consecutive inserts of a bulk write are grouped into a single message
+ * until their documents reach this many bytes.
+ */
+#define BULK_WRITE_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+/*
+ * Unordered bulk writes keep at most this many messages in flight, each
+ * sent only once the connection has room for more writes.
+ */
+#define BULK_WRITE_MAX_IN_FLIGHT 16
+
+typedef struct
+{
+   MongoBulkWrite  *bulk;
+   MongoConnection *connection;
+   gchar           *db_and_collection;
+   GCancellable    *cancellable;
+   guint            next;
+   guint            in_flight;
+   gboolean         waiting;
+   GError          *error;
+} BulkWrite;
+
+typedef struct
+{
+   GSimpleAsyncResult *simple;
+   guint               first;
+   guint               n_ops;
+} BulkWriteMessage;
+
 static GParamSpec *gParamSpecs[LAST_PROP];
 
 /**
@@ -745,6 +777,376 @@ mongo_collection_insert_finish (MongoCollection  *collection,
    return ret;
 }
 
+static void
+mongo_collection_bulk_write_free (gpointer data)
+{
+   BulkWrite *state = data;
+
+   if (state) {
+      mongo_bulk_write_unref(state->bulk);
+      g_clear_object(&state->connection);
+      g_free(state->db_and_collection);
+      g_clear_object(&state->cancellable);
+      g_clear_error(&state->error);
+      g_slice_free(BulkWrite, state);
+   }
+}
+
+static void mongo_collection_bulk_write_cb   (GObject      *object,
+                                              GAsyncResult *result,
+                                              gpointer      user_data);
+static void mongo_collection_bulk_write_pump (BulkWrite          *state,
+                                              GSimpleAsyncResult *simple);
+
+/*
+ * Sends the operation at state->next as its own message, along with
+ * any inserts that immediately follow it if it is an insert.
+ */
+static void
+mongo_collection_bulk_write_send_next (BulkWrite          *state,
+                                       GSimpleAsyncResult *simple)
+{
+   BulkWriteMessage *message;
+   MongoBulkWriteOp *op;
+   MongoBulkWriteOp *next;
+   MongoBson **documents;
+   gsize size;
+   guint i;
+
+   g_assert(state);
+   g_assert(state->next < state->bulk->ops->len);
+
+   op = mongo_bulk_write_index(state->bulk, state->next);
+
+   message = g_slice_new0(BulkWriteMessage);
+   message->simple = g_object_ref(simple);
+   message->first = state->next;
+   message->n_ops = 1;
+
+   switch (op->oper) {
+   case MONGO_OPERATION_INSERT:
+      size = op->document->len;
+      for (i = message->first + 1; i < state->bulk->ops->len; i++) {
+         next = mongo_bulk_write_index(state->bulk, i);
+         if ((next->oper != MONGO_OPERATION_INSERT) ||
+             ((size + next->document->len) > BULK_WRITE_MAX_MESSAGE_SIZE)) {
+            break;
+         }
+         size += next->document->len;
+         message->n_ops++;
+      }
+      documents = g_new(MongoBson *, message->n_ops);
+      for (i = 0; i < message->n_ops; i++) {
+         next = mongo_bulk_write_index(state->bulk, message->first + i);
+         documents[i] = next->document;
+      }
+      mongo_connection_insert_async(state->connection,
+                                    state->db_and_collection,
+                                    (state->bulk->ordered ?
+                                     MONGO_INSERT_NONE :
+                                     MONGO_INSERT_CONTINUE_ON_ERROR),
+                                    documents,
+                                    message->n_ops,
+                                    state->cancellable,
+                                    mongo_collection_bulk_write_cb,
+                                    message);
+      g_free(documents);
+      break;
+   case MONGO_OPERATION_UPDATE:
+      mongo_connection_update_async(state->connection,
+                                    state->db_and_collection,
+                                    op->flags,
+                                    op->selector,
+                                    op->document,
+                                    state->cancellable,
+                                    mongo_collection_bulk_write_cb,
+                                    message);
+      break;
+   case MONGO_OPERATION_DELETE:
+      mongo_connection_delete_async(state->connection,
+                                    state->db_and_collection,
+                                    op->flags,
+                                    op->selector,
+                                    state->cancellable,
+                                    mongo_collection_bulk_write_cb,
+                                    message);
+      break;
+   default:
+      g_assert_not_reached();
+      break;
+   }
+
+   state->next += message->n_ops;
+   state->in_flight++;
+}
+
+/*
+ * Completes the bulk write once nothing is in flight and no more
+ * messages will be sent.
+ */
+static void
+mongo_collection_bulk_write_maybe_complete (BulkWrite          *state,
+                                            GSimpleAsyncResult *simple)
+{
+   g_assert(state);
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   if (!state->in_flight && !state->waiting) {
+      state->bulk->executing = FALSE;
+      if (state->error) {
+         g_simple_async_result_set_from_error(simple, state->error);
+      }
+      g_simple_async_result_set_op_res_gboolean(simple, !state->error);
+      mongo_simple_async_result_complete_in_idle(simple);
+   }
+}
+
+static void
+mongo_collection_bulk_write_wait_cb (GObject      *object,
+                                     GAsyncResult *result,
+                                     gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   GSimpleAsyncResult *simple = user_data;
+   BulkWrite *state;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   state = g_object_get_data(G_OBJECT(simple), "bulk-write-state");
+   state->waiting = FALSE;
+
+   /*
+    * If the connection cannot take more writes, the remaining operations
+    * are left pending.
+    */
+   if (!mongo_connection_wait_writable_finish(connection, result, &error)) {
+      if (!state->error) {
+         state->error = error;
+      } else {
+         g_clear_error(&error);
+      }
+      mongo_collection_bulk_write_maybe_complete(state, simple);
+   } else {
+      mongo_collection_bulk_write_send_next(state, simple);
+      mongo_collection_bulk_write_pump(state, simple);
+   }
+
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+/*
+ * Sends the next message of an ordered bulk write if none is in flight.
+ * For unordered bulk writes, waits for the connection to become writable
+ * before sending the next message, as long as fewer than
+ * BULK_WRITE_MAX_IN_FLIGHT are outstanding.
+ */
+static void
+mongo_collection_bulk_write_pump (BulkWrite          *state,
+                                  GSimpleAsyncResult *simple)
+{
+   g_assert(state);
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   if (state->next >= state->bulk->ops->len) {
+      return;
+   }
+
+   if (state->bulk->ordered) {
+      if (!state->in_flight && !state->error) {
+         mongo_collection_bulk_write_send_next(state, simple);
+      }
+   } else if (!state->waiting &&
+              (state->in_flight < BULK_WRITE_MAX_IN_FLIGHT)) {
+      state->waiting = TRUE;
+      mongo_connection_wait_writable_async(state->connection,
+                                           state->cancellable,
+                                           mongo_collection_bulk_write_wait_cb,
+                                           g_object_ref(simple));
+   }
+}
+
+static void
+mongo_collection_bulk_write_cb (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   GSimpleAsyncResult *simple;
+   BulkWriteMessage *message = user_data;
+   MongoBulkWriteOp *op;
+   MongoBson *reply = NULL;
+   BulkWrite *state;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(message);
+
+   simple = message->simple;
+   state = g_object_get_data(G_OBJECT(simple), "bulk-write-state");
+   op = mongo_bulk_write_index(state->bulk, message->first);
+
+   switch (op->oper) {
+   case MONGO_OPERATION_INSERT:
+      mongo_connection_insert_finish(connection, result, &error);
+      break;
+   case MONGO_OPERATION_UPDATE:
+      mongo_connection_update_finish(connection, result, &reply, &error);
+      break;
+   case MONGO_OPERATION_DELETE:
+      mongo_connection_delete_finish(connection, result, &error);
+      break;
+   default:
+      g_assert_not_reached();
+      break;
+   }
+
+   mongo_bulk_write_complete(state->bulk,
+                             message->first,
+                             message->n_ops,
+                             error,
+                             reply);
+
+   if (error && !state->error) {
+      state->error = error;
+   } else {
+      g_clear_error(&error);
+   }
+
+   mongo_clear_bson(&reply);
+
+   state->in_flight--;
+
+   mongo_collection_bulk_write_pump(state, simple);
+   mongo_collection_bulk_write_maybe_complete(state, simple);
+
+   g_object_unref(simple);
+   g_slice_free(BulkWriteMessage, message);
+
+   EXIT;
+}
+
+/**
+ * mongo_collection_bulk_write_async:
+ * @collection: (in): A #MongoCollection.
+ * @bulk: (in): A #MongoBulkWrite.
+ * @cancellable: (in) (allow-none): A #GCancellable or %NULL.
+ * @callback: (in): A callback to execute upon completion.
+ * @user_data: (in): User data for @callback.
+ *
+ * Asynchronously executes the operations in @bulk against @collection.
+ * Consecutive inserts are sent as a single message. If @bulk is ordered,
+ * messages are sent one at a time and execution stops at the first
+ * failure. Otherwise, up to 16 messages are pipelined, each waiting for
+ * mongo_connection_wait_writable_async() before it is sent, and inserts
+ * continue past errors.
+ *
+ * The outcome of each operation is stored in @bulk and may be inspected
+ * with mongo_bulk_write_get_status() once @callback has been called.
+ * @bulk must not be modified while it is executing.
+ *
+ * @callback MUST call mongo_collection_bulk_write_finish().
+ */
+void
+mongo_collection_bulk_write_async (MongoCollection     *collection,
+                                   MongoBulkWrite      *bulk,
+                                   GCancellable        *cancellable,
+                                   GAsyncReadyCallback  callback,
+                                   gpointer             user_data)
+{
+   MongoCollectionPrivate *priv;
+   GSimpleAsyncResult *simple;
+   BulkWrite *state;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_COLLECTION(collection));
+   g_return_if_fail(bulk);
+   g_return_if_fail(!bulk->executing);
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   priv = collection->priv;
+
+   if (!priv->connection) {
+      g_simple_async_report_error_in_idle(G_OBJECT(collection),
+                                          callback,
+                                          user_data,
+                                          MONGO_CONNECTION_ERROR,
+                                          MONGO_CONNECTION_ERROR_NOT_CONNECTED,
+                                          _("Missing Mongo connection"));
+      EXIT;
+   }
+
+   simple = g_simple_async_result_new(G_OBJECT(collection),
+                                      callback,
+                                      user_data,
+                                      mongo_collection_bulk_write_async);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+
+   mongo_bulk_write_reset(bulk);
+
+   if (!bulk->ops->len) {
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      mongo_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+      EXIT;
+   }
+
+   state = g_slice_new0(BulkWrite);
+   state->bulk = mongo_bulk_write_ref(bulk);
+   state->connection = g_object_ref(priv->connection);
+   state->db_and_collection = g_strdup(priv->db_and_collection);
+   state->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+   g_object_set_data_full(G_OBJECT(simple), "bulk-write-state",
+                          state, mongo_collection_bulk_write_free);
+
+   bulk->executing = TRUE;
+
+   mongo_collection_bulk_write_pump(state, simple);
+
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+/**
+ * mongo_collection_bulk_write_finish:
+ * @collection: (in): A #MongoCollection.
+ * @result: (in): A #GAsyncResult.
+ * @error: (out) (allow-none): A location for a #GError, or %NULL.
+ *
+ * Completes an asynchronous request to execute a #MongoBulkWrite. The
+ * outcome of individual operations is available from the #MongoBulkWrite.
+ *
+ * Returns: %TRUE if every operation succeeded; otherwise %FALSE and
+ *    @error is set to the first failure.
+ */
+gboolean
+mongo_collection_bulk_write_finish (MongoCollection  *collection,
+                                    GAsyncResult     *result,
+                                    GError          **error)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   g_return_val_if_fail(MONGO_IS_COLLECTION(collection), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   return ret;
+}
+
 static void
 mongo_collection_drop_cb (GObject      *object,
                           GAsyncResult *result,
@@ -27,6 +27,7 @@
 #include <gio/gio.h>
 
 #include "mongo-bson.h"
+#include "mongo-bulk-write.h"
 #include "mongo-cursor.h"
 #include "mongo-protocol.h"
 
@@ -132,6 +133,14 @@ void         mongo_collection_update_async    (MongoCollection      *collection,
 gboolean     mongo_collection_update_finish   (MongoCollection      *collection,
                                                GAsyncResult         *result,
                                                GError              **error);
+void         mongo_collection_bulk_write_async  (MongoCollection      *collection,
+                                                 MongoBulkWrite       *bulk,
+                                                 GCancellable         *cancellable,
+                                                 GAsyncReadyCallback   callback,
+                                                 gpointer              user_data);
+gboolean     mongo_collection_bulk_write_finish (MongoCollection      *collection,
+                                                 GAsyncResult         *result,
+                                                 GError              **error);
 
 
 G_END_DECLS
@@ -31,6 +31,12 @@
  * SECTION:mongo-connection
  * @title: MongoConnection
  * @short_description: Connection to Mongo DB.
+ *
+ * A #MongoConnection may be shared by many threads. Requests may be
+ * submitted from any thread and complete in the thread-default main
+ * context of the thread that submitted them, which must be running.
+ * The connection state and its sockets stay with the main context the
+ * connection was created in, or with its I/O thread if "ioThread" is set.
  */
 
 /*
@@ -47,6 +53,18 @@ G_DEFINE_TYPE(MongoConnection, mongo_connection, G_TYPE_OBJECT)
 #define MONGO_PORT_DEFAULT 27017
 #endif
 
+#ifndef MONGO_MAX_POOL_SIZE_DEFAULT
+#define MONGO_MAX_POOL_SIZE_DEFAULT 4
+#endif
+
+#ifndef MONGO_HEARTBEAT_FREQUENCY_DEFAULT
+#define MONGO_HEARTBEAT_FREQUENCY_DEFAULT 10000
+#endif
+
+#ifndef MONGO_LOCAL_THRESHOLD_DEFAULT
+#define MONGO_LOCAL_THRESHOLD_DEFAULT 15
+#endif
+
 struct _MongoConnectionPrivate
 {
    /*
@@ -55,39 +73,113 @@ struct _MongoConnectionPrivate
    GHashTable *databases;
 
    /*
-    * Connection and protocol.
+    * Connection and pool of protocols. Every protocol in the pool is
+    * connected to @host, the current primary. @pool_generation changes
+    * whenever a new primary is found so that pool connections started
+    * for a previous primary can be discarded.
+    *
+    * @unacked is the protocol the last unacknowledged write was sent on.
+    * Requests follow it there until one sent after the write, marked with
+    * @unacked_seq, is answered.
     */
    GSocketClient *socket_client;
-   MongoProtocol *protocol;
+   GPtrArray *pool;
+   gchar *host;
+   guint pool_generation;
+   guint pool_connecting;
+   MongoProtocol *unacked;
+   guint unacked_seq;
 
    /*
     * Cancellable emitted when shutting down.
     */
    GCancellable *dispose_cancel;
 
+   /*
+    * Hosts being probed in the current connection round. Every host is
+    * connected to and asked "ismaster" at once, and the first primary
+    * found is adopted. @probe_round changes when the round ends so that
+    * late probes can be discarded. @probed contains every host tried in
+    * the round, and @probe_delay is the delay before the next round if
+    * no primary is found.
+    */
+   GPtrArray *probes;
+   GHashTable *probed;
+   GCancellable *probe_cancel;
+   guint probe_round;
+   guint probe_delay;
+
+   /*
+    * Heartbeat monitors, keyed by host. Each has its own socket so that
+    * round trip times are not skewed by requests queued on the pool.
+    * @members_checked is set once the first heartbeat has checked every
+    * host, and until then reads for a secondary wait in @member_waiters.
+    */
+   GHashTable *monitors;
+   GSource *heartbeat_source;
+   gboolean members_checked;
+   GQueue member_waiters;
+
+   /*
+    * Sockets to secondaries used for reads, keyed by host, and the host
+    * each open cursor on a secondary belongs to, keyed by cursor id.
+    * @cursor_protocols holds the pooled protocol each open cursor on the
+    * primary was opened on.
+    */
+   GHashTable *members;
+   GHashTable *cursors;
+   GHashTable *cursor_protocols;
+
    /*
     * Current connection state.
     */
    guint state;
 
    /*
-    * Queued requests.
+    * Requests queued while connecting. @queue_bytes is the size of the
+    * documents they hold. @queue_timeout fires at the earliest deadline,
+    * and @queue_waiters are mongo_connection_wait_writable_async() calls
+    * waiting for the queue to have room.
     */
    GQueue *queue;
+   guint64 queue_bytes;
+   GSource *queue_timeout;
+   GQueue queue_waiters;
+
+   /*
+    * Size limits reported by the server in ismaster, or 0 if unknown.
+    */
+   guint max_bson_size;
+   guint max_message_size;
 
    /*
     * Connection options.
     */
    guint connecttimeoutms;
+   guint heartbeatfrequencyms;
+   guint localthresholdms;
+   guint min_pool_size;
+   guint max_pool_size;
+   guint max_queue_size;
+   guint64 max_queue_bytes;
+   gboolean queue_block;
+   guint queuetimeoutms;
+   guint write_batch_size;
+   guint pending_high_watermark;
+   guint pending_low_watermark;
+   guint64 send_high_watermark;
+   guint64 send_low_watermark;
    gboolean fsync;
    gboolean fsync_set;
    guint w;
    gboolean journal;
    gboolean journal_set;
+   MongoReadMode read_mode;
    gchar *replica_set;
    gboolean safe;
    gboolean slave_okay;
    guint sockettimeoutms;
+   gboolean close_on_timeout;
    GUri *uri;
    gchar *uri_string;
    guint wtimeoutms;
@@ -96,6 +188,30 @@ struct _MongoConnectionPrivate
     * Node reconnection manager.
     */
    MongoManager *manager;
+
+   /*
+    * Protects @databases, which may be used from any thread.
+    */
+   GMutex databases_mutex;
+
+   /*
+    * The main context the connection was created in. It owns the
+    * connection state unless "ioThread" is set.
+    */
+   GMainContext *context;
+
+   /*
+    * With "ioThread", the connection state, sockets and message decoding
+    * all live on @io_thread. Requests submitted from a thread that does
+    * not own the connection state are handed over through @inbox.
+    */
+   gboolean io_thread_enabled;
+   GThread *io_thread;
+   GMainLoop *io_loop;
+   GMutex inbox_mutex;
+   GQueue inbox;
+   gboolean inbox_scheduled;
+   guint inbox_wakeups;
 };
 
 typedef struct
@@ -103,6 +219,8 @@ typedef struct
    MongoOperation oper;
    GSimpleAsyncResult *simple;
    GCancellable *cancellable;
+   gsize size;
+   gint64 deadline;
    union {
       struct {
          gchar *db_and_collection;
@@ -139,9 +257,58 @@ typedef struct
    } u;
 } Request;
 
+typedef struct
+{
+   MongoConnection *connection;
+   guint generation;
+} PoolGrow;
+
+typedef struct
+{
+   MongoConnection *connection;
+   GCancellable    *dispose_cancel;
+   gchar           *host;
+   MongoProtocol   *protocol;
+   guint            round;
+} Probe;
+
+typedef struct
+{
+   MongoConnection *connection;
+   GCancellable    *dispose_cancel;
+   gchar           *host;
+   MongoProtocol   *protocol;
+   gint64           started;
+   gboolean         busy;
+   gboolean         checked;
+} Monitor;
+
+typedef struct
+{
+   MongoConnection *connection;
+   GCancellable    *dispose_cancel;
+   gchar           *host;
+   MongoProtocol   *protocol;
+   GQueue           queue;
+   gboolean         connecting;
+} Member;
+
+typedef struct
+{
+   GCancellable        *cancellable;
+   GCancellable        *linked;
+   gulong               linked_handler;
+   GSource             *timeout_source;
+   guint                timeout_msec;
+   gboolean             timed_out;
+   GAsyncReadyCallback  callback;
+   gpointer             user_data;
+} ConnectAttempt;
+
 enum
 {
    PROP_0,
+   PROP_READ_MODE,
    PROP_REPLICA_SET,
    PROP_SLAVE_OKAY,
    PROP_URI,
@@ -165,7 +332,109 @@ enum
 static GParamSpec *gParamSpecs[LAST_PROP];
 static guint       gSignals[LAST_SIGNAL];
 
+extern GBytes *_mongo_bson_share (MongoBson *bson);
+
 static void mongo_connection_start_connecting (MongoConnection *connection);
+static void mongo_connection_start_heartbeat  (MongoConnection *connection);
+static void mongo_connection_queue            (MongoConnection *connection,
+                                               Request         *request);
+
+/*
+ * Remembers where a cursor was opened so that getmore and kill_cursors
+ * for it are sent there too. @simple carries the host it was routed to,
+ * if not the primary. Cursors on the primary stay on @protocol, as the
+ * server does not support concurrent getmores on one cursor and answers
+ * the requests of one socket in order.
+ */
+static void
+mongo_connection_pin_cursor (GSimpleAsyncResult *simple,
+                             MongoProtocol      *protocol,
+                             MongoMessageReply  *reply)
+{
+   MongoConnection *connection;
+   const guint64 *previous;
+   const gchar *host;
+   GHashTable *pins;
+   guint64 cursor_id;
+   guint64 *key;
+
+   host = g_object_get_data(G_OBJECT(simple), "host");
+   if (!host && !protocol) {
+      return;
+   }
+
+   connection = (MongoConnection *)
+      g_async_result_get_source_object(G_ASYNC_RESULT(simple));
+   pins = host ? connection->priv->cursors : connection->priv->cursor_protocols;
+
+   if ((cursor_id = mongo_message_reply_get_cursor_id(reply))) {
+      key = g_new(guint64, 1);
+      *key = cursor_id;
+      g_hash_table_replace(pins, key,
+                           host ? (gpointer)g_strdup(host) : (gpointer)protocol);
+   } else if ((previous = g_object_get_data(G_OBJECT(simple), "cursor-id"))) {
+      g_hash_table_remove(pins, previous);
+   }
+
+   g_object_unref(connection);
+}
+
+/*
+ * Creates the result of a public request. The caller's #MongoSource is
+ * remembered so that the request completes in the caller's main context,
+ * whichever thread the reply is read from.
+ */
+static GSimpleAsyncResult *
+mongo_connection_simple_new (MongoConnection     *connection,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data,
+                             gpointer             tag)
+{
+   GSimpleAsyncResult *simple;
+
+   simple = g_simple_async_result_new(G_OBJECT(connection),
+                                      callback,
+                                      user_data,
+                                      tag);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+   g_object_set_data(G_OBJECT(simple),
+                     "mongo-source",
+                     mongo_source_get_thread_default());
+
+   return simple;
+}
+
+/*
+ * Completes @simple, created with mongo_connection_simple_new(), in the
+ * main context of the thread that made the request.
+ */
+static void
+mongo_connection_complete_in_idle (GSimpleAsyncResult *simple)
+{
+   mongo_source_complete_in_idle(g_object_get_data(G_OBJECT(simple),
+                                                   "mongo-source"),
+                                 simple);
+}
+
+/*
+ * Runs @func after @msec milliseconds in the thread-default main context,
+ * which is the I/O thread's when "ioThread" is set.
+ */
+static GSource *
+mongo_connection_add_timeout (guint       msec,
+                              GSourceFunc func,
+                              gpointer    data)
+{
+   GSource *source;
+
+   source = g_timeout_source_new(msec);
+   g_source_set_callback(source, func, data, NULL);
+   g_source_set_name(source, "MongoConnectionTimeout");
+   g_source_attach(source, g_main_context_get_thread_default());
+
+   return source;
+}
 
 static void
 mongo_connection_update_cb (GObject      *object,
@@ -196,7 +465,7 @@ mongo_connection_update_cb (GObject      *object,
    }
 
    g_simple_async_result_set_op_res_gboolean(simple, ret);
-   mongo_simple_async_result_complete_in_idle(simple);
+   mongo_connection_complete_in_idle(simple);
    g_object_unref(simple);
 
    EXIT;
@@ -222,7 +491,7 @@ mongo_connection_insert_cb (GObject      *object,
    }
 
    g_simple_async_result_set_op_res_gboolean(simple, ret);
-   mongo_simple_async_result_complete_in_idle(simple);
+   mongo_connection_complete_in_idle(simple);
    g_object_unref(simple);
 
    EXIT;
@@ -244,10 +513,12 @@ mongo_connection_query_cb (GObject      *object,
    if (!(reply = mongo_protocol_query_finish(protocol, result, &error))) {
       g_simple_async_result_take_error(simple, error);
    } else {
+      mongo_connection_release_unacked(simple, protocol);
+      mongo_connection_pin_cursor(simple, protocol, reply);
       g_simple_async_result_set_op_res_gpointer(simple, reply, g_object_unref);
    }
 
-   mongo_simple_async_result_complete_in_idle(simple);
+   mongo_connection_complete_in_idle(simple);
    g_object_unref(simple);
 
    EXIT;
@@ -271,10 +542,12 @@ mongo_connection_getmore_cb (GObject      *object,
    if (!(reply = mongo_protocol_getmore_finish(protocol, result, &error))) {
       g_simple_async_result_take_error(simple, error);
    } else {
+      mongo_connection_release_unacked(simple, protocol);
+      mongo_connection_pin_cursor(simple, protocol, reply);
       g_simple_async_result_set_op_res_gpointer(simple, reply, g_object_unref);
    }
 
-   mongo_simple_async_result_complete_in_idle(simple);
+   mongo_connection_complete_in_idle(simple);
    g_object_unref(simple);
 
    EXIT;
@@ -300,7 +573,7 @@ mongo_connection_delete_cb (GObject      *object,
    }
 
    g_simple_async_result_set_op_res_gboolean(simple, ret);
-   mongo_simple_async_result_complete_in_idle(simple);
+   mongo_connection_complete_in_idle(simple);
    g_object_unref(simple);
 
    EXIT;
@@ -315,6 +588,7 @@ mongo_connection_kill_cursors_cb (GObject      *object,
    MongoProtocol *protocol = (MongoProtocol *)object;
    gboolean ret;
    GError *error = NULL;
+   guint *n_parts;
 
    ENTRY;
 
@@ -325,8 +599,18 @@ mongo_connection_kill_cursors_cb (GObject      *object,
       g_simple_async_result_take_error(simple, error);
    }
 
+   /*
+    * A request split across members succeeds if every part does, and
+    * completes along with the last of them.
+    */
+   if ((n_parts = g_object_get_data(G_OBJECT(simple), "n-parts"))) {
+      ret = ret && g_simple_async_result_get_op_res_gboolean(simple);
+   }
+
    g_simple_async_result_set_op_res_gboolean(simple, ret);
-   mongo_simple_async_result_complete_in_idle(simple);
+   if (!n_parts || !--(*n_parts)) {
+      mongo_connection_complete_in_idle(simple);
+   }
    g_object_unref(simple);
 
    EXIT;
@@ -336,7 +620,20 @@ static void
 request_fail (Request      *request,
               const GError *error)
 {
+   guint *n_parts;
+
    g_simple_async_result_take_error(request->simple, g_error_copy(error));
+
+   /*
+    * Only the last part of a split request completes it.
+    */
+   if ((n_parts = g_object_get_data(G_OBJECT(request->simple), "n-parts"))) {
+      g_simple_async_result_set_op_res_gboolean(request->simple, FALSE);
+      if (--(*n_parts)) {
+         return;
+      }
+   }
+
    g_simple_async_result_complete_in_idle(request->simple);
 }
 
@@ -417,6 +714,29 @@ request_run (Request       *request,
    }
 }
 
+/*
+ * Returns a view of @bson for a request to keep until it is sent. The
+ * memory of @bson is frozen with _mongo_bson_share() instead of copied,
+ * so changes the caller makes afterwards do not reach the request.
+ */
+static MongoBson *
+request_share_bson (const MongoBson *bson)
+{
+   GBytes *bytes;
+
+   if (!bson) {
+      return NULL;
+   }
+
+   bytes = _mongo_bson_share((MongoBson *)bson);
+
+   return mongo_bson_new_from_static_data(
+         (guint8 *)g_bytes_get_data(bytes, NULL),
+         g_bytes_get_size(bytes),
+         (GDestroyNotify)g_bytes_unref,
+         bytes);
+}
+
 static Request *
 request_new (gpointer             source,
              GCancellable        *cancellable,
@@ -426,19 +746,18 @@ request_new (gpointer             source,
 {
    Request *request;
 
-   g_assert(G_IS_OBJECT(source));
+   g_assert(MONGO_IS_CONNECTION(source));
    g_assert(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_assert(callback);
    g_assert(tag);
 
    request = g_slice_new0(Request);
    request->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
-   request->simple = g_simple_async_result_new(source,
-                                               callback,
-                                               user_data,
-                                               tag);
-   g_simple_async_result_set_check_cancellable(request->simple,
-                                               cancellable);
+   request->simple = mongo_connection_simple_new(source,
+                                                 cancellable,
+                                                 callback,
+                                                 user_data,
+                                                 tag);
 
    return request;
 }
@@ -495,90 +814,1594 @@ request_free (Request *request)
    }
 }
 
+/*
+ * Computes the size of the documents held by @request, which is what it
+ * costs to keep it queued.
+ */
+static gsize
+request_get_size (Request *request)
+{
+   gsize size = 0;
+   guint i;
+
+   switch (request->oper) {
+   case MONGO_OPERATION_UPDATE:
+      size = request->u.update.selector->len;
+      if (request->u.update.update) {
+         size += request->u.update.update->len;
+      }
+      break;
+   case MONGO_OPERATION_INSERT:
+      for (i = 0; i < request->u.insert.documents->len; i++) {
+         size += ((MongoBson *)request->u.insert.documents->pdata[i])->len;
+      }
+      break;
+   case MONGO_OPERATION_QUERY:
+      size = request->u.query.query->len;
+      if (request->u.query.field_selector) {
+         size += request->u.query.field_selector->len;
+      }
+      break;
+   case MONGO_OPERATION_DELETE:
+      size = request->u.delete.selector->len;
+      break;
+   case MONGO_OPERATION_KILL_CURSORS:
+      size = request->u.kill_cursors.cursors->len * sizeof(guint64);
+      break;
+   case MONGO_OPERATION_GETMORE:
+   case MONGO_OPERATION_REPLY:
+   case MONGO_OPERATION_MSG:
+   default:
+      break;
+   }
+
+   return size;
+}
+
+/*
+ * Applies the size limits reported by the server, if any, to @protocol.
+ */
 static void
-mongo_connection_protocol_failed (MongoProtocol   *protocol,
-                                  const GError    *error,
-                                  MongoConnection *connection)
+mongo_connection_apply_limits (MongoConnection *connection,
+                               MongoProtocol   *protocol)
 {
-   ENTRY;
+   MongoConnectionPrivate *priv = connection->priv;
 
-   g_assert(MONGO_IS_PROTOCOL(protocol));
-   g_assert(MONGO_IS_CONNECTION(connection));
+   if (priv->max_bson_size) {
+      g_object_set(protocol, "max-bson-size", priv->max_bson_size, NULL);
+   }
 
-   g_warning("Mongo protocol failure: %s.",
-             error ? error->message : "Unknown error");
+   if (priv->max_message_size) {
+      g_object_set(protocol, "max-message-size", priv->max_message_size, NULL);
+   }
+}
 
-   /*
-    * Clear the protocol so we can connect to the next host.
-    */
-   connection->priv->state = STATE_0;
-   g_clear_object(&connection->priv->protocol);
+static MongoProtocol *
+mongo_connection_create_protocol (MongoConnection   *connection,
+                                  GSocketConnection *conn)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   MongoProtocol *protocol;
+
+   protocol = g_object_new(MONGO_TYPE_PROTOCOL,
+                           "fsync", priv->fsync,
+                           "io-stream", conn,
+                           "journal", priv->journal,
+                           "safe", priv->safe,
+                           "write-timeout", priv->wtimeoutms,
+                           "write-quorum", priv->w,
+                           "write-batch-size", priv->write_batch_size,
+                           "pending-high-watermark", priv->pending_high_watermark,
+                           "pending-low-watermark", priv->pending_low_watermark,
+                           "send-high-watermark", priv->send_high_watermark,
+                           "send-low-watermark", priv->send_low_watermark,
+                           "request-timeout", priv->sockettimeoutms,
+                           "close-on-timeout", priv->close_on_timeout,
+                           NULL);
+   mongo_connection_apply_limits(connection, protocol);
+
+   return protocol;
+}
+
+static void mongo_connection_protocol_failed (MongoProtocol   *protocol,
+                                              const GError    *error,
+                                              MongoConnection *connection);
+
+static void
+mongo_connection_pool_add (MongoConnection *connection,
+                           MongoProtocol   *protocol)
+{
+   g_ptr_array_add(connection->priv->pool, g_object_ref(protocol));
 
    /*
-    * Start connecting to the next configured host.
+    * Wire up failure of the protocol so that we can drop it from the
+    * pool, or connect to the next host if it was the last one.
     */
-   if (!g_cancellable_is_cancelled(connection->priv->dispose_cancel)) {
-      mongo_connection_start_connecting(connection);
+   g_signal_connect(protocol, "failed",
+                    G_CALLBACK(mongo_connection_protocol_failed),
+                    connection);
+}
+
+static void
+mongo_connection_pool_clear (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   MongoProtocol *protocol;
+
+   while (priv->pool->len) {
+      protocol = g_ptr_array_index(priv->pool, priv->pool->len - 1);
+      g_signal_handlers_disconnect_by_func(protocol,
+                                           mongo_connection_protocol_failed,
+                                           connection);
+      g_ptr_array_remove_index(priv->pool, priv->pool->len - 1);
    }
 
-   EXIT;
+   g_hash_table_remove_all(priv->cursor_protocols);
+   priv->unacked = NULL;
+
+   priv->pool_generation++;
+   priv->pool_connecting = 0;
+}
+
+static void
+mongo_connection_connect_cancelled (GCancellable   *cancellable,
+                                    ConnectAttempt *attempt)
+{
+   g_cancellable_cancel(attempt->cancellable);
+}
+
+static gboolean
+mongo_connection_connect_timeout (gpointer data)
+{
+   ConnectAttempt *attempt = data;
+
+   attempt->timed_out = TRUE;
+   g_cancellable_cancel(attempt->cancellable);
+
+   return FALSE;
+}
+
+static void
+mongo_connection_connect_cb (GObject      *object,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+   ConnectAttempt *attempt = user_data;
+
+   if (attempt->timeout_source) {
+      g_source_destroy(attempt->timeout_source);
+      g_source_unref(attempt->timeout_source);
+   }
+
+   if (attempt->timed_out) {
+      g_message("Connection attempt timed out after %u milliseconds.",
+                attempt->timeout_msec);
+   }
+
+   attempt->callback(object, result, attempt->user_data);
+
+   g_cancellable_disconnect(attempt->linked, attempt->linked_handler);
+   g_object_unref(attempt->linked);
+   g_object_unref(attempt->cancellable);
+   g_slice_free(ConnectAttempt, attempt);
+}
+
+/*
+ * Connects to @host, giving up after "connectTimeoutMS" if it is set or
+ * when @cancellable is cancelled. @callback should complete the attempt
+ * with g_socket_client_connect_to_host_finish(). It is always called,
+ * even if the connection has been finalized since.
+ */
+static void
+mongo_connection_connect_to_host (MongoConnection     *connection,
+                                  const gchar         *host,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   ConnectAttempt *attempt;
+
+   attempt = g_slice_new0(ConnectAttempt);
+   attempt->cancellable = g_cancellable_new();
+   attempt->linked = g_object_ref(cancellable);
+   attempt->linked_handler =
+      g_cancellable_connect(cancellable,
+                            G_CALLBACK(mongo_connection_connect_cancelled),
+                            attempt,
+                            NULL);
+   attempt->callback = callback;
+   attempt->user_data = user_data;
+
+   if (priv->connecttimeoutms) {
+      attempt->timeout_msec = priv->connecttimeoutms;
+      attempt->timeout_source =
+         mongo_connection_add_timeout(priv->connecttimeoutms,
+                                      mongo_connection_connect_timeout,
+                                      attempt);
+   }
+
+   g_socket_client_connect_to_host_async(priv->socket_client,
+                                         host,
+                                         MONGO_PORT_DEFAULT,
+                                         attempt->cancellable,
+                                         mongo_connection_connect_cb,
+                                         attempt);
 }
 
 static void
-mongo_connection_ismaster_cb (GObject      *object,
-                              GAsyncResult *result,
-                              gpointer      user_data)
+mongo_connection_pool_connect_cb (GObject      *object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
 {
    MongoConnectionPrivate *priv;
-   MongoConnection *connection = user_data;
-   MongoProtocol *protocol = (MongoProtocol *)object;
-   MongoBsonIter iter;
-   MongoBsonIter iter2;
-   const gchar *host;
-   const gchar *primary;
-   const gchar *replica_set;
-   MongoMessageReply *reply = NULL;
-   gboolean ismaster = FALSE;
-   Request *request;
+   GSocketConnection *conn;
+   MongoConnection *connection;
+   GSocketClient *socket_client = (GSocketClient *)object;
+   MongoProtocol *protocol;
+   PoolGrow *grow = user_data;
    GError *error = NULL;
-   GList *list = NULL;
 
    ENTRY;
 
-   g_assert(MONGO_IS_PROTOCOL(protocol));
-   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(G_IS_SOCKET_CLIENT(socket_client));
+   g_assert(grow);
 
+   connection = grow->connection;
    priv = connection->priv;
 
+   conn = g_socket_client_connect_to_host_finish(socket_client,
+                                                 result,
+                                                 &error);
+
    /*
-    * Complete asynchronous protocol query.
+    * Ignore connections that were started for a previous primary.
     */
-   if (!(reply = mongo_protocol_query_finish(protocol, result, &error))) {
-      g_message("%s", error->message);
-      g_error_free(error);
-      GOTO(failure);
+   if (grow->generation != priv->pool_generation) {
+      g_clear_error(&error);
+      GOTO(cleanup);
    }
 
-   /*
-    * Make sure we got a valid document back.
-    */
-   if (!(list = mongo_message_reply_get_documents(reply))) {
-      GOTO(failure);
+   priv->pool_connecting--;
+
+   if (!conn) {
+      g_message("Failed to add pooled connection: %s", error->message);
+      g_error_free(error);
+      GOTO(cleanup);
    }
 
-   /*
-    * Make sure we got a valid response back.
-    */
-   mongo_bson_iter_init(&iter, list->data);
-   if (mongo_bson_iter_find(&iter, "ok")) {
-      if (!mongo_bson_iter_get_value_boolean(&iter)) {
-         GOTO(failure);
-      }
+   if (priv->state == STATE_CONNECTED) {
+      protocol = mongo_connection_create_protocol(connection, conn);
+      mongo_connection_pool_add(connection, protocol);
+      g_object_unref(protocol);
    }
 
-   /*
-    * Check to see if this host contains the repl set name.
-    * If so, verify that it is the one we should be talking to.
+cleanup:
+   g_clear_object(&conn);
+   g_object_unref(grow->connection);
+   g_slice_free(PoolGrow, grow);
+
+   EXIT;
+}
+
+/*
+ * Starts connecting another protocol to the primary unless the pool has
+ * reached "maxPoolSize". The primary has already answered "ismaster" so
+ * the handshake is not repeated for pooled connections.
+ */
+static void
+mongo_connection_pool_grow (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   PoolGrow *grow;
+
+   if ((priv->state != STATE_CONNECTED) ||
+       !priv->host ||
+       ((priv->pool->len + priv->pool_connecting) >= priv->max_pool_size)) {
+      return;
+   }
+
+   grow = g_slice_new0(PoolGrow);
+   grow->connection = g_object_ref(connection);
+   grow->generation = priv->pool_generation;
+
+   priv->pool_connecting++;
+
+   mongo_connection_connect_to_host(connection,
+                                    priv->host,
+                                    priv->dispose_cancel,
+                                    mongo_connection_pool_connect_cb,
+                                    grow);
+}
+
+static void
+mongo_connection_pool_fill (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   guint n_pool;
+
+   n_pool = priv->pool->len + priv->pool_connecting;
+   for (; n_pool < priv->min_pool_size; n_pool++) {
+      mongo_connection_pool_grow(connection);
+   }
+}
+
+static gboolean
+mongo_connection_is_protocol (gpointer key,
+                              gpointer value,
+                              gpointer user_data)
+{
+   return (value == user_data);
+}
+
+/*
+ * Finds the pooled protocol with the least outstanding work. Congested
+ * protocols come last, then those with more requests waiting for a
+ * reply, then those with more bytes waiting to be sent, which is where
+ * unacknowledged writes show. @busy is set if the protocol found has
+ * work outstanding.
+ */
+static MongoProtocol *
+mongo_connection_least_loaded (MongoConnection *connection,
+                               gboolean        *busy)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   MongoProtocol *protocol;
+   MongoProtocol *best = NULL;
+   gboolean best_congested = TRUE;
+   gboolean congested;
+   guint best_pending = G_MAXUINT;
+   guint pending;
+   gsize best_queued = G_MAXSIZE;
+   gsize queued;
+   guint i;
+
+   g_assert(priv->pool->len);
+
+   for (i = 0; i < priv->pool->len; i++) {
+      protocol = g_ptr_array_index(priv->pool, i);
+      congested = mongo_protocol_get_congested(protocol);
+      pending = mongo_protocol_get_n_pending(protocol);
+      queued = mongo_protocol_get_send_queued(protocol);
+      if (!best ||
+          (congested < best_congested) ||
+          ((congested == best_congested) &&
+           ((pending < best_pending) ||
+            ((pending == best_pending) && (queued < best_queued))))) {
+         best = protocol;
+         best_congested = congested;
+         best_pending = pending;
+         best_queued = queued;
+         if (!congested && !pending && !queued) {
+            break;
+         }
+      }
+   }
+
+   *busy = (best_pending || best_queued);
+
+   return best;
+}
+
+/*
+ * Called with a reply to a request on @protocol. If the request was
+ * sent after the last unacknowledged write there, the server applied
+ * the write first and requests may be spread across the pool again.
+ */
+static void
+mongo_connection_release_unacked (GSimpleAsyncResult *simple,
+                                  MongoProtocol      *protocol)
+{
+   MongoConnection *connection;
+   guint seq;
+
+   seq = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(simple), "unacked-seq"));
+   if (!seq) {
+      return;
+   }
+
+   connection = (MongoConnection *)
+      g_async_result_get_source_object(G_ASYNC_RESULT(simple));
+
+   if ((connection->priv->unacked == protocol) &&
+       (connection->priv->unacked_seq == seq)) {
+      connection->priv->unacked = NULL;
+   }
+
+   g_object_unref(connection);
+}
+
+static void
+mongo_connection_member_free (Member *member)
+{
+   g_clear_object(&member->protocol);
+   g_object_unref(member->dispose_cancel);
+   g_free(member->host);
+   g_slice_free(Member, member);
+}
+
+static void
+mongo_connection_member_failed (MongoProtocol *protocol,
+                                const GError  *error,
+                                Member        *member)
+{
+   g_signal_handlers_disconnect_by_func(protocol,
+                                        mongo_connection_member_failed,
+                                        member);
+   mongo_manager_update_host(member->connection->priv->manager,
+                             member->host,
+                             MONGO_MANAGER_HOST_DOWN,
+                             0,
+                             -1);
+   g_clear_object(&member->protocol);
+}
+
+/*
+ * Destroy notify for the members table. A member that is still
+ * connecting is freed by the callback of the connection attempt.
+ */
+static void
+mongo_connection_member_release (gpointer data)
+{
+   Member *member = data;
+
+   if (member->protocol) {
+      g_signal_handlers_disconnect_by_func(member->protocol,
+                                           mongo_connection_member_failed,
+                                           member);
+      mongo_protocol_fail(member->protocol, NULL);
+   }
+
+   if (!member->connecting) {
+      mongo_connection_member_free(member);
+   }
+}
+
+static void
+mongo_connection_member_connect_cb (GObject      *object,
+                                    GAsyncResult *result,
+                                    gpointer      user_data)
+{
+   GSocketConnection *conn;
+   MongoConnection *connection;
+   GSocketClient *socket_client = (GSocketClient *)object;
+   Request *request;
+   Member *member = user_data;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(G_IS_SOCKET_CLIENT(socket_client));
+   g_assert(member);
+
+   connection = member->connection;
+   conn = g_socket_client_connect_to_host_finish(socket_client,
+                                                 result,
+                                                 &error);
+   member->connecting = FALSE;
+
+   /*
+    * Queued requests reference the connection, so none can be left if
+    * it is being finalized.
+    */
+   if (g_cancellable_is_cancelled(member->dispose_cancel)) {
+      g_clear_error(&error);
+      g_clear_object(&conn);
+      mongo_connection_member_free(member);
+      EXIT;
+   }
+
+   if (!conn) {
+      g_message("Failed to connect to secondary: %s", error->message);
+      mongo_manager_update_host(connection->priv->manager,
+                                member->host,
+                                MONGO_MANAGER_HOST_DOWN,
+                                0,
+                                -1);
+      while ((request = g_queue_pop_head(&member->queue))) {
+         request_fail(request, error);
+         request_free(request);
+      }
+      g_error_free(error);
+      EXIT;
+   }
+
+   member->protocol = mongo_connection_create_protocol(connection, conn);
+   g_signal_connect(member->protocol, "failed",
+                    G_CALLBACK(mongo_connection_member_failed),
+                    member);
+   g_object_unref(conn);
+
+   while ((request = g_queue_pop_head(&member->queue))) {
+      request_run(request, member->protocol);
+      request_free(request);
+   }
+
+   EXIT;
+}
+
+/*
+ * Runs @request on the secondary @host, connecting to it first if
+ * needed.
+ */
+static void
+mongo_connection_member_dispatch (MongoConnection *connection,
+                                  const gchar     *host,
+                                  Request         *request)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   Member *member;
+
+   if (!(member = g_hash_table_lookup(priv->members, host))) {
+      member = g_slice_new0(Member);
+      member->connection = connection;
+      member->dispose_cancel = g_object_ref(priv->dispose_cancel);
+      member->host = g_strdup(host);
+      g_queue_init(&member->queue);
+      g_hash_table_insert(priv->members, g_strdup(host), member);
+   }
+
+   g_object_set_data_full(G_OBJECT(request->simple), "host",
+                          g_strdup(host), g_free);
+
+   if (request->oper == MONGO_OPERATION_QUERY) {
+      request->u.query.flags |= MONGO_QUERY_SLAVE_OK;
+   }
+
+   if (member->protocol) {
+      request_run(request, member->protocol);
+      request_free(request);
+      return;
+   }
+
+   g_queue_push_tail(&member->queue, request);
+
+   if (!member->connecting) {
+      member->connecting = TRUE;
+      mongo_connection_connect_to_host(connection,
+                                       host,
+                                       priv->dispose_cancel,
+                                       mongo_connection_member_connect_cb,
+                                       member);
+   }
+}
+
+/*
+ * Picks a secondary, or the primary too if @with_primary is set, among
+ * those whose round trip time is within "localThresholdMS" of the
+ * fastest. Members that have not been checked yet are never picked, as
+ * they may be arbiters or hidden. Returns %NULL if there is no candidate
+ * or the primary was picked.
+ */
+static gchar *
+mongo_connection_select_member (MongoConnection *connection,
+                                gboolean         with_primary)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   GPtrArray *candidates;
+   GPtrArray *eligible;
+   gchar **hosts;
+   gchar *ret = NULL;
+   gint64 fastest = G_MAXINT64;
+   gint64 rtt;
+   guint i;
+
+   hosts = mongo_manager_get_hosts(priv->manager);
+   candidates = g_ptr_array_new();
+   eligible = g_ptr_array_new();
+
+   for (i = 0; hosts[i]; i++) {
+      if (mongo_manager_get_host_state(priv->manager, hosts[i]) ==
+          MONGO_MANAGER_HOST_SECONDARY) {
+         g_ptr_array_add(candidates, hosts[i]);
+      }
+   }
+
+   if (with_primary && priv->host) {
+      g_ptr_array_add(candidates, priv->host);
+   }
+
+   for (i = 0; i < candidates->len; i++) {
+      rtt = mongo_manager_get_host_rtt(priv->manager, candidates->pdata[i]);
+      if ((rtt >= 0) && (rtt < fastest)) {
+         fastest = rtt;
+      }
+   }
+
+   /*
+    * Members without a round trip time are only eligible if none has one.
+    */
+   for (i = 0; i < candidates->len; i++) {
+      rtt = mongo_manager_get_host_rtt(priv->manager, candidates->pdata[i]);
+      if ((rtt < 0) ?
+          (fastest == G_MAXINT64) :
+          (rtt <= fastest + (priv->localthresholdms * G_GINT64_CONSTANT(1000)))) {
+         g_ptr_array_add(eligible, candidates->pdata[i]);
+      }
+   }
+
+   if (eligible->len) {
+      i = g_random_int_range(0, eligible->len);
+      if (!with_primary || !!g_strcmp0(eligible->pdata[i], priv->host)) {
+         ret = g_strdup(eligible->pdata[i]);
+      }
+   }
+
+   g_ptr_array_unref(eligible);
+   g_ptr_array_unref(candidates);
+   g_strfreev(hosts);
+
+   return ret;
+}
+
+/*
+ * Checks if @request is a query that may be served by a secondary.
+ * Commands are only considered reads if they are known not to write.
+ */
+static gboolean
+mongo_connection_is_read (Request *request)
+{
+   static const gchar *read_commands[] = {
+      "collStats", "count", "dbStats", "distinct", "geoNear",
+      "geoSearch", "group", NULL
+   };
+   MongoBsonIter iter;
+   const gchar *key;
+   guint i;
+
+   if (request->oper != MONGO_OPERATION_QUERY) {
+      return FALSE;
+   }
+
+   if (!g_str_has_suffix(request->u.query.db_and_collection, ".$cmd")) {
+      return TRUE;
+   }
+
+   mongo_bson_iter_init(&iter, request->u.query.query);
+   if (mongo_bson_iter_next(&iter)) {
+      key = mongo_bson_iter_get_key(&iter);
+      for (i = 0; read_commands[i]; i++) {
+         if (!g_ascii_strcasecmp(key, read_commands[i])) {
+            return TRUE;
+         }
+      }
+   }
+
+   return FALSE;
+}
+
+/*
+ * Sends the cursors of a kill_cursors @request that were opened on a
+ * secondary to that member, one request per member. @request keeps the
+ * remaining cursors, which belong to the primary. Returns %TRUE if no
+ * cursor is left for the primary, in which case @request is consumed.
+ */
+static gboolean
+mongo_connection_route_kill_cursors (MongoConnection *connection,
+                                     Request         *request)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   GHashTableIter iter;
+   const gchar *pinned;
+   GHashTable *groups;
+   Request *part;
+   GArray *cursors;
+   GArray *primary;
+   GArray *group;
+   gboolean ret;
+   guint64 cursor_id;
+   gchar *host;
+   guint *n_parts;
+   guint i;
+
+   cursors = request->u.kill_cursors.cursors;
+   primary = g_array_new(FALSE, FALSE, sizeof(guint64));
+   groups = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+   for (i = 0; i < cursors->len; i++) {
+      cursor_id = g_array_index(cursors, guint64, i);
+      if (!(pinned = g_hash_table_lookup(priv->cursors, &cursor_id))) {
+         g_hash_table_remove(priv->cursor_protocols, &cursor_id);
+         g_array_append_val(primary, cursor_id);
+         continue;
+      }
+      if (!(group = g_hash_table_lookup(groups, pinned))) {
+         group = g_array_new(FALSE, FALSE, sizeof(guint64));
+         g_hash_table_insert(groups, g_strdup(pinned), group);
+      }
+      g_array_append_val(group, cursor_id);
+      g_hash_table_remove(priv->cursors, &cursor_id);
+   }
+
+   if (!g_hash_table_size(groups)) {
+      g_array_free(primary, TRUE);
+      g_hash_table_unref(groups);
+      return FALSE;
+   }
+
+   n_parts = g_new(guint, 1);
+   *n_parts = g_hash_table_size(groups) + !!primary->len;
+   g_object_set_data_full(G_OBJECT(request->simple), "n-parts",
+                          n_parts, g_free);
+   g_simple_async_result_set_op_res_gboolean(request->simple, TRUE);
+
+   g_hash_table_iter_init(&iter, groups);
+   while (g_hash_table_iter_next(&iter, (gpointer *)&host, (gpointer *)&group)) {
+      part = g_slice_new0(Request);
+      part->oper = MONGO_OPERATION_KILL_CURSORS;
+      part->simple = g_object_ref(request->simple);
+      if (request->cancellable) {
+         part->cancellable = g_object_ref(request->cancellable);
+      }
+      part->u.kill_cursors.cursors = group;
+      mongo_connection_member_dispatch(connection, host, part);
+   }
+
+   g_array_free(cursors, TRUE);
+   request->u.kill_cursors.cursors = primary;
+
+   if ((ret = !primary->len)) {
+      request_free(request);
+   }
+
+   g_hash_table_unref(groups);
+
+   return ret;
+}
+
+/*
+ * Sends @request to a secondary if the read preference calls for it.
+ * getmore and kill_cursors follow the member their cursor was opened on.
+ * Returns %FALSE if @request should be served by the primary instead.
+ */
+static gboolean
+mongo_connection_route (MongoConnection *connection,
+                        Request         *request)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   const gchar *pinned;
+   gboolean connected;
+   guint64 *cursor_id;
+   GError *error;
+   gchar *host = NULL;
+
+   connected = (priv->state == STATE_CONNECTED);
+
+   switch (request->oper) {
+   case MONGO_OPERATION_GETMORE:
+      cursor_id = g_new(guint64, 1);
+      *cursor_id = request->u.getmore.cursor_id;
+      g_object_set_data_full(G_OBJECT(request->simple), "cursor-id",
+                             cursor_id, g_free);
+      if (!(pinned = g_hash_table_lookup(priv->cursors, cursor_id))) {
+         return FALSE;
+      }
+      host = g_strdup(pinned);
+      break;
+   case MONGO_OPERATION_KILL_CURSORS:
+      return mongo_connection_route_kill_cursors(connection, request);
+   case MONGO_OPERATION_QUERY:
+      if ((priv->read_mode == MONGO_READ_PRIMARY) ||
+          !mongo_connection_is_read(request)) {
+         return FALSE;
+      }
+      if (connected) {
+         mongo_connection_start_heartbeat(connection);
+      }
+      switch (priv->read_mode) {
+      case MONGO_READ_PRIMARY_PREFERRED:
+         if (!connected) {
+            host = mongo_connection_select_member(connection, FALSE);
+         }
+         break;
+      case MONGO_READ_SECONDARY:
+      case MONGO_READ_SECONDARY_PREFERRED:
+         host = mongo_connection_select_member(connection, FALSE);
+         break;
+      case MONGO_READ_NEAREST:
+         host = mongo_connection_select_member(connection, connected);
+         break;
+      case MONGO_READ_PRIMARY:
+      default:
+         break;
+      }
+      /*
+       * Secondary reads wait while connecting, as the replica set has
+       * not been discovered yet, and then until every member has been
+       * checked once.
+       */
+      if (!host && connected && !priv->members_checked &&
+          ((priv->read_mode == MONGO_READ_SECONDARY) ||
+           (priv->read_mode == MONGO_READ_SECONDARY_PREFERRED))) {
+         g_queue_push_tail(&priv->member_waiters, request);
+         return TRUE;
+      }
+      if (!host && connected && (priv->read_mode == MONGO_READ_SECONDARY)) {
+         error = g_error_new(MONGO_CONNECTION_ERROR,
+                             MONGO_CONNECTION_ERROR_NO_SECONDARY,
+                             _("No secondary is available."));
+         request_fail(request, error);
+         request_free(request);
+         g_error_free(error);
+         return TRUE;
+      }
+      break;
+   case MONGO_OPERATION_UPDATE:
+   case MONGO_OPERATION_INSERT:
+   case MONGO_OPERATION_DELETE:
+   case MONGO_OPERATION_REPLY:
+   case MONGO_OPERATION_MSG:
+   default:
+      break;
+   }
+
+   if (!host) {
+      return FALSE;
+   }
+
+   mongo_connection_member_dispatch(connection, host, request);
+   g_free(host);
+
+   return TRUE;
+}
+
+/*
+ * The following expose the read routing to the tests, which check it
+ * without a replica set.
+ */
+gboolean
+_mongo_connection_is_read (const gchar *db_and_collection,
+                           MongoBson   *query)
+{
+   Request request = { 0 };
+
+   request.oper = MONGO_OPERATION_QUERY;
+   request.u.query.db_and_collection = (gchar *)db_and_collection;
+   request.u.query.query = query;
+
+   return mongo_connection_is_read(&request);
+}
+
+MongoManager *
+_mongo_connection_get_manager (MongoConnection *connection)
+{
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), NULL);
+
+   return connection->priv->manager;
+}
+
+gchar *
+_mongo_connection_select_member (MongoConnection *connection,
+                                 gboolean         with_primary)
+{
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), NULL);
+
+   return mongo_connection_select_member(connection, with_primary);
+}
+
+void
+_mongo_connection_pin_cursor (GSimpleAsyncResult *simple,
+                              MongoProtocol      *protocol,
+                              MongoMessageReply  *reply)
+{
+   mongo_connection_pin_cursor(simple, protocol, reply);
+}
+
+const gchar *
+_mongo_connection_get_cursor_host (MongoConnection *connection,
+                                   guint64          cursor_id)
+{
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), NULL);
+
+   return g_hash_table_lookup(connection->priv->cursors, &cursor_id);
+}
+
+/*
+ * Exposes the size of the pool to the tests.
+ */
+guint
+_mongo_connection_get_pool_size (MongoConnection *connection)
+{
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), 0);
+
+   return connection->priv->pool->len;
+}
+
+/*
+ * Runs @request on the protocol with the least outstanding work. If even
+ * that one is busy, another connection is added to the pool for the
+ * requests that follow. Reads may be sent to a secondary instead.
+ */
+static void
+mongo_connection_dispatch (MongoConnection *connection,
+                           Request         *request)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   MongoProtocol *protocol = NULL;
+   gboolean unacked;
+   gboolean busy;
+
+   if (mongo_connection_route(connection, request)) {
+      return;
+   }
+
+   unacked = (!priv->safe &&
+              ((request->oper == MONGO_OPERATION_INSERT) ||
+               (request->oper == MONGO_OPERATION_UPDATE) ||
+               (request->oper == MONGO_OPERATION_DELETE)));
+
+   /*
+    * The getmores of a cursor follow the protocol it was opened on.
+    */
+   if (request->oper == MONGO_OPERATION_GETMORE) {
+      protocol = g_hash_table_lookup(priv->cursor_protocols,
+                                     &request->u.getmore.cursor_id);
+   }
+
+   /*
+    * Nothing tells when an unacknowledged write has been applied, so
+    * requests stay behind it on its socket to not overtake it.
+    */
+   if (!protocol) {
+      protocol = priv->unacked;
+   }
+
+   if (!protocol) {
+      protocol = mongo_connection_least_loaded(connection, &busy);
+      if (busy) {
+         mongo_connection_pool_grow(connection);
+      }
+   }
+
+   if (unacked) {
+      priv->unacked = protocol;
+      if (!++priv->unacked_seq) {
+         priv->unacked_seq++;
+      }
+   } else if (protocol == priv->unacked) {
+      g_object_set_data(G_OBJECT(request->simple), "unacked-seq",
+                        GUINT_TO_POINTER(priv->unacked_seq));
+   }
+
+   request_run(request, protocol);
+   request_free(request);
+}
+
+static void
+mongo_connection_protocol_failed (MongoProtocol   *protocol,
+                                  const GError    *error,
+                                  MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   g_warning("Mongo protocol failure: %s.",
+             error ? error->message : "Unknown error");
+
+   /*
+    * Drop the protocol from the pool. If others remain they continue
+    * to serve requests.
+    */
+   g_signal_handlers_disconnect_by_func(protocol,
+                                        mongo_connection_protocol_failed,
+                                        connection);
+   g_hash_table_foreach_remove(priv->cursor_protocols,
+                               mongo_connection_is_protocol,
+                               protocol);
+   if (priv->unacked == protocol) {
+      priv->unacked = NULL;
+   }
+   g_ptr_array_remove(priv->pool, protocol);
+
+   if (priv->pool->len) {
+      mongo_connection_pool_fill(connection);
+      EXIT;
+   }
+
+   /*
+    * That was the last protocol, so connect to the next host.
+    */
+   priv->state = STATE_0;
+   mongo_connection_pool_clear(connection);
+
+   /*
+    * Start connecting to the next configured host.
+    */
+   if (!g_cancellable_is_cancelled(priv->dispose_cancel)) {
+      mongo_connection_start_connecting(connection);
+   }
+
+   EXIT;
+}
+
+static gboolean
+mongo_connection_start_connecting_timeout (gpointer data)
+{
+   mongo_connection_start_connecting(data);
+   g_object_unref(data);
+   return FALSE;
+}
+
+static void
+mongo_connection_probe_free (Probe *probe)
+{
+   g_clear_object(&probe->protocol);
+   g_object_unref(probe->dispose_cancel);
+   g_free(probe->host);
+   g_slice_free(Probe, probe);
+}
+
+/*
+ * Ends the current round of probes. Probes still running are cancelled
+ * and discard whatever they connected to when they complete.
+ */
+static void
+mongo_connection_probe_cancel_all (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   Probe *probe;
+
+   priv->probe_round++;
+
+   if (priv->probe_cancel) {
+      g_cancellable_cancel(priv->probe_cancel);
+      g_clear_object(&priv->probe_cancel);
+   }
+
+   while (priv->probes->len) {
+      probe = g_ptr_array_index(priv->probes, priv->probes->len - 1);
+      g_ptr_array_remove_index(priv->probes, priv->probes->len - 1);
+      if (probe->protocol) {
+         mongo_protocol_fail(probe->protocol, NULL);
+      }
+   }
+
+   g_hash_table_remove_all(priv->probed);
+}
+
+static void mongo_connection_probe_connect_cb (GObject      *object,
+                                               GAsyncResult *result,
+                                               gpointer      user_data);
+
+/*
+ * Starts probing @host unless it has already been tried this round.
+ */
+static void
+mongo_connection_probe_start (MongoConnection *connection,
+                              const gchar     *host)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   Probe *probe;
+
+   if (g_hash_table_lookup(priv->probed, host)) {
+      return;
+   }
+
+   g_hash_table_insert(priv->probed, g_strdup(host), GINT_TO_POINTER(TRUE));
+
+   probe = g_slice_new0(Probe);
+   probe->connection = connection;
+   probe->dispose_cancel = g_object_ref(priv->dispose_cancel);
+   probe->host = g_strdup(host);
+   probe->round = priv->probe_round;
+   g_ptr_array_add(priv->probes, probe);
+
+   mongo_connection_connect_to_host(connection,
+                                    host,
+                                    priv->probe_cancel,
+                                    mongo_connection_probe_connect_cb,
+                                    probe);
+}
+
+/*
+ * Called when @probe did not find a primary. Hosts it learned about are
+ * probed too, and once no probes remain the round has failed.
+ */
+static void
+mongo_connection_probe_failed (MongoConnection *connection,
+                               Probe           *probe)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   Request *r;
+   GError *error;
+   gchar **hosts;
+   guint delay;
+   guint i;
+
+   g_ptr_array_remove(priv->probes, probe);
+
+   hosts = mongo_manager_get_hosts(priv->manager);
+   for (i = 0; hosts[i]; i++) {
+      mongo_connection_probe_start(connection, hosts[i]);
+   }
+   g_strfreev(hosts);
+
+   if (priv->probes->len) {
+      return;
+   }
+
+   /*
+    * No more hosts to connect to this round. We need to therefore cancel
+    * any pending requests immediately, unless they have a deadline of
+    * their own with "queueTimeoutMS".
+    */
+   if (!priv->queuetimeoutms) {
+      error = g_error_new(MONGO_CONNECTION_ERROR,
+                          MONGO_CONNECTION_ERROR_CONNECT_FAILED,
+                          _("Failed to connect to MongoDB."));
+      while ((r = mongo_connection_queue_pop(connection))) {
+         request_fail(r, error);
+         request_free(r);
+      }
+      g_error_free(error);
+   }
+
+   delay = priv->probe_delay;
+   mongo_connection_probe_cancel_all(connection);
+
+   g_message("No more hosts, delaying for %u milliseconds.", delay);
+   g_source_unref(
+      mongo_connection_add_timeout(delay,
+                                   mongo_connection_start_connecting_timeout,
+                                   g_object_ref(connection)));
+}
+
+/*
+ * Drops the pool and starts looking for the new primary. Requests in
+ * flight on the old primary fail, while queued ones wait for the new one.
+ */
+static void
+mongo_connection_failover (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   GPtrArray *pool;
+   guint i;
+
+   pool = g_ptr_array_new_with_free_func(g_object_unref);
+   for (i = 0; i < priv->pool->len; i++) {
+      g_ptr_array_add(pool, g_object_ref(g_ptr_array_index(priv->pool, i)));
+   }
+
+   mongo_connection_pool_clear(connection);
+
+   for (i = 0; i < pool->len; i++) {
+      mongo_protocol_fail(g_ptr_array_index(pool, i), NULL);
+   }
+   g_ptr_array_unref(pool);
+
+   priv->state = STATE_0;
+   mongo_connection_start_connecting(connection);
+}
+
+static void
+mongo_connection_monitor_free (Monitor *monitor)
+{
+   g_clear_object(&monitor->protocol);
+   g_object_unref(monitor->dispose_cancel);
+   g_free(monitor->host);
+   g_slice_free(Monitor, monitor);
+}
+
+/*
+ * Destroy notify for the monitors table. A monitor with a check in
+ * flight is freed by the callback of that check instead.
+ */
+static void
+mongo_connection_monitor_release (gpointer data)
+{
+   Monitor *monitor = data;
+
+   if (monitor->protocol) {
+      mongo_protocol_fail(monitor->protocol, NULL);
+   }
+
+   if (!monitor->busy) {
+      mongo_connection_monitor_free(monitor);
+   }
+}
+
+/*
+ * Called after each check of @monitor's host. If the host we are using as
+ * primary is no longer primary, switch to the new one right away rather
+ * than waiting for requests to fail.
+ */
+static void
+mongo_connection_monitor_checked (MongoConnection *connection,
+                                  Monitor         *monitor)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   GHashTableIter iter;
+   gboolean checked = TRUE;
+   Monitor *other;
+   Request *request;
+
+   monitor->checked = TRUE;
+
+   /*
+    * Once every member has been checked, the reads waiting for a
+    * secondary can be routed.
+    */
+   if (!priv->members_checked) {
+      g_hash_table_iter_init(&iter, priv->monitors);
+      while (checked &&
+             g_hash_table_iter_next(&iter, NULL, (gpointer *)&other)) {
+         checked = other->checked;
+      }
+      if (checked) {
+         priv->members_checked = TRUE;
+         while ((request = g_queue_pop_head(&priv->member_waiters))) {
+            mongo_connection_queue(connection, request);
+         }
+      }
+   }
+
+   if ((priv->state == STATE_CONNECTED) &&
+       !g_strcmp0(monitor->host, priv->host) &&
+       (mongo_manager_get_host_state(priv->manager, monitor->host) !=
+        MONGO_MANAGER_HOST_PRIMARY)) {
+      g_message("%s is no longer primary, failing over.", monitor->host);
+      mongo_connection_failover(connection);
+   }
+}
+
+/*
+ * Marks @monitor's host as unreachable. A new socket is opened for the
+ * next check.
+ */
+static void
+mongo_connection_monitor_down (MongoConnection *connection,
+                               Monitor         *monitor)
+{
+   if (monitor->protocol) {
+      mongo_protocol_fail(monitor->protocol, NULL);
+      g_clear_object(&monitor->protocol);
+   }
+
+   mongo_manager_update_host(connection->priv->manager,
+                             monitor->host,
+                             MONGO_MANAGER_HOST_DOWN,
+                             0,
+                             -1);
+}
+
+static void
+mongo_connection_monitor_ismaster_cb (GObject      *object,
+                                      GAsyncResult *result,
+                                      gpointer      user_data)
+{
+   MongoConnectionPrivate *priv;
+   MongoManagerHostState state = MONGO_MANAGER_HOST_OTHER;
+   MongoMessageReply *reply;
+   MongoConnection *connection;
+   MongoProtocol *protocol = (MongoProtocol *)object;
+   MongoBsonIter iter;
+   MongoBsonIter iter2;
+   const gchar *key;
+   Monitor *monitor = user_data;
+   GError *error = NULL;
+   GList *list;
+   gint64 rtt_usec;
+   gint set_version = 0;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(monitor);
+
+   connection = monitor->connection;
+   reply = mongo_protocol_query_finish(protocol, result, &error);
+   rtt_usec = g_get_monotonic_time() - monitor->started;
+   monitor->busy = FALSE;
+
+   /*
+    * The connection was finalized while the check was in flight.
+    */
+   if (g_cancellable_is_cancelled(monitor->dispose_cancel)) {
+      g_clear_error(&error);
+      g_clear_object(&reply);
+      mongo_connection_monitor_free(monitor);
+      EXIT;
+   }
+
+   priv = connection->priv;
+
+   if (!reply || !(list = mongo_message_reply_get_documents(reply))) {
+      g_clear_error(&error);
+      mongo_connection_monitor_down(connection, monitor);
+      GOTO(checked);
+   }
+
+   mongo_bson_iter_init(&iter, list->data);
+   while (mongo_bson_iter_next(&iter)) {
+      key = mongo_bson_iter_get_key(&iter);
+      switch (mongo_bson_iter_get_value_type(&iter)) {
+      case MONGO_BSON_BOOLEAN:
+         if (!mongo_bson_iter_get_value_boolean(&iter)) {
+            break;
+         }
+         if (!g_strcmp0(key, "ismaster")) {
+            state = MONGO_MANAGER_HOST_PRIMARY;
+         } else if (!g_strcmp0(key, "secondary") &&
+                    (state != MONGO_MANAGER_HOST_PRIMARY)) {
+            state = MONGO_MANAGER_HOST_SECONDARY;
+         }
+         break;
+      case MONGO_BSON_INT32:
+         if (!g_strcmp0(key, "setVersion")) {
+            set_version = mongo_bson_iter_get_value_int(&iter);
+         }
+         break;
+      case MONGO_BSON_UTF8:
+         if (!g_strcmp0(key, "primary")) {
+            mongo_manager_add_host(priv->manager,
+                                   mongo_bson_iter_get_value_string(&iter,
+                                                                    NULL));
+         } else if (!g_strcmp0(key, "setName") && priv->replica_set &&
+                    !!g_strcmp0(priv->replica_set,
+                                mongo_bson_iter_get_value_string(&iter,
+                                                                 NULL))) {
+            /*
+             * The host has been moved to another replica set.
+             */
+            state = MONGO_MANAGER_HOST_DOWN;
+            GOTO(update);
+         }
+         break;
+      case MONGO_BSON_ARRAY:
+         if (!g_strcmp0(key, "hosts") &&
+             mongo_bson_iter_recurse(&iter, &iter2)) {
+            while (mongo_bson_iter_next(&iter2)) {
+               if (mongo_bson_iter_get_value_type(&iter2) == MONGO_BSON_UTF8) {
+                  mongo_manager_add_host(
+                        priv->manager,
+                        mongo_bson_iter_get_value_string(&iter2, NULL));
+               }
+            }
+         }
+         break;
+      default:
+         break;
+      }
+   }
+
+update:
+   mongo_manager_update_host(priv->manager,
+                             monitor->host,
+                             state,
+                             set_version,
+                             rtt_usec);
+
+checked:
+   mongo_connection_monitor_checked(connection, monitor);
+   g_clear_object(&reply);
+
+   EXIT;
+}
+
+static void
+mongo_connection_monitor_send (Monitor *monitor)
+{
+   MongoBson *command;
+
+   command = mongo_bson_new_empty();
+   mongo_bson_append_int(command, "ismaster", 1);
+   monitor->started = g_get_monotonic_time();
+   mongo_protocol_query_async(monitor->protocol,
+                              "admin.$cmd",
+                              MONGO_QUERY_EXHAUST,
+                              0,
+                              1,
+                              command,
+                              NULL,
+                              NULL,
+                              mongo_connection_monitor_ismaster_cb,
+                              monitor);
+   mongo_bson_unref(command);
+}
+
+static void
+mongo_connection_monitor_connect_cb (GObject      *object,
+                                     GAsyncResult *result,
+                                     gpointer      user_data)
+{
+   GSocketConnection *conn;
+   MongoConnection *connection;
+   GSocketClient *socket_client = (GSocketClient *)object;
+   Monitor *monitor = user_data;
+
+   ENTRY;
+
+   g_assert(G_IS_SOCKET_CLIENT(socket_client));
+   g_assert(monitor);
+
+   connection = monitor->connection;
+   conn = g_socket_client_connect_to_host_finish(socket_client, result, NULL);
+
+   if (g_cancellable_is_cancelled(monitor->dispose_cancel)) {
+      g_clear_object(&conn);
+      monitor->busy = FALSE;
+      mongo_connection_monitor_free(monitor);
+      EXIT;
+   }
+
+   if (!conn) {
+      monitor->busy = FALSE;
+      mongo_connection_monitor_down(connection, monitor);
+      mongo_connection_monitor_checked(connection, monitor);
+      EXIT;
+   }
+
+   monitor->protocol = mongo_connection_create_protocol(connection, conn);
+   mongo_connection_monitor_send(monitor);
+   g_object_unref(conn);
+
+   EXIT;
+}
+
+/*
+ * Starts a check of @host with "ismaster". A check still in flight from
+ * the previous heartbeat has taken too long, so the host is considered
+ * down instead.
+ */
+static void
+mongo_connection_monitor_check (MongoConnection *connection,
+                                const gchar     *host)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   Monitor *monitor;
+
+   if (!(monitor = g_hash_table_lookup(priv->monitors, host))) {
+      monitor = g_slice_new0(Monitor);
+      monitor->connection = connection;
+      monitor->dispose_cancel = g_object_ref(priv->dispose_cancel);
+      monitor->host = g_strdup(host);
+      g_hash_table_insert(priv->monitors, g_strdup(host), monitor);
+   }
+
+   if (monitor->busy) {
+      if (monitor->protocol) {
+         mongo_protocol_fail(monitor->protocol, NULL);
+      }
+      return;
+   }
+
+   monitor->busy = TRUE;
+
+   if (monitor->protocol) {
+      mongo_connection_monitor_send(monitor);
+   } else {
+      mongo_connection_connect_to_host(connection,
+                                       host,
+                                       priv->dispose_cancel,
+                                       mongo_connection_monitor_connect_cb,
+                                       monitor);
+   }
+}
+
+static gboolean
+mongo_connection_heartbeat (gpointer data)
+{
+   MongoConnectionPrivate *priv;
+   MongoConnection *connection = data;
+   gchar **hosts;
+   guint i;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   if (priv->host) {
+      mongo_connection_monitor_check(connection, priv->host);
+   }
+
+   hosts = mongo_manager_get_hosts(priv->manager);
+   for (i = 0; hosts[i]; i++) {
+      if (!!g_strcmp0(hosts[i], priv->host)) {
+         mongo_connection_monitor_check(connection, hosts[i]);
+      }
+   }
+   g_strfreev(hosts);
+
+   return TRUE;
+}
+
+/*
+ * Starts the heartbeat unless it is running, checking every member right
+ * away. Reads from secondaries need it to know the members' states, so
+ * it runs at a default interval if "heartbeatFrequencyMS" is not set.
+ */
+static void
+mongo_connection_start_heartbeat (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+
+   if (!priv->heartbeat_source) {
+      priv->heartbeat_source =
+         mongo_connection_add_timeout(priv->heartbeatfrequencyms ?:
+                                      MONGO_HEARTBEAT_FREQUENCY_DEFAULT,
+                                      mongo_connection_heartbeat,
+                                      connection);
+      mongo_connection_heartbeat(connection);
+   }
+}
+
+static void
+mongo_connection_probe_ismaster_cb (GObject      *object,
+                                    GAsyncResult *result,
+                                    gpointer      user_data)
+{
+   MongoConnectionPrivate *priv;
+   MongoConnection *connection;
+   MongoProtocol *protocol = (MongoProtocol *)object;
+   MongoBsonIter iter;
+   MongoBsonIter iter2;
+   const gchar *host;
+   const gchar *key;
+   const gchar *primary;
+   const gchar *replica_set;
+   MongoMessageReply *reply = NULL;
+   gboolean ismaster = FALSE;
+   Request *request;
+   GError *error = NULL;
+   GList *list = NULL;
+   Probe *probe = user_data;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(probe);
+
+   connection = probe->connection;
+
+   /*
+    * Complete asynchronous protocol query.
+    */
+   reply = mongo_protocol_query_finish(protocol, result, &error);
+
+   /*
+    * Discard the reply if the connection is being finalized or the
+    * round this probe belongs to has ended.
+    */
+   if (g_cancellable_is_cancelled(probe->dispose_cancel) ||
+       (probe->round != connection->priv->probe_round)) {
+      g_clear_error(&error);
+      GOTO(discard);
+   }
+
+   priv = connection->priv;
+
+   if (!reply) {
+      g_message("%s", error->message);
+      g_error_free(error);
+      GOTO(failure);
+   }
+
+   /*
+    * Make sure we got a valid document back.
+    */
+   if (!(list = mongo_message_reply_get_documents(reply))) {
+      GOTO(failure);
+   }
+
+   /*
+    * Make sure we got a valid response back.
+    */
+   mongo_bson_iter_init(&iter, list->data);
+   if (mongo_bson_iter_find(&iter, "ok")) {
+      if (!mongo_bson_iter_get_value_boolean(&iter)) {
+         GOTO(failure);
+      }
+   }
+
+   /*
+    * Check to see if this host contains the repl set name.
+    * If so, verify that it is the one we should be talking to.
     */
    if (priv->replica_set) {
       mongo_bson_iter_init(&iter, list->data);
@@ -631,26 +2454,49 @@ mongo_connection_ismaster_cb (GObject      *object,
       }
    }
 
+   /*
+    * Record the size limits of the server so that large inserts are
+    * split into messages it will accept.
+    */
+   priv->max_bson_size = 0;
+   priv->max_message_size = 0;
+   mongo_bson_iter_init(&iter, list->data);
+   while (mongo_bson_iter_next(&iter)) {
+      if (mongo_bson_iter_get_value_type(&iter) != MONGO_BSON_INT32) {
+         continue;
+      }
+      key = mongo_bson_iter_get_key(&iter);
+      if (!g_strcmp0(key, "maxBsonObjectSize")) {
+         priv->max_bson_size = MAX(0, mongo_bson_iter_get_value_int(&iter));
+      } else if (!g_strcmp0(key, "maxMessageSizeBytes")) {
+         priv->max_message_size = MAX(0, mongo_bson_iter_get_value_int(&iter));
+      }
+   }
+   mongo_connection_apply_limits(connection, protocol);
+
    /*
     * We can reset the connection delay since we were successful.
     */
    mongo_manager_reset_delay(priv->manager);
 
    /*
-    * This is the master and we are connected, so lets store the
-    * protocol for use by the connection and change the state to
-    * connected.
+    * This is the master, so the rest of the round is no longer needed.
     */
-   priv->protocol = g_object_ref(protocol);
-   priv->state = STATE_CONNECTED;
+   g_ptr_array_remove(priv->probes, probe);
+   mongo_connection_probe_cancel_all(connection);
+
+   g_free(priv->host);
+   priv->host = g_strdup(probe->host);
+   mongo_manager_update_host(priv->manager, priv->host,
+                             MONGO_MANAGER_HOST_PRIMARY, 0, -1);
 
    /*
-    * Wire up failure of the protocol so that we can connect to
-    * the next host.
+    * This is the master and we are connected, so lets start the pool
+    * with this protocol and change the state to connected.
     */
-   g_signal_connect(protocol, "failed",
-                    G_CALLBACK(mongo_connection_protocol_failed),
-                    connection);
+   mongo_connection_pool_clear(connection);
+   mongo_connection_pool_add(connection, protocol);
+   priv->state = STATE_CONNECTED;
 
    /*
     * Emit the ::connected signal.
@@ -667,68 +2513,91 @@ mongo_connection_ismaster_cb (GObject      *object,
     * Flush any pending requests.
     */
    while ((priv->state == STATE_CONNECTED) &&
-          (priv->protocol) &&
-          (request = g_queue_pop_head(priv->queue))) {
-      request_run(request, priv->protocol);
-      request_free(request);
+          (priv->pool->len) &&
+          (request = mongo_connection_queue_pop(connection))) {
+      mongo_connection_dispatch(connection, request);
+   }
+
+   /*
+    * Open the rest of the "minPoolSize" connections.
+    */
+   mongo_connection_pool_fill(connection);
+
+   /*
+    * Start watching the replica set for changes of primary.
+    */
+   if (priv->heartbeatfrequencyms ||
+       (priv->read_mode != MONGO_READ_PRIMARY)) {
+      mongo_connection_start_heartbeat(connection);
    }
 
    g_clear_object(&reply);
+   mongo_connection_probe_free(probe);
    EXIT;
 
 failure:
    mongo_protocol_fail(protocol, NULL);
-   priv->state = STATE_0;
-   mongo_connection_start_connecting(connection);
+   mongo_connection_probe_failed(connection, probe);
    g_clear_object(&reply);
+   mongo_connection_probe_free(probe);
+   EXIT;
 
+discard:
+   mongo_protocol_fail(protocol, NULL);
+   g_clear_object(&reply);
+   mongo_connection_probe_free(probe);
    EXIT;
 }
 
 static void
-mongo_connection_connect_to_host_cb (GObject      *object,
-                                     GAsyncResult *result,
-                                     gpointer      user_data)
+mongo_connection_probe_connect_cb (GObject      *object,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
 {
-   MongoConnectionPrivate *priv;
+   MongoConnection *connection;
    GSocketConnection *conn;
-   MongoConnection *connection = user_data;
    GSocketClient *socket_client = (GSocketClient *)object;
-   MongoProtocol *protocol;
    MongoBson *command;
    GError *error = NULL;
+   Probe *probe = user_data;
 
    ENTRY;
 
    g_assert(G_IS_SOCKET_CLIENT(socket_client));
-   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(probe);
 
-   priv = connection->priv;
+   connection = probe->connection;
 
    /*
     * Complete the asynchronous connection attempt.
     */
-   if (!(conn = g_socket_client_connect_to_host_finish(socket_client,
-                                                       result,
-                                                       &error))) {
+   conn = g_socket_client_connect_to_host_finish(socket_client,
+                                                 result,
+                                                 &error);
+
+   /*
+    * Discard the connection if the #MongoConnection is being finalized
+    * or the round this probe belongs to has ended.
+    */
+   if (g_cancellable_is_cancelled(probe->dispose_cancel) ||
+       (probe->round != connection->priv->probe_round)) {
+      g_clear_error(&error);
+      GOTO(cleanup);
+   }
+
+   if (!conn) {
       g_message("Failed to connect to host: %s", error->message);
-      priv->state = STATE_0;
-      mongo_connection_start_connecting(connection);
       g_error_free(error);
-      EXIT;
+      mongo_manager_update_host(connection->priv->manager, probe->host,
+                                MONGO_MANAGER_HOST_DOWN, 0, -1);
+      mongo_connection_probe_failed(connection, probe);
+      GOTO(cleanup);
    }
 
    /*
     * Build a protocol using our connection.
     */
-   protocol = g_object_new(MONGO_TYPE_PROTOCOL,
-                           "fsync", priv->fsync,
-                           "io-stream", conn,
-                           "journal", priv->journal,
-                           "safe", priv->safe,
-                           "write-timeout", priv->wtimeoutms,
-                           "write-quorum", priv->w,
-                           NULL);
+   probe->protocol = mongo_connection_create_protocol(connection, conn);
 
    /*
     * We then need to check that the server is PRIMARY and matches our
@@ -736,38 +2605,38 @@ mongo_connection_connect_to_host_cb (GObject      *object,
     */
    command = mongo_bson_new_empty();
    mongo_bson_append_int(command, "ismaster", 1);
-   mongo_protocol_query_async(protocol,
+   mongo_protocol_query_async(probe->protocol,
                               "admin.$cmd",
                               MONGO_QUERY_EXHAUST,
                               0,
                               1,
                               command,
                               NULL,
-                              priv->dispose_cancel,
-                              mongo_connection_ismaster_cb,
-                              connection);
+                              NULL,
+                              mongo_connection_probe_ismaster_cb,
+                              probe);
    mongo_bson_unref(command);
-   g_object_unref(protocol);
    g_object_unref(conn);
 
    EXIT;
-}
 
-static gboolean
-mongo_connection_start_connecting_timeout (gpointer data)
-{
-   mongo_connection_start_connecting(data);
-   g_object_unref(data);
-   return FALSE;
+cleanup:
+   g_clear_object(&conn);
+   mongo_connection_probe_free(probe);
+
+   EXIT;
 }
 
+/*
+ * Starts a round of probes to every known seed and host at once. The
+ * first primary to answer is adopted, so failing over takes about one
+ * round trip rather than one connection attempt per host.
+ */
 static void
 mongo_connection_start_connecting (MongoConnection *connection)
 {
    MongoConnectionPrivate *priv;
    const gchar *host;
-   Request *r;
-   GError *error;
    guint delay = 0;
 
    ENTRY;
@@ -780,34 +2649,197 @@ mongo_connection_start_connecting (MongoConnection *connection)
 
    priv->state = STATE_CONNECTING;
 
-   if (!(host = mongo_manager_next(priv->manager, &delay))) {
-      /*
-       * No more hosts to connect to this round. We need to therefore cancel
-       * any pending requests immediately.
-       */
-      error = g_error_new(MONGO_CONNECTION_ERROR,
-                          MONGO_CONNECTION_ERROR_CONNECT_FAILED,
-                          _("Failed to connect to MongoDB."));
-      while ((r = g_queue_pop_head(priv->queue))) {
-         request_fail(r, error);
-         request_free(r);
+   mongo_connection_probe_cancel_all(connection);
+   priv->probe_cancel = g_cancellable_new();
+
+   /*
+    * mongo_manager_next() provides the delay to use once every host of
+    * the round has been tried.
+    */
+   while ((host = mongo_manager_next(priv->manager, &delay))) {
+      mongo_connection_probe_start(connection, host);
+   }
+   priv->probe_delay = delay;
+
+   /*
+    * With no hosts to try, fail the round right away.
+    */
+   if (!priv->probes->len) {
+      mongo_connection_probe_failed(connection, NULL);
+   }
+
+   EXIT;
+}
+
+/*
+ * Checks if the queue of requests waiting for a connection has no room
+ * for another @size bytes.
+ */
+static gboolean
+mongo_connection_queue_full (MongoConnection *connection,
+                             gsize            size)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+
+   if (priv->max_queue_size && (priv->queue->length >= priv->max_queue_size)) {
+      return TRUE;
+   }
+
+   /*
+    * A single request larger than the limit is let through an empty queue.
+    */
+   if (priv->max_queue_bytes && priv->queue->length &&
+       ((priv->queue_bytes + size) > priv->max_queue_bytes)) {
+      return TRUE;
+   }
+
+   return FALSE;
+}
+
+/*
+ * Completes the mongo_connection_wait_writable_async() calls waiting for
+ * room in the queue, if there is some.
+ */
+static void
+mongo_connection_queue_wake (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   GSimpleAsyncResult *simple;
+
+   if (g_queue_is_empty(&priv->queue_waiters) ||
+       mongo_connection_queue_full(connection, 1)) {
+      return;
+   }
+
+   while ((simple = g_queue_pop_head(&priv->queue_waiters))) {
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      mongo_connection_complete_in_idle(simple);
+      g_object_unref(simple);
+   }
+}
+
+static Request *
+mongo_connection_queue_unlink (MongoConnection *connection,
+                               GList           *link)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   Request *request = link->data;
+
+   g_queue_delete_link(priv->queue, link);
+   priv->queue_bytes -= request->size;
+   mongo_connection_queue_wake(connection);
+
+   return request;
+}
+
+static Request *
+mongo_connection_queue_pop (MongoConnection *connection)
+{
+   GList *link;
+
+   if (!(link = g_queue_peek_head_link(connection->priv->queue))) {
+      return NULL;
+   }
+
+   return mongo_connection_queue_unlink(connection, link);
+}
+
+static void mongo_connection_queue_schedule (MongoConnection *connection);
+
+/*
+ * Fails the queued requests whose "queueTimeoutMS" deadline has passed.
+ */
+static gboolean
+mongo_connection_queue_expire (gpointer data)
+{
+   MongoConnectionPrivate *priv;
+   MongoConnection *connection = data;
+   Request *request;
+   GError *error;
+   GList *iter;
+   GList *next;
+   gint64 now;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   g_source_unref(priv->queue_timeout);
+   priv->queue_timeout = NULL;
+
+   error = g_error_new(MONGO_CONNECTION_ERROR,
+                       MONGO_CONNECTION_ERROR_QUEUE_TIMEOUT,
+                       _("Timed out waiting for a connection to MongoDB."));
+   now = g_get_monotonic_time();
+
+   for (iter = priv->queue->head; iter; iter = next) {
+      next = iter->next;
+      request = iter->data;
+      if (request->deadline && (request->deadline <= now)) {
+         mongo_connection_queue_unlink(connection, iter);
+         request_fail(request, error);
+         request_free(request);
+      }
+   }
+
+   g_error_free(error);
+
+   mongo_connection_queue_schedule(connection);
+
+   RETURN(FALSE);
+}
+
+/*
+ * Arms the timer for the earliest deadline of the queued requests,
+ * unless it is armed already.
+ */
+static void
+mongo_connection_queue_schedule (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   Request *request;
+   gint64 deadline = G_MAXINT64;
+   gint64 now;
+   GList *iter;
+
+   if (priv->queue_timeout) {
+      return;
+   }
+
+   for (iter = priv->queue->head; iter; iter = iter->next) {
+      request = iter->data;
+      if (request->deadline) {
+         deadline = MIN(deadline, request->deadline);
       }
-      g_error_free(error);
-      g_message("No more hosts, delaying for %u milliseconds.", delay);
-      g_timeout_add(delay,
-                    mongo_connection_start_connecting_timeout,
-                    g_object_ref(connection));
-      EXIT;
    }
 
-   g_socket_client_connect_to_host_async(priv->socket_client,
-                                         host,
-                                         MONGO_PORT_DEFAULT,
-                                         priv->dispose_cancel,
-                                         mongo_connection_connect_to_host_cb,
-                                         connection);
+   if (deadline == G_MAXINT64) {
+      return;
+   }
 
-   EXIT;
+   now = g_get_monotonic_time();
+   priv->queue_timeout =
+      mongo_connection_add_timeout(MAX(0, deadline - now + 999) / 1000,
+                                   mongo_connection_queue_expire,
+                                   connection);
+}
+
+static void
+mongo_connection_queue_push (MongoConnection *connection,
+                             Request         *request)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+
+   if (priv->queuetimeoutms && !request->deadline) {
+      request->deadline = g_get_monotonic_time() +
+                          (priv->queuetimeoutms * G_GINT64_CONSTANT(1000));
+   }
+
+   g_queue_push_tail(priv->queue, request);
+   priv->queue_bytes += request->size;
+   mongo_connection_queue_schedule(connection);
 }
 
 static void
@@ -815,19 +2847,41 @@ mongo_connection_queue (MongoConnection *connection,
                         Request         *request)
 {
    MongoConnectionPrivate *priv;
+   GError *error;
 
    g_return_if_fail(MONGO_IS_CONNECTION(connection));
    g_return_if_fail(request);
 
    priv = connection->priv;
 
+   request->size = request_get_size(request);
+
    switch (priv->state) {
    case STATE_0:
-      g_queue_push_tail(priv->queue, request);
-      mongo_connection_start_connecting(connection);
-      break;
    case STATE_CONNECTING:
-      g_queue_push_tail(priv->queue, request);
+      if ((priv->state == STATE_CONNECTING) &&
+          mongo_connection_route(connection, request)) {
+         break;
+      }
+      /*
+       * Unless "queueOverflow=block", a full queue fails new requests
+       * right away. Otherwise producers are expected to wait with
+       * mongo_connection_wait_writable_async().
+       */
+      if (!priv->queue_block &&
+          mongo_connection_queue_full(connection, request->size)) {
+         error = g_error_new(MONGO_CONNECTION_ERROR,
+                             MONGO_CONNECTION_ERROR_QUEUE_FULL,
+                             _("Too many requests waiting for a connection."));
+         request_fail(request, error);
+         request_free(request);
+         g_error_free(error);
+         break;
+      }
+      mongo_connection_queue_push(connection, request);
+      if (priv->state == STATE_0) {
+         mongo_connection_start_connecting(connection);
+      }
       break;
    case STATE_CONNECTED:
       /*
@@ -836,10 +2890,9 @@ mongo_connection_queue (MongoConnection *connection,
        * queue in that case.
        */
       if (g_queue_is_empty(priv->queue)) {
-         request_run(request, priv->protocol);
-         request_free(request);
+         mongo_connection_dispatch(connection, request);
       } else {
-         g_queue_push_tail(priv->queue, request);
+         mongo_connection_queue_push(connection, request);
       }
       break;
    case STATE_DISPOSED:
@@ -849,6 +2902,145 @@ mongo_connection_queue (MongoConnection *connection,
    }
 }
 
+static gboolean
+mongo_connection_inbox_dispatch (gpointer data)
+{
+   MongoConnectionPrivate *priv;
+   MongoConnection *connection = data;
+   Request *request;
+   GQueue inbox;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   g_mutex_lock(&priv->inbox_mutex);
+   inbox = priv->inbox;
+   g_queue_init(&priv->inbox);
+   priv->inbox_scheduled = FALSE;
+   g_mutex_unlock(&priv->inbox_mutex);
+
+   while ((request = g_queue_pop_head(&inbox))) {
+      mongo_connection_queue(connection, request);
+   }
+
+   RETURN(FALSE);
+}
+
+static gpointer
+mongo_connection_io_thread (gpointer data)
+{
+   GMainContext *context;
+   MongoSource *source;
+   GMainLoop *loop = data;
+
+   context = g_main_loop_get_context(loop);
+   g_main_context_push_thread_default(context);
+
+   /*
+    * Completions of protocol requests stay on this thread. Only the
+    * results of public requests are sent back to the caller.
+    */
+   source = mongo_source_new();
+   g_source_attach((GSource *)source, context);
+   mongo_source_set_thread_default(source);
+
+   g_main_loop_run(loop);
+
+   mongo_source_set_thread_default(NULL);
+   g_source_destroy((GSource *)source);
+   g_source_unref((GSource *)source);
+
+   g_main_context_pop_thread_default(context);
+   g_main_loop_unref(loop);
+
+   return NULL;
+}
+
+static gboolean
+mongo_connection_io_thread_quit (gpointer data)
+{
+   g_main_loop_quit(data);
+   return FALSE;
+}
+
+/*
+ * Returns how many times the inbox has woken the owning context. Used by
+ * the tests to check that submissions are batched.
+ */
+guint
+_mongo_connection_get_inbox_wakeups (MongoConnection *connection)
+{
+   guint ret;
+
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), 0);
+
+   g_mutex_lock(&connection->priv->inbox_mutex);
+   ret = connection->priv->inbox_wakeups;
+   g_mutex_unlock(&connection->priv->inbox_mutex);
+
+   return ret;
+}
+
+/*
+ * Hands @request to the thread that owns the connection state. A caller
+ * running the connection's main context queues it directly. Any other
+ * thread, or any caller at all when "ioThread" is set, adds it to the
+ * inbox and the owning context is woken once per batch.
+ */
+static void
+mongo_connection_submit (MongoConnection *connection,
+                         Request         *request)
+{
+   MongoConnectionPrivate *priv = connection->priv;
+   GMainContext *context;
+   gboolean wakeup;
+
+   if (!priv->io_thread_enabled && g_main_context_is_owner(priv->context)) {
+      mongo_connection_queue(connection, request);
+      return;
+   }
+
+   g_mutex_lock(&priv->inbox_mutex);
+
+   if (priv->io_thread_enabled && !priv->io_thread) {
+      context = g_main_context_new();
+      priv->io_loop = g_main_loop_new(context, FALSE);
+      priv->io_thread = g_thread_new("mongo-connection",
+                                     mongo_connection_io_thread,
+                                     g_main_loop_ref(priv->io_loop));
+      g_main_context_unref(context);
+   }
+
+   if (priv->io_loop) {
+      context = g_main_loop_get_context(priv->io_loop);
+   } else {
+      context = priv->context;
+   }
+
+   g_queue_push_tail(&priv->inbox, request);
+   if ((wakeup = !priv->inbox_scheduled)) {
+      priv->inbox_scheduled = TRUE;
+      priv->inbox_wakeups++;
+   }
+
+   g_mutex_unlock(&priv->inbox_mutex);
+
+   /*
+    * This runs the dispatch right away if the calling thread can acquire
+    * the context, such as before the main loop has been started.
+    */
+   if (wakeup) {
+      g_main_context_invoke_full(context,
+                                 G_PRIORITY_DEFAULT,
+                                 mongo_connection_inbox_dispatch,
+                                 g_object_ref(connection),
+                                 g_object_unref);
+   }
+}
+
 /**
  * mongo_connection_new:
  *
@@ -885,6 +3077,59 @@ mongo_connection_new (void)
  *
  * And will result in %NULL being returned.
  *
+ * The "minPoolSize" and "maxPoolSize" options control how many sockets
+ * are opened to the primary. Requests are sent on the socket with the
+ * least outstanding work, so two requests are only guaranteed to be
+ * processed in order if the second is issued after the first completes.
+ * The exception are writes with "safe=false", which are never
+ * acknowledged: requests issued after one are sent on the same socket
+ * until one of them is answered.
+ *
+ * The "writeBatchSize" option allows up to that many safe writes to be
+ * acknowledged by a single getlasterror. See #MongoProtocol:write-batch-size.
+ *
+ * The "pendingHighWatermark", "pendingLowWatermark", "sendHighWatermark",
+ * and "sendLowWatermark" options bound the number of requests and bytes in
+ * flight on each pooled connection. See mongo_connection_wait_writable_async().
+ *
+ * The "connectTimeoutMS" option bounds how long a connection attempt may
+ * take before the host is considered unreachable. The "socketTimeoutMS" option bounds
+ * how long to wait for the reply to a request. A request that exceeds it
+ * fails with %MONGO_PROTOCOL_ERROR_TIMEOUT. With "closeOnTimeout=true"
+ * its socket is closed as well, failing the requests queued behind it,
+ * which are likely stuck too. It is %FALSE by default, in which case the
+ * socket stays open and a late reply is discarded.
+ *
+ * With "ioThread=true", socket I/O and the decoding of replies run on a
+ * private thread with its own #GMainContext. Results are still delivered
+ * to the main context of the thread that made the request, so decoding
+ * runs in parallel with the application's callbacks. The #MongoConnection::connected
+ * signal is emitted on the I/O thread in this mode.
+ *
+ * The "heartbeatFrequencyMS" option enables checking every member of the
+ * replica set with "ismaster" at that interval, each over a socket of its
+ * own. The state and round trip time of each member are tracked, and when
+ * the primary steps down or stops answering the connection fails over
+ * without waiting for a request to fail.
+ *
+ * The "readPreference" option sends queries to secondaries, and may be
+ * one of "primary", "primaryPreferred", "secondary", "secondaryPreferred"
+ * or "nearest". See #MongoReadMode. A secondary is picked at random among
+ * those whose round trip time is within "localThresholdMS" of the fastest,
+ * 15 by default. Until every member has been checked once, reads for a
+ * secondary wait. Cursors stay on the member they were opened on.
+ *
+ * While no primary is available, requests are queued. The "maxQueueSize"
+ * and "maxQueueBytes" options bound the number of queued requests and
+ * the size of their documents. With "queueOverflow=fail", the default,
+ * requests beyond either limit fail with %MONGO_CONNECTION_ERROR_QUEUE_FULL.
+ * With "queueOverflow=block", they are queued anyway and producers are
+ * expected to wait with mongo_connection_wait_writable_async(), which
+ * holds them until the queue has room. The "queueTimeoutMS" option fails
+ * requests still queued after that long with
+ * %MONGO_CONNECTION_ERROR_QUEUE_TIMEOUT. They then stay queued across
+ * failed connection rounds, which otherwise fail every queued request.
+ *
  * Returns: (transfer full): A newly created #MongoConnection.
  */
 MongoConnection *
@@ -920,6 +3165,7 @@ mongo_connection_get_database (MongoConnection *connection,
 
    priv = connection->priv;
 
+   g_mutex_lock(&priv->databases_mutex);
    if (!(database = g_hash_table_lookup(priv->databases, name))) {
       database = g_object_new(MONGO_TYPE_DATABASE,
                               "connection", connection,
@@ -927,6 +3173,7 @@ mongo_connection_get_database (MongoConnection *connection,
                               NULL);
       g_hash_table_insert(priv->databases, g_strdup(name), database);
    }
+   g_mutex_unlock(&priv->databases_mutex);
 
    RETURN(database);
 }
@@ -1127,8 +3374,8 @@ mongo_connection_delete_async (MongoConnection     *connection,
    request->oper = MONGO_OPERATION_DELETE;
    request->u.delete.db_and_collection = g_strdup(db_and_collection);
    request->u.delete.flags = flags;
-   request->u.delete.selector = mongo_bson_dup(selector);
-   mongo_connection_queue(connection, request);
+   request->u.delete.selector = request_share_bson(selector);
+   mongo_connection_submit(connection, request);
 
    EXIT;
 }
@@ -1205,9 +3452,9 @@ mongo_connection_update_async (MongoConnection     *connection,
    request->oper = MONGO_OPERATION_UPDATE;
    request->u.update.db_and_collection = g_strdup(db_and_collection);
    request->u.update.flags = flags;
-   request->u.update.selector = mongo_bson_dup(selector);
-   request->u.update.update = mongo_bson_dup(update);
-   mongo_connection_queue(connection, request);
+   request->u.update.selector = request_share_bson(selector);
+   request->u.update.update = request_share_bson(update);
+   mongo_connection_submit(connection, request);
 
    EXIT;
 }
@@ -1305,9 +3552,9 @@ mongo_connection_insert_async (MongoConnection      *connection,
                              (GDestroyNotify)mongo_bson_unref);
    for (i = 0; i < n_documents; i++) {
       g_ptr_array_add(request->u.insert.documents,
-                      mongo_bson_dup(documents[i]));
+                      request_share_bson(documents[i]));
    }
-   mongo_connection_queue(connection, request);
+   mongo_connection_submit(connection, request);
 
    EXIT;
 }
@@ -1397,9 +3644,9 @@ mongo_connection_query_async (MongoConnection     *connection,
    request->u.query.skip = skip;
    request->u.query.limit = limit;
    request->u.query.query =
-      query ? mongo_bson_dup(query) : mongo_bson_new_empty();
-   request->u.query.field_selector = mongo_bson_dup(field_selector);
-   mongo_connection_queue(connection, request);
+      query ? request_share_bson(query) : mongo_bson_new_empty();
+   request->u.query.field_selector = request_share_bson(field_selector);
+   mongo_connection_submit(connection, request);
 
    EXIT;
 }
@@ -1473,7 +3720,7 @@ mongo_connection_getmore_async (MongoConnection     *connection,
    request->u.getmore.db_and_collection = g_strdup(db_and_collection);
    request->u.getmore.limit = limit;
    request->u.getmore.cursor_id = cursor_id;
-   mongo_connection_queue(connection, request);
+   mongo_connection_submit(connection, request);
 
    EXIT;
 }
@@ -1547,7 +3794,7 @@ mongo_connection_kill_cursors_async (MongoConnection     *connection,
    request->oper = MONGO_OPERATION_KILL_CURSORS;
    request->u.kill_cursors.cursors = g_array_new(FALSE, FALSE, sizeof(guint64));
    g_array_append_vals(request->u.kill_cursors.cursors, cursors, n_cursors);
-   mongo_connection_queue(connection, request);
+   mongo_connection_submit(connection, request);
 
    EXIT;
 }
@@ -1582,6 +3829,175 @@ mongo_connection_kill_cursors_finish (MongoConnection  *connection,
    RETURN(ret);
 }
 
+static void
+mongo_connection_wait_writable_cb (GObject      *object,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
+{
+   GSimpleAsyncResult *simple = user_data;
+   MongoProtocol *protocol = (MongoProtocol *)object;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   if (!mongo_protocol_wait_writable_finish(protocol, result, &error)) {
+      g_simple_async_result_take_error(simple, error);
+   }
+
+   g_simple_async_result_set_op_res_gboolean(simple, !error);
+   mongo_connection_complete_in_idle(simple);
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+/*
+ * Starts waiting for the least loaded protocol to drain. This runs on the
+ * thread that owns the connection state. Takes ownership of @data, the
+ * #GSimpleAsyncResult to complete.
+ */
+static gboolean
+mongo_connection_wait_writable_run (gpointer data)
+{
+   MongoConnectionPrivate *priv;
+   GSimpleAsyncResult *simple = data;
+   MongoConnection *connection;
+   MongoProtocol *protocol;
+   gboolean busy;
+
+   ENTRY;
+
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   connection = (MongoConnection *)
+      g_async_result_get_source_object(G_ASYNC_RESULT(simple));
+   priv = connection->priv;
+
+   if ((priv->state != STATE_CONNECTED) &&
+       mongo_connection_queue_full(connection, 1)) {
+      g_queue_push_tail(&priv->queue_waiters, simple);
+   } else if ((priv->state != STATE_CONNECTED) || !priv->pool->len) {
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      mongo_connection_complete_in_idle(simple);
+      g_object_unref(simple);
+   } else {
+      protocol = priv->unacked ?:
+                 mongo_connection_least_loaded(connection, &busy);
+      mongo_protocol_wait_writable_async(protocol,
+                                         NULL,
+                                         mongo_connection_wait_writable_cb,
+                                         simple);
+   }
+
+   g_object_unref(connection);
+
+   RETURN(FALSE);
+}
+
+/**
+ * mongo_connection_wait_writable_async:
+ * @connection: A #MongoConnection.
+ * @cancellable: (allow-none): A #GCancellable or %NULL.
+ * @callback: A #GAsyncReadyCallback.
+ * @user_data: User data for @callback.
+ *
+ * Asynchronously waits until the least loaded connection in the pool has
+ * drained below its low watermarks. Producers issuing a large number of
+ * writes should wait on this before queuing more so that memory use stays
+ * bounded when the server falls behind. See #MongoProtocol:congested.
+ *
+ * If no connection has been established yet, this completes once the
+ * queue of requests waiting for one is below "maxQueueSize" and
+ * "maxQueueBytes", which is immediately if they are not set.
+ *
+ * @callback MUST call mongo_connection_wait_writable_finish().
+ */
+void
+mongo_connection_wait_writable_async (MongoConnection     *connection,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data)
+{
+   MongoConnectionPrivate *priv;
+   GSimpleAsyncResult *simple;
+   GMainLoop *io_loop = NULL;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   priv = connection->priv;
+
+   simple = mongo_connection_simple_new(connection,
+                                        cancellable,
+                                        callback,
+                                        user_data,
+                                        mongo_connection_wait_writable_async);
+
+   if (!priv->io_thread_enabled) {
+      g_main_context_invoke(priv->context,
+                            mongo_connection_wait_writable_run,
+                            simple);
+      EXIT;
+   }
+
+   g_mutex_lock(&priv->inbox_mutex);
+   if (priv->io_thread) {
+      io_loop = g_main_loop_ref(priv->io_loop);
+   }
+   g_mutex_unlock(&priv->inbox_mutex);
+
+   if (!io_loop) {
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      mongo_connection_complete_in_idle(simple);
+      g_object_unref(simple);
+      EXIT;
+   }
+
+   g_main_context_invoke(g_main_loop_get_context(io_loop),
+                         mongo_connection_wait_writable_run,
+                         simple);
+   g_main_loop_unref(io_loop);
+
+   EXIT;
+}
+
+/**
+ * mongo_connection_wait_writable_finish:
+ * @connection: A #MongoConnection.
+ * @result: A #GAsyncResult.
+ * @error: (out) (allow-none): A location for a #GError, or %NULL.
+ *
+ * Completes an asynchronous request to mongo_connection_wait_writable_async().
+ *
+ * Returns: %TRUE if more requests may be queued; otherwise %FALSE and
+ *   @error is set.
+ */
+gboolean
+mongo_connection_wait_writable_finish (MongoConnection  *connection,
+                                       GAsyncResult     *result,
+                                       GError          **error)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   RETURN(ret);
+}
+
 const gchar *
 mongo_connection_get_replica_set (MongoConnection *connection)
 {
@@ -1690,6 +4106,20 @@ mongo_connection_set_uri (MongoConnection *connection,
     * Clear existing parameters.
     */
    priv->connecttimeoutms = 0;
+   priv->heartbeatfrequencyms = 0;
+   priv->localthresholdms = MONGO_LOCAL_THRESHOLD_DEFAULT;
+   priv->min_pool_size = 1;
+   priv->max_pool_size = MONGO_MAX_POOL_SIZE_DEFAULT;
+   priv->max_queue_size = 0;
+   priv->max_queue_bytes = 0;
+   priv->queue_block = FALSE;
+   priv->queuetimeoutms = 0;
+   priv->write_batch_size = 1;
+   priv->io_thread_enabled = FALSE;
+   priv->pending_high_watermark = 0;
+   priv->pending_low_watermark = 0;
+   priv->send_high_watermark = 0;
+   priv->send_low_watermark = 0;
    priv->fsync = FALSE;
    priv->fsync_set = FALSE;
    priv->w = 0;
@@ -1697,9 +4127,11 @@ mongo_connection_set_uri (MongoConnection *connection,
    priv->journal_set = FALSE;
    g_free(priv->replica_set);
    priv->replica_set = NULL;
+   priv->read_mode = MONGO_READ_PRIMARY;
    priv->safe = TRUE;
    priv->slave_okay = FALSE;
    priv->sockettimeoutms = 0;
+   priv->close_on_timeout = FALSE;
    priv->wtimeoutms = 0;
 
    /*
@@ -1713,6 +4145,22 @@ mongo_connection_set_uri (MongoConnection *connection,
       if ((value = g_hash_table_lookup(params, "slaveok"))) {
          priv->slave_okay = !!g_strcmp0(value, "false");
       }
+      if ((value = g_hash_table_lookup(params, "readpreference"))) {
+         if (!g_strcmp0(value, "primarypreferred")) {
+            priv->read_mode = MONGO_READ_PRIMARY_PREFERRED;
+         } else if (!g_strcmp0(value, "secondary")) {
+            priv->read_mode = MONGO_READ_SECONDARY;
+         } else if (!g_strcmp0(value, "secondarypreferred")) {
+            priv->read_mode = MONGO_READ_SECONDARY_PREFERRED;
+         } else if (!g_strcmp0(value, "nearest")) {
+            priv->read_mode = MONGO_READ_NEAREST;
+         } else if (!!g_strcmp0(value, "primary")) {
+            g_warning("Unknown readPreference: %s", value);
+         }
+      }
+      if ((value = g_hash_table_lookup(params, "localthresholdms"))) {
+         priv->localthresholdms = MAX(0, strtol(value, NULL, 10));
+      }
       if ((value = g_hash_table_lookup(params, "safe"))) {
          priv->safe = !!g_strcmp0(value, "false");
       }
@@ -1736,13 +4184,97 @@ mongo_connection_set_uri (MongoConnection *connection,
       if ((value = g_hash_table_lookup(params, "sockettimeoutms"))) {
          priv->sockettimeoutms = MAX(0, strtol(value, NULL, 10));
       }
+      if ((value = g_hash_table_lookup(params, "closeontimeout"))) {
+         priv->close_on_timeout = !!g_strcmp0(value, "false");
+      }
+      if ((value = g_hash_table_lookup(params, "heartbeatfrequencyms"))) {
+         priv->heartbeatfrequencyms = MAX(0, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "minpoolsize"))) {
+         priv->min_pool_size = MAX(1, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "maxpoolsize"))) {
+         priv->max_pool_size = MAX(1, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "maxqueuesize"))) {
+         priv->max_queue_size = MAX(0, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "maxqueuebytes"))) {
+         priv->max_queue_bytes = g_ascii_strtoull(value, NULL, 10);
+      }
+      if ((value = g_hash_table_lookup(params, "queuetimeoutms"))) {
+         priv->queuetimeoutms = MAX(0, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "queueoverflow"))) {
+         if (!g_strcmp0(value, "block")) {
+            priv->queue_block = TRUE;
+         } else if (!!g_strcmp0(value, "fail")) {
+            g_warning("Unknown queueOverflow: %s", value);
+         }
+      }
+      if ((value = g_hash_table_lookup(params, "writebatchsize"))) {
+         priv->write_batch_size = MAX(1, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "iothread"))) {
+         priv->io_thread_enabled = !!g_strcmp0(value, "false");
+      }
+      if ((value = g_hash_table_lookup(params, "pendinghighwatermark"))) {
+         priv->pending_high_watermark = MAX(0, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "pendinglowwatermark"))) {
+         priv->pending_low_watermark = MAX(0, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "sendhighwatermark"))) {
+         priv->send_high_watermark = g_ascii_strtoull(value, NULL, 10);
+      }
+      if ((value = g_hash_table_lookup(params, "sendlowwatermark"))) {
+         priv->send_low_watermark = g_ascii_strtoull(value, NULL, 10);
+      }
       g_hash_table_unref(params);
    }
    g_free(lower);
 
+   priv->max_pool_size = MAX(priv->min_pool_size, priv->max_pool_size);
+
    EXIT;
 }
 
+/**
+ * mongo_connection_get_read_mode:
+ * @connection: A #MongoConnection.
+ *
+ * Retrieves the "read-mode" property, which selects the members of the
+ * replica set that queries are sent to.
+ *
+ * Returns: A #MongoReadMode.
+ */
+MongoReadMode
+mongo_connection_get_read_mode (MongoConnection *connection)
+{
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), MONGO_READ_PRIMARY);
+   return connection->priv->read_mode;
+}
+
+/**
+ * mongo_connection_set_read_mode:
+ * @connection: A #MongoConnection.
+ * @read_mode: A #MongoReadMode.
+ *
+ * Sets the "read-mode" property. Queries issued afterwards are routed
+ * according to @read_mode. Cursors that are already open are not moved.
+ */
+void
+mongo_connection_set_read_mode (MongoConnection *connection,
+                                MongoReadMode    read_mode)
+{
+   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+   g_return_if_fail(read_mode <= MONGO_READ_NEAREST);
+
+   connection->priv->read_mode = read_mode;
+   g_object_notify_by_pspec(G_OBJECT(connection),
+                            gParamSpecs[PROP_READ_MODE]);
+}
+
 /**
  * mongo_connection_get_slave_okay:
  * @connection: A #MongoConnection.
@@ -1782,6 +4314,7 @@ static void
 mongo_connection_finalize (GObject *object)
 {
    MongoConnectionPrivate *priv;
+   GMainContext *io_context = NULL;
    GHashTable *hash;
    Request *request;
 
@@ -1789,6 +4322,45 @@ mongo_connection_finalize (GObject *object)
 
    priv = MONGO_CONNECTION(object)->priv;
 
+   /*
+    * Stop the I/O thread before tearing down the state it owns. If this
+    * is the I/O thread, it exits once the current dispatch returns.
+    */
+   if (priv->io_thread) {
+      g_main_context_invoke(g_main_loop_get_context(priv->io_loop),
+                            mongo_connection_io_thread_quit,
+                            priv->io_loop);
+      if (priv->io_thread == g_thread_self()) {
+         g_thread_unref(priv->io_thread);
+      } else {
+         g_thread_join(priv->io_thread);
+         io_context = g_main_loop_get_context(priv->io_loop);
+         g_main_context_ref(io_context);
+      }
+      priv->io_thread = NULL;
+      g_main_loop_unref(priv->io_loop);
+      priv->io_loop = NULL;
+   }
+
+   g_mutex_clear(&priv->databases_mutex);
+   g_mutex_clear(&priv->inbox_mutex);
+   g_main_context_unref(priv->context);
+
+   if (priv->heartbeat_source) {
+      g_source_destroy(priv->heartbeat_source);
+      g_source_unref(priv->heartbeat_source);
+      priv->heartbeat_source = NULL;
+   }
+
+   g_cancellable_cancel(priv->dispose_cancel);
+   mongo_connection_probe_cancel_all(MONGO_CONNECTION(object));
+   g_ptr_array_unref(priv->probes);
+   g_hash_table_unref(priv->probed);
+   g_hash_table_unref(priv->monitors);
+   g_hash_table_unref(priv->members);
+   g_hash_table_unref(priv->cursors);
+   g_clear_object(&priv->dispose_cancel);
+
    if ((hash = priv->databases)) {
       priv->databases = NULL;
       g_hash_table_unref(hash);
@@ -1798,7 +4370,13 @@ mongo_connection_finalize (GObject *object)
     * TODO: Move a lot of this to dispose.
     */
 
-   while ((request = g_queue_pop_head(priv->queue))) {
+   if (priv->queue_timeout) {
+      g_source_destroy(priv->queue_timeout);
+      g_source_unref(priv->queue_timeout);
+      priv->queue_timeout = NULL;
+   }
+
+   while ((request = mongo_connection_queue_pop(MONGO_CONNECTION(object)))) {
       request_fail(request, NULL);
       request_free(request);
    }
@@ -1810,7 +4388,27 @@ mongo_connection_finalize (GObject *object)
    priv->queue = NULL;
 
    g_clear_object(&priv->socket_client);
-   g_clear_object(&priv->protocol);
+
+   mongo_connection_pool_clear(MONGO_CONNECTION(object));
+   g_ptr_array_unref(priv->pool);
+   priv->pool = NULL;
+   g_hash_table_unref(priv->cursor_protocols);
+   priv->cursor_protocols = NULL;
+
+   /*
+    * The reads of the protocols dropped above are still attached to the
+    * context of the I/O thread, which has exited. Drain it here so they
+    * see the cancellation and release their sockets.
+    */
+   if (io_context) {
+      while (g_main_context_pending(io_context)) {
+         g_main_context_iteration(io_context, FALSE);
+      }
+      g_main_context_unref(io_context);
+   }
+
+   g_free(priv->host);
+   priv->host = NULL;
 
    if (priv->uri_string) {
       g_free(priv->uri_string);
@@ -1834,6 +4432,9 @@ mongo_connection_get_property (GObject    *object,
    MongoConnection *connection = MONGO_CONNECTION(object);
 
    switch (prop_id) {
+   case PROP_READ_MODE:
+      g_value_set_enum(value, mongo_connection_get_read_mode(connection));
+      break;
    case PROP_REPLICA_SET:
       g_value_set_string(value, mongo_connection_get_replica_set(connection));
       break;
@@ -1857,6 +4458,9 @@ mongo_connection_set_property (GObject      *object,
    MongoConnection *connection = MONGO_CONNECTION(object);
 
    switch (prop_id) {
+   case PROP_READ_MODE:
+      mongo_connection_set_read_mode(connection, g_value_get_enum(value));
+      break;
    case PROP_REPLICA_SET:
       mongo_connection_set_replica_set(connection, g_value_get_string(value));
       break;
@@ -1884,6 +4488,16 @@ mongo_connection_class_init (MongoConnectionClass *klass)
    object_class->set_property = mongo_connection_set_property;
    g_type_class_add_private(object_class, sizeof(MongoConnectionPrivate));
 
+   gParamSpecs[PROP_READ_MODE] =
+      g_param_spec_enum("read-mode",
+                        _("Read Mode"),
+                        _("The replica set members to send queries to."),
+                        MONGO_TYPE_READ_MODE,
+                        MONGO_READ_PRIMARY,
+                        G_PARAM_READWRITE);
+   g_object_class_install_property(object_class, PROP_READ_MODE,
+                                   gParamSpecs[PROP_READ_MODE]);
+
    gParamSpecs[PROP_REPLICA_SET] =
       g_param_spec_string("replica-set",
                           _("Replica Set"),
@@ -1937,6 +4551,31 @@ mongo_connection_init (MongoConnection *connection)
    connection->priv->manager = mongo_manager_new();
    mongo_manager_add_seed(connection->priv->manager, "127.0.0.1:27017");
    connection->priv->queue = g_queue_new();
+   connection->priv->pool = g_ptr_array_new_with_free_func(g_object_unref);
+   connection->priv->dispose_cancel = g_cancellable_new();
+   connection->priv->probes = g_ptr_array_new();
+   connection->priv->probed = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+   connection->priv->monitors =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                            mongo_connection_monitor_release);
+   connection->priv->members =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                            mongo_connection_member_release);
+   connection->priv->cursors =
+      g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+   connection->priv->cursor_protocols =
+      g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+   connection->priv->context = g_main_context_ref_thread_default();
+   g_mutex_init(&connection->priv->databases_mutex);
+   g_mutex_init(&connection->priv->inbox_mutex);
+   g_queue_init(&connection->priv->inbox);
+   g_queue_init(&connection->priv->queue_waiters);
+   g_queue_init(&connection->priv->member_waiters);
+   connection->priv->min_pool_size = 1;
+   connection->priv->max_pool_size = MONGO_MAX_POOL_SIZE_DEFAULT;
+   connection->priv->write_batch_size = 1;
+   connection->priv->localthresholdms = MONGO_LOCAL_THRESHOLD_DEFAULT;
    connection->priv->safe = TRUE;
    connection->priv->socket_client =
          g_object_new(G_TYPE_SOCKET_CLIENT,
@@ -1954,3 +4593,25 @@ mongo_connection_error_quark (void)
 {
    return g_quark_from_static_string("MongoConnectionError");
 }
+
+GType
+mongo_read_mode_get_type (void)
+{
+   static GType type_id;
+   static gsize initialized;
+   static const GEnumValue values[] = {
+      { MONGO_READ_PRIMARY, "MONGO_READ_PRIMARY", "primary" },
+      { MONGO_READ_PRIMARY_PREFERRED, "MONGO_READ_PRIMARY_PREFERRED", "primary-preferred" },
+      { MONGO_READ_SECONDARY, "MONGO_READ_SECONDARY", "secondary" },
+      { MONGO_READ_SECONDARY_PREFERRED, "MONGO_READ_SECONDARY_PREFERRED", "secondary-preferred" },
+      { MONGO_READ_NEAREST, "MONGO_READ_NEAREST", "nearest" },
+      { 0 }
+   };
+
+   if (g_once_init_enter(&initialized)) {
+      type_id = g_enum_register_static("MongoReadMode", values);
+      g_once_init_leave(&initialized, TRUE);
+   }
+
+   return type_id;
+}
@@ -33,6 +33,7 @@
 G_BEGIN_DECLS
 
 #define MONGO_TYPE_CONNECTION            (mongo_connection_get_type())
+#define MONGO_TYPE_READ_MODE             (mongo_read_mode_get_type())
 #define MONGO_CONNECTION_ERROR           (mongo_connection_error_quark())
 #define MONGO_CONNECTION(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), MONGO_TYPE_CONNECTION, MongoConnection))
 #define MONGO_CONNECTION_CONST(obj)      (G_TYPE_CHECK_INSTANCE_CAST ((obj), MONGO_TYPE_CONNECTION, MongoConnection const))
@@ -54,8 +55,32 @@ enum _MongoConnectionError
    MONGO_CONNECTION_ERROR_INVALID_REPLY,
    MONGO_CONNECTION_ERROR_NOT_MASTER,
    MONGO_CONNECTION_ERROR_CONNECT_FAILED,
+   MONGO_CONNECTION_ERROR_NO_SECONDARY,
+   MONGO_CONNECTION_ERROR_QUEUE_FULL,
+   MONGO_CONNECTION_ERROR_QUEUE_TIMEOUT,
 };
 
+/**
+ * MongoReadMode:
+ * @MONGO_READ_PRIMARY: Read from the primary only.
+ * @MONGO_READ_PRIMARY_PREFERRED: Read from the primary, or from a secondary
+ *   while no primary is available.
+ * @MONGO_READ_SECONDARY: Read from secondaries only.
+ * @MONGO_READ_SECONDARY_PREFERRED: Read from a secondary, or from the
+ *   primary if there are none.
+ * @MONGO_READ_NEAREST: Read from any member within the latency window.
+ *
+ * #MongoReadMode selects the replica set members that queries are sent to.
+ */
+typedef enum
+{
+   MONGO_READ_PRIMARY             = 0,
+   MONGO_READ_PRIMARY_PREFERRED   = 1,
+   MONGO_READ_SECONDARY           = 2,
+   MONGO_READ_SECONDARY_PREFERRED = 3,
+   MONGO_READ_NEAREST             = 4,
+} MongoReadMode;
+
 struct _MongoConnection
 {
    GObject parent;
@@ -148,15 +173,26 @@ void               mongo_connection_query_async         (MongoConnection      *c
 MongoMessageReply *mongo_connection_query_finish        (MongoConnection      *connection,
                                                          GAsyncResult         *result,
                                                          GError              **error);
+void               mongo_connection_wait_writable_async (MongoConnection      *connection,
+                                                         GCancellable         *cancellable,
+                                                         GAsyncReadyCallback   callback,
+                                                         gpointer              user_data);
+gboolean           mongo_connection_wait_writable_finish (MongoConnection      *connection,
+                                                          GAsyncResult         *result,
+                                                          GError              **error);
 MongoDatabase     *mongo_connection_get_database        (MongoConnection      *connection,
                                                          const gchar          *name);
 GType              mongo_connection_get_type            (void) G_GNUC_CONST;
 GQuark             mongo_connection_error_quark         (void) G_GNUC_CONST;
 MongoConnection   *mongo_connection_new                 (void);
 MongoConnection   *mongo_connection_new_from_uri        (const gchar          *uri);
+MongoReadMode      mongo_connection_get_read_mode       (MongoConnection      *connection);
+void               mongo_connection_set_read_mode       (MongoConnection      *connection,
+                                                         MongoReadMode         read_mode);
 gboolean           mongo_connection_get_slave_okay      (MongoConnection      *connection);
 void               mongo_connection_set_slave_okay      (MongoConnection      *connection,
                                                          gboolean              slave_okay);
+GType              mongo_read_mode_get_type             (void) G_GNUC_CONST;
 MongoConnection   *mongo_database_get_connection        (MongoDatabase        *database);
 MongoConnection   *mongo_collection_get_connection      (MongoCollection      *collection);
 
@@ -31,6 +31,10 @@
  * #MongoCursor is used to iterate through the result set of a query.
  * It is an asynchronous cursor, meaning you need to request that the items
  * are fetched from Mongo using mongo_cursor_foreach_async().
+ *
+ * While the documents of one batch are handed to the foreach callback,
+ * the next batches are already requested from the server. The number of
+ * batches requested ahead is controlled by the "prefetch" property.
  */
 
 G_DEFINE_TYPE(MongoCursor, mongo_cursor, G_TYPE_OBJECT)
@@ -45,9 +49,28 @@ struct _MongoCursorPrivate
    guint limit;
    guint skip;
    guint batch_size;
+   guint prefetch;
    MongoQueryFlags flags;
 };
 
+/*
+ * State for a mongo_cursor_foreach_async() request. Replies that arrive
+ * ahead of their turn are kept in @replies, sorted by offset.
+ */
+typedef struct
+{
+   MongoConnection *connection;
+   GQueue           replies;
+   guint64          cursor_id;
+   guint            offset;
+   guint            received;
+   guint            in_flight;
+   gboolean         exhausted;
+   gboolean         done;
+   gboolean         completed;
+   GError          *error;
+} Foreach;
+
 enum
 {
    PROP_0,
@@ -58,6 +81,7 @@ enum
    PROP_FIELDS,
    PROP_FLAGS,
    PROP_LIMIT,
+   PROP_PREFETCH,
    PROP_QUERY,
    PROP_SKIP,
    LAST_PROP
@@ -156,6 +180,45 @@ mongo_cursor_get_skip (MongoCursor *cursor)
    return cursor->priv->skip;
 }
 
+/**
+ * mongo_cursor_get_prefetch:
+ * @cursor: (in): A #MongoCursor.
+ *
+ * Fetches the "prefetch" property. See mongo_cursor_set_prefetch().
+ *
+ * Returns: The number of batches requested ahead.
+ */
+guint
+mongo_cursor_get_prefetch (MongoCursor *cursor)
+{
+   g_return_val_if_fail(MONGO_IS_CURSOR(cursor), 0);
+   return cursor->priv->prefetch;
+}
+
+/**
+ * mongo_cursor_set_prefetch:
+ * @cursor: (in): A #MongoCursor.
+ * @prefetch: The number of batches to request ahead.
+ *
+ * Sets the number of batches that mongo_cursor_foreach_async() keeps
+ * requested from the server while the foreach callback is processing
+ * the current batch. A value of 0 only requests the next batch once
+ * the current batch has been processed.
+ *
+ * The getmores of one cursor are all sent over the socket the query was
+ * answered on, as the server does not handle concurrent getmores for
+ * one cursor on different sockets.
+ */
+void
+mongo_cursor_set_prefetch (MongoCursor *cursor,
+                           guint        prefetch)
+{
+   g_return_if_fail(MONGO_IS_CURSOR(cursor));
+   cursor->priv->prefetch = prefetch;
+   g_object_notify_by_pspec(G_OBJECT(cursor),
+                            gParamSpecs[PROP_PREFETCH]);
+}
+
 void
 mongo_cursor_set_batch_size (MongoCursor *cursor,
                              guint        batch_size)
@@ -361,103 +424,266 @@ mongo_cursor_kill_cursors_cb (GObject      *object,
    EXIT;
 }
 
+static void
+mongo_cursor_foreach_free (gpointer data)
+{
+   Foreach *state = data;
+
+   g_clear_object(&state->connection);
+   g_queue_foreach(&state->replies, (GFunc)g_object_unref, NULL);
+   g_queue_clear(&state->replies);
+   g_clear_error(&state->error);
+   g_slice_free(Foreach, state);
+}
+
+static gint
+mongo_cursor_reply_compare (gconstpointer a,
+                            gconstpointer b,
+                            gpointer      user_data)
+{
+   guint offset_a = mongo_message_reply_get_offset((MongoMessageReply *)a);
+   guint offset_b = mongo_message_reply_get_offset((MongoMessageReply *)b);
+
+   return (offset_a < offset_b) ? -1 : (offset_a > offset_b);
+}
+
+/*
+ * Keeps up to @depth getmore requests in flight for the cursor.
+ */
+static void
+mongo_cursor_foreach_fill (MongoCursor        *cursor,
+                           Foreach            *state,
+                           GSimpleAsyncResult *simple,
+                           guint               depth)
+{
+   MongoCursorPrivate *priv = cursor->priv;
+   GCancellable *cancellable;
+   gchar *db_and_collection = NULL;
+
+   /*
+    * Exhaust queries are not continued with getmores, the server streams
+    * the following batches on its own.
+    */
+   if (priv->flags & MONGO_QUERY_EXHAUST) {
+      return;
+   }
+
+   cancellable = g_object_get_data(G_OBJECT(simple), "cancellable");
+
+   while (!state->done &&
+          !state->exhausted &&
+          state->cursor_id &&
+          (state->in_flight < depth)) {
+      /*
+       * Don't ask for batches beyond the limit.
+       */
+      if (priv->limit &&
+          ((state->received + (state->in_flight * priv->batch_size)) >=
+           priv->limit)) {
+         break;
+      }
+
+      if (!db_and_collection) {
+         db_and_collection = g_strdup_printf("%s.%s",
+                                             priv->database,
+                                             priv->collection);
+      }
+
+      mongo_connection_getmore_async(state->connection,
+                                     db_and_collection,
+                                     priv->batch_size,
+                                     state->cursor_id,
+                                     cancellable,
+                                     mongo_cursor_foreach_getmore_cb,
+                                     g_object_ref(simple));
+      state->in_flight++;
+   }
+
+   g_free(db_and_collection);
+}
+
+/*
+ * Delivers the documents of @reply to the foreach callback.
+ * Returns FALSE if iteration should stop.
+ */
+static gboolean
+mongo_cursor_foreach_deliver (MongoCursor        *cursor,
+                              MongoMessageReply  *reply,
+                              GSimpleAsyncResult *simple)
+{
+   MongoMessageReplyIter iter;
+   MongoCursorCallback func;
+   MongoBson *bson;
+   gpointer func_data;
+   gboolean ret = TRUE;
+   guint offset;
+   guint i;
+
+   func = g_object_get_data(G_OBJECT(simple), "foreach-func");
+   func_data = g_object_get_data(G_OBJECT(simple), "foreach-data");
+   g_assert(func);
+
+   offset = mongo_message_reply_get_offset(reply);
+
+   mongo_message_reply_iter_init(&iter, reply);
+   for (i = 0; ret && mongo_message_reply_iter_next(&iter); i++) {
+      if (cursor->priv->limit && (offset + i) >= cursor->priv->limit) {
+         ret = FALSE;
+         break;
+      }
+      bson = mongo_message_reply_iter_get_document(&iter);
+      ret = func(cursor, bson, func_data);
+      mongo_bson_unref(bson);
+   }
+
+   return ret;
+}
+
 static void
 mongo_cursor_foreach_dispatch (MongoConnection    *connection,
                                MongoMessageReply  *reply,
                                GSimpleAsyncResult *simple)
 {
-   MongoCursorCallback func;
    MongoCursorPrivate *priv;
+   MongoMessageReply *head;
    GCancellable *cancellable;
    MongoCursor *cursor;
-   MongoBson *bson;
-   gpointer func_data;
+   Foreach *state;
    guint64 cursor_id;
-   gchar *db_and_collection;
-   GList *iter;
-   GList *list;
    guint offset;
-   guint i;
+   guint count;
 
    ENTRY;
 
    g_assert(MONGO_IS_CONNECTION(connection));
-   g_assert(reply);
    g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
 
-   func = g_object_get_data(G_OBJECT(simple), "foreach-func");
-   func_data = g_object_get_data(G_OBJECT(simple), "foreach-data");
-   g_assert(func);
-
    cursor = MONGO_CURSOR(g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
    g_assert(MONGO_IS_CURSOR(cursor));
 
    cancellable = g_object_get_data(G_OBJECT(simple), "cancellable");
    g_assert(!cancellable || G_IS_CANCELLABLE(cancellable));
 
+   state = g_object_get_data(G_OBJECT(simple), "foreach-state");
+   g_assert(state);
+
    priv = cursor->priv;
 
-   if (!(list = mongo_message_reply_get_documents(reply))) {
-      GOTO(stop);
+   if (!state->connection) {
+      state->connection = g_object_ref(connection);
    }
 
-   offset = mongo_message_reply_get_offset(reply);
+   if (reply && !state->done) {
+      cursor_id = mongo_message_reply_get_cursor_id(reply);
+      if (!cursor_id ||
+          (mongo_message_reply_get_flags(reply) &
+           MONGO_REPLY_CURSOR_NOT_FOUND)) {
+         state->exhausted = TRUE;
+      } else {
+         state->cursor_id = cursor_id;
+      }
 
-   for (iter = list, i = 0; iter; iter = iter->next, i++) {
-      bson = iter->data;
-      if (priv->limit && (offset + i) >= priv->limit) {
-         GOTO(stop);
+      if (!(mongo_message_reply_get_flags(reply) &
+            MONGO_REPLY_CURSOR_NOT_FOUND)) {
+         offset = mongo_message_reply_get_offset(reply);
+         count = mongo_message_reply_get_count(reply);
+         state->received = MAX(state->received, offset + count);
+         g_queue_insert_sorted(&state->replies,
+                               g_object_ref(reply),
+                               mongo_cursor_reply_compare,
+                               NULL);
       }
-      if (!func(cursor, bson, func_data)) {
-         GOTO(stop);
+
+      /*
+       * Request the following batches before handing this one to the
+       * foreach callback so the server works while we do.
+       */
+      if (priv->prefetch) {
+         mongo_cursor_foreach_fill(cursor, state, simple, priv->prefetch);
       }
-   }
 
-   offset = mongo_message_reply_get_offset(reply);
-   cursor_id = mongo_message_reply_get_cursor_id(reply);
+      /*
+       * Deliver every batch that is next in line. If nothing else is in
+       * flight there is nothing to wait for.
+       */
+      while (!state->done &&
+             (head = g_queue_peek_head(&state->replies)) &&
+             ((mongo_message_reply_get_offset(head) <= state->offset) ||
+              !state->in_flight)) {
+         g_queue_pop_head(&state->replies);
+         offset = mongo_message_reply_get_offset(head);
+         count = mongo_message_reply_get_count(head);
+         if (!mongo_cursor_foreach_deliver(cursor, head, simple)) {
+            state->done = TRUE;
+         }
+         state->offset = MAX(state->offset, offset + count);
+         g_object_unref(head);
+      }
+   }
 
-   if (!cursor_id || ((offset + g_list_length(list)) >= priv->limit)) {
-      GOTO(stop);
+   if (!state->done) {
+      if (state->exhausted) {
+         state->done = (!state->in_flight &&
+                        g_queue_is_empty(&state->replies));
+      } else if (priv->flags & MONGO_QUERY_EXHAUST) {
+         /*
+          * Only the first batch of an exhaust query has a request to
+          * complete, so iteration ends once it has been delivered.
+          */
+         state->done = TRUE;
+      } else if (priv->limit && (state->offset >= priv->limit)) {
+         state->done = TRUE;
+      } else {
+         mongo_cursor_foreach_fill(cursor, state, simple,
+                                   MAX(1, priv->prefetch));
+      }
    }
 
    /*
-    * TODO: How do we know if we are finished if EXHAUST is set?
+    * Complete once every outstanding getmore has returned.
     */
+   if (state->done && !state->in_flight && !state->completed) {
+      state->completed = TRUE;
+
+      if (state->cursor_id && !state->exhausted) {
+         mongo_connection_kill_cursors_async(state->connection,
+                                             &state->cursor_id,
+                                             1,
+                                             cancellable,
+                                             mongo_cursor_kill_cursors_cb,
+                                             NULL);
+      }
 
-   if (!(cursor->priv->flags & MONGO_QUERY_EXHAUST)) {
-      db_and_collection = g_strdup_printf("%s.%s",
-                                          cursor->priv->database,
-                                          cursor->priv->collection);
-      mongo_connection_getmore_async(connection,
-                                     db_and_collection,
-                                     cursor->priv->batch_size,
-                                     cursor_id,
-                                     cancellable,
-                                     mongo_cursor_foreach_getmore_cb,
-                                     simple);
-      g_free(db_and_collection);
+      if (state->error) {
+         g_simple_async_result_set_from_error(simple, state->error);
+      } else {
+         g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      }
+
+      mongo_simple_async_result_complete_in_idle(simple);
    }
 
    g_object_unref(cursor);
 
    EXIT;
+}
 
-stop:
-   if (mongo_message_reply_get_cursor_id(reply)) {
-      mongo_connection_kill_cursors_async(connection,
-                                          &cursor_id,
-                                          1,
-                                          cancellable,
-                                          mongo_cursor_kill_cursors_cb,
-                                          NULL);
-   }
+static void
+mongo_cursor_foreach_fail (GSimpleAsyncResult *simple,
+                           GError             *error)
+{
+   Foreach *state;
 
-   g_simple_async_result_set_op_res_gboolean(simple, TRUE);
-   mongo_simple_async_result_complete_in_idle(simple);
-   g_object_unref(simple);
-   g_object_unref(cursor);
+   state = g_object_get_data(G_OBJECT(simple), "foreach-state");
+   g_assert(state);
 
-   EXIT;
+   if (!state->error && !state->done) {
+      state->error = error;
+   } else {
+      g_error_free(error);
+   }
+
+   state->done = TRUE;
 }
 
 static void
@@ -468,6 +694,7 @@ mongo_cursor_foreach_getmore_cb (GObject      *object,
    GSimpleAsyncResult *simple = user_data;
    MongoConnection *connection = (MongoConnection *)object;
    MongoMessageReply *reply;
+   Foreach *state;
    GError *error = NULL;
 
    ENTRY;
@@ -475,15 +702,16 @@ mongo_cursor_foreach_getmore_cb (GObject      *object,
    g_assert(MONGO_IS_CONNECTION(connection));
    g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
 
+   state = g_object_get_data(G_OBJECT(simple), "foreach-state");
+   state->in_flight--;
+
    if (!(reply = mongo_connection_getmore_finish(connection, result, &error))) {
-      g_simple_async_result_take_error(simple, error);
-      mongo_simple_async_result_complete_in_idle(simple);
-      g_object_unref(simple);
-      EXIT;
+      mongo_cursor_foreach_fail(simple, error);
    }
 
    mongo_cursor_foreach_dispatch(connection, reply, simple);
-   g_object_unref(reply);
+   g_clear_object(&reply);
+   g_object_unref(simple);
 
    EXIT;
 }
@@ -504,14 +732,12 @@ mongo_cursor_foreach_query_cb (GObject      *object,
    g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
 
    if (!(reply = mongo_connection_query_finish(connection, result, &error))) {
-      g_simple_async_result_take_error(simple, error);
-      mongo_simple_async_result_complete_in_idle(simple);
-      g_object_unref(simple);
-      EXIT;
+      mongo_cursor_foreach_fail(simple, error);
    }
 
    mongo_cursor_foreach_dispatch(connection, reply, simple);
-   g_object_unref(reply);
+   g_clear_object(&reply);
+   g_object_unref(simple);
 
    EXIT;
 }
@@ -557,6 +783,8 @@ mongo_cursor_foreach_async (MongoCursor         *cursor,
       g_object_set_data_full(G_OBJECT(simple), "cancellable",
                              cancellable, (GDestroyNotify)g_object_unref);
    }
+   g_object_set_data_full(G_OBJECT(simple), "foreach-state",
+                          g_slice_new0(Foreach), mongo_cursor_foreach_free);
    g_object_set_data(G_OBJECT(simple), "foreach-func", foreach_func);
    if (foreach_notify) {
       g_object_set_data_full(G_OBJECT(simple), "foreach-data",
@@ -592,6 +820,15 @@ mongo_cursor_foreach_finish (MongoCursor   *cursor,
                              GAsyncResult  *result,
                              GError       **error)
 {
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+
+   g_return_val_if_fail(MONGO_IS_CURSOR(cursor), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (g_simple_async_result_propagate_error(simple, error)) {
+      return FALSE;
+   }
+
    return TRUE;
 }
 
@@ -658,6 +895,9 @@ mongo_cursor_get_property (GObject    *object,
    case PROP_LIMIT:
       g_value_set_uint(value, mongo_cursor_get_limit(cursor));
       break;
+   case PROP_PREFETCH:
+      g_value_set_uint(value, mongo_cursor_get_prefetch(cursor));
+      break;
    case PROP_QUERY:
       g_value_set_boxed(value, mongo_cursor_get_query(cursor));
       break;
@@ -699,6 +939,9 @@ mongo_cursor_set_property (GObject      *object,
    case PROP_LIMIT:
       mongo_cursor_set_limit(cursor, g_value_get_uint(value));
       break;
+   case PROP_PREFETCH:
+      mongo_cursor_set_prefetch(cursor, g_value_get_uint(value));
+      break;
    case PROP_QUERY:
       mongo_cursor_set_query(cursor, g_value_get_boxed(value));
       break;
@@ -792,6 +1035,17 @@ mongo_cursor_class_init (MongoCursorClass *klass)
    g_object_class_install_property(object_class, PROP_LIMIT,
                                    gParamSpecs[PROP_LIMIT]);
 
+   gParamSpecs[PROP_PREFETCH] =
+      g_param_spec_uint("prefetch",
+                        _("Prefetch"),
+                        _("The number of batches to request ahead."),
+                        0,
+                        G_MAXUINT32,
+                        1,
+                        G_PARAM_READWRITE);
+   g_object_class_install_property(object_class, PROP_PREFETCH,
+                                   gParamSpecs[PROP_PREFETCH]);
+
    gParamSpecs[PROP_QUERY] =
       g_param_spec_boxed("query",
                          _("Query"),
@@ -823,5 +1077,6 @@ mongo_cursor_init (MongoCursor *cursor)
                                               MONGO_TYPE_CURSOR,
                                               MongoCursorPrivate);
    cursor->priv->batch_size = 100;
+   cursor->priv->prefetch = 1;
    EXIT;
 }
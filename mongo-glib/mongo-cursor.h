@@ -114,6 +114,9 @@ GType            mongo_cursor_get_type       (void) G_GNUC_CONST;
 guint            mongo_cursor_get_batch_size (MongoCursor          *cursor);
 void             mongo_cursor_set_batch_size (MongoCursor          *cursor,
                                               guint                 batch_size);
+guint            mongo_cursor_get_prefetch   (MongoCursor          *cursor);
+void             mongo_cursor_set_prefetch   (MongoCursor          *cursor,
+                                              guint                 prefetch);
 
 G_END_DECLS
 
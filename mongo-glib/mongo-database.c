@@ -39,6 +39,7 @@ G_DEFINE_TYPE(MongoDatabase, mongo_database, G_TYPE_OBJECT)
 struct _MongoDatabasePrivate
 {
    gchar *name;
+   GMutex collections_mutex;
    GHashTable *collections;
    MongoConnection *connection;
 };
@@ -76,6 +77,7 @@ mongo_database_get_collection (MongoDatabase *database,
 
    priv = database->priv;
 
+   g_mutex_lock(&priv->collections_mutex);
    if (!(collection = g_hash_table_lookup(priv->collections, name))) {
       collection = g_object_new(MONGO_TYPE_COLLECTION,
                                 "connection", priv->connection,
@@ -84,6 +86,7 @@ mongo_database_get_collection (MongoDatabase *database,
                                 NULL);
       g_hash_table_insert(priv->collections, g_strdup(name), collection);
    }
+   g_mutex_unlock(&priv->collections_mutex);
 
    RETURN(collection);
 }
@@ -260,6 +263,8 @@ mongo_database_finalize (GObject *object)
       g_hash_table_unref(hash);
    }
 
+   g_mutex_clear(&priv->collections_mutex);
+
    G_OBJECT_CLASS(mongo_database_parent_class)->finalize(object);
 
    EXIT;
@@ -348,6 +353,7 @@ mongo_database_init (MongoDatabase *database)
       G_TYPE_INSTANCE_GET_PRIVATE(database,
                                   MONGO_TYPE_DATABASE,
                                   MongoDatabasePrivate);
+   g_mutex_init(&database->priv->collections_mutex);
    database->priv->collections =
       g_hash_table_new_full(g_str_hash, g_str_equal,
                             g_free, g_object_unref);
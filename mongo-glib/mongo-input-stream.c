@@ -32,12 +32,22 @@ struct _MongoInputStreamPrivate
    gint32 msg_len;
    gint32 to_read;
    guint8 *buffer;
+
+   /*
+    * Read buffer used when "buffer-size" is set. Valid data lives
+    * between read_begin and read_end.
+    */
+   guint8 *read_buffer;
+   gsize read_buffer_size;
+   gsize read_begin;
+   gsize read_end;
 };
 
 enum
 {
    PROP_0,
    PROP_ASYNC_CONTEXT,
+   PROP_BUFFER_SIZE,
    LAST_PROP
 };
 
@@ -84,6 +94,80 @@ mongo_input_stream_set_async_context (MongoInputStream *stream,
    EXIT;
 }
 
+static MongoMessage *
+mongo_input_stream_parse_message (const guint8  *data,
+                                  gsize          length,
+                                  GError       **error)
+{
+   MongoMessage *message;
+   GType type_id;
+#pragma pack(push, 1)
+   struct {
+      gint32 msg_len;
+      gint32 request_id;
+      gint32 response_to;
+      gint32 op_code;
+   } header;
+#pragma pack(pop)
+
+   ENTRY;
+
+   g_assert(data);
+   g_assert_cmpint(length, >, sizeof header);
+
+   memcpy(&header, data, sizeof header);
+
+   header.msg_len = GINT32_FROM_LE(header.msg_len);
+   header.request_id = GINT32_FROM_LE(header.request_id);
+   header.response_to = GINT32_FROM_LE(header.response_to);
+   header.op_code = GINT32_FROM_LE(header.op_code);
+
+   if (!(type_id = mongo_operation_get_message_type(header.op_code))) {
+      g_set_error(error,
+                  MONGO_INPUT_STREAM_ERROR,
+                  MONGO_INPUT_STREAM_ERROR_UNKNOWN_OPERATION,
+                  _("Unknown operation %d."),
+                  header.op_code);
+      RETURN(NULL);
+   }
+
+   DUMP_BYTES(buffer, data, length);
+
+   message = g_object_new(type_id,
+                          "request-id", header.request_id,
+                          "response-to", header.response_to,
+                          NULL);
+   if (!mongo_message_load_from_data(message,
+                                     data + sizeof header,
+                                     length - sizeof header)) {
+      g_set_error(error,
+                  MONGO_INPUT_STREAM_ERROR,
+                  MONGO_INPUT_STREAM_ERROR_INVALID_MESSAGE,
+                  _("Failed to parse message."));
+      g_object_unref(message);
+      RETURN(NULL);
+   }
+
+   RETURN(message);
+}
+
+static void
+mongo_input_stream_set_buffer_size (MongoInputStream *stream,
+                                    guint             buffer_size)
+{
+   MongoInputStreamPrivate *priv;
+
+   g_return_if_fail(MONGO_IS_INPUT_STREAM(stream));
+   g_return_if_fail(!stream->priv->read_buffer);
+
+   priv = stream->priv;
+
+   if (buffer_size) {
+      priv->read_buffer_size = MAX(buffer_size, 64);
+      priv->read_buffer = g_malloc(priv->read_buffer_size);
+   }
+}
+
 static void
 mongo_input_stream_read_message_body_cb (GObject      *object,
                                          GAsyncResult *result,
@@ -95,15 +179,6 @@ mongo_input_stream_read_message_body_cb (GObject      *object,
    MongoMessage *message = NULL;
    GError *error = NULL;
    gssize ret;
-   GType type_id;
-#pragma pack(push, 1)
-   struct {
-      gint32 msg_len;
-      gint32 request_id;
-      gint32 response_to;
-      gint32 op_code;
-   } header;
-#pragma pack(pop)
 
    ENTRY;
 
@@ -138,25 +213,10 @@ mongo_input_stream_read_message_body_cb (GObject      *object,
       EXIT;
    }
 
-   memcpy(&header, priv->buffer, sizeof header);
-   if (!(type_id = mongo_operation_get_message_type(header.op_code))) {
-      GOTO(failure);
-   }
-
-   header.msg_len = GINT32_FROM_LE(header.msg_len);
-   header.request_id = GINT32_FROM_LE(header.request_id);
-   header.response_to = GINT32_FROM_LE(header.response_to);
-   header.op_code = GINT32_FROM_LE(header.op_code);
-
-   DUMP_BYTES(buffer, priv->buffer, priv->msg_len);
-
-   message = g_object_new(type_id,
-                          "request-id", header.request_id,
-                          "response-to", header.response_to,
-                          NULL);
-   if (!mongo_message_load_from_data(message,
-                                     priv->buffer + sizeof header, // FIXME: load all data.
-                                     priv->msg_len - sizeof header)) {
+   if (!(message = mongo_input_stream_parse_message(priv->buffer,
+                                                    priv->msg_len,
+                                                    &error))) {
+      g_simple_async_result_take_error(simple, error);
       GOTO(failure);
    }
 
@@ -247,6 +307,144 @@ mongo_input_stream_read_message_header_cb (GObject      *object,
    EXIT;
 }
 
+static void
+mongo_input_stream_fill (MongoInputStream   *stream,
+                         GSimpleAsyncResult *simple);
+
+static void
+mongo_input_stream_fill_cb (GObject      *object,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+   MongoInputStreamPrivate *priv;
+   GSimpleAsyncResult *simple = user_data;
+   MongoInputStream *input = (MongoInputStream *)object;
+   GError *error = NULL;
+   gssize ret;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_INPUT_STREAM(input));
+   g_assert(G_IS_ASYNC_RESULT(result));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   priv = input->priv;
+
+   ret = g_input_stream_read_finish(G_INPUT_STREAM(input), result, &error);
+   if (ret <= 0) {
+      g_input_stream_close(G_INPUT_STREAM(input), NULL, NULL);
+      if (error) {
+         g_simple_async_result_take_error(simple, error);
+      } else {
+         g_simple_async_result_set_error(simple,
+                                         G_IO_ERROR,
+                                         G_IO_ERROR_CLOSED,
+                                         _("The stream is closed."));
+      }
+      mongo_source_complete_in_idle(priv->source, simple);
+      g_object_unref(simple);
+      EXIT;
+   }
+
+   priv->read_end += ret;
+
+   mongo_input_stream_fill(input, simple);
+
+   EXIT;
+}
+
+/*
+ * Completes @simple with the next message in the read buffer, reading
+ * more data from the base stream if there is not yet a complete message.
+ * A single large read usually contains many replies, which are then
+ * handed out without touching the stream again.
+ */
+static void
+mongo_input_stream_fill (MongoInputStream   *stream,
+                         GSimpleAsyncResult *simple)
+{
+   MongoInputStreamPrivate *priv;
+   MongoMessage *message;
+   GError *error = NULL;
+   gint32 msg_len = 0;
+   gsize avail;
+   gsize needed;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_INPUT_STREAM(stream));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   priv = stream->priv;
+
+   avail = priv->read_end - priv->read_begin;
+
+   if (avail >= sizeof msg_len) {
+      memcpy(&msg_len, priv->read_buffer + priv->read_begin, sizeof msg_len);
+      msg_len = GINT32_FROM_LE(msg_len);
+
+      if (msg_len <= 16) {
+         g_input_stream_close(G_INPUT_STREAM(stream), NULL, NULL);
+         g_simple_async_result_set_error(simple,
+                                         MONGO_INPUT_STREAM_ERROR,
+                                         MONGO_INPUT_STREAM_ERROR_INSUFFICIENT_DATA,
+                                         _("Insufficient data for message."));
+         mongo_source_complete_in_idle(priv->source, simple);
+         g_object_unref(simple);
+         EXIT;
+      }
+
+      if (avail >= (gsize)msg_len) {
+         message = mongo_input_stream_parse_message(
+               priv->read_buffer + priv->read_begin,
+               msg_len,
+               &error);
+         priv->read_begin += msg_len;
+         if (priv->read_begin == priv->read_end) {
+            priv->read_begin = 0;
+            priv->read_end = 0;
+         }
+         if (message) {
+            g_simple_async_result_set_op_res_gpointer(simple, message,
+                                                      g_object_unref);
+         } else {
+            g_input_stream_close(G_INPUT_STREAM(stream), NULL, NULL);
+            g_simple_async_result_take_error(simple, error);
+         }
+         mongo_source_complete_in_idle(priv->source, simple);
+         g_object_unref(simple);
+         EXIT;
+      }
+   }
+
+   /*
+    * Move the partial message to the front of the buffer so that the
+    * rest of it can be read contiguously, growing the buffer if the
+    * message is larger than it.
+    */
+   if (priv->read_begin) {
+      memmove(priv->read_buffer, priv->read_buffer + priv->read_begin, avail);
+      priv->read_begin = 0;
+      priv->read_end = avail;
+   }
+
+   needed = MAX((gsize)msg_len, avail + 1);
+   if (needed > priv->read_buffer_size) {
+      priv->read_buffer_size = needed;
+      priv->read_buffer = g_realloc(priv->read_buffer, needed);
+   }
+
+   g_input_stream_read_async(G_INPUT_STREAM(stream),
+                             priv->read_buffer + priv->read_end,
+                             priv->read_buffer_size - priv->read_end,
+                             G_PRIORITY_DEFAULT,
+                             priv->shutdown,
+                             mongo_input_stream_fill_cb,
+                             simple);
+
+   EXIT;
+}
+
 /**
  * mongo_input_stream_read_message_async:
  * @stream: A #MongoInputStream.
@@ -255,6 +453,10 @@ mongo_input_stream_read_message_header_cb (GObject      *object,
  * @user_data: user data for @callback.
  *
  * Asynchronously reads the next message from the #MongoInputStream.
+ *
+ * If #MongoInputStream:buffer-size is set, data is read from the base
+ * stream in large chunks and any complete messages already buffered are
+ * returned without performing another read.
  */
 void
 mongo_input_stream_read_message_async (MongoInputStream    *stream,
@@ -276,6 +478,11 @@ mongo_input_stream_read_message_async (MongoInputStream    *stream,
                                       mongo_input_stream_read_message_async);
    g_simple_async_result_set_check_cancellable(simple, cancellable);
 
+   if (priv->read_buffer) {
+      mongo_input_stream_fill(stream, simple);
+      EXIT;
+   }
+
    g_input_stream_read_async(G_INPUT_STREAM(stream),
                              &priv->msg_len,
                              sizeof priv->msg_len,
@@ -419,6 +626,11 @@ mongo_input_stream_finalize (GObject *object)
    g_source_destroy((GSource *)priv->source);
    priv->source = NULL;
 
+   g_free(priv->read_buffer);
+   priv->read_buffer = NULL;
+
+   g_clear_object(&priv->shutdown);
+
    G_OBJECT_CLASS(mongo_input_stream_parent_class)->finalize(object);
 
    EXIT;
@@ -436,6 +648,9 @@ mongo_input_stream_get_property (GObject    *object,
    case PROP_ASYNC_CONTEXT:
       g_value_set_boxed(value, mongo_input_stream_get_async_context(stream));
       break;
+   case PROP_BUFFER_SIZE:
+      g_value_set_uint(value, stream->priv->read_buffer_size);
+      break;
    default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
    }
@@ -453,6 +668,9 @@ mongo_input_stream_set_property (GObject      *object,
    case PROP_ASYNC_CONTEXT:
       mongo_input_stream_set_async_context(stream, g_value_get_boxed(value));
       break;
+   case PROP_BUFFER_SIZE:
+      mongo_input_stream_set_buffer_size(stream, g_value_get_uint(value));
+      break;
    default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
    }
@@ -481,6 +699,25 @@ mongo_input_stream_class_init (MongoInputStreamClass *klass)
    g_object_class_install_property(object_class, PROP_ASYNC_CONTEXT,
                                    gParamSpecs[PROP_ASYNC_CONTEXT]);
 
+   /**
+    * MongoInputStream:buffer-size:
+    *
+    * The size of the read buffer in bytes. If zero, each message is read
+    * individually with a separate read for the header and the body.
+    * Otherwise, data is read in chunks of up to this size and multiple
+    * messages are parsed out of each read.
+    */
+   gParamSpecs[PROP_BUFFER_SIZE] =
+      g_param_spec_uint("buffer-size",
+                        _("Buffer Size"),
+                        _("The size of the read buffer."),
+                        0,
+                        G_MAXINT32,
+                        0,
+                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_BUFFER_SIZE,
+                                   gParamSpecs[PROP_BUFFER_SIZE]);
+
    EXIT;
 }
 
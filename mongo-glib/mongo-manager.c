@@ -26,19 +26,89 @@
  * #MongoManager encapsulates the logic required to know who to connect to
  * upon failure of a replica set. It tracks seeded replica servers as well
  * as servers that were discovered up connecting to a Mongo server.
+ *
+ * It also keeps a description of the topology as last reported by the
+ * hosts themselves: the state of each host, the smoothed round trip time
+ * to it, and the replica set configuration version.
+ *
+ * Hosts that fail are backed off individually, and mongo_manager_next()
+ * tries hosts that were recently healthy first. Delays are randomized so
+ * that many clients losing the same primary do not reconnect in lockstep.
  */
 
+#define MIN_DELAY 200
 #define MAX_DELAY (1000 * 60)
 
+/*
+ * Weight, in tenths, given to a new round trip time sample.
+ */
+#define RTT_WEIGHT 2
+
+typedef struct
+{
+   MongoManagerHostState state;
+   gint set_version;
+   gint64 rtt_usec;
+   guint failures;
+   guint backoff;
+   gint64 retry_at;
+} MongoManagerMember;
+
 struct _MongoManager
 {
    volatile gint ref_count;
    GPtrArray *seeds;
    GPtrArray *hosts;
+   GHashTable *members;
+   GPtrArray *round;
    guint offset;
    guint delay;
 };
 
+static void
+mongo_manager_member_free (gpointer data)
+{
+   g_slice_free(MongoManagerMember, data);
+}
+
+/*
+ * Computes the next delay after @previous with decorrelated jitter: a
+ * random delay between the minimum and twice the previous one, so that
+ * clients that started backing off together drift apart.
+ */
+static guint
+mongo_manager_jitter (guint previous)
+{
+   guint upper;
+
+   if (!previous) {
+      return g_random_int_range(MIN_DELAY, 1000);
+   }
+
+   upper = MIN(MAX_DELAY, MAX(MIN_DELAY, previous) * 2);
+
+   return g_random_int_range(MIN_DELAY, upper + 1);
+}
+
+/*
+ * Drops what is known about the discovered @host, unless it is also a
+ * seed that will keep being tried.
+ */
+static void
+mongo_manager_forget_host (MongoManager *manager,
+                           const gchar  *host)
+{
+   guint i;
+
+   for (i = 0; i < manager->seeds->len; i++) {
+      if (!g_strcmp0(host, manager->seeds->pdata[i])) {
+         return;
+      }
+   }
+
+   g_hash_table_remove(manager->members, host);
+}
+
 /**
  * mongo_manager_new:
  *
@@ -55,6 +125,9 @@ mongo_manager_new (void)
    mgr->ref_count = 1;
    mgr->hosts = g_ptr_array_new_with_free_func(g_free);
    mgr->seeds = g_ptr_array_new_with_free_func(g_free);
+   mgr->members = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        mongo_manager_member_free);
+   mgr->round = g_ptr_array_new_with_free_func(g_free);
 
    return mgr;
 }
@@ -120,8 +193,14 @@ mongo_manager_add_seed (MongoManager *manager,
 void
 mongo_manager_clear_hosts (MongoManager *manager)
 {
+   guint i;
+
    g_return_if_fail(manager);
 
+   for (i = 0; i < manager->hosts->len; i++) {
+      mongo_manager_forget_host(manager, manager->hosts->pdata[i]);
+   }
+
    if (manager->hosts->len) {
       g_ptr_array_remove_range(manager->hosts, 0, manager->hosts->len);
    }
@@ -191,6 +270,170 @@ mongo_manager_get_seeds (MongoManager *manager)
    return ret;
 }
 
+/**
+ * mongo_manager_update_host:
+ * @manager: (in): A #MongoManager.
+ * @host: (in): A "host:port" string.
+ * @state: The state @host reported, or %MONGO_MANAGER_HOST_DOWN.
+ * @set_version: The replica set version @host reported, or 0.
+ * @rtt_usec: The round trip time of the check in microseconds, or -1.
+ *
+ * Records the outcome of checking @host. Round trip times are smoothed
+ * with an exponentially weighted moving average so that one slow reply
+ * does not change which host is considered nearest.
+ *
+ * Each %MONGO_MANAGER_HOST_DOWN counts as a failure of @host, which is
+ * then skipped by mongo_manager_next() for a randomized delay that grows
+ * with consecutive failures. Any other state clears the failures.
+ */
+void
+mongo_manager_update_host (MongoManager          *manager,
+                           const gchar           *host,
+                           MongoManagerHostState  state,
+                           gint                   set_version,
+                           gint64                 rtt_usec)
+{
+   MongoManagerMember *member;
+
+   g_return_if_fail(manager);
+   g_return_if_fail(host);
+
+   if (!(member = g_hash_table_lookup(manager->members, host))) {
+      member = g_slice_new0(MongoManagerMember);
+      member->rtt_usec = -1;
+      g_hash_table_insert(manager->members, g_strdup(host), member);
+   }
+
+   member->state = state;
+
+   if (set_version) {
+      member->set_version = set_version;
+   }
+
+   if (state == MONGO_MANAGER_HOST_DOWN) {
+      member->rtt_usec = -1;
+      member->failures++;
+      member->backoff = mongo_manager_jitter(member->backoff);
+      member->retry_at = g_get_monotonic_time() +
+                         (member->backoff * G_GINT64_CONSTANT(1000));
+      return;
+   }
+
+   member->failures = 0;
+   member->backoff = 0;
+   member->retry_at = 0;
+
+   if (rtt_usec >= 0) {
+      if (member->rtt_usec < 0) {
+         member->rtt_usec = rtt_usec;
+      } else {
+         member->rtt_usec = ((rtt_usec * RTT_WEIGHT) +
+                             (member->rtt_usec * (10 - RTT_WEIGHT))) / 10;
+      }
+   }
+}
+
+/**
+ * mongo_manager_get_host_state:
+ * @manager: (in): A #MongoManager.
+ * @host: (in): A "host:port" string.
+ *
+ * Fetches the last known state of @host.
+ *
+ * Returns: A #MongoManagerHostState.
+ */
+MongoManagerHostState
+mongo_manager_get_host_state (MongoManager *manager,
+                              const gchar  *host)
+{
+   MongoManagerMember *member;
+
+   g_return_val_if_fail(manager, MONGO_MANAGER_HOST_UNKNOWN);
+   g_return_val_if_fail(host, MONGO_MANAGER_HOST_UNKNOWN);
+
+   if (!(member = g_hash_table_lookup(manager->members, host))) {
+      return MONGO_MANAGER_HOST_UNKNOWN;
+   }
+
+   return member->state;
+}
+
+/**
+ * mongo_manager_get_host_rtt:
+ * @manager: (in): A #MongoManager.
+ * @host: (in): A "host:port" string.
+ *
+ * Fetches the smoothed round trip time to @host.
+ *
+ * Returns: The round trip time in microseconds, or -1 if unknown.
+ */
+gint64
+mongo_manager_get_host_rtt (MongoManager *manager,
+                            const gchar  *host)
+{
+   MongoManagerMember *member;
+
+   g_return_val_if_fail(manager, -1);
+   g_return_val_if_fail(host, -1);
+
+   if (!(member = g_hash_table_lookup(manager->members, host))) {
+      return -1;
+   }
+
+   return member->rtt_usec;
+}
+
+/**
+ * mongo_manager_get_host_failures:
+ * @manager: (in): A #MongoManager.
+ * @host: (in): A "host:port" string.
+ *
+ * Fetches the number of consecutive times @host was found down.
+ *
+ * Returns: The number of failures.
+ */
+guint
+mongo_manager_get_host_failures (MongoManager *manager,
+                                 const gchar  *host)
+{
+   MongoManagerMember *member;
+
+   g_return_val_if_fail(manager, 0);
+   g_return_val_if_fail(host, 0);
+
+   if (!(member = g_hash_table_lookup(manager->members, host))) {
+      return 0;
+   }
+
+   return member->failures;
+}
+
+/**
+ * mongo_manager_get_set_version:
+ * @manager: (in): A #MongoManager.
+ *
+ * Fetches the newest replica set configuration version reported by any
+ * host.
+ *
+ * Returns: The version, or 0 if unknown.
+ */
+gint
+mongo_manager_get_set_version (MongoManager *manager)
+{
+   MongoManagerMember *member;
+   GHashTableIter iter;
+   gint set_version = 0;
+
+   g_return_val_if_fail(manager, 0);
+
+   g_hash_table_iter_init(&iter, manager->members);
+   while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&member)) {
+      set_version = MAX(set_version, member->set_version);
+   }
+
+   return set_version;
+}
+
 /**
  * mongo_manager_remove_host:
  * @manager: (in): A #MongoManager.
@@ -209,6 +452,7 @@ mongo_manager_remove_host (MongoManager *manager,
 
    for (i = 0; i < manager->hosts->len; i++) {
       if (!g_strcmp0(manager->hosts->pdata[i], host)) {
+         mongo_manager_forget_host(manager, host);
          g_ptr_array_remove_index(manager->hosts, i);
          break;
       }
@@ -253,6 +497,93 @@ mongo_manager_reset_delay (MongoManager *manager)
    manager->delay = 0;
 }
 
+/*
+ * Orders hosts that were reported healthy first, then by the number of
+ * consecutive failures. The sort is stable so that ties keep the order
+ * seeds and hosts were added in.
+ */
+static gint
+mongo_manager_compare (gconstpointer a,
+                       gconstpointer b,
+                       gpointer      user_data)
+{
+   MongoManagerMember *member_a;
+   MongoManagerMember *member_b;
+   MongoManager *manager = user_data;
+   gboolean healthy_a;
+   gboolean healthy_b;
+   guint failures_a;
+   guint failures_b;
+
+   member_a = g_hash_table_lookup(manager->members, *(gchar **)a);
+   member_b = g_hash_table_lookup(manager->members, *(gchar **)b);
+
+   healthy_a = member_a &&
+               ((member_a->state == MONGO_MANAGER_HOST_PRIMARY) ||
+                (member_a->state == MONGO_MANAGER_HOST_SECONDARY));
+   healthy_b = member_b &&
+               ((member_b->state == MONGO_MANAGER_HOST_PRIMARY) ||
+                (member_b->state == MONGO_MANAGER_HOST_SECONDARY));
+
+   if (healthy_a != healthy_b) {
+      return healthy_a ? -1 : 1;
+   }
+
+   failures_a = member_a ? member_a->failures : 0;
+   failures_b = member_b ? member_b->failures : 0;
+
+   return (failures_a < failures_b) ? -1 : (failures_a > failures_b);
+}
+
+/*
+ * Builds the list of hosts for the next round of mongo_manager_next().
+ * Hosts still backing off from a failure are left out, unless every host
+ * is, in which case they are all tried.
+ */
+static void
+mongo_manager_build_round (MongoManager *manager)
+{
+   MongoManagerMember *member;
+   GPtrArray *candidates[2];
+   const gchar *host;
+   gint64 now;
+   guint i;
+   guint j;
+
+   if (manager->round->len) {
+      g_ptr_array_remove_range(manager->round, 0, manager->round->len);
+   }
+
+   now = g_get_monotonic_time();
+   candidates[0] = manager->seeds;
+   candidates[1] = manager->hosts;
+
+   for (i = 0; i < G_N_ELEMENTS(candidates); i++) {
+      for (j = 0; j < candidates[i]->len; j++) {
+         host = g_ptr_array_index(candidates[i], j);
+         member = g_hash_table_lookup(manager->members, host);
+         if (!member || (member->retry_at <= now)) {
+            g_ptr_array_add(manager->round, g_strdup(host));
+         }
+      }
+   }
+
+   if (!manager->round->len) {
+      for (i = 0; i < G_N_ELEMENTS(candidates); i++) {
+         for (j = 0; j < candidates[i]->len; j++) {
+            host = g_ptr_array_index(candidates[i], j);
+            g_ptr_array_add(manager->round, g_strdup(host));
+         }
+      }
+   }
+
+   g_qsort_with_data(manager->round->pdata,
+                     manager->round->len,
+                     sizeof(gpointer),
+                     mongo_manager_compare,
+                     manager);
+}
+
 /**
  * mongo_manager_next:
  * @manager: (in): A #MongoManager.
@@ -262,43 +593,32 @@ mongo_manager_reset_delay (MongoManager *manager)
  * does not exist, %NULL is returned and @delay is set. The caller should
  * delay that many milliseconds before calling mongo_manager_next() again.
  *
+ * Each round starts with the hosts that were last reported healthy,
+ * followed by the others in order of their number of failures. Hosts
+ * that failed recently are skipped while they back off. @delay is picked
+ * at random, up to twice the previous delay, capped at one minute.
+ *
  * Returns: A "host:port" to connect to, or %NULL and @delay is set.
  */
 const gchar *
 mongo_manager_next (MongoManager *manager,
                     guint        *delay)
 {
-   gchar *next;
-   guint offset;
-
    g_return_val_if_fail(manager, NULL);
    g_return_val_if_fail(delay, NULL);
 
    *delay = 0;
 
-   offset = manager->offset;
-
-   if (offset < manager->seeds->len) {
-      next = g_ptr_array_index(manager->seeds, offset);
-      manager->offset++;
-      return next;
+   if (!manager->offset) {
+      mongo_manager_build_round(manager);
    }
 
-   offset -= manager->seeds->len;
-
-   if (offset < manager->hosts->len) {
-      next = g_ptr_array_index(manager->hosts, offset);
-      manager->offset++;
-      return next;
+   if (manager->offset < manager->round->len) {
+      return g_ptr_array_index(manager->round, manager->offset++);
    }
 
    manager->offset = 0;
-
-   if (!manager->delay) {
-      manager->delay = g_random_int_range(200, 1000);
-   } else {
-      manager->delay = CLAMP(manager->delay << 1, 1, MAX_DELAY);
-   }
+   manager->delay = mongo_manager_jitter(manager->delay);
 
    *delay = manager->delay;
 
@@ -311,6 +631,8 @@ mongo_manager_dispose (MongoManager *manager)
    g_assert(manager);
    g_ptr_array_unref(manager->hosts);
    g_ptr_array_unref(manager->seeds);
+   g_hash_table_unref(manager->members);
+   g_ptr_array_unref(manager->round);
 }
 
 /**
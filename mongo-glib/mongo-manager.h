@@ -27,6 +27,26 @@ G_BEGIN_DECLS
 
 typedef struct _MongoManager MongoManager;
 
+/**
+ * MongoManagerHostState:
+ * @MONGO_MANAGER_HOST_UNKNOWN: The host has not been checked.
+ * @MONGO_MANAGER_HOST_PRIMARY: The host is the replica set primary.
+ * @MONGO_MANAGER_HOST_SECONDARY: The host is a secondary.
+ * @MONGO_MANAGER_HOST_OTHER: The host answered but can't serve requests,
+ *   such as an arbiter or a member that is recovering.
+ * @MONGO_MANAGER_HOST_DOWN: The host could not be reached.
+ *
+ * #MongoManagerHostState describes the last known state of a host.
+ */
+typedef enum
+{
+   MONGO_MANAGER_HOST_UNKNOWN   = 0,
+   MONGO_MANAGER_HOST_PRIMARY   = 1,
+   MONGO_MANAGER_HOST_SECONDARY = 2,
+   MONGO_MANAGER_HOST_OTHER     = 3,
+   MONGO_MANAGER_HOST_DOWN      = 4,
+} MongoManagerHostState;
+
 void           mongo_manager_add_seed    (MongoManager *manager,
                                           const gchar  *seed);
 void           mongo_manager_add_host    (MongoManager *manager,
@@ -34,7 +54,14 @@ void           mongo_manager_add_host    (MongoManager *manager,
 void           mongo_manager_clear_hosts (MongoManager *manager);
 void           mongo_manager_clear_seeds (MongoManager *manager);
 gchar        **mongo_manager_get_hosts   (MongoManager *manager);
+guint          mongo_manager_get_host_failures (MongoManager *manager,
+                                                const gchar  *host);
+gint64         mongo_manager_get_host_rtt (MongoManager *manager,
+                                           const gchar  *host);
+MongoManagerHostState mongo_manager_get_host_state (MongoManager *manager,
+                                                    const gchar  *host);
 gchar        **mongo_manager_get_seeds   (MongoManager *manager);
+gint           mongo_manager_get_set_version (MongoManager *manager);
 GType          mongo_manager_get_type    (void) G_GNUC_CONST;
 MongoManager  *mongo_manager_new         (void);
 const gchar   *mongo_manager_next        (MongoManager *manager,
@@ -46,6 +73,11 @@ void           mongo_manager_remove_seed (MongoManager *manager,
                                           const gchar  *seed);
 void           mongo_manager_reset_delay (MongoManager *manager);
 void           mongo_manager_unref       (MongoManager *manager);
+void           mongo_manager_update_host (MongoManager          *manager,
+                                          const gchar           *host,
+                                          MongoManagerHostState  state,
+                                          gint                   set_version,
+                                          gint64                 rtt_usec);
 
 G_END_DECLS
 
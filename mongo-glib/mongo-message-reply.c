@@ -27,6 +27,8 @@ G_DEFINE_TYPE(MongoMessageReply, mongo_message_reply, MONGO_TYPE_MESSAGE)
 struct _MongoMessageReplyPrivate
 {
    guint64           cursor_id;
+   GBytes           *data;
+   guint32           n_documents;
    GList            *documents;
    MongoReplyFlags   flags;
    guint32           offset;
@@ -48,7 +50,7 @@ gsize
 mongo_message_reply_get_count (MongoMessageReply *reply)
 {
    g_return_val_if_fail(MONGO_IS_MESSAGE_REPLY(reply), 0);
-   return g_list_length(reply->priv->documents);
+   return reply->priv->n_documents;
 }
 
 guint64
@@ -71,16 +73,36 @@ mongo_message_reply_set_cursor_id (MongoMessageReply *reply,
  * mongo_message_reply_get_documents:
  * @reply: (in): A #MongoMessageReply.
  *
- * Returns an array of documents for the reply. @count is set to the
- * number of documents returned.
+ * Returns a list of documents for the reply.
+ *
+ * Replies read from the wire keep the documents in the received buffer,
+ * and the #MongoBson instances are only created the first time this is
+ * called. If you only need to look at each document once, consider
+ * using #MongoMessageReplyIter instead.
  *
  * Returns: (transfer none) (element-type MongoBson*): A #GList of #MongoBson.
  */
 GList *
 mongo_message_reply_get_documents (MongoMessageReply *reply)
 {
+   MongoMessageReplyPrivate *priv;
+   MongoMessageReplyIter iter;
+   GList *list = NULL;
+
    g_return_val_if_fail(MONGO_IS_MESSAGE_REPLY(reply), NULL);
-   return reply->priv->documents;
+
+   priv = reply->priv;
+
+   if (!priv->documents && priv->data) {
+      mongo_message_reply_iter_init(&iter, reply);
+      while (mongo_message_reply_iter_next(&iter)) {
+         list = g_list_prepend(list,
+                               mongo_message_reply_iter_get_document(&iter));
+      }
+      priv->documents = g_list_reverse(list);
+   }
+
+   return priv->documents;
 }
 
 /**
@@ -107,10 +129,17 @@ mongo_message_reply_set_documents (MongoMessageReply *reply,
    g_list_foreach(priv->documents, (GFunc)mongo_bson_unref, NULL);
    g_list_free(priv->documents);
    priv->documents = NULL;
+   priv->n_documents = 0;
+
+   if (priv->data) {
+      g_bytes_unref(priv->data);
+      priv->data = NULL;
+   }
 
    for (iter = documents; iter; iter = iter->next) {
       if (iter->data) {
          list = g_list_prepend(list, mongo_bson_ref(iter->data));
+         priv->n_documents++;
       }
    }
    priv->documents = g_list_reverse(list);
@@ -150,6 +179,157 @@ mongo_message_reply_set_offset (MongoMessageReply *reply,
    g_object_notify_by_pspec(G_OBJECT(reply), gParamSpecs[PROP_OFFSET]);
 }
 
+/**
+ * mongo_message_reply_iter_init:
+ * @iter: (out): An uninitialized #MongoMessageReplyIter.
+ * @reply: (in): A #MongoMessageReply.
+ *
+ * Initializes @iter to walk the documents contained in @reply. Call
+ * mongo_message_reply_iter_next() to move to the first document.
+ *
+ * @reply must stay alive for as long as @iter is in use.
+ */
+void
+mongo_message_reply_iter_init (MongoMessageReplyIter *iter,
+                               MongoMessageReply     *reply)
+{
+   g_return_if_fail(iter);
+   g_return_if_fail(MONGO_IS_MESSAGE_REPLY(reply));
+
+   memset(iter, 0, sizeof *iter);
+   iter->user_data1 = reply;
+}
+
+/**
+ * mongo_message_reply_iter_next:
+ * @iter: (inout): A #MongoMessageReplyIter.
+ *
+ * Moves @iter to the next document in the reply.
+ *
+ * Returns: %TRUE if @iter points at a document; %FALSE if there are no
+ *   more documents.
+ */
+gboolean
+mongo_message_reply_iter_next (MongoMessageReplyIter *iter)
+{
+   MongoMessageReplyPrivate *priv;
+   MongoMessageReply *reply;
+   const guint8 *data;
+   MongoBson *bson;
+   guint32 doc_len;
+   GList *list;
+   gsize offset;
+   gsize length;
+
+   g_return_val_if_fail(iter, FALSE);
+   g_return_val_if_fail(MONGO_IS_MESSAGE_REPLY(iter->user_data1), FALSE);
+
+   reply = iter->user_data1;
+   priv = reply->priv;
+
+   if (!priv->data) {
+      /*
+       * The documents were provided with
+       * mongo_message_reply_set_documents(), walk the list.
+       */
+      list = iter->user_data2 ? ((GList *)iter->user_data2)->next
+                              : priv->documents;
+      iter->user_data2 = list;
+      if (!list) {
+         iter->user_data3 = NULL;
+         iter->user_data4 = NULL;
+         return FALSE;
+      }
+      bson = list->data;
+      iter->user_data3 = bson->data;
+      iter->user_data4 = GSIZE_TO_POINTER(bson->len);
+      return TRUE;
+   }
+
+   data = g_bytes_get_data(priv->data, &length);
+   offset = GPOINTER_TO_SIZE(iter->user_data2);
+
+   if (offset >= length) {
+      iter->user_data3 = NULL;
+      iter->user_data4 = NULL;
+      return FALSE;
+   }
+
+   /*
+    * Document boundaries were validated when the reply was loaded.
+    */
+   memcpy(&doc_len, data + offset, sizeof doc_len);
+   doc_len = GUINT32_FROM_LE(doc_len);
+
+   iter->user_data2 = GSIZE_TO_POINTER(offset + doc_len);
+   iter->user_data3 = (guint8 *)data + offset;
+   iter->user_data4 = GSIZE_TO_POINTER(doc_len);
+
+   return TRUE;
+}
+
+/**
+ * mongo_message_reply_iter_get_document:
+ * @iter: (in): A #MongoMessageReplyIter.
+ *
+ * Fetches the document currently pointed to by @iter. For replies read
+ * from the wire, the #MongoBson is a view into the reply's buffer and
+ * keeps that buffer alive; the document is not copied. To read fields of
+ * the document without creating a #MongoBson at all, use
+ * mongo_message_reply_iter_recurse().
+ *
+ * Returns: (transfer full): A #MongoBson that should be freed with
+ *   mongo_bson_unref().
+ */
+MongoBson *
+mongo_message_reply_iter_get_document (MongoMessageReplyIter *iter)
+{
+   MongoMessageReply *reply;
+
+   g_return_val_if_fail(iter, NULL);
+   g_return_val_if_fail(iter->user_data3, NULL);
+
+   reply = iter->user_data1;
+
+   if (!reply->priv->data) {
+      return mongo_bson_ref(((GList *)iter->user_data2)->data);
+   }
+
+   return mongo_bson_new_from_static_data(iter->user_data3,
+                                          GPOINTER_TO_SIZE(iter->user_data4),
+                                          (GDestroyNotify)g_bytes_unref,
+                                          g_bytes_ref(reply->priv->data));
+}
+
+/**
+ * mongo_message_reply_iter_recurse:
+ * @iter: (in): A #MongoMessageReplyIter.
+ * @child: (out): A #MongoBsonIter.
+ *
+ * Initializes @child to iterate the fields of the document currently
+ * pointed to by @iter. The fields are read straight out of the reply's
+ * buffer without copying the document.
+ *
+ * Returns: %TRUE if @child was initialized.
+ */
+gboolean
+mongo_message_reply_iter_recurse (MongoMessageReplyIter *iter,
+                                  MongoBsonIter         *child)
+{
+   g_return_val_if_fail(iter, FALSE);
+   g_return_val_if_fail(child, FALSE);
+
+   if (!iter->user_data3) {
+      return FALSE;
+   }
+
+   mongo_bson_iter_init_from_data(child,
+                                  iter->user_data3,
+                                  GPOINTER_TO_SIZE(iter->user_data4));
+
+   return TRUE;
+}
+
 static guint8 *
 mongo_message_reply_save_to_data (MongoMessage *message,
                                   gsize        *length)
@@ -197,13 +377,19 @@ mongo_message_reply_save_to_data (MongoMessage *message,
    g_byte_array_append(bytes, (guint8 *)&v32, sizeof v32);
 
    /* Number of documents returned */
-   v32 = GUINT32_TO_LE(g_list_length(priv->documents));
+   v32 = GUINT32_TO_LE(priv->n_documents);
    g_byte_array_append(bytes, (guint8 *)&v32, sizeof v32);
 
    /* encode BSON documents */
-   for (iter = priv->documents; iter; iter = iter->next) {
-      bson = iter->data;
-      g_byte_array_append(bytes, bson->data, bson->len);
+   if (priv->data) {
+      g_byte_array_append(bytes,
+                          g_bytes_get_data(priv->data, NULL),
+                          g_bytes_get_size(priv->data));
+   } else {
+      for (iter = priv->documents; iter; iter = iter->next) {
+         bson = iter->data;
+         g_byte_array_append(bytes, bson->data, bson->len);
+      }
    }
 
    /* Update message length */
@@ -225,77 +411,69 @@ mongo_message_reply_load_from_data (MongoMessage *message,
 {
    MongoMessageReplyPrivate *priv;
    MongoMessageReply *reply = (MongoMessageReply *)message;
-   MongoBson *bson;
    guint64 cursor;
    guint32 flags;
    guint32 offset;
    guint32 count;
-   guint32 msg_len;
-   gssize len = length;
-   GList *list = NULL;
+   guint32 doc_len;
+   gsize pos;
    guint i;
 
    ENTRY;
 
    g_assert(MONGO_IS_MESSAGE_REPLY(reply));
    g_assert(data);
-   g_assert(len);
+   g_assert(length);
 
    priv = reply->priv;
 
+   if (length < 20) {
+      RETURN(FALSE);
+   }
+
    memcpy(&flags, data, sizeof flags);
    flags = GUINT32_FROM_LE(flags);
    data += 4;
-   len -= 4;
+   length -= 4;
 
    memcpy(&cursor, data, sizeof cursor);
    cursor = GUINT64_FROM_LE(cursor);
    data += 8;
-   len -= 8;
+   length -= 8;
 
    memcpy(&offset, data, sizeof offset);
    offset = GUINT32_FROM_LE(offset);
    data += 4;
-   len -= 4;
+   length -= 4;
 
    memcpy(&count, data, sizeof count);
    count = GUINT32_FROM_LE(count);
    data += 4;
-   len -= 4;
-
-   for (i = 0; i < count; i++) {
-      if (len <= 0) {
-         GOTO(failure);
+   length -= 4;
+
+   /*
+    * Validate the document boundaries without creating any documents.
+    * They are kept in a single buffer and only materialized on request.
+    */
+   for (i = 0, pos = 0; i < count; i++) {
+      if ((length - pos) < 5) {
+         RETURN(FALSE);
       }
-
-      memcpy(&msg_len, data, sizeof msg_len);
-      msg_len = GUINT32_FROM_LE(msg_len);
-
-      if (msg_len <= len) {
-         if ((bson = mongo_bson_new_from_data(data, msg_len))) {
-            list = g_list_append(list, bson);
-         } else {
-            GOTO(failure);
-         }
+      memcpy(&doc_len, data + pos, sizeof doc_len);
+      doc_len = GUINT32_FROM_LE(doc_len);
+      if ((doc_len < 5) || (doc_len > (length - pos))) {
+         RETURN(FALSE);
       }
-
-      data += msg_len;
-   }
-
-   if (g_list_length(list) != count) {
-      GOTO(failure);
+      pos += doc_len;
    }
 
    priv->cursor_id = cursor;
    priv->flags = flags;
    priv->offset = offset;
-   priv->documents = list;
-   RETURN(TRUE);
+   priv->n_documents = count;
+   priv->data = g_bytes_new(data, pos);
 
-failure:
-   g_list_foreach(list, (GFunc)mongo_bson_unref, NULL);
-   g_list_free(list);
-   RETURN(FALSE);
+   RETURN(TRUE);
 }
 
 static void
@@ -310,6 +488,11 @@ mongo_message_reply_finalize (GObject *object)
    g_list_foreach(priv->documents, (GFunc)mongo_bson_unref, NULL);
    g_list_free(priv->documents);
 
+   if (priv->data) {
+      g_bytes_unref(priv->data);
+      priv->data = NULL;
+   }
+
    G_OBJECT_CLASS(mongo_message_reply_parent_class)->finalize(object);
 
    EXIT;
@@ -34,6 +34,7 @@ G_BEGIN_DECLS
 typedef struct _MongoMessageReply        MongoMessageReply;
 typedef struct _MongoMessageReplyClass   MongoMessageReplyClass;
 typedef struct _MongoMessageReplyPrivate MongoMessageReplyPrivate;
+typedef struct _MongoMessageReplyIter    MongoMessageReplyIter;
 
 struct _MongoMessageReply
 {
@@ -48,6 +49,22 @@ struct _MongoMessageReplyClass
    MongoMessageClass parent_class;
 };
 
+/**
+ * MongoMessageReplyIter:
+ *
+ * #MongoMessageReplyIter is used to walk the documents of a
+ * #MongoMessageReply without creating a #GList or a #MongoBson for each
+ * document. It is meant to be used on the stack.
+ */
+struct _MongoMessageReplyIter
+{
+   /*< private >*/
+   gpointer user_data1; /* Reply */
+   gpointer user_data2; /* Next offset or current list node */
+   gpointer user_data3; /* Current document */
+   gpointer user_data4; /* Current document length */
+};
+
 gsize            mongo_message_reply_get_count      (MongoMessageReply   *reply);
 guint64          mongo_message_reply_get_cursor_id  (MongoMessageReply   *reply);
 GList           *mongo_message_reply_get_documents  (MongoMessageReply   *reply);
@@ -62,6 +79,12 @@ void             mongo_message_reply_set_flags      (MongoMessageReply  *reply,
                                                      MongoReplyFlags     flags);
 void             mongo_message_reply_set_offset     (MongoMessageReply  *reply,
                                                      guint               offset);
+void             mongo_message_reply_iter_init      (MongoMessageReplyIter *iter,
+                                                     MongoMessageReply     *reply);
+gboolean         mongo_message_reply_iter_next      (MongoMessageReplyIter *iter);
+MongoBson       *mongo_message_reply_iter_get_document (MongoMessageReplyIter *iter);
+gboolean         mongo_message_reply_iter_recurse   (MongoMessageReplyIter *iter,
+                                                     MongoBsonIter         *child);
 
 G_END_DECLS
 
@@ -33,12 +33,22 @@
 
 G_DEFINE_TYPE(MongoOutputStream, mongo_output_stream, G_TYPE_FILTER_OUTPUT_STREAM)
 
+/*
+ * Queued requests are coalesced into a single write of up to this many
+ * bytes. A request larger than this is written on its own without being
+ * copied.
+ */
+#define COALESCE_MAX_BYTES (256 * 1024)
+
 struct _MongoOutputStreamPrivate
 {
    MongoSource  *source;
    GCancellable *shutdown;
    GHashTable   *async_results;
    GQueue       *queue;
+   GQueue       *in_flight;
+   GBytes       *batch;
+   gsize         batch_offset;
    gint32        next_request_id;
    gboolean      flushing;
 };
@@ -47,6 +57,7 @@ typedef struct
 {
    GSimpleAsyncResult *simple;
    GBytes             *bytes;
+   gsize               end;
    gboolean            ignore_error;
 } Request;
 
@@ -162,6 +173,7 @@ mongo_output_stream_queue (MongoOutputStream  *stream,
    request = g_slice_new(Request);
    request->simple = simple ? g_object_ref(simple) : NULL;
    request->bytes = g_bytes_ref(bytes);
+   request->end = 0;
    request->ignore_error = ignore_error;
 
    g_queue_push_head(stream->priv->queue, request);
@@ -169,6 +181,105 @@ mongo_output_stream_queue (MongoOutputStream  *stream,
    EXIT;
 }
 
+static void
+mongo_output_stream_fill_batch (MongoOutputStream *stream)
+{
+   MongoOutputStreamPrivate *priv;
+   GByteArray *ar;
+   Request *request;
+   GList *iter;
+   gsize size;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_OUTPUT_STREAM(stream));
+   g_assert(!stream->priv->batch);
+   g_assert(g_queue_is_empty(stream->priv->in_flight));
+
+   priv = stream->priv;
+
+   if (!(request = g_queue_pop_tail(priv->queue))) {
+      EXIT;
+   }
+
+   size = g_bytes_get_size(request->bytes);
+   request->end = size;
+   g_queue_push_tail(priv->in_flight, request);
+
+   /*
+    * If there is nothing to coalesce with, or the request alone fills the
+    * budget, write it straight from its own buffer.
+    */
+   request = g_queue_peek_tail(priv->queue);
+   if (!request ||
+       (size + g_bytes_get_size(request->bytes)) > COALESCE_MAX_BYTES) {
+      request = g_queue_peek_head(priv->in_flight);
+      priv->batch = g_bytes_ref(request->bytes);
+      EXIT;
+   }
+
+   /*
+    * Move as many requests as fit within the budget into the batch. The
+    * queue is pushed at the head, so the oldest requests are at the tail.
+    */
+   while ((request = g_queue_peek_tail(priv->queue))) {
+      if ((size + g_bytes_get_size(request->bytes)) > COALESCE_MAX_BYTES) {
+         break;
+      }
+      size += g_bytes_get_size(request->bytes);
+      request->end = size;
+      g_queue_push_tail(priv->in_flight, g_queue_pop_tail(priv->queue));
+   }
+
+   ar = g_byte_array_sized_new(size);
+   for (iter = priv->in_flight->head; iter; iter = iter->next) {
+      request = iter->data;
+      g_byte_array_append(ar,
+                          g_bytes_get_data(request->bytes, NULL),
+                          g_bytes_get_size(request->bytes));
+   }
+   g_assert_cmpint(ar->len, ==, size);
+
+   priv->batch = g_byte_array_free_to_bytes(ar);
+
+   EXIT;
+}
+
+static void
+mongo_output_stream_fail_batch (MongoOutputStream *stream,
+                                GError            *error)
+{
+   MongoOutputStreamPrivate *priv;
+   Request *request;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_OUTPUT_STREAM(stream));
+   g_assert(error);
+
+   priv = stream->priv;
+
+   while ((request = g_queue_pop_head(priv->in_flight))) {
+      if (request->simple && !request->ignore_error) {
+         g_simple_async_result_set_from_error(request->simple, error);
+         mongo_source_complete_in_idle(priv->source, request->simple);
+      }
+      request_free(request);
+   }
+
+   if (priv->batch) {
+      g_bytes_unref(priv->batch);
+      priv->batch = NULL;
+   }
+
+   priv->batch_offset = 0;
+
+   EXIT;
+}
+
+static void
+mongo_output_stream_write_batch (MongoOutputStream *stream);
+
 static void
 mongo_output_stream_flush_cb (GObject      *object,
                               GAsyncResult *result,
@@ -177,62 +288,90 @@ mongo_output_stream_flush_cb (GObject      *object,
    MongoOutputStreamPrivate *priv;
    MongoOutputStream *stream = (MongoOutputStream *)object;
    GOutputStream *output = (GOutputStream *)object;
-   const guint8 *buf;
-   Request *request = user_data;
+   Request *request;
    GError *error = NULL;
    gssize bytes_written;
-   gsize expected;
-   gsize buflen;
 
    ENTRY;
 
    g_assert(G_IS_OUTPUT_STREAM(output));
    g_assert(MONGO_IS_OUTPUT_STREAM(stream));
    g_assert(G_IS_ASYNC_RESULT(result));
-   g_assert(request);
 
    priv = stream->priv;
 
-   expected = g_bytes_get_size(request->bytes);
    bytes_written = g_output_stream_write_finish(output, result, &error);
 
-   if (bytes_written != expected) {
+   if (bytes_written <= 0) {
       g_output_stream_close(output, NULL, NULL);
-      if (request->simple && !request->ignore_error) {
-         if (!error) {
-            error = g_error_new(MONGO_OUTPUT_STREAM_ERROR,
-                                MONGO_OUTPUT_STREAM_ERROR_SHORT_WRITE,
-                                _("Failed to write all data to stream."));
-         }
-         g_simple_async_result_take_error(request->simple, error);
-         mongo_source_complete_in_idle(priv->source, request->simple);
+      if (!error) {
+         error = g_error_new(MONGO_OUTPUT_STREAM_ERROR,
+                             MONGO_OUTPUT_STREAM_ERROR_SHORT_WRITE,
+                             _("Failed to write all data to stream."));
       }
-      request_free(request);
+      mongo_output_stream_fail_batch(stream, error);
+      g_error_free(error);
       priv->flushing = FALSE;
       EXIT;
    }
 
-   if (request->simple) {
-      g_simple_async_result_set_op_res_gboolean(request->simple, TRUE);
-      mongo_source_complete_in_idle(priv->source, request->simple);
+   priv->batch_offset += bytes_written;
+
+   /*
+    * Complete every request whose bytes have now been fully written.
+    */
+   while ((request = g_queue_peek_head(priv->in_flight)) &&
+          (request->end <= priv->batch_offset)) {
+      g_queue_pop_head(priv->in_flight);
+      if (request->simple) {
+         g_simple_async_result_set_op_res_gboolean(request->simple, TRUE);
+         mongo_source_complete_in_idle(priv->source, request->simple);
+      }
+      request_free(request);
    }
 
-   request_free(request);
+   if (priv->batch_offset == g_bytes_get_size(priv->batch)) {
+      g_assert(g_queue_is_empty(priv->in_flight));
+      g_bytes_unref(priv->batch);
+      priv->batch = NULL;
+      priv->batch_offset = 0;
+      mongo_output_stream_fill_batch(stream);
+   }
 
-   if (!(request = g_queue_pop_tail(priv->queue))) {
+   if (!priv->batch) {
       priv->flushing = FALSE;
       EXIT;
    }
 
-   buf = g_bytes_get_data(request->bytes, &buflen);
+   mongo_output_stream_write_batch(stream);
+
+   EXIT;
+}
+
+static void
+mongo_output_stream_write_batch (MongoOutputStream *stream)
+{
+   MongoOutputStreamPrivate *priv;
+   const guint8 *buf;
+   gsize buflen;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_OUTPUT_STREAM(stream));
+   g_assert(stream->priv->batch);
+
+   priv = stream->priv;
+
+   buf = g_bytes_get_data(priv->batch, &buflen);
+   g_assert_cmpint(priv->batch_offset, <, buflen);
 
    g_output_stream_write_async(G_OUTPUT_STREAM(stream),
-                               buf,
-                               buflen,
+                               buf + priv->batch_offset,
+                               buflen - priv->batch_offset,
                                G_PRIORITY_DEFAULT,
                                priv->shutdown,
                                mongo_output_stream_flush_cb,
-                               request);
+                               NULL);
 
    EXIT;
 }
@@ -241,9 +380,6 @@ static void
 mongo_output_stream_flush (MongoOutputStream *stream)
 {
    MongoOutputStreamPrivate *priv;
-   const guint8 *buf;
-   Request *request;
-   gsize buflen;
 
    ENTRY;
 
@@ -255,21 +391,15 @@ mongo_output_stream_flush (MongoOutputStream *stream)
       EXIT;
    }
 
-   if (!(request = g_queue_pop_tail(priv->queue))) {
+   mongo_output_stream_fill_batch(stream);
+
+   if (!priv->batch) {
       EXIT;
    }
 
    priv->flushing = TRUE;
 
-   buf = g_bytes_get_data(request->bytes, &buflen);
-
-   g_output_stream_write_async(G_OUTPUT_STREAM(stream),
-                               buf,
-                               buflen,
-                               G_PRIORITY_DEFAULT,
-                               priv->shutdown,
-                               mongo_output_stream_flush_cb,
-                               request);
+   mongo_output_stream_write_batch(stream);
 
    EXIT;
 }
@@ -568,10 +698,12 @@ mongo_output_stream_dispose (GObject *object)
    priv->queue = g_queue_new();
 
    while ((request = g_queue_pop_tail(queue))) {
-      g_simple_async_result_set_error(request->simple,
-                                      G_IO_ERROR,
-                                      G_IO_ERROR_CANCELLED,
-                                      _("The request was cancelled."));
+      if (request->simple) {
+         g_simple_async_result_set_error(request->simple,
+                                         G_IO_ERROR,
+                                         G_IO_ERROR_CANCELLED,
+                                         _("The request was cancelled."));
+      }
       request_free(request);
    }
 
@@ -584,6 +716,7 @@ static void
 mongo_output_stream_finalize (GObject *object)
 {
    MongoOutputStreamPrivate *priv;
+   Request *request;
 
    ENTRY;
 
@@ -597,6 +730,15 @@ mongo_output_stream_finalize (GObject *object)
       g_warning("%s() called with queued requests.", G_STRFUNC);
    }
 
+   while ((request = g_queue_pop_head(priv->in_flight))) {
+      request_free(request);
+   }
+
+   if (priv->batch) {
+      g_bytes_unref(priv->batch);
+      priv->batch = NULL;
+   }
+
    g_hash_table_unref(priv->async_results);
    priv->async_results = NULL;
 
@@ -606,6 +748,9 @@ mongo_output_stream_finalize (GObject *object)
    g_queue_free(priv->queue);
    priv->queue = NULL;
 
+   g_queue_free(priv->in_flight);
+   priv->in_flight = NULL;
+
    g_clear_object(&priv->shutdown);
 
    G_OBJECT_CLASS(mongo_output_stream_parent_class)->finalize(object);
@@ -660,6 +805,7 @@ mongo_output_stream_init (MongoOutputStream *stream)
    stream->priv->async_results = g_hash_table_new(g_direct_hash,
                                                   g_direct_equal);
    stream->priv->queue = g_queue_new();
+   stream->priv->in_flight = g_queue_new();
    stream->priv->shutdown = g_cancellable_new();
    EXIT;
 }
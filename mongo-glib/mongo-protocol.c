@@ -31,32 +31,97 @@
  * #MongoProtocol encapsulates the wire protocol for Mongo DB.
  * It uses a #GIOStream for communication. Typically, this
  * is used by #MongoConnection but can be used directly if necessary.
+ *
+ * Large documents are not copied when building a message; the message
+ * shares the memory of the #MongoBson until it has been written. A
+ * document modified in the meantime is copied first, so the message
+ * always contains the document as it was when the request was made.
  */
 
 G_DEFINE_TYPE(MongoProtocol, mongo_protocol, G_TYPE_OBJECT)
 
+extern GBytes *_mongo_bson_share (MongoBson *bson);
+
+/*
+ * A request waiting on a reply. Pending requests are kept in a ring
+ * indexed by their offset from the oldest request id still outstanding.
+ * Request ids are handed out sequentially, so the ring only grows at the
+ * tail and is trimmed from the head as replies arrive; no hashing or
+ * allocation is needed per request. Ids of messages that get no reply
+ * simply leave empty slots behind.
+ *
+ * A request whose reply is much later than those around it would keep
+ * the ring from being trimmed. Once the ring would span more than
+ * PENDING_MAX_SPAN ids, such stragglers are moved to a hash table so the
+ * ring stays bounded.
+ */
+typedef struct
+{
+   GSimpleAsyncResult *simple;
+   GSequenceIter      *deadline;
+} Pending;
+
 struct _MongoProtocolPrivate
 {
    GIOStream *io_stream;
    MongoInputStream *input_stream;
    GOutputStream *output_stream;
+   GSocket *socket;
+   GSource *send_source;
+   GQueue *send_queue;
+   gsize send_offset;
+   gsize send_queued;
+   gboolean sending;
    guint32 last_request_id;
    GCancellable *shutdown;
-   GHashTable *requests;
+   Pending *pending;
+   guint pending_size;
+   guint pending_head;
+   guint pending_span;
+   guint pending_count;
+   gint32 pending_first_id;
+   GHashTable *stragglers;
    gboolean getlasterror_fsync;
    gint getlasterror_w;
    gint getlasterror_wtimeoutms;
    gboolean getlasterror_j;
    gboolean safe;
+   guint max_bson_size;
+   guint max_message_size;
+   guint write_batch_size;
+   GPtrArray *write_batch;
+   gchar *write_batch_db;
+   GSource *write_batch_source;
+   gsize send_high_watermark;
+   gsize send_low_watermark;
+   guint pending_high_watermark;
+   guint pending_low_watermark;
+   gboolean congested;
+   GQueue waiters;
+   guint request_timeout;
+   gboolean close_on_timeout;
+   GSequence *deadlines;
+   GSource *timeout_source;
+   gint64 timeout_expires;
 };
 
 enum
 {
    PROP_0,
+   PROP_CLOSE_ON_TIMEOUT,
+   PROP_CONGESTED,
    PROP_FSYNC,
    PROP_IO_STREAM,
    PROP_JOURNAL,
+   PROP_MAX_BSON_SIZE,
+   PROP_MAX_MESSAGE_SIZE,
+   PROP_PENDING_HIGH_WATERMARK,
+   PROP_PENDING_LOW_WATERMARK,
+   PROP_REQUEST_TIMEOUT,
    PROP_SAFE,
+   PROP_SEND_HIGH_WATERMARK,
+   PROP_SEND_LOW_WATERMARK,
+   PROP_WRITE_BATCH_SIZE,
    PROP_WRITE_QUORUM,
    PROP_WRITE_TIMEOUT,
    LAST_PROP
@@ -72,50 +137,172 @@ enum
 static GParamSpec *gParamSpecs[LAST_PROP];
 static guint       gSignals[LAST_SIGNAL];
 
+/*
+ * Documents at least this large are referenced by the frame instead of
+ * being copied into it. Smaller documents are cheaper to copy than to
+ * send as their own vector.
+ */
+#define INLINE_BSON_MAX  1024
+
+/*
+ * Maximum number of vectors handed to a single g_socket_send_message().
+ */
+#define MAX_SEND_VECTORS 64
+
+/*
+ * Size limits assumed until the server reports its own in ismaster.
+ */
+#define DEFAULT_MAX_BSON_SIZE    (16 * 1024 * 1024)
+#define DEFAULT_MAX_MESSAGE_SIZE 48000000
+
+/*
+ * Collects the getlasterror replies of an insert that was split into
+ * several messages so that the caller sees a single completion.
+ */
+typedef struct
+{
+   guint              n_parts;
+   GError            *error;
+   MongoMessageReply *reply;
+} InsertSplit;
+
+/*
+ * The time by which a reply to @request_id must arrive when
+ * "request-timeout" is set. Deadlines are kept sorted so that a single
+ * timer for the earliest one covers every outstanding request.
+ */
+typedef struct
+{
+   gint64 expires;
+   gint32 request_id;
+} Deadline;
+
+/*
+ * Bounds of the pending request ring. It doubles as needed up to
+ * PENDING_MAX_SPAN slots and halves again once mostly empty.
+ */
+#define PENDING_MIN_SIZE 64
+#define PENDING_MAX_SPAN 4096
+
+/*
+ * Size of the chunks replies are read from the socket in.
+ */
+#define READ_BUFFER_SIZE (64 * 1024)
+
+/*
+ * A Frame is a wire protocol message as a list of buffers. Small fields
+ * are packed into owned buffers while large documents are referenced in
+ * place, so that the document data is never copied on its way to the
+ * socket.
+ */
+typedef struct
+{
+   GByteArray *header;
+   GByteArray *buffer;
+   GQueue      segments;
+   gsize       length;
+} Frame;
+
+static void
+mongo_protocol_append_data (Frame        *frame,
+                            const guint8 *data,
+                            gsize         length)
+{
+   if (!frame->buffer) {
+      frame->buffer = g_byte_array_new();
+   }
+   g_byte_array_append(frame->buffer, data, length);
+   frame->length += length;
+}
+
+static void
+mongo_protocol_flush_buffer (Frame *frame)
+{
+   ENTRY;
+
+   /*
+    * The header buffer is held back until the message length is known.
+    */
+   if (frame->buffer && (frame->buffer != frame->header)) {
+      g_queue_push_tail(&frame->segments,
+                        g_byte_array_free_to_bytes(frame->buffer));
+   }
+
+   frame->buffer = NULL;
+
+   EXIT;
+}
+
 static void
-mongo_protocol_append_bson (GByteArray      *array,
+mongo_protocol_append_bson (Frame           *frame,
                             const MongoBson *bson)
 {
+   GBytes *bytes;
+
    ENTRY;
-   g_byte_array_append(array, bson->data, bson->len);
+
+   if (bson->len < INLINE_BSON_MAX) {
+      mongo_protocol_append_data(frame, bson->data, bson->len);
+      EXIT;
+   }
+
+   mongo_protocol_flush_buffer(frame);
+
+   /*
+    * The caller may still modify @bson once this returns, so its memory
+    * is frozen rather than referenced as is.
+    */
+   bytes = _mongo_bson_share((MongoBson *)bson);
+   g_queue_push_tail(&frame->segments, bytes);
+   frame->length += bson->len;
+
    EXIT;
 }
 
 static void
-mongo_protocol_append_cstring (GByteArray  *array,
+mongo_protocol_append_cstring (Frame       *frame,
                                const gchar *value)
 {
    ENTRY;
-   g_byte_array_append(array, (guint8 *)value, strlen(value) + 1);
+   mongo_protocol_append_data(frame, (guint8 *)value, strlen(value) + 1);
    EXIT;
 }
 
 static void
-mongo_protocol_append_int32 (GByteArray *array,
-                             gint32      value)
+mongo_protocol_append_int32 (Frame  *frame,
+                             gint32  value)
 {
    ENTRY;
-   g_byte_array_append(array, (guint8 *)&value, sizeof value);
+   mongo_protocol_append_data(frame, (guint8 *)&value, sizeof value);
    EXIT;
 }
 
 static void
-mongo_protocol_append_int64 (GByteArray *array,
-                            gint64      value)
+mongo_protocol_append_int64 (Frame  *frame,
+                             gint64  value)
 {
    ENTRY;
-   g_byte_array_append(array, (guint8 *)&value, sizeof value);
+   mongo_protocol_append_data(frame, (guint8 *)&value, sizeof value);
    EXIT;
 }
 
 static void
-mongo_protocol_overwrite_int32 (GByteArray *array,
-                                guint       offset,
-                                gint32      value)
+mongo_protocol_frame_init (Frame          *frame,
+                           gint32          request_id,
+                           MongoOperation  operation)
 {
    ENTRY;
-   g_assert_cmpint(offset, <, array->len);
-   memcpy(array->data + offset, &value, sizeof value);
+
+   frame->header = g_byte_array_new();
+   frame->buffer = frame->header;
+   frame->length = 0;
+   g_queue_init(&frame->segments);
+
+   mongo_protocol_append_int32(frame, 0);
+   mongo_protocol_append_int32(frame, GINT32_TO_LE(request_id));
+   mongo_protocol_append_int32(frame, 0);
+   mongo_protocol_append_int32(frame, GINT32_TO_LE(operation));
+
    EXIT;
 }
 
@@ -135,15 +322,473 @@ mongo_protocol_next_request_id (MongoProtocol *protocol)
    return ++priv->last_request_id;
 }
 
+/*
+ * Sets the request id the next request follows. Used by the tests to
+ * exercise request ids wrapping around.
+ */
+void
+_mongo_protocol_set_last_request_id (MongoProtocol *protocol,
+                                     guint32        last_request_id)
+{
+   g_return_if_fail(MONGO_IS_PROTOCOL(protocol));
+   g_return_if_fail(last_request_id <= G_MAXINT32);
+
+   protocol->priv->last_request_id = last_request_id;
+}
+
+/*
+ * Updates the "congested" property from the number of pending requests
+ * and the number of bytes waiting to be written. Congestion starts when
+ * either reaches its high watermark and ends once both are back at or
+ * below their low watermarks, at which point waiters are released.
+ */
+static void
+mongo_protocol_check_congested (MongoProtocol *protocol)
+{
+   MongoProtocolPrivate *priv;
+   GSimpleAsyncResult *simple;
+   guint n_pending;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   n_pending = mongo_protocol_get_n_pending(protocol);
+
+   if (!priv->congested) {
+      if ((priv->send_high_watermark &&
+           (priv->send_queued >= priv->send_high_watermark)) ||
+          (priv->pending_high_watermark &&
+           (n_pending >= priv->pending_high_watermark))) {
+         priv->congested = TRUE;
+         g_object_notify_by_pspec(G_OBJECT(protocol),
+                                  gParamSpecs[PROP_CONGESTED]);
+      }
+      EXIT;
+   }
+
+   if ((!priv->send_high_watermark ||
+        (priv->send_queued <= priv->send_low_watermark)) &&
+       (!priv->pending_high_watermark ||
+        (n_pending <= priv->pending_low_watermark))) {
+      priv->congested = FALSE;
+      while ((simple = g_queue_pop_head(&priv->waiters))) {
+         g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+         mongo_simple_async_result_complete_in_idle(simple);
+         g_object_unref(simple);
+      }
+      g_object_notify_by_pspec(G_OBJECT(protocol),
+                               gParamSpecs[PROP_CONGESTED]);
+   }
+
+   EXIT;
+}
+
+static gint
+mongo_protocol_deadline_compare (gconstpointer a,
+                                 gconstpointer b,
+                                 gpointer      user_data)
+{
+   const Deadline *deadline_a = a;
+   const Deadline *deadline_b = b;
+
+   if (deadline_a->expires < deadline_b->expires) {
+      return -1;
+   } else if (deadline_a->expires > deadline_b->expires) {
+      return 1;
+   }
+
+   return 0;
+}
+
+static void
+mongo_protocol_deadline_free (gpointer data)
+{
+   g_slice_free(Deadline, data);
+}
+
+static gboolean mongo_protocol_timeout_dispatch (gpointer data);
+
+/*
+ * Makes sure the timer fires no later than the earliest deadline. A timer
+ * armed for a request that has since been answered is left alone; it
+ * simply finds nothing expired and is rearmed for the next deadline.
+ */
+static void
+mongo_protocol_schedule_timeout (MongoProtocol *protocol)
+{
+   MongoProtocolPrivate *priv;
+   GSequenceIter *iter;
+   Deadline *deadline;
+   gint64 msec;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   iter = g_sequence_get_begin_iter(priv->deadlines);
+   if (g_sequence_iter_is_end(iter)) {
+      return;
+   }
+
+   deadline = g_sequence_get(iter);
+
+   if (priv->timeout_source) {
+      if (priv->timeout_expires <= deadline->expires) {
+         return;
+      }
+      g_source_destroy(priv->timeout_source);
+   }
+
+   msec = (deadline->expires - g_get_monotonic_time() + 999) / 1000;
+   msec = CLAMP(msec, 0, G_MAXUINT);
+
+   priv->timeout_expires = deadline->expires;
+   priv->timeout_source = g_timeout_source_new((guint)msec);
+   g_source_set_callback(priv->timeout_source,
+                         mongo_protocol_timeout_dispatch,
+                         g_object_ref(protocol),
+                         g_object_unref);
+   g_source_set_name(priv->timeout_source, "MongoProtocolTimeout");
+   g_source_attach(priv->timeout_source, g_main_context_get_thread_default());
+   g_source_unref(priv->timeout_source);
+}
+
+/*
+ * Returns the offset of @request_id from the oldest pending request id,
+ * accounting for request ids wrapping from %G_MAXINT32 back to 1.
+ */
+static guint
+mongo_protocol_pending_offset (MongoProtocolPrivate *priv,
+                               gint32                request_id)
+{
+   if (request_id >= priv->pending_first_id) {
+      return request_id - priv->pending_first_id;
+   }
+   return (G_MAXINT32 - priv->pending_first_id) + request_id;
+}
+
+/*
+ * Moves the pending requests into a ring of @size slots.
+ */
+static void
+mongo_protocol_pending_resize (MongoProtocolPrivate *priv,
+                               guint                 size)
+{
+   Pending *pending;
+   guint i;
+
+   g_assert(size >= priv->pending_span);
+
+   pending = g_new0(Pending, size);
+   for (i = 0; i < priv->pending_span; i++) {
+      pending[i] = priv->pending[(priv->pending_head + i) &
+                                 (priv->pending_size - 1)];
+   }
+
+   g_free(priv->pending);
+   priv->pending = pending;
+   priv->pending_size = size;
+   priv->pending_head = 0;
+}
+
+static guint
+mongo_protocol_pending_size_for (guint span)
+{
+   guint size = PENDING_MIN_SIZE;
+
+   while (size < span) {
+      size <<= 1;
+   }
+
+   return size;
+}
+
+/*
+ * Drops the slots of requests that are no longer pending from the head
+ * so that the ring only spans outstanding requests, and shrinks the ring
+ * once it is mostly empty.
+ */
+static void
+mongo_protocol_pending_trim (MongoProtocolPrivate *priv)
+{
+   guint mask = priv->pending_size - 1;
+
+   while (priv->pending_span && !priv->pending[priv->pending_head].simple) {
+      priv->pending_head = (priv->pending_head + 1) & mask;
+      priv->pending_first_id = (priv->pending_first_id == G_MAXINT32) ?
+                               1 : priv->pending_first_id + 1;
+      priv->pending_span--;
+   }
+
+   if ((priv->pending_size > PENDING_MIN_SIZE) &&
+       (priv->pending_span < (priv->pending_size / 4))) {
+      mongo_protocol_pending_resize(
+         priv, mongo_protocol_pending_size_for(priv->pending_span * 2));
+   }
+}
+
+/*
+ * Moves the oldest request in the ring to the stragglers table.
+ */
+static void
+mongo_protocol_pending_evict (MongoProtocolPrivate *priv)
+{
+   Pending *straggler;
+   Pending *slot;
+
+   slot = &priv->pending[priv->pending_head];
+   g_assert(slot->simple);
+
+   straggler = g_slice_new(Pending);
+   *straggler = *slot;
+   g_hash_table_insert(priv->stragglers,
+                       GINT_TO_POINTER(priv->pending_first_id),
+                       straggler);
+
+   slot->simple = NULL;
+   slot->deadline = NULL;
+
+   mongo_protocol_pending_trim(priv);
+}
+
+static void
+mongo_protocol_pending_free (gpointer data)
+{
+   Pending *pending = data;
+
+   g_clear_object(&pending->simple);
+   g_slice_free(Pending, pending);
+}
+
+/*
+ * Registers @simple to be completed by the reply to @request_id, which
+ * must be newer than any request already pending. If "request-timeout"
+ * is set, a deadline is recorded for the reply.
+ * Takes ownership of @simple.
+ */
+static void
+mongo_protocol_add_request (MongoProtocol      *protocol,
+                            gint32              request_id,
+                            GSimpleAsyncResult *simple)
+{
+   MongoProtocolPrivate *priv;
+   Deadline *deadline;
+   Pending *slot;
+   guint offset;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   priv = protocol->priv;
+
+   /*
+    * Requests too far behind @request_id become stragglers, which also
+    * keeps offsets from aliasing once request ids wrap around.
+    */
+   while (priv->pending_span &&
+          (mongo_protocol_pending_offset(priv, request_id) >=
+           PENDING_MAX_SPAN)) {
+      mongo_protocol_pending_evict(priv);
+   }
+
+   if (!priv->pending_span) {
+      priv->pending_first_id = request_id;
+      priv->pending_head = 0;
+   }
+
+   offset = mongo_protocol_pending_offset(priv, request_id);
+   g_assert(offset >= priv->pending_span);
+
+   if (offset >= priv->pending_size) {
+      mongo_protocol_pending_resize(
+         priv, mongo_protocol_pending_size_for(offset + 1));
+   }
+
+   slot = &priv->pending[(priv->pending_head + offset) &
+                         (priv->pending_size - 1)];
+   slot->simple = simple;
+   slot->deadline = NULL;
+
+   priv->pending_span = offset + 1;
+   priv->pending_count++;
+
+   if (priv->request_timeout) {
+      deadline = g_slice_new(Deadline);
+      deadline->expires = g_get_monotonic_time() +
+                          (priv->request_timeout * G_GINT64_CONSTANT(1000));
+      deadline->request_id = request_id;
+      slot->deadline = g_sequence_insert_sorted(priv->deadlines, deadline,
+                                                mongo_protocol_deadline_compare,
+                                                NULL);
+      mongo_protocol_schedule_timeout(protocol);
+   }
+}
+
+/*
+ * Removes the request waiting on the reply to @request_id, along with its
+ * deadline, and returns it. The caller owns the returned reference.
+ * Returns %NULL if no such request is pending, such as for a late reply
+ * to a request that has already timed out.
+ */
+static GSimpleAsyncResult *
+mongo_protocol_steal_request (MongoProtocol *protocol,
+                              gint32         request_id)
+{
+   MongoProtocolPrivate *priv;
+   GSimpleAsyncResult *simple;
+   Pending *slot;
+   guint offset;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   if (!priv->pending_count) {
+      return NULL;
+   }
+
+   offset = mongo_protocol_pending_offset(priv, request_id);
+   if (offset < priv->pending_span) {
+      slot = &priv->pending[(priv->pending_head + offset) &
+                            (priv->pending_size - 1)];
+   } else if (!(slot = g_hash_table_lookup(priv->stragglers,
+                                           GINT_TO_POINTER(request_id)))) {
+      return NULL;
+   }
+
+   if (!(simple = slot->simple)) {
+      return NULL;
+   }
+
+   if (slot->deadline) {
+      g_sequence_remove(slot->deadline);
+   }
+
+   slot->simple = NULL;
+   slot->deadline = NULL;
+   priv->pending_count--;
+
+   if (offset < priv->pending_span) {
+      mongo_protocol_pending_trim(priv);
+   } else {
+      g_hash_table_remove(priv->stragglers, GINT_TO_POINTER(request_id));
+   }
+
+   return simple;
+}
+
+/*
+ * Fails every request whose reply did not arrive by its deadline. If
+ * "close-on-timeout" is set the whole protocol is failed instead, since
+ * replies to the requests behind a stuck one are unlikely to arrive.
+ */
+static gboolean
+mongo_protocol_timeout_dispatch (gpointer data)
+{
+   MongoProtocolPrivate *priv;
+   GSimpleAsyncResult *simple;
+   MongoProtocol *protocol = data;
+   GSequenceIter *iter;
+   Deadline *deadline;
+   GError *error = NULL;
+   gint64 now;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+   priv->timeout_source = NULL;
+
+   now = g_get_monotonic_time();
+
+   while (!g_sequence_iter_is_end(
+             (iter = g_sequence_get_begin_iter(priv->deadlines)))) {
+      deadline = g_sequence_get(iter);
+      if (deadline->expires > now) {
+         break;
+      }
+
+      if (!error) {
+         error = g_error_new(MONGO_PROTOCOL_ERROR,
+                             MONGO_PROTOCOL_ERROR_TIMEOUT,
+                             _("No reply was received within %u milliseconds."),
+                             priv->request_timeout);
+         if (priv->close_on_timeout) {
+            mongo_protocol_fail(protocol, error);
+            g_error_free(error);
+            RETURN(FALSE);
+         }
+      }
+
+      simple = mongo_protocol_steal_request(protocol, deadline->request_id);
+      g_simple_async_result_set_from_error(simple, error);
+      mongo_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+   }
+
+   if (error) {
+      g_error_free(error);
+      mongo_protocol_check_congested(protocol);
+   }
+
+   mongo_protocol_schedule_timeout(protocol);
+
+   RETURN(FALSE);
+}
+
+static void
+mongo_protocol_clear_send_queue (MongoProtocol *protocol)
+{
+   MongoProtocolPrivate *priv;
+   GBytes *in_flight = NULL;
+   GBytes *bytes;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   /*
+    * If there is a write in flight, the buffer at the head of the queue is
+    * still referenced by the output stream. Keep it until the write
+    * completes and mongo_protocol_send_cb() drops it.
+    */
+   if (priv->sending) {
+      in_flight = g_queue_pop_head(priv->send_queue);
+   }
+
+   while ((bytes = g_queue_pop_head(priv->send_queue))) {
+      g_bytes_unref(bytes);
+   }
+
+   if (in_flight) {
+      g_queue_push_head(priv->send_queue, in_flight);
+      priv->send_queued = g_bytes_get_size(in_flight) - priv->send_offset;
+   } else {
+      priv->send_offset = 0;
+      priv->send_queued = 0;
+   }
+
+   mongo_protocol_check_congested(protocol);
+
+   EXIT;
+}
+
 void
 mongo_protocol_fail (MongoProtocol *protocol,
                      const GError  *error)
 {
    MongoProtocolPrivate *priv;
    GHashTableIter iter;
-   gpointer key;
    gpointer value;
+   Pending *slot;
    GError *local_error;
+   guint i;
 
    ENTRY;
 
@@ -151,6 +796,11 @@ mongo_protocol_fail (MongoProtocol *protocol,
 
    priv = protocol->priv;
 
+   /*
+    * Handlers of ::failed may drop the last reference to @protocol.
+    */
+   g_object_ref(protocol);
+
    if (error) {
       local_error = g_error_copy(error);
       g_warning("%s(): %s", G_STRFUNC, error->message);
@@ -160,13 +810,63 @@ mongo_protocol_fail (MongoProtocol *protocol,
                                 _("An unexpected failure occurred."));
    }
 
-   g_hash_table_iter_init(&iter, priv->requests);
-   while (g_hash_table_iter_next(&iter, &key, &value)) {
+   g_hash_table_iter_init(&iter, priv->stragglers);
+   while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      slot = value;
+      g_simple_async_result_set_from_error(slot->simple, local_error);
+      mongo_simple_async_result_complete_in_idle(slot->simple);
+   }
+   g_hash_table_remove_all(priv->stragglers);
+
+   for (i = 0; i < priv->pending_span; i++) {
+      slot = &priv->pending[(priv->pending_head + i) &
+                            (priv->pending_size - 1)];
+      if (slot->simple) {
+         g_simple_async_result_set_from_error(slot->simple, local_error);
+         mongo_simple_async_result_complete_in_idle(slot->simple);
+         g_object_unref(slot->simple);
+         slot->simple = NULL;
+         slot->deadline = NULL;
+      }
+   }
+
+   priv->pending_count = 0;
+   priv->pending_span = 0;
+
+   g_sequence_remove_range(g_sequence_get_begin_iter(priv->deadlines),
+                           g_sequence_get_end_iter(priv->deadlines));
+
+   if (priv->timeout_source) {
+      g_source_destroy(priv->timeout_source);
+      priv->timeout_source = NULL;
+   }
+
+   if (priv->write_batch_source) {
+      g_source_destroy(priv->write_batch_source);
+      priv->write_batch_source = NULL;
+   }
+
+   while ((value = g_queue_pop_head(&priv->waiters))) {
       g_simple_async_result_set_from_error(value, local_error);
       mongo_simple_async_result_complete_in_idle(value);
+      g_object_unref(value);
    }
 
-   g_hash_table_remove_all(priv->requests);
+   if (priv->write_batch) {
+      for (i = 0; i < priv->write_batch->len; i++) {
+         value = g_ptr_array_index(priv->write_batch, i);
+         g_simple_async_result_set_from_error(value, local_error);
+         mongo_simple_async_result_complete_in_idle(value);
+      }
+      g_ptr_array_unref(priv->write_batch);
+      priv->write_batch = NULL;
+   }
+
+   /*
+    * Nobody is waiting on the queued messages anymore, so there is no
+    * reason to try to deliver them.
+    */
+   mongo_protocol_clear_send_queue(protocol);
 
    g_signal_emit(protocol, gSignals[FAILED], 0, local_error);
 
@@ -176,90 +876,348 @@ mongo_protocol_fail (MongoProtocol *protocol,
       g_io_stream_close(priv->io_stream, NULL, NULL);
    }
 
+   g_object_unref(protocol);
+
    EXIT;
 }
 
+static void mongo_protocol_flush_write_batch (MongoProtocol *protocol);
+
+/**
+ * mongo_protocol_flush_sync:
+ * @protocol: (in): A #MongoProtocol.
+ *
+ * Synchronously writes any messages that are queued but have not yet
+ * been handed to the underlying stream. This blocks the caller, and is
+ * only useful when the main loop will not be iterated again (such as
+ * during shutdown). Any pending write batch is acknowledged first. If an
+ * asynchronous write is already in flight, the remaining messages will be
+ * delivered when it completes.
+ */
 void
 mongo_protocol_flush_sync (MongoProtocol *protocol)
 {
+   MongoProtocolPrivate *priv;
+   const guint8 *data;
+   GError *error = NULL;
+   GBytes *bytes;
+   gsize n_written;
+   gsize len;
+
    ENTRY;
 
    g_return_if_fail(MONGO_IS_PROTOCOL(protocol));
 
-   if (!g_output_stream_has_pending(protocol->priv->output_stream)) {
-      g_output_stream_flush(protocol->priv->output_stream, NULL, NULL);
+   priv = protocol->priv;
+
+   mongo_protocol_flush_write_batch(protocol);
+
+   if (priv->sending || !priv->output_stream) {
+      EXIT;
+   }
+
+   if (priv->send_source) {
+      g_source_destroy(priv->send_source);
+      priv->send_source = NULL;
    }
 
+   while ((bytes = g_queue_peek_head(priv->send_queue))) {
+      data = g_bytes_get_data(bytes, &len);
+      if (!g_output_stream_write_all(priv->output_stream,
+                                     data + priv->send_offset,
+                                     len - priv->send_offset,
+                                     &n_written,
+                                     NULL,
+                                     &error)) {
+         mongo_protocol_fail(protocol, error);
+         g_error_free(error);
+         EXIT;
+      }
+      g_bytes_unref(g_queue_pop_head(priv->send_queue));
+      priv->send_offset = 0;
+   }
+
+   priv->send_queued = 0;
+   mongo_protocol_check_congested(protocol);
+
    EXIT;
 }
 
 static void
-mongo_protocol_write (MongoProtocol      *protocol,
-                      guint32             request_id,
-                      GSimpleAsyncResult *simple,
-                      const guint8       *buffer,
-                      gsize               buffer_len)
+mongo_protocol_advance (MongoProtocol *protocol,
+                        gsize          n_written)
 {
    MongoProtocolPrivate *priv;
+   GBytes *bytes;
+   gsize remaining;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   g_assert_cmpint(n_written, <=, priv->send_queued);
+   priv->send_queued -= n_written;
+
+   while (n_written) {
+      bytes = g_queue_peek_head(priv->send_queue);
+      g_assert(bytes);
+
+      remaining = g_bytes_get_size(bytes) - priv->send_offset;
+      if (n_written < remaining) {
+         priv->send_offset += n_written;
+         break;
+      }
+
+      g_bytes_unref(g_queue_pop_head(priv->send_queue));
+      priv->send_offset = 0;
+      n_written -= remaining;
+   }
+
+   mongo_protocol_check_congested(protocol);
+
+   EXIT;
+}
+
+static gboolean
+mongo_protocol_socket_send (GSocket      *socket,
+                            GIOCondition  condition,
+                            gpointer      user_data)
+{
+   MongoProtocolPrivate *priv;
+   GOutputVector vectors[MAX_SEND_VECTORS];
+   MongoProtocol *protocol = user_data;
+   const guint8 *data;
    GError *error = NULL;
-   gsize n_written = 0;
+   gssize n_written;
+   gsize offset;
+   GList *iter;
+   guint n_vectors = 0;
 
    ENTRY;
 
+   g_assert(G_IS_SOCKET(socket));
    g_assert(MONGO_IS_PROTOCOL(protocol));
-   g_assert(request_id);
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
-   g_assert(buffer);
-   g_assert(buffer_len);
 
    priv = protocol->priv;
 
-   DUMP_BYTES(buffer, buffer, buffer_len);
+   if (g_cancellable_is_cancelled(priv->shutdown) ||
+       g_queue_is_empty(priv->send_queue)) {
+      priv->send_source = NULL;
+      RETURN(FALSE);
+   }
+
+   /*
+    * Gather as many queued buffers as we can into a single sendmsg().
+    */
+   offset = priv->send_offset;
+   for (iter = priv->send_queue->head;
+        iter && (n_vectors < G_N_ELEMENTS(vectors));
+        iter = iter->next) {
+      data = g_bytes_get_data(iter->data, NULL);
+      vectors[n_vectors].buffer = data + offset;
+      vectors[n_vectors].size = g_bytes_get_size(iter->data) - offset;
+      offset = 0;
+      n_vectors++;
+   }
+
+   n_written = g_socket_send_message(socket, NULL, vectors, n_vectors,
+                                     NULL, 0, 0, NULL, &error);
 
-   if (!g_output_stream_write_all(priv->output_stream,
-                                  buffer,
-                                  buffer_len,
-                                  &n_written,
-                                  NULL, &error)) {
+   if (n_written < 0) {
+      if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+         g_error_free(error);
+         RETURN(TRUE);
+      }
+      priv->send_source = NULL;
       mongo_protocol_fail(protocol, error);
-      g_simple_async_result_take_error(simple, error);
-      mongo_simple_async_result_complete_in_idle(simple);
-      g_object_unref(simple);
+      g_error_free(error);
+      RETURN(FALSE);
+   }
+
+   mongo_protocol_advance(protocol, n_written);
+
+   if (g_queue_is_empty(priv->send_queue)) {
+      priv->send_source = NULL;
+      RETURN(FALSE);
+   }
+
+   RETURN(TRUE);
+}
+
+static void mongo_protocol_send_next (MongoProtocol *protocol);
+
+static void
+mongo_protocol_send_cb (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+   MongoProtocolPrivate *priv;
+   GOutputStream *output_stream = (GOutputStream *)object;
+   MongoProtocol *protocol = user_data;
+   GError *error = NULL;
+   gssize n_written;
+
+   ENTRY;
+
+   g_assert(G_IS_OUTPUT_STREAM(output_stream));
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+   priv->sending = FALSE;
+
+   n_written = g_output_stream_write_finish(output_stream, result, &error);
+
+   if (n_written < 0) {
+      if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+         mongo_protocol_fail(protocol, error);
+      }
+      mongo_protocol_clear_send_queue(protocol);
+      g_error_free(error);
+      g_object_unref(protocol);
+      EXIT;
+   }
+
+   /*
+    * Short writes are normal when the kernel send buffer is full. Just
+    * continue from where we left off when the stream is writable again.
+    */
+   mongo_protocol_advance(protocol, n_written);
+   mongo_protocol_send_next(protocol);
+   g_object_unref(protocol);
+
+   EXIT;
+}
+
+static void
+mongo_protocol_send_next (MongoProtocol *protocol)
+{
+   MongoProtocolPrivate *priv;
+   const guint8 *data;
+   GBytes *bytes;
+   gsize len;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   if (priv->sending || priv->send_source || !priv->output_stream) {
+      EXIT;
+   }
+
+   if (!(bytes = g_queue_peek_head(priv->send_queue))) {
+      EXIT;
+   }
+
+   /*
+    * If we are talking directly to a socket, we can write all of the
+    * queued buffers with a single vectored send whenever the socket
+    * becomes writable.
+    */
+   if (priv->socket) {
+      priv->send_source = g_socket_create_source(priv->socket,
+                                                 G_IO_OUT,
+                                                 priv->shutdown);
+      g_source_set_callback(priv->send_source,
+                            (GSourceFunc)mongo_protocol_socket_send,
+                            g_object_ref(protocol),
+                            g_object_unref);
+      g_source_set_name(priv->send_source, "MongoProtocol");
+      g_source_attach(priv->send_source,
+                      g_main_context_get_thread_default());
+      g_source_unref(priv->send_source);
       EXIT;
    }
 
-   mongo_protocol_flush_sync(protocol);
+   data = g_bytes_get_data(bytes, &len);
+   g_assert_cmpint(priv->send_offset, <, len);
+
+   priv->sending = TRUE;
+
+   g_output_stream_write_async(priv->output_stream,
+                               data + priv->send_offset,
+                               len - priv->send_offset,
+                               G_PRIORITY_DEFAULT,
+                               priv->shutdown,
+                               mongo_protocol_send_cb,
+                               g_object_ref(protocol));
+
+   EXIT;
+}
+
+/*
+ * Completes @frame and queues its buffers to be written to the underlying
+ * stream. This never blocks; the buffers are written asynchronously from
+ * the main loop in the order they were queued. Write failures are
+ * reported to every pending request through mongo_protocol_fail().
+ */
+static void
+mongo_protocol_write (MongoProtocol *protocol,
+                      Frame         *frame)
+{
+   MongoProtocolPrivate *priv;
+   GBytes *bytes;
+   gint32 length;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(frame);
+   g_assert(frame->header);
+
+   priv = protocol->priv;
+
+   mongo_protocol_flush_buffer(frame);
+
+   length = GINT32_TO_LE(frame->length);
+   memcpy(frame->header->data, &length, sizeof length);
+
+   DUMP_BYTES(header, frame->header->data, frame->header->len);
+
+   g_queue_push_tail(priv->send_queue,
+                     g_byte_array_free_to_bytes(frame->header));
+   frame->header = NULL;
+
+   while ((bytes = g_queue_pop_head(&frame->segments))) {
+      g_queue_push_tail(priv->send_queue, bytes);
+   }
+
+   priv->send_queued += frame->length;
+
+   mongo_protocol_send_next(protocol);
+   mongo_protocol_check_congested(protocol);
 
    EXIT;
 }
 
+/*
+ * Sends a getlasterror command for the most recent write(s) to
+ * @db_and_collection and registers @simple to be completed by its reply.
+ * Takes ownership of @simple.
+ */
 static void
-mongo_protocol_append_getlasterror (MongoProtocol *protocol,
-                                    GByteArray    *array,
-                                    const gchar   *db_and_collection)
+mongo_protocol_send_getlasterror (MongoProtocol      *protocol,
+                                  const gchar        *db_and_collection,
+                                  GSimpleAsyncResult *simple)
 {
    MongoProtocolPrivate *priv;
    MongoBson *bson;
    guint32 request_id;
    gchar **split;
    gchar *db_cmd;
-   guint offset;
+   Frame frame;
 
    ENTRY;
 
    g_assert(MONGO_IS_PROTOCOL(protocol));
-   g_assert(array);
    g_assert(db_and_collection);
-
-   /*
-    * TODO: If the user did not request safe=True, we should either make us not
-    *       call this and return success immediately or handle it here for
-    *       everything and synthesize the result here.
-    */
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
 
    priv = protocol->priv;
 
-   offset = array->len;
    request_id = mongo_protocol_next_request_id(protocol);
 
    /*
@@ -276,31 +1234,202 @@ mongo_protocol_append_getlasterror (MongoProtocol *protocol,
    if (priv->getlasterror_wtimeoutms) {
       mongo_bson_append_int(bson, "wtimeout", priv->getlasterror_wtimeoutms);
    }
-   if (priv->getlasterror_fsync) {
-      mongo_bson_append_boolean(bson, "fsync", priv->getlasterror_fsync);
+   if (priv->getlasterror_fsync) {
+      mongo_bson_append_boolean(bson, "fsync", priv->getlasterror_fsync);
+   }
+
+   split = g_strsplit(db_and_collection, ".", 2);
+   db_cmd = g_strdup_printf("%s.$cmd", split[0]);
+   g_strfreev(split);
+
+   /*
+    * Build the MONGO_OPERATION_QUERY message.
+    */
+   mongo_protocol_frame_init(&frame, request_id, MONGO_OPERATION_QUERY);
+   mongo_protocol_append_int32(&frame, GINT32_TO_LE(MONGO_QUERY_NONE));
+   mongo_protocol_append_cstring(&frame, db_cmd);
+   mongo_protocol_append_int32(&frame, 0);
+   mongo_protocol_append_int32(&frame, GINT32_TO_LE(1));
+   mongo_protocol_append_bson(&frame, bson);
+
+   /*
+    * We get our response from the getlasterror command, so register
+    * @simple under its request id.
+    */
+   mongo_protocol_add_request(protocol, request_id, simple);
+   mongo_protocol_write(protocol, &frame);
+
+   g_free(db_cmd);
+   mongo_bson_unref(bson);
+
+   EXIT;
+}
+
+/*
+ * Completes every request of a write batch with the reply (or error) of
+ * the single getlasterror that acknowledged it.
+ */
+static void
+mongo_protocol_write_batch_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   GSimpleAsyncResult *request;
+   MongoMessageReply *reply = NULL;
+   GPtrArray *batch;
+   GError *error = NULL;
+   guint i;
+
+   ENTRY;
+
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   batch = g_object_get_data(G_OBJECT(simple), "write-batch");
+   g_assert(batch);
+
+   if (!g_simple_async_result_propagate_error(simple, &error)) {
+      reply = g_simple_async_result_get_op_res_gpointer(simple);
+   }
+
+   for (i = 0; i < batch->len; i++) {
+      request = g_ptr_array_index(batch, i);
+      if (error) {
+         g_simple_async_result_set_from_error(request, error);
+      } else {
+         g_simple_async_result_set_op_res_gpointer(request,
+                                                   g_object_ref(reply),
+                                                   g_object_unref);
+      }
+      g_simple_async_result_complete(request);
+   }
+
+   g_clear_error(&error);
+
+   EXIT;
+}
+
+/*
+ * Sends the getlasterror for the pending write batch, if any. The batch
+ * is handed to a proxy result that fans the reply out to each request.
+ */
+static void
+mongo_protocol_flush_write_batch (MongoProtocol *protocol)
+{
+   MongoProtocolPrivate *priv;
+   GSimpleAsyncResult *simple;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   if (priv->write_batch_source) {
+      g_source_destroy(priv->write_batch_source);
+      priv->write_batch_source = NULL;
+   }
+
+   if (!priv->write_batch) {
+      EXIT;
+   }
+
+   simple = g_simple_async_result_new(G_OBJECT(protocol),
+                                      mongo_protocol_write_batch_cb,
+                                      NULL,
+                                      mongo_protocol_flush_write_batch);
+   g_object_set_data_full(G_OBJECT(simple), "write-batch",
+                          priv->write_batch,
+                          (GDestroyNotify)g_ptr_array_unref);
+   priv->write_batch = NULL;
+
+   mongo_protocol_send_getlasterror(protocol, priv->write_batch_db, simple);
+
+   g_free(priv->write_batch_db);
+   priv->write_batch_db = NULL;
+
+   EXIT;
+}
+
+static gboolean
+mongo_protocol_write_batch_dispatch (gpointer data)
+{
+   MongoProtocol *protocol = data;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   protocol->priv->write_batch_source = NULL;
+   mongo_protocol_flush_write_batch(protocol);
+
+   RETURN(FALSE);
+}
+
+/*
+ * Follows a write with a getlasterror command and registers @simple to
+ * be completed by its reply. If "safe" is not set, the write is not
+ * acknowledged: no command is sent and @simple completes right away with
+ * an empty reply so that the _finish() functions need no special case.
+ *
+ * If "write-batch-size" is greater than one, @simple is added to the
+ * pending write batch instead. The batch is acknowledged by a single
+ * getlasterror once it is full or the main loop goes idle.
+ *
+ * Takes ownership of @simple.
+ */
+static void
+mongo_protocol_write_getlasterror (MongoProtocol      *protocol,
+                                   const gchar        *db_and_collection,
+                                   GSimpleAsyncResult *simple)
+{
+   MongoProtocolPrivate *priv;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(db_and_collection);
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   priv = protocol->priv;
+
+   if (!priv->safe) {
+      g_simple_async_result_set_op_res_gpointer(
+            simple,
+            g_object_new(MONGO_TYPE_MESSAGE_REPLY, NULL),
+            g_object_unref);
+      mongo_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+      EXIT;
+   }
+
+   if (priv->write_batch_size <= 1) {
+      mongo_protocol_send_getlasterror(protocol, db_and_collection, simple);
+      EXIT;
    }
 
-   split = g_strsplit(db_and_collection, ".", 2);
-   db_cmd = g_strdup_printf("%s.$cmd", split[0]);
-   g_strfreev(split);
+   if (!priv->write_batch) {
+      priv->write_batch = g_ptr_array_new_with_free_func(g_object_unref);
+      priv->write_batch_db = g_strdup(db_and_collection);
+   }
 
-   /*
-    * Build the MONGO_OPERATION_QUERY message.
-    */
-   mongo_protocol_append_int32(array, 0);
-   mongo_protocol_append_int32(array, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(array, 0);
-   mongo_protocol_append_int32(array, GINT32_TO_LE(MONGO_OPERATION_QUERY));
-   mongo_protocol_append_int32(array, GINT32_TO_LE(MONGO_QUERY_NONE));
-   mongo_protocol_append_cstring(array, db_cmd);
-   mongo_protocol_append_int32(array, 0);
-   mongo_protocol_append_int32(array, 1);
-   mongo_protocol_append_bson(array, bson);
-   mongo_protocol_overwrite_int32(array, offset,
-                                  GINT32_TO_LE(array->len - offset));
+   g_ptr_array_add(priv->write_batch, simple);
+
+   if (priv->write_batch->len >= priv->write_batch_size) {
+      mongo_protocol_flush_write_batch(protocol);
+   } else if (!priv->write_batch_source) {
+      priv->write_batch_source = g_idle_source_new();
+      g_source_set_callback(priv->write_batch_source,
+                            mongo_protocol_write_batch_dispatch,
+                            g_object_ref(protocol),
+                            g_object_unref);
+      g_source_set_name(priv->write_batch_source, "MongoProtocolWriteBatch");
+      g_source_attach(priv->write_batch_source,
+                      g_main_context_get_thread_default());
+      g_source_unref(priv->write_batch_source);
+   }
 
-   g_free(db_cmd);
-   mongo_bson_unref(bson);
+   mongo_protocol_check_congested(protocol);
 
    EXIT;
 }
@@ -315,10 +1444,9 @@ mongo_protocol_update_async (MongoProtocol       *protocol,
                              GAsyncReadyCallback  callback,
                              gpointer             user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
-   GByteArray *buffer;
    guint32 request_id;
+   Frame frame;
 
    ENTRY;
 
@@ -329,41 +1457,19 @@ mongo_protocol_update_async (MongoProtocol       *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_update_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
-   buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_UPDATE));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_cstring(buffer, db_and_collection);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
-   mongo_protocol_append_bson(buffer, selector);
-   mongo_protocol_append_bson(buffer, update);
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
-   mongo_protocol_append_getlasterror(protocol, buffer, db_and_collection);
-
-   /*
-    * We get our response from the getlasterror command, so use it's request
-    * id as the key in the hashtable.
-    */
-   g_hash_table_insert(priv->requests,
-                       GINT_TO_POINTER(request_id + 1),
-                       simple);
-
-   /*
-    * Write the bytes to the buffered stream.
-    */
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
-
-   g_byte_array_free(buffer, TRUE);
+   mongo_protocol_frame_init(&frame, request_id, MONGO_OPERATION_UPDATE);
+   mongo_protocol_append_int32(&frame, 0);
+   mongo_protocol_append_cstring(&frame, db_and_collection);
+   mongo_protocol_append_int32(&frame, GINT32_TO_LE(flags));
+   mongo_protocol_append_bson(&frame, selector);
+   mongo_protocol_append_bson(&frame, update);
+   mongo_protocol_write(protocol, &frame);
+   mongo_protocol_write_getlasterror(protocol, db_and_collection, simple);
 
    EXIT;
 }
@@ -411,6 +1517,89 @@ mongo_protocol_update_finish (MongoProtocol  *protocol,
    RETURN(!!reply);
 }
 
+static void
+mongo_protocol_insert_split_free (gpointer data)
+{
+   InsertSplit *split = data;
+
+   if (split) {
+      g_clear_error(&split->error);
+      g_clear_object(&split->reply);
+      g_slice_free(InsertSplit, split);
+   }
+}
+
+static void
+mongo_protocol_insert_part_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+   GSimpleAsyncResult *simple = user_data;
+   GSimpleAsyncResult *part = (GSimpleAsyncResult *)result;
+   MongoMessageReply *reply;
+   InsertSplit *split;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(part));
+
+   split = g_object_get_data(G_OBJECT(simple), "insert-split");
+   g_assert(split);
+   g_assert(split->n_parts);
+
+   if (g_simple_async_result_propagate_error(part, &error)) {
+      if (!split->error) {
+         split->error = error;
+      } else {
+         g_error_free(error);
+      }
+   } else if ((reply = g_simple_async_result_get_op_res_gpointer(part))) {
+      g_clear_object(&split->reply);
+      split->reply = g_object_ref(reply);
+   }
+
+   if (!--split->n_parts) {
+      if (split->error) {
+         g_simple_async_result_set_from_error(simple, split->error);
+      } else {
+         g_simple_async_result_set_op_res_gpointer(simple,
+                                                   g_object_ref(split->reply),
+                                                   g_object_unref);
+      }
+      g_simple_async_result_complete(simple);
+   }
+
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+/**
+ * mongo_protocol_insert_async:
+ * @protocol: (in): A #MongoProtocol.
+ * @db_and_collection: (in): A string containing the "db.collection".
+ * @flags: (in): A bitwise-or of #MongoInsertFlags.
+ * @documents: (array length=n_documents) (element-type MongoBson*): The
+ *    documents to insert.
+ * @n_documents: (in): The number of elements in @documents.
+ * @cancellable: (allow-none): A #GCancellable or %NULL.
+ * @callback: A #GAsyncReadyCallback.
+ * @user_data: (allow-none): User data for @callback.
+ *
+ * Asynchronously inserts @documents into @db_and_collection.
+ *
+ * If the documents do not fit within #MongoProtocol:max-message-size they
+ * are split into several messages which are pipelined, each followed by
+ * its own getlasterror. @callback is called once all of them have been
+ * acknowledged and reports the first error, if any. Since each message is
+ * applied independently, %MONGO_INSERT_CONTINUE_ON_ERROR only applies
+ * within a single message.
+ *
+ * Inserting a document larger than #MongoProtocol:max-bson-size fails
+ * with %MONGO_PROTOCOL_ERROR_TOO_LARGE without sending anything.
+ */
 void
 mongo_protocol_insert_async (MongoProtocol        *protocol,
                              const gchar          *db_and_collection,
@@ -423,8 +1612,9 @@ mongo_protocol_insert_async (MongoProtocol        *protocol,
 {
    MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
-   GByteArray *buffer;
-   guint32 request_id;
+   GSimpleAsyncResult *part;
+   InsertSplit *split = NULL;
+   Frame frame;
    guint i;
 
    ENTRY;
@@ -438,39 +1628,61 @@ mongo_protocol_insert_async (MongoProtocol        *protocol,
 
    priv = protocol->priv;
 
+   for (i = 0; i < n_documents; i++) {
+      if (documents[i]->len > priv->max_bson_size) {
+         g_simple_async_report_error_in_idle(G_OBJECT(protocol),
+                                             callback,
+                                             user_data,
+                                             MONGO_PROTOCOL_ERROR,
+                                             MONGO_PROTOCOL_ERROR_TOO_LARGE,
+                                             _("Document of %u bytes exceeds "
+                                               "the maximum of %u bytes."),
+                                             documents[i]->len,
+                                             priv->max_bson_size);
+         EXIT;
+      }
+   }
+
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_insert_async);
 
-   request_id = mongo_protocol_next_request_id(protocol);
-
-   buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_INSERT));
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
-   mongo_protocol_append_cstring(buffer, db_and_collection);
-   for (i = 0; i < n_documents; i++) {
-      mongo_protocol_append_bson(buffer, documents[i]);
-   }
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
-   mongo_protocol_append_getlasterror(protocol, buffer, db_and_collection);
+   i = 0;
+
+   while (i < n_documents) {
+      mongo_protocol_frame_init(&frame,
+                                mongo_protocol_next_request_id(protocol),
+                                MONGO_OPERATION_INSERT);
+      mongo_protocol_append_int32(&frame, GINT32_TO_LE(flags));
+      mongo_protocol_append_cstring(&frame, db_and_collection);
+      do {
+         mongo_protocol_append_bson(&frame, documents[i++]);
+      } while ((i < n_documents) &&
+               ((frame.length + documents[i]->len) <= priv->max_message_size));
+      mongo_protocol_write(protocol, &frame);
+
+      /*
+       * Everything fit in a single message, so acknowledge it directly.
+       */
+      if (!split && (i == n_documents)) {
+         mongo_protocol_write_getlasterror(protocol, db_and_collection, simple);
+         EXIT;
+      }
 
-   /*
-    * We get our response from the getlasterror command, so use it's request
-    * id as the key in the hashtable.
-    */
-   g_hash_table_insert(priv->requests,
-                       GINT_TO_POINTER(request_id + 1),
-                       simple);
+      if (!split) {
+         split = g_slice_new0(InsertSplit);
+         g_object_set_data_full(G_OBJECT(simple), "insert-split", split,
+                                mongo_protocol_insert_split_free);
+      }
 
-   /*
-    * Write the bytes to the buffered stream.
-    */
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+      split->n_parts++;
+      part = g_simple_async_result_new(G_OBJECT(protocol),
+                                       mongo_protocol_insert_part_cb,
+                                       g_object_ref(simple),
+                                       mongo_protocol_insert_async);
+      mongo_protocol_write_getlasterror(protocol, db_and_collection, part);
+   }
 
-   g_byte_array_free(buffer, TRUE);
+   g_object_unref(simple);
 
    EXIT;
 }
@@ -507,10 +1719,9 @@ mongo_protocol_query_async (MongoProtocol       *protocol,
                             GAsyncReadyCallback  callback,
                             gpointer             user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
-   GByteArray *buffer;
    guint32 request_id;
+   Frame frame;
 
    ENTRY;
 
@@ -520,33 +1731,23 @@ mongo_protocol_query_async (MongoProtocol       *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_query_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
-   buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_QUERY));
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
-   mongo_protocol_append_cstring(buffer, db_and_collection);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(skip));
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(limit));
-   mongo_protocol_append_bson(buffer, query);
+   mongo_protocol_frame_init(&frame, request_id, MONGO_OPERATION_QUERY);
+   mongo_protocol_append_int32(&frame, GINT32_TO_LE(flags));
+   mongo_protocol_append_cstring(&frame, db_and_collection);
+   mongo_protocol_append_int32(&frame, GINT32_TO_LE(skip));
+   mongo_protocol_append_int32(&frame, GINT32_TO_LE(limit));
+   mongo_protocol_append_bson(&frame, query);
    if (field_selector) {
-      mongo_protocol_append_bson(buffer, field_selector);
+      mongo_protocol_append_bson(&frame, field_selector);
    }
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
-
-   g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
 
-   g_byte_array_free(buffer, TRUE);
+   mongo_protocol_add_request(protocol, request_id, simple);
+   mongo_protocol_write(protocol, &frame);
 
    EXIT;
 }
@@ -592,10 +1793,9 @@ mongo_protocol_getmore_async (MongoProtocol       *protocol,
                               GAsyncReadyCallback  callback,
                               gpointer             user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
-   GByteArray *buffer;
    guint32 request_id;
+   Frame frame;
 
    ENTRY;
 
@@ -604,29 +1804,19 @@ mongo_protocol_getmore_async (MongoProtocol       *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_getmore_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
-   buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_GETMORE));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_cstring(buffer, db_and_collection);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(limit));
-   mongo_protocol_append_int64(buffer, GINT64_TO_LE(cursor_id));
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
+   mongo_protocol_frame_init(&frame, request_id, MONGO_OPERATION_GETMORE);
+   mongo_protocol_append_int32(&frame, 0);
+   mongo_protocol_append_cstring(&frame, db_and_collection);
+   mongo_protocol_append_int32(&frame, GINT32_TO_LE(limit));
+   mongo_protocol_append_int64(&frame, GINT64_TO_LE(cursor_id));
 
-   g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
-
-   g_byte_array_free(buffer, TRUE);
+   mongo_protocol_add_request(protocol, request_id, simple);
+   mongo_protocol_write(protocol, &frame);
 
    EXIT;
 }
@@ -672,10 +1862,9 @@ mongo_protocol_delete_async (MongoProtocol       *protocol,
                              GAsyncReadyCallback  callback,
                              gpointer             user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
-   GByteArray *buffer;
    guint32 request_id;
+   Frame frame;
 
    ENTRY;
 
@@ -685,40 +1874,18 @@ mongo_protocol_delete_async (MongoProtocol       *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_delete_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
-   buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_DELETE));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_cstring(buffer, db_and_collection);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
-   mongo_protocol_append_bson(buffer, selector);
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
-   mongo_protocol_append_getlasterror(protocol, buffer, db_and_collection);
-
-   /*
-    * We get our response from the getlasterror command, so use it's request
-    * id as the key in the hashtable.
-    */
-   g_hash_table_insert(priv->requests,
-                       GINT_TO_POINTER(request_id + 1),
-                       simple);
-
-   /*
-    * Write the bytes to the buffered stream.
-    */
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
-
-   g_byte_array_free(buffer, TRUE);
+   mongo_protocol_frame_init(&frame, request_id, MONGO_OPERATION_DELETE);
+   mongo_protocol_append_int32(&frame, 0);
+   mongo_protocol_append_cstring(&frame, db_and_collection);
+   mongo_protocol_append_int32(&frame, GINT32_TO_LE(flags));
+   mongo_protocol_append_bson(&frame, selector);
+   mongo_protocol_write(protocol, &frame);
+   mongo_protocol_write_getlasterror(protocol, db_and_collection, simple);
 
    EXIT;
 }
@@ -751,10 +1918,9 @@ mongo_protocol_kill_cursors_async (MongoProtocol       *protocol,
                                    GAsyncReadyCallback  callback,
                                    gpointer             user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
-   GByteArray *buffer;
    guint32 request_id;
+   Frame frame;
    guint i;
 
    ENTRY;
@@ -765,30 +1931,27 @@ mongo_protocol_kill_cursors_async (MongoProtocol       *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_kill_cursors_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
-   buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_KILL_CURSORS));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, n_cursors);
+   mongo_protocol_frame_init(&frame, request_id, MONGO_OPERATION_KILL_CURSORS);
+   mongo_protocol_append_int32(&frame, 0);
+   mongo_protocol_append_int32(&frame, n_cursors);
    for (i = 0; i < n_cursors; i++) {
-      mongo_protocol_append_int64(buffer, cursors[i]);
+      mongo_protocol_append_int64(&frame, cursors[i]);
    }
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
 
-   g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_write(protocol, &frame);
 
-   g_byte_array_free(buffer, TRUE);
+   /*
+    * The server does not reply to this message, so there is nothing to
+    * wait for once it has been queued.
+    */
+   g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+   mongo_simple_async_result_complete_in_idle(simple);
+   g_object_unref(simple);
 
    EXIT;
 }
@@ -820,10 +1983,9 @@ mongo_protocol_msg_async (MongoProtocol       *protocol,
                           GAsyncReadyCallback  callback,
                           gpointer             user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
-   GByteArray *buffer;
    guint32 request_id;
+   Frame frame;
 
    ENTRY;
 
@@ -832,26 +1994,23 @@ mongo_protocol_msg_async (MongoProtocol       *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_msg_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
-   buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_MSG));
-   mongo_protocol_append_cstring(buffer, message);
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
+   mongo_protocol_frame_init(&frame, request_id, MONGO_OPERATION_MSG);
+   mongo_protocol_append_cstring(&frame, message);
 
-   g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_write(protocol, &frame);
 
-   g_byte_array_free(buffer, TRUE);
+   /*
+    * The server does not reply to this message, so there is nothing to
+    * wait for once it has been queued.
+    */
+   g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+   mongo_simple_async_result_complete_in_idle(simple);
+   g_object_unref(simple);
 
    EXIT;
 }
@@ -891,6 +2050,137 @@ mongo_protocol_get_io_stream (MongoProtocol *protocol)
    return protocol->priv->io_stream;
 }
 
+/**
+ * mongo_protocol_get_n_pending:
+ * @protocol: (in): A #MongoProtocol.
+ *
+ * Fetches the number of requests on @protocol that are still waiting for
+ * a reply from the server. This can be used to pick the least busy
+ * protocol out of a pool.
+ *
+ * Returns: The number of outstanding requests.
+ */
+guint
+mongo_protocol_get_n_pending (MongoProtocol *protocol)
+{
+   MongoProtocolPrivate *priv;
+
+   g_return_val_if_fail(MONGO_IS_PROTOCOL(protocol), 0);
+
+   priv = protocol->priv;
+
+   return (priv->pending_count +
+           (priv->write_batch ? priv->write_batch->len : 0));
+}
+
+/**
+ * mongo_protocol_get_send_queued:
+ * @protocol: (in): A #MongoProtocol.
+ *
+ * Fetches the number of bytes submitted to @protocol that have not been
+ * written to the socket yet. Unlike mongo_protocol_get_n_pending(), this
+ * includes writes that are not acknowledged by the server.
+ *
+ * Returns: The number of unsent bytes.
+ */
+gsize
+mongo_protocol_get_send_queued (MongoProtocol *protocol)
+{
+   g_return_val_if_fail(MONGO_IS_PROTOCOL(protocol), 0);
+   return protocol->priv->send_queued;
+}
+
+/**
+ * mongo_protocol_get_congested:
+ * @protocol: (in): A #MongoProtocol.
+ *
+ * Checks if @protocol has reached one of its high watermarks and has not
+ * yet drained below the low watermarks. See #MongoProtocol:congested.
+ *
+ * Returns: %TRUE if producers should hold off on new requests.
+ */
+gboolean
+mongo_protocol_get_congested (MongoProtocol *protocol)
+{
+   g_return_val_if_fail(MONGO_IS_PROTOCOL(protocol), FALSE);
+   return protocol->priv->congested;
+}
+
+/**
+ * mongo_protocol_wait_writable_async:
+ * @protocol: (in): A #MongoProtocol.
+ * @cancellable: (allow-none): A #GCancellable or %NULL.
+ * @callback: A #GAsyncReadyCallback.
+ * @user_data: (allow-none): User data for @callback.
+ *
+ * Asynchronously waits until @protocol is no longer congested. If it is
+ * not congested, @callback is called from the main loop right away.
+ * Producers can use this to throttle themselves rather than queueing
+ * requests faster than the server can handle them.
+ *
+ * @callback MUST call mongo_protocol_wait_writable_finish().
+ */
+void
+mongo_protocol_wait_writable_async (MongoProtocol       *protocol,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+   GSimpleAsyncResult *simple;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_PROTOCOL(protocol));
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
+                                      mongo_protocol_wait_writable_async);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+
+   if (!protocol->priv->congested) {
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      mongo_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+      EXIT;
+   }
+
+   g_queue_push_tail(&protocol->priv->waiters, simple);
+
+   EXIT;
+}
+
+/**
+ * mongo_protocol_wait_writable_finish:
+ * @protocol: (in): A #MongoProtocol.
+ * @result: A #GAsyncResult.
+ * @error: (out) (allow-none): A location for a #GError, or %NULL.
+ *
+ * Completes an asynchronous request to wait for @protocol to drain.
+ *
+ * Returns: %TRUE if @protocol is ready for more requests; otherwise
+ *    %FALSE and @error is set.
+ */
+gboolean
+mongo_protocol_wait_writable_finish (MongoProtocol  *protocol,
+                                     GAsyncResult   *result,
+                                     GError        **error)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(MONGO_IS_PROTOCOL(protocol), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   RETURN(ret);
+}
+
 static void
 mongo_protocol_read_message_cb (GObject      *object,
                                 GAsyncResult *result,
@@ -930,13 +2220,13 @@ mongo_protocol_read_message_cb (GObject      *object,
    g_signal_emit(protocol, gSignals[MESSAGE_READ], 0, message);
 
    response_to = mongo_message_get_response_to(message);
-   if ((request = g_hash_table_lookup(priv->requests,
-                                      GINT_TO_POINTER(response_to)))) {
+   if ((request = mongo_protocol_steal_request(protocol, response_to))) {
       g_simple_async_result_set_op_res_gpointer(request,
                                                 g_object_ref(message),
                                                 g_object_unref);
       mongo_simple_async_result_complete_in_idle(request);
-      g_hash_table_remove(priv->requests, GINT_TO_POINTER(response_to));
+      g_object_unref(request);
+      mongo_protocol_check_congested(protocol);
    }
 
    g_object_unref(message);
@@ -967,19 +2257,29 @@ mongo_protocol_set_io_stream (MongoProtocol *protocol,
 
    priv->io_stream = g_object_ref(io_stream);
 
+   /*
+    * Replies are decoded and completed in the main context @protocol is
+    * used from, which may be a private I/O thread of #MongoConnection.
+    */
    input_stream = g_io_stream_get_input_stream(io_stream);
-   priv->input_stream = mongo_input_stream_new(input_stream);
-#if 0
-   g_buffered_input_stream_set_buffer_size(
-         G_BUFFERED_INPUT_STREAM(input_stream),
-         4096);
-#endif
+   priv->input_stream = g_object_new(MONGO_TYPE_INPUT_STREAM,
+                                     "async-context", g_main_context_get_thread_default(),
+                                     "base-stream", input_stream,
+                                     "buffer-size", READ_BUFFER_SIZE,
+                                     NULL);
 
    output_stream = g_io_stream_get_output_stream(io_stream);
-   priv->output_stream = g_buffered_output_stream_new(output_stream);
-   g_buffered_output_stream_set_auto_grow(
-         G_BUFFERED_OUTPUT_STREAM(priv->output_stream),
-         TRUE);
+   priv->output_stream = g_object_ref(output_stream);
+
+   /*
+    * Plain socket connections let us bypass the output stream and gather
+    * queued buffers into a single vectored send.
+    */
+   if (G_IS_SOCKET_CONNECTION(io_stream)) {
+      priv->socket = g_socket_connection_get_socket(
+            G_SOCKET_CONNECTION(io_stream));
+      g_object_ref(priv->socket);
+   }
 
    mongo_input_stream_read_message_async(
          MONGO_INPUT_STREAM(priv->input_stream),
@@ -1010,7 +2310,8 @@ static void
 mongo_protocol_finalize (GObject *object)
 {
    MongoProtocolPrivate *priv;
-   GHashTable *hash;
+   Pending *slot;
+   guint i;
 
    ENTRY;
 
@@ -1018,14 +2319,44 @@ mongo_protocol_finalize (GObject *object)
 
    g_cancellable_cancel(priv->shutdown);
 
-   if ((hash = priv->requests)) {
-      priv->requests = NULL;
-      g_hash_table_unref(hash);
+   for (i = 0; i < priv->pending_span; i++) {
+      slot = &priv->pending[(priv->pending_head + i) &
+                            (priv->pending_size - 1)];
+      g_clear_object(&slot->simple);
+   }
+
+   g_free(priv->pending);
+   priv->pending = NULL;
+   priv->pending_count = 0;
+   priv->pending_span = 0;
+
+   if (priv->stragglers) {
+      g_hash_table_unref(priv->stragglers);
+      priv->stragglers = NULL;
+   }
+
+   if (priv->deadlines) {
+      g_sequence_free(priv->deadlines);
+      priv->deadlines = NULL;
+   }
+
+   if (priv->write_batch) {
+      g_ptr_array_unref(priv->write_batch);
+      priv->write_batch = NULL;
+   }
+
+   g_free(priv->write_batch_db);
+   priv->write_batch_db = NULL;
+
+   if (priv->send_queue) {
+      g_queue_free_full(priv->send_queue, (GDestroyNotify)g_bytes_unref);
+      priv->send_queue = NULL;
    }
 
    g_clear_object(&priv->shutdown);
    g_clear_object(&priv->input_stream);
    g_clear_object(&priv->output_stream);
+   g_clear_object(&priv->socket);
    g_clear_object(&priv->io_stream);
 
    G_OBJECT_CLASS(mongo_protocol_parent_class)->finalize(object);
@@ -1042,9 +2373,36 @@ mongo_protocol_get_property (GObject    *object,
    MongoProtocol *protocol = MONGO_PROTOCOL(object);
 
    switch (prop_id) {
+   case PROP_CLOSE_ON_TIMEOUT:
+      g_value_set_boolean(value, protocol->priv->close_on_timeout);
+      break;
+   case PROP_CONGESTED:
+      g_value_set_boolean(value, mongo_protocol_get_congested(protocol));
+      break;
    case PROP_IO_STREAM:
       g_value_set_object(value, mongo_protocol_get_io_stream(protocol));
       break;
+   case PROP_MAX_BSON_SIZE:
+      g_value_set_uint(value, protocol->priv->max_bson_size);
+      break;
+   case PROP_MAX_MESSAGE_SIZE:
+      g_value_set_uint(value, protocol->priv->max_message_size);
+      break;
+   case PROP_PENDING_HIGH_WATERMARK:
+      g_value_set_uint(value, protocol->priv->pending_high_watermark);
+      break;
+   case PROP_PENDING_LOW_WATERMARK:
+      g_value_set_uint(value, protocol->priv->pending_low_watermark);
+      break;
+   case PROP_REQUEST_TIMEOUT:
+      g_value_set_uint(value, protocol->priv->request_timeout);
+      break;
+   case PROP_SEND_HIGH_WATERMARK:
+      g_value_set_uint64(value, protocol->priv->send_high_watermark);
+      break;
+   case PROP_SEND_LOW_WATERMARK:
+      g_value_set_uint64(value, protocol->priv->send_low_watermark);
+      break;
    default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
    }
@@ -1059,15 +2417,46 @@ mongo_protocol_set_property (GObject      *object,
    MongoProtocol *protocol = MONGO_PROTOCOL(object);
 
    switch (prop_id) {
+   case PROP_CLOSE_ON_TIMEOUT:
+      protocol->priv->close_on_timeout = g_value_get_boolean(value);
+      break;
    case PROP_FSYNC:
       protocol->priv->getlasterror_fsync = g_value_get_boolean(value);
       break;
    case PROP_JOURNAL:
       protocol->priv->getlasterror_j = g_value_get_boolean(value);
       break;
+   case PROP_MAX_BSON_SIZE:
+      protocol->priv->max_bson_size = g_value_get_uint(value);
+      break;
+   case PROP_MAX_MESSAGE_SIZE:
+      protocol->priv->max_message_size = g_value_get_uint(value);
+      break;
+   case PROP_PENDING_HIGH_WATERMARK:
+      protocol->priv->pending_high_watermark = g_value_get_uint(value);
+      mongo_protocol_check_congested(protocol);
+      break;
+   case PROP_PENDING_LOW_WATERMARK:
+      protocol->priv->pending_low_watermark = g_value_get_uint(value);
+      mongo_protocol_check_congested(protocol);
+      break;
+   case PROP_REQUEST_TIMEOUT:
+      protocol->priv->request_timeout = g_value_get_uint(value);
+      break;
+   case PROP_SEND_HIGH_WATERMARK:
+      protocol->priv->send_high_watermark = g_value_get_uint64(value);
+      mongo_protocol_check_congested(protocol);
+      break;
+   case PROP_SEND_LOW_WATERMARK:
+      protocol->priv->send_low_watermark = g_value_get_uint64(value);
+      mongo_protocol_check_congested(protocol);
+      break;
    case PROP_SAFE:
       protocol->priv->safe = g_value_get_boolean(value);
       break;
+   case PROP_WRITE_BATCH_SIZE:
+      protocol->priv->write_batch_size = g_value_get_uint(value);
+      break;
    case PROP_WRITE_QUORUM:
       protocol->priv->getlasterror_w = g_value_get_int(value);
       break;
@@ -1096,6 +2485,44 @@ mongo_protocol_class_init (MongoProtocolClass *klass)
    object_class->set_property = mongo_protocol_set_property;
    g_type_class_add_private(object_class, sizeof(MongoProtocolPrivate));
 
+   /**
+    * MongoProtocol:close-on-timeout:
+    *
+    * If the connection should be closed, failing every pending request,
+    * when a request exceeds #MongoProtocol:request-timeout. Otherwise only
+    * the late request fails and any reply that arrives for it afterwards
+    * is discarded.
+    */
+   gParamSpecs[PROP_CLOSE_ON_TIMEOUT] =
+      g_param_spec_boolean("close-on-timeout",
+                           _("Close on Timeout"),
+                           _("Close the connection when a request times out."),
+                           FALSE,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_CLOSE_ON_TIMEOUT,
+                                   gParamSpecs[PROP_CLOSE_ON_TIMEOUT]);
+
+   /**
+    * MongoProtocol:congested:
+    *
+    * Set once the number of pending requests or the number of bytes
+    * waiting to be written reaches its high watermark, and cleared once
+    * both have drained to their low watermarks. Connect to
+    * "notify::congested" or use mongo_protocol_wait_writable_async() to
+    * know when to resume sending.
+    *
+    * Requests are never rejected because of congestion; it is up to the
+    * producer to hold off.
+    */
+   gParamSpecs[PROP_CONGESTED] =
+      g_param_spec_boolean("congested",
+                           _("Congested"),
+                           _("If the high watermark has been reached."),
+                           FALSE,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_CONGESTED,
+                                   gParamSpecs[PROP_CONGESTED]);
+
    gParamSpecs[PROP_FSYNC] =
       g_param_spec_boolean("fsync",
                            _("Fsync"),
@@ -1123,6 +2550,68 @@ mongo_protocol_class_init (MongoProtocolClass *klass)
    g_object_class_install_property(object_class, PROP_JOURNAL,
                                    gParamSpecs[PROP_JOURNAL]);
 
+   gParamSpecs[PROP_MAX_BSON_SIZE] =
+      g_param_spec_uint("max-bson-size",
+                        _("Max BSON Size"),
+                        _("The largest document the server accepts."),
+                        1,
+                        G_MAXUINT,
+                        DEFAULT_MAX_BSON_SIZE,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_MAX_BSON_SIZE,
+                                   gParamSpecs[PROP_MAX_BSON_SIZE]);
+
+   gParamSpecs[PROP_MAX_MESSAGE_SIZE] =
+      g_param_spec_uint("max-message-size",
+                        _("Max Message Size"),
+                        _("The largest message the server accepts."),
+                        1,
+                        G_MAXUINT,
+                        DEFAULT_MAX_MESSAGE_SIZE,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_MAX_MESSAGE_SIZE,
+                                   gParamSpecs[PROP_MAX_MESSAGE_SIZE]);
+
+   gParamSpecs[PROP_PENDING_HIGH_WATERMARK] =
+      g_param_spec_uint("pending-high-watermark",
+                        _("Pending High Watermark"),
+                        _("Pending requests at which to become congested."),
+                        0,
+                        G_MAXUINT,
+                        0,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_PENDING_HIGH_WATERMARK,
+                                   gParamSpecs[PROP_PENDING_HIGH_WATERMARK]);
+
+   gParamSpecs[PROP_PENDING_LOW_WATERMARK] =
+      g_param_spec_uint("pending-low-watermark",
+                        _("Pending Low Watermark"),
+                        _("Pending requests at which congestion ends."),
+                        0,
+                        G_MAXUINT,
+                        0,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_PENDING_LOW_WATERMARK,
+                                   gParamSpecs[PROP_PENDING_LOW_WATERMARK]);
+
+   /**
+    * MongoProtocol:request-timeout:
+    *
+    * The number of milliseconds to wait for the reply to a request before
+    * failing it with %MONGO_PROTOCOL_ERROR_TIMEOUT, or 0 to wait forever.
+    * Changes only apply to requests made afterwards.
+    */
+   gParamSpecs[PROP_REQUEST_TIMEOUT] =
+      g_param_spec_uint("request-timeout",
+                        _("Request Timeout"),
+                        _("Milliseconds to wait for a reply."),
+                        0,
+                        G_MAXUINT,
+                        0,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_REQUEST_TIMEOUT,
+                                   gParamSpecs[PROP_REQUEST_TIMEOUT]);
+
    gParamSpecs[PROP_SAFE] =
       g_param_spec_boolean("safe",
                            _("Safe"),
@@ -1132,6 +2621,49 @@ mongo_protocol_class_init (MongoProtocolClass *klass)
    g_object_class_install_property(object_class, PROP_SAFE,
                                    gParamSpecs[PROP_SAFE]);
 
+   gParamSpecs[PROP_SEND_HIGH_WATERMARK] =
+      g_param_spec_uint64("send-high-watermark",
+                          _("Send High Watermark"),
+                          _("Unsent bytes at which to become congested."),
+                          0,
+                          G_MAXSIZE,
+                          0,
+                          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_SEND_HIGH_WATERMARK,
+                                   gParamSpecs[PROP_SEND_HIGH_WATERMARK]);
+
+   gParamSpecs[PROP_SEND_LOW_WATERMARK] =
+      g_param_spec_uint64("send-low-watermark",
+                          _("Send Low Watermark"),
+                          _("Unsent bytes at which congestion ends."),
+                          0,
+                          G_MAXSIZE,
+                          0,
+                          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_SEND_LOW_WATERMARK,
+                                   gParamSpecs[PROP_SEND_LOW_WATERMARK]);
+
+   /**
+    * MongoProtocol:write-batch-size:
+    *
+    * The maximum number of safe writes acknowledged by a single
+    * getlasterror. Writes are pipelined back-to-back and the trailing
+    * getlasterror is sent once the batch is full or the main loop goes
+    * idle. Every write in the batch receives the same reply, and since
+    * getlasterror only reports on the last operation, an error for an
+    * earlier write in the batch may go unnoticed.
+    */
+   gParamSpecs[PROP_WRITE_BATCH_SIZE] =
+      g_param_spec_uint("write-batch-size",
+                        _("Write Batch Size"),
+                        _("Number of writes acknowledged per getlasterror."),
+                        1,
+                        G_MAXUINT,
+                        1,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT_ONLY);
+   g_object_class_install_property(object_class, PROP_WRITE_BATCH_SIZE,
+                                   gParamSpecs[PROP_WRITE_BATCH_SIZE]);
+
    gParamSpecs[PROP_WRITE_QUORUM] =
       g_param_spec_int("write-quorum",
                        _("Write Quorum"),
@@ -1190,11 +2722,15 @@ mongo_protocol_init (MongoProtocol *protocol)
    protocol->priv->last_request_id = g_random_int_range(0, G_MAXINT32);
    protocol->priv->getlasterror_w = 0;
    protocol->priv->getlasterror_j = TRUE;
+   protocol->priv->write_batch_size = 1;
+   protocol->priv->max_bson_size = DEFAULT_MAX_BSON_SIZE;
+   protocol->priv->max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
    protocol->priv->shutdown = g_cancellable_new();
-   protocol->priv->requests = g_hash_table_new_full(g_direct_hash,
-                                                    g_direct_equal,
-                                                    NULL,
-                                                    g_object_unref);
+   protocol->priv->send_queue = g_queue_new();
+   protocol->priv->deadlines = g_sequence_new(mongo_protocol_deadline_free);
+   protocol->priv->stragglers =
+      g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                            mongo_protocol_pending_free);
 
    EXIT;
 }
@@ -51,6 +51,8 @@ typedef struct _MongoProtocolPrivate MongoProtocolPrivate;
 enum _MongoProtocolError
 {
    MONGO_PROTOCOL_ERROR_UNEXPECTED = 1,
+   MONGO_PROTOCOL_ERROR_TOO_LARGE,
+   MONGO_PROTOCOL_ERROR_TIMEOUT,
 };
 
 struct _MongoProtocol
@@ -74,6 +76,9 @@ struct _MongoProtocolClass
 GQuark             mongo_protocol_error_quark         (void) G_GNUC_CONST;
 GType              mongo_protocol_get_type            (void) G_GNUC_CONST;
 GIOStream         *mongo_protocol_get_io_stream       (MongoProtocol        *protocol);
+gboolean           mongo_protocol_get_congested       (MongoProtocol        *protocol);
+guint              mongo_protocol_get_n_pending       (MongoProtocol        *protocol);
+gsize              mongo_protocol_get_send_queued     (MongoProtocol        *protocol);
 void               mongo_protocol_fail                (MongoProtocol        *protocol,
                                                        const GError         *error);
 void               mongo_protocol_update_async        (MongoProtocol        *protocol,
@@ -150,6 +155,13 @@ gboolean           mongo_protocol_msg_finish          (MongoProtocol        *pro
                                                        GAsyncResult         *result,
                                                        GError              **error);
 void               mongo_protocol_flush_sync          (MongoProtocol        *protocol);
+void               mongo_protocol_wait_writable_async (MongoProtocol        *protocol,
+                                                       GCancellable         *cancellable,
+                                                       GAsyncReadyCallback   callback,
+                                                       gpointer              user_data);
+gboolean           mongo_protocol_wait_writable_finish (MongoProtocol        *protocol,
+                                                        GAsyncResult         *result,
+                                                        GError              **error);
 
 G_END_DECLS
 
@@ -90,6 +90,10 @@ mongo_client_context_dispatch (MongoClientContext *client);
 static void
 mongo_client_context_fail (MongoClientContext *client);
 
+static void
+mongo_client_context_reply (MongoClientContext *client,
+                            MongoMessage       *message);
+
 static void
 mongo_server_read_header_cb (GInputStream *stream,
                              GAsyncResult *result,
@@ -101,6 +105,49 @@ mongo_server_new (void)
    return g_object_new(MONGO_TYPE_SERVER, NULL);
 }
 
+/**
+ * mongo_server_pause_message:
+ * @server: A #MongoServer.
+ * @message: A #MongoMessage being handled by @server.
+ *
+ * Holds back the reply to @message once the signal handlers have run, so
+ * that it may be completed later with mongo_server_unpause_message().
+ */
+void
+mongo_server_pause_message (MongoServer  *server,
+                            MongoMessage *message)
+{
+   g_return_if_fail(MONGO_IS_SERVER(server));
+   g_return_if_fail(MONGO_IS_MESSAGE(message));
+
+   _mongo_message_set_paused(message, TRUE);
+}
+
+/**
+ * mongo_server_unpause_message:
+ * @server: A #MongoServer.
+ * @message: A #MongoMessage paused with mongo_server_pause_message().
+ *
+ * Writes the reply to @message that was held back when it was paused.
+ * Replies may be sent in a different order than the requests arrived.
+ */
+void
+mongo_server_unpause_message (MongoServer  *server,
+                              MongoMessage *message)
+{
+   MongoClientContext *client;
+
+   g_return_if_fail(MONGO_IS_SERVER(server));
+   g_return_if_fail(MONGO_IS_MESSAGE(message));
+   g_return_if_fail(_mongo_message_get_paused(message));
+
+   _mongo_message_set_paused(message, FALSE);
+
+   if ((client = g_object_get_data(G_OBJECT(message), "client-context"))) {
+      mongo_client_context_reply(client, message);
+   }
+}
+
 static void
 mongo_server_read_msg_cb (GInputStream *stream,
                           GAsyncResult *result,
@@ -581,15 +628,12 @@ mongo_client_context_write (MongoClientContext  *client,
 static void
 mongo_client_context_dispatch (MongoClientContext *client)
 {
-   MongoMessageReply *reply;
    MongoMessage *message = NULL;
-   MongoBson *bson;
    gboolean handled;
    gboolean wants_reply = FALSE;
    guint8 *data = NULL;
    gsize data_len;
    GType type_id = G_TYPE_NONE;
-   GList list = { 0 };
 
    ENTRY;
 
@@ -667,25 +711,12 @@ mongo_client_context_dispatch (MongoClientContext *client)
     */
 
    if (wants_reply) {
-      if (!_mongo_message_get_paused(message)) {
-         if ((reply = MONGO_MESSAGE_REPLY(mongo_message_get_reply(message)))) {
-            mongo_client_context_write(client, message, MONGO_MESSAGE(reply));
-         } else {
-            reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
-                                 "cursor-id", G_GUINT64_CONSTANT(0),
-                                 "flags", MONGO_REPLY_QUERY_FAILURE,
-                                 "request-id", -1,
-                                 "response-to", client->header.request_id,
-                                 NULL);
-            bson = mongo_bson_new_empty();
-            mongo_bson_append_string(bson, "$err", "Your request is denied.");
-            mongo_bson_append_int(bson, "code", 0);
-            list.data = bson;
-            mongo_message_reply_set_documents(reply, &list);
-            mongo_client_context_write(client, message, MONGO_MESSAGE(reply));
-            mongo_bson_unref(bson);
-            g_object_unref(reply);
-         }
+      if (_mongo_message_get_paused(message)) {
+         g_object_set_data_full(G_OBJECT(message), "client-context",
+                                mongo_client_context_ref(client),
+                                (GDestroyNotify)mongo_client_context_unref);
+      } else {
+         mongo_client_context_reply(client, message);
       }
    }
 
@@ -696,6 +727,41 @@ cleanup:
    EXIT;
 }
 
+static void
+mongo_client_context_reply (MongoClientContext *client,
+                            MongoMessage       *message)
+{
+   MongoMessageReply *reply;
+   MongoBson *bson;
+   GList list = { 0 };
+
+   ENTRY;
+
+   g_assert(client);
+   g_assert(message);
+
+   if ((reply = MONGO_MESSAGE_REPLY(mongo_message_get_reply(message)))) {
+      mongo_client_context_write(client, message, MONGO_MESSAGE(reply));
+   } else {
+      reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                           "cursor-id", G_GUINT64_CONSTANT(0),
+                           "flags", MONGO_REPLY_QUERY_FAILURE,
+                           "request-id", -1,
+                           "response-to", mongo_message_get_request_id(message),
+                           NULL);
+      bson = mongo_bson_new_empty();
+      mongo_bson_append_string(bson, "$err", "Your request is denied.");
+      mongo_bson_append_int(bson, "code", 0);
+      list.data = bson;
+      mongo_message_reply_set_documents(reply, &list);
+      mongo_client_context_write(client, message, MONGO_MESSAGE(reply));
+      mongo_bson_unref(bson);
+      g_object_unref(reply);
+   }
+
+   EXIT;
+}
+
 static void
 mongo_client_context_fail (MongoClientContext *client)
 {
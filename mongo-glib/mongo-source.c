@@ -19,22 +19,24 @@
 #include "mongo-debug.h"
 #include "mongo-source.h"
 
+/*
+ * Completed results are pushed onto @head, newest first, with a
+ * compare-and-exchange so that completing from any thread never takes a
+ * lock. The main loop takes the whole list at once and completes it in
+ * the order it was pushed. Since the consumer only ever empties the list,
+ * a push can't be confused by a node being reused.
+ *
+ * @context is set for the shared source of a context other than the
+ * default, which is registered in gContextSources until it is finalized
+ * along with the context.
+ */
 struct _MongoSource
 {
    GSource source;
-   GMutex mutex;
    GSList *head;
-   GSList *tail;
+   GMainContext *context;
 };
 
-/*
- * TODO: This currently only allows for completions within the default
- *       GMainContext. This might be useful to allow completing in other
- *       contexts (create a new source for each). That would require that
- *       we allow for configuring either protocol or connection with an
- *       async context.
- */
-
 static gboolean mongo_source_prepare  (MongoSource *source,
                                        gint        *timeout_);
 static gboolean mongo_source_check    (MongoSource *source);
@@ -44,6 +46,9 @@ static gboolean mongo_source_dispatch (MongoSource *source,
 static void     mongo_source_finalize (MongoSource *source);
 
 static MongoSource  *gMongoSource;
+static GPrivate      gThreadDefault;
+static GHashTable   *gContextSources;
+G_LOCK_DEFINE_STATIC(gContextSources);
 static GSourceFuncs  gMongoSourceFuncs = {
    (gpointer)mongo_source_prepare,
    (gpointer)mongo_source_check,
@@ -61,7 +66,6 @@ mongo_source_new (void)
    msource = (MongoSource *)source;
    g_source_set_name(source, "MongoSource");
    g_source_set_priority(source, G_PRIORITY_DEFAULT);
-   g_mutex_init(&msource->mutex);
 
    return msource;
 }
@@ -73,7 +77,6 @@ mongo_source_get_source (void)
       MongoSource *tmp;
       tmp = (MongoSource *)g_source_new(&gMongoSourceFuncs,
                                         sizeof(MongoSource));
-      g_mutex_init(&tmp->mutex);
       g_source_set_name((GSource *)tmp, "MongoSource");
       g_source_attach((GSource *)tmp, g_main_context_default());
       g_once_init_leave(&gMongoSource, tmp);
@@ -82,17 +85,58 @@ mongo_source_get_source (void)
    return gMongoSource;
 }
 
+/**
+ * mongo_source_get_for_context:
+ * @context: (allow-none): A #GMainContext or %NULL for the default.
+ *
+ * Fetches the shared #MongoSource attached to @context, creating it on
+ * first use. This may be called from any thread.
+ *
+ * Returns: (transfer none): A #MongoSource.
+ */
+MongoSource *
+mongo_source_get_for_context (GMainContext *context)
+{
+   MongoSource *source;
+
+   if (!context || (context == g_main_context_default())) {
+      return mongo_source_get_source();
+   }
+
+   G_LOCK(gContextSources);
+
+   if (!gContextSources) {
+      gContextSources = g_hash_table_new(g_direct_hash, g_direct_equal);
+   }
+
+   /*
+    * The context holds the only reference, so the source is finalized
+    * and unregistered when the context is freed.
+    */
+   if (!(source = g_hash_table_lookup(gContextSources, context))) {
+      source = mongo_source_new();
+      source->context = context;
+      g_source_attach((GSource *)source, context);
+      g_source_unref((GSource *)source);
+      g_hash_table_insert(gContextSources, context, source);
+   }
+
+   G_UNLOCK(gContextSources);
+
+   return source;
+}
+
 static gboolean
 mongo_source_prepare (MongoSource *source,
                       gint        *timeout_)
 {
-   return !!source->head;
+   return !!g_atomic_pointer_get(&source->head);
 }
 
 static gboolean
 mongo_source_check (MongoSource *source)
 {
-   return !!source->head;
+   return !!g_atomic_pointer_get(&source->head);
 }
 
 static gboolean
@@ -109,13 +153,11 @@ mongo_source_dispatch (MongoSource *source,
       (*callback) (user_data);
    }
 
-   g_mutex_lock(&source->mutex);
-
-   list = source->head;
-   source->head = NULL;
-   source->tail = NULL;
+   do {
+      list = g_atomic_pointer_get(&source->head);
+   } while (!g_atomic_pointer_compare_and_exchange(&source->head, list, NULL));
 
-   g_mutex_unlock(&source->mutex);
+   list = g_slist_reverse(list);
 
    for (iter = list; iter; iter = iter->next) {
       g_simple_async_result_complete(iter->data);
@@ -134,11 +176,16 @@ mongo_source_finalize (MongoSource *source)
 
    ENTRY;
 
-   g_mutex_clear(&source->mutex);
+   if (source->context) {
+      G_LOCK(gContextSources);
+      if (g_hash_table_lookup(gContextSources, source->context) == source) {
+         g_hash_table_remove(gContextSources, source->context);
+      }
+      G_UNLOCK(gContextSources);
+   }
 
    list = source->head;
    source->head = NULL;
-   source->tail = NULL;
 
    g_slist_foreach(list, (GFunc)g_object_unref, NULL);
    g_slist_free(list);
@@ -146,32 +193,93 @@ mongo_source_finalize (MongoSource *source)
    EXIT;
 }
 
+/*
+ * Exposes the number of registered context sources to the tests.
+ */
+guint
+_mongo_source_get_n_context_sources (void)
+{
+   guint ret;
+
+   G_LOCK(gContextSources);
+   ret = gContextSources ? g_hash_table_size(gContextSources) : 0;
+   G_UNLOCK(gContextSources);
+
+   return ret;
+}
+
+/**
+ * mongo_source_set_thread_default:
+ * @source: (allow-none): A #MongoSource or %NULL.
+ *
+ * Sets the #MongoSource that mongo_simple_async_result_complete_in_idle()
+ * uses from the calling thread. A thread running its own #GMainContext
+ * should set a source attached to that context so that its results are
+ * not completed in the default main context. Pass %NULL to go back to
+ * the default.
+ *
+ * The caller must keep @source alive until it is unset.
+ */
+void
+mongo_source_set_thread_default (MongoSource *source)
+{
+   g_private_set(&gThreadDefault, source);
+}
+
+/**
+ * mongo_source_get_thread_default:
+ *
+ * Fetches the #MongoSource that mongo_simple_async_result_complete_in_idle()
+ * uses from the calling thread. Unless one was set with
+ * mongo_source_set_thread_default(), this is the shared source for the
+ * thread-default main context.
+ *
+ * Returns: (transfer none): A #MongoSource.
+ */
+MongoSource *
+mongo_source_get_thread_default (void)
+{
+   MongoSource *source;
+
+   if (!(source = g_private_get(&gThreadDefault))) {
+      source = mongo_source_get_for_context(
+            g_main_context_get_thread_default());
+   }
+
+   return source;
+}
+
+/**
+ * mongo_source_complete_in_idle:
+ * @source: A #MongoSource.
+ * @simple: A #GSimpleAsyncResult.
+ *
+ * Requests the completion of @simple from the main context @source is
+ * attached to. This may be called from any thread. The main context is
+ * only woken up for the first result queued since @source last
+ * dispatched.
+ */
 void
 mongo_source_complete_in_idle (MongoSource        *source,
                                GSimpleAsyncResult *simple)
 {
    GSList *link_;
+   GSList *head;
 
    ENTRY;
 
-   link_ = g_slist_append(NULL, g_object_ref(simple));
+   link_ = g_slist_alloc();
+   link_->data = g_object_ref(simple);
 
-   g_mutex_lock(&source->mutex);
+   do {
+      head = g_atomic_pointer_get(&source->head);
+      link_->next = head;
+   } while (!g_atomic_pointer_compare_and_exchange(&source->head, head, link_));
 
-   if (source->tail) {
-      source->tail->next = link_;
+   if (!head) {
+      g_main_context_wakeup(g_source_get_context((GSource *)source));
    }
 
-   source->tail = link_;
-
-   if (!source->head) {
-      source->head = link_;
-   }
-
-   g_mutex_unlock(&source->mutex);
-
-   g_main_context_wakeup(g_source_get_context((GSource *)source));
-
    EXIT;
 }
 
@@ -179,7 +287,8 @@ mongo_source_complete_in_idle (MongoSource        *source,
  * mongo_simple_async_result_complete_in_idle:
  * @simple: A #GSimpleAsyncResult.
  *
- * Requests the completion of a simple async result in the main loop.
+ * Requests the completion of a simple async result in the main loop
+ * of the calling thread.
  * This is preferred to g_simple_async_result_complete_in_idle() as
  * it doesn't require a new GSource to be allocated and attached like
  * g_simple_async_result_complete_in_idle() does.
@@ -187,29 +296,5 @@ mongo_source_complete_in_idle (MongoSource        *source,
 void
 mongo_simple_async_result_complete_in_idle (GSimpleAsyncResult *simple)
 {
-   MongoSource *source;
-   GSList *link_;
-
-   ENTRY;
-
-   source = mongo_source_get_source();
-   link_ = g_slist_append(NULL, g_object_ref(simple));
-
-   g_mutex_lock(&source->mutex);
-
-   if (source->tail) {
-      source->tail->next = link_;
-   }
-
-   source->tail = link_;
-
-   if (!source->head) {
-      source->head = link_;
-   }
-
-   g_mutex_unlock(&source->mutex);
-
-   g_main_context_wakeup(g_source_get_context((GSource *)source));
-
-   EXIT;
+   mongo_source_complete_in_idle(mongo_source_get_thread_default(), simple);
 }
@@ -36,9 +36,12 @@ G_BEGIN_DECLS
  */
 typedef struct _MongoSource MongoSource;
 
-MongoSource *mongo_source_new              (void);
-void         mongo_source_complete_in_idle (MongoSource        *source,
-                                            GSimpleAsyncResult *simple);
+MongoSource *mongo_source_new                 (void);
+MongoSource *mongo_source_get_for_context     (GMainContext       *context);
+void         mongo_source_complete_in_idle    (MongoSource        *source,
+                                               GSimpleAsyncResult *simple);
+MongoSource *mongo_source_get_thread_default  (void);
+void         mongo_source_set_thread_default  (MongoSource        *source);
 
 void mongo_simple_async_result_complete_in_idle (GSimpleAsyncResult *simple);
 
@@ -9,3 +9,14 @@
 #ifdef G_DISABLE_CAST_CHECKS
 #undef G_DISABLE_CAST_CHECKS
 #endif
+
+#include <glib.h>
+
+/*
+ * Mirrors the private layout in mongo-server.c so tests can inspect the
+ * clients connected to a MongoServer.
+ */
+struct _MongoServerPrivate
+{
+   GHashTable *client_contexts;
+};
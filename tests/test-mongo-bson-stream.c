@@ -0,0 +1,358 @@
+#include <string.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
+
+#include "test-helper.h"
+
+#include <mongo-glib/mongo-glib.h>
+
+#define N_DOCUMENTS 17
+
+static GPtrArray *
+load_documents (void)
+{
+   GPtrArray *documents;
+   MongoBson *bson;
+   gchar *filename;
+   gchar *name;
+   guint8 *buffer = NULL;
+   GError *error = NULL;
+   gsize length = 0;
+   guint i;
+
+   documents = g_ptr_array_new_with_free_func((GDestroyNotify)mongo_bson_unref);
+
+   for (i = 1; i <= N_DOCUMENTS; i++) {
+      name = g_strdup_printf("test%u.bson", i);
+      filename = g_build_filename(SRC_DIR, "tests", "bson", name, NULL);
+      if (!g_file_get_contents(filename, (gchar **)&buffer, &length, &error)) {
+         g_assert_no_error(error);
+         g_assert(FALSE);
+      }
+      bson = mongo_bson_new_take_data(buffer, length);
+      g_assert(bson);
+      g_ptr_array_add(documents, bson);
+      g_free(filename);
+      g_free(name);
+   }
+
+   return documents;
+}
+
+/*
+ * Writes every document into a temporary file, dropping the last
+ * @truncate bytes.
+ */
+static gchar *
+write_stream (GPtrArray *documents,
+              gsize      truncate)
+{
+   GByteArray *contents;
+   MongoBson *bson;
+   GError *error = NULL;
+   gchar *filename = NULL;
+   gint fd;
+   guint i;
+
+   fd = g_file_open_tmp("test-mongo-bson-stream-XXXXXX", &filename, &error);
+   g_assert_no_error(error);
+   close(fd);
+
+   contents = g_byte_array_new();
+   for (i = 0; i < documents->len; i++) {
+      bson = g_ptr_array_index(documents, i);
+      g_byte_array_append(contents, bson->data, bson->len);
+   }
+   g_assert_cmpint(contents->len, >, truncate);
+
+   g_file_set_contents(filename,
+                       (const gchar *)contents->data,
+                       contents->len - truncate,
+                       &error);
+   g_assert_no_error(error);
+
+   g_byte_array_unref(contents);
+
+   return filename;
+}
+
+static void
+assert_same (const MongoBson *bson,
+             const MongoBson *expected)
+{
+   g_assert(bson);
+   g_assert(expected);
+   g_assert_cmpint(bson->len, ==, expected->len);
+   g_assert(!memcmp(bson->data, expected->data, expected->len));
+}
+
+/*
+ * Reads @filename with both the read and mapped paths and checks that
+ * each yields the first @n_expected documents and nothing more.
+ */
+static void
+assert_stream (const gchar *filename,
+               GPtrArray   *documents,
+               guint        n_expected)
+{
+   MongoBsonStream *mapped;
+   MongoBsonStream *stream;
+   MongoBson *bson;
+   MongoBson *view;
+   GError *error = NULL;
+   GFile *file;
+   gboolean r;
+   guint i;
+
+   file = g_file_new_for_path(filename);
+   stream = mongo_bson_stream_new();
+   r = mongo_bson_stream_load_from_file(stream, file, NULL, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+
+   mapped = mongo_bson_stream_new();
+   r = mongo_bson_stream_load_from_mapped_file(mapped, filename, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+
+   for (i = 0; i < n_expected; i++) {
+      bson = mongo_bson_stream_next(stream);
+      view = mongo_bson_stream_next(mapped);
+      assert_same(bson, g_ptr_array_index(documents, i));
+      assert_same(view, bson);
+      mongo_bson_unref(bson);
+      mongo_bson_unref(view);
+   }
+
+   g_assert(!mongo_bson_stream_next(stream));
+   g_assert(!mongo_bson_stream_next(mapped));
+
+   g_object_unref(stream);
+   g_object_unref(mapped);
+   g_object_unref(file);
+}
+
+static void
+test_MongoBsonStream_mapped (void)
+{
+   GPtrArray *documents;
+   gchar *filename;
+
+   documents = load_documents();
+   filename = write_stream(documents, 0);
+   assert_stream(filename, documents, N_DOCUMENTS);
+
+   g_unlink(filename);
+   g_free(filename);
+   g_ptr_array_unref(documents);
+}
+
+static void
+test_MongoBsonStream_truncated (void)
+{
+   GPtrArray *documents;
+   gchar *filename;
+
+   /*
+    * Both paths must stop before the partial last document.
+    */
+   documents = load_documents();
+   filename = write_stream(documents, 3);
+   assert_stream(filename, documents, N_DOCUMENTS - 1);
+
+   g_unlink(filename);
+   g_free(filename);
+   g_ptr_array_unref(documents);
+}
+
+static gpointer
+scan_chunk_cb (GPtrArray *documents,
+               gpointer   user_data)
+{
+   GPtrArray *copies;
+   guint i;
+
+   /*
+    * The documents are only valid during the callback.
+    */
+   copies = g_ptr_array_new();
+   for (i = 0; i < documents->len; i++) {
+      g_ptr_array_add(copies,
+                      mongo_bson_dup(g_ptr_array_index(documents, i)));
+   }
+
+   return copies;
+}
+
+static void
+scan_merge_cb (gpointer result,
+               gpointer user_data)
+{
+   GPtrArray *copies = result;
+   GPtrArray *merged = user_data;
+   guint i;
+
+   for (i = 0; i < copies->len; i++) {
+      g_ptr_array_add(merged, g_ptr_array_index(copies, i));
+   }
+
+   g_ptr_array_unref(copies);
+}
+
+static GPtrArray *
+scan (const gchar *filename,
+      gboolean     ordered)
+{
+   MongoBsonStream *stream;
+   GPtrArray *merged;
+   GError *error = NULL;
+   gboolean r;
+
+   stream = mongo_bson_stream_new();
+   r = mongo_bson_stream_load_from_mapped_file(stream, filename, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+
+   /*
+    * Small chunks so that every worker gets several of them.
+    */
+   merged = g_ptr_array_new_with_free_func((GDestroyNotify)mongo_bson_unref);
+   r = mongo_bson_stream_scan_parallel(stream, 4, 64, ordered,
+                                       scan_chunk_cb, scan_merge_cb,
+                                       merged, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+
+   g_assert(!mongo_bson_stream_next(stream));
+   g_object_unref(stream);
+
+   return merged;
+}
+
+static void
+test_MongoBsonStream_scan_ordered (void)
+{
+   GPtrArray *documents;
+   GPtrArray *merged;
+   gchar *filename;
+   guint i;
+
+   documents = load_documents();
+   filename = write_stream(documents, 0);
+
+   merged = scan(filename, TRUE);
+   g_assert_cmpint(merged->len, ==, N_DOCUMENTS);
+   for (i = 0; i < N_DOCUMENTS; i++) {
+      assert_same(g_ptr_array_index(merged, i),
+                  g_ptr_array_index(documents, i));
+   }
+
+   g_ptr_array_unref(merged);
+   g_unlink(filename);
+   g_free(filename);
+   g_ptr_array_unref(documents);
+}
+
+static void
+test_MongoBsonStream_scan_unordered (void)
+{
+   GPtrArray *documents;
+   GPtrArray *merged;
+   MongoBson *expected;
+   MongoBson *bson;
+   gboolean seen[N_DOCUMENTS] = { 0 };
+   gchar *filename;
+   guint i;
+   guint j;
+
+   documents = load_documents();
+   filename = write_stream(documents, 0);
+
+   /*
+    * Chunks may be merged in any order, but every document must be
+    * seen exactly once.
+    */
+   merged = scan(filename, FALSE);
+   g_assert_cmpint(merged->len, ==, N_DOCUMENTS);
+   for (i = 0; i < merged->len; i++) {
+      bson = g_ptr_array_index(merged, i);
+      for (j = 0; j < N_DOCUMENTS; j++) {
+         expected = g_ptr_array_index(documents, j);
+         if (!seen[j] &&
+             (bson->len == expected->len) &&
+             !memcmp(bson->data, expected->data, bson->len)) {
+            seen[j] = TRUE;
+            break;
+         }
+      }
+      g_assert_cmpint(j, <, N_DOCUMENTS);
+   }
+
+   g_ptr_array_unref(merged);
+   g_unlink(filename);
+   g_free(filename);
+   g_ptr_array_unref(documents);
+}
+
+static void
+test_MongoBsonStream_scan_truncated (void)
+{
+   MongoBsonStream *stream;
+   GPtrArray *documents;
+   GPtrArray *merged;
+   GError *error = NULL;
+   gchar *filename;
+   gboolean r;
+   guint i;
+
+   documents = load_documents();
+   filename = write_stream(documents, 3);
+
+   /*
+    * The documents before the partial one are scanned, but the scan
+    * must not pass for a complete one.
+    */
+   stream = mongo_bson_stream_new();
+   r = mongo_bson_stream_load_from_mapped_file(stream, filename, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+
+   merged = g_ptr_array_new_with_free_func((GDestroyNotify)mongo_bson_unref);
+   r = mongo_bson_stream_scan_parallel(stream, 4, 64, TRUE,
+                                       scan_chunk_cb, scan_merge_cb,
+                                       merged, &error);
+   g_assert_error(error, MONGO_BSON_STREAM_ERROR,
+                  MONGO_BSON_STREAM_ERROR_CORRUPT);
+   g_assert(!r);
+   g_clear_error(&error);
+
+   g_assert_cmpint(merged->len, ==, N_DOCUMENTS - 1);
+   for (i = 0; i < merged->len; i++) {
+      assert_same(g_ptr_array_index(merged, i),
+                  g_ptr_array_index(documents, i));
+   }
+
+   g_object_unref(stream);
+   g_ptr_array_unref(merged);
+   g_unlink(filename);
+   g_free(filename);
+   g_ptr_array_unref(documents);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/MongoBsonStream/mapped", test_MongoBsonStream_mapped);
+   g_test_add_func("/MongoBsonStream/truncated",
+                   test_MongoBsonStream_truncated);
+   g_test_add_func("/MongoBsonStream/scan_ordered",
+                   test_MongoBsonStream_scan_ordered);
+   g_test_add_func("/MongoBsonStream/scan_unordered",
+                   test_MongoBsonStream_scan_unordered);
+   g_test_add_func("/MongoBsonStream/scan_truncated",
+                   test_MongoBsonStream_scan_truncated);
+   return g_test_run();
+}
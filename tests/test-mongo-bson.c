@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "test-helper.h"
 
 #include <mongo-glib/mongo-glib.h>
@@ -578,6 +580,65 @@ null_string (void)
    mongo_bson_unref(b);
 }
 
+static void
+view_notify (gpointer data)
+{
+   gboolean *notified = data;
+   *notified = TRUE;
+}
+
+static void
+view_tests (void)
+{
+   MongoBsonIter iter;
+   MongoBson *parent;
+   MongoBson *child;
+   MongoBson *view;
+   MongoBson *sub;
+   gboolean notified = FALSE;
+   guint8 *data;
+
+   child = mongo_bson_new_empty();
+   mongo_bson_append_int(child, "a", 1);
+   parent = mongo_bson_new_empty();
+   mongo_bson_append_bson(parent, "child", child);
+
+   data = g_malloc(parent->len);
+   memcpy(data, parent->data, parent->len);
+   view = mongo_bson_new_from_static_data(data, parent->len,
+                                          view_notify, &notified);
+   g_assert(view);
+   g_assert(view->data == data);
+
+   /*
+    * Sub-documents of a view point into the same buffer.
+    */
+   g_assert(mongo_bson_iter_init_find(&iter, view, "child"));
+   sub = mongo_bson_iter_get_value_bson(&iter);
+   g_assert(sub);
+   g_assert(sub->data > data && sub->data < (data + parent->len));
+   g_assert_cmpint(sub->len, ==, child->len);
+
+   /*
+    * Modifying a view copies it and leaves the buffer alone.
+    */
+   mongo_bson_append_int(view, "b", 2);
+   g_assert(view->data != data);
+   g_assert(!memcmp(data, parent->data, parent->len));
+   g_assert(mongo_bson_iter_init_find(&iter, view, "b"));
+
+   mongo_bson_unref(view);
+   g_assert(!notified);
+   g_assert(mongo_bson_iter_init_find(&iter, sub, "a"));
+   g_assert_cmpint(mongo_bson_iter_get_value_int(&iter), ==, 1);
+   mongo_bson_unref(sub);
+   g_assert(notified);
+
+   g_free(data);
+   mongo_bson_unref(parent);
+   mongo_bson_unref(child);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -588,5 +649,6 @@ main (gint   argc,
    g_test_add_func("/MongoBson/join", join);
    g_test_add_func("/MongoBson/invalid", invalid_tests);
    g_test_add_func("/MongoBson/null_string", null_string);
+   g_test_add_func("/MongoBson/view", view_tests);
    return g_test_run();
 }
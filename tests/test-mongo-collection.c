@@ -176,6 +176,79 @@ test3 (void)
    g_assert_cmpint(success, ==, TRUE);
 }
 
+static void
+test4_bulk_write_cb (GObject      *object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+   MongoCollection *col = (MongoCollection *)object;
+   gboolean *success = user_data;
+   GError *error = NULL;
+
+   *success = mongo_collection_bulk_write_finish(col, result, &error);
+   g_assert_no_error(error);
+   g_assert(*success);
+
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+test4 (void)
+{
+   MongoCollection *col;
+   MongoBulkWrite *bulk;
+   MongoDatabase *db;
+   MongoBson *bson;
+   MongoBson *update;
+   gboolean success = FALSE;
+   guint i;
+
+   gConnection = mongo_connection_new();
+
+   db = mongo_connection_get_database(gConnection, "dbtest1");
+   g_assert(db);
+
+   col = mongo_database_get_collection(db, "dbcollection1");
+   g_assert(col);
+
+   bulk = mongo_bulk_write_new(TRUE);
+
+   for (i = 0; i < 10; i++) {
+      bson = mongo_bson_new();
+      mongo_bson_append_int(bson, "i", i);
+      mongo_bulk_write_insert(bulk, bson);
+      mongo_bson_unref(bson);
+   }
+
+   bson = mongo_bson_new_empty();
+   mongo_bson_append_int(bson, "i", 0);
+   update = mongo_bson_new_empty();
+   mongo_bson_append_int(update, "i", 100);
+   mongo_bulk_write_upsert(bulk, bson, update);
+   mongo_bulk_write_delete(bulk, update, TRUE);
+   mongo_bson_unref(update);
+   mongo_bson_unref(bson);
+
+   g_assert_cmpint(mongo_bulk_write_get_n_ops(bulk), ==, 12);
+
+   mongo_collection_bulk_write_async(col, bulk, NULL,
+                                     test4_bulk_write_cb, &success);
+
+   g_main_loop_run(gMainLoop);
+
+   g_assert_cmpint(success, ==, TRUE);
+
+   for (i = 0; i < 12; i++) {
+      g_assert_cmpint(mongo_bulk_write_get_status(bulk, i),
+                      ==,
+                      MONGO_BULK_WRITE_SUCCEEDED);
+      g_assert(!mongo_bulk_write_get_error(bulk, i));
+   }
+   g_assert(mongo_bulk_write_get_reply(bulk, 10));
+
+   mongo_bulk_write_unref(bulk);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -188,6 +261,7 @@ main (gint   argc,
    g_test_add_func("/MongoCollection/count", test1);
    g_test_add_func("/MongoCollection/insert", test2);
    g_test_add_func("/MongoCollection/find_one", test3);
+   g_test_add_func("/MongoCollection/bulk_write", test4);
 
    return g_test_run();
 }
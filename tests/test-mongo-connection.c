@@ -1,8 +1,25 @@
+#include <string.h>
+
 #include "test-helper.h"
 
 #include <mongo-glib/mongo-glib.h>
+#include <mongo-glib/mongo-source.h>
 
 static GMainLoop *gMainLoop;
+static GThread   *gMainThread;
+
+extern guint         _mongo_connection_get_inbox_wakeups (MongoConnection    *connection);
+extern gboolean      _mongo_connection_is_read           (const gchar        *db_and_collection,
+                                                          MongoBson          *query);
+extern MongoManager *_mongo_connection_get_manager       (MongoConnection    *connection);
+extern gchar        *_mongo_connection_select_member     (MongoConnection    *connection,
+                                                          gboolean            with_primary);
+extern void          _mongo_connection_pin_cursor        (GSimpleAsyncResult *simple,
+                                                          MongoProtocol      *protocol,
+                                                          MongoMessageReply  *reply);
+extern const gchar  *_mongo_connection_get_cursor_host   (MongoConnection    *connection,
+                                                          guint64             cursor_id);
+extern guint         _mongo_connection_get_pool_size     (MongoConnection    *connection);
 
 static void
 test1_insert_cb (GObject      *object,
@@ -209,6 +226,1205 @@ test5 (void)
 #undef TEST_URI
 }
 
+static void
+test6_insert_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   GError *error = NULL;
+   gint *code = user_data;
+
+   g_assert(!mongo_connection_insert_finish(connection, result, &error));
+   g_assert_error(error, MONGO_CONNECTION_ERROR, *code);
+   g_error_free(error);
+
+   *code = 0;
+
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+test6 (void)
+{
+   MongoConnection *connection;
+   MongoBson *bson;
+   gint code1 = MONGO_CONNECTION_ERROR_QUEUE_TIMEOUT;
+   gint code2 = MONGO_CONNECTION_ERROR_QUEUE_FULL;
+
+   /*
+    * Nothing listens on port 1, so requests stay queued until their
+    * deadline, and only one fits in the queue.
+    */
+   connection = mongo_connection_new_from_uri("mongodb://127.0.0.1:1/"
+                                              "?maxQueueSize=1"
+                                              "&queueTimeoutMS=50");
+   bson = mongo_bson_new();
+   mongo_bson_append_int(bson, "key1", 1234);
+   mongo_connection_insert_async(connection, "dbtest1.dbcollection1",
+                                 MONGO_INSERT_NONE, &bson, 1, NULL,
+                                 test6_insert_cb, &code1);
+   mongo_connection_insert_async(connection, "dbtest1.dbcollection1",
+                                 MONGO_INSERT_NONE, &bson, 1, NULL,
+                                 test6_insert_cb, &code2);
+   mongo_bson_unref(bson);
+
+   g_main_loop_run(gMainLoop);
+   g_assert_cmpint(code2, ==, 0);
+   g_assert_cmpint(code1, !=, 0);
+
+   g_main_loop_run(gMainLoop);
+   g_assert_cmpint(code1, ==, 0);
+
+   g_object_unref(connection);
+}
+
+static void
+test7_log_handler (const gchar    *log_domain,
+                   GLogLevelFlags  log_level,
+                   const gchar    *message,
+                   gpointer        user_data)
+{
+   guint *n_timed_out = user_data;
+
+   if (strstr(message, "timed out")) {
+      (*n_timed_out)++;
+   }
+}
+
+static void
+test7 (void)
+{
+   MongoConnection *connection;
+   GSocketAddress *address;
+   GInetAddress *loopback;
+   MongoBson *bson;
+   GSocket *fillers[3];
+   GSocket *listener;
+   GError *error = NULL;
+   gchar *uri;
+   guint n_timed_out = 0;
+   guint handler;
+   guint port;
+   guint i;
+   gint code = MONGO_CONNECTION_ERROR_QUEUE_TIMEOUT;
+
+   /*
+    * A listener that never accepts and whose backlog is already full
+    * drops new connection attempts on the floor, so connecting to it
+    * only ends when connectTimeoutMS gives up.
+    */
+   loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+   address = g_inet_socket_address_new(loopback, 0);
+   listener = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+                           G_SOCKET_PROTOCOL_TCP, &error);
+   g_assert_no_error(error);
+   g_socket_set_listen_backlog(listener, 0);
+   g_socket_bind(listener, address, TRUE, &error);
+   g_assert_no_error(error);
+   g_socket_listen(listener, &error);
+   g_assert_no_error(error);
+   g_object_unref(address);
+
+   address = g_socket_get_local_address(listener, &error);
+   g_assert_no_error(error);
+   port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(address));
+
+   for (i = 0; i < G_N_ELEMENTS(fillers); i++) {
+      fillers[i] = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+                                G_SOCKET_PROTOCOL_TCP, &error);
+      g_assert_no_error(error);
+      g_socket_set_blocking(fillers[i], FALSE);
+      if (!g_socket_connect(fillers[i], address, NULL, &error)) {
+         g_assert_error(error, G_IO_ERROR, G_IO_ERROR_PENDING);
+         g_clear_error(&error);
+      }
+   }
+   g_object_unref(address);
+
+   handler = g_log_set_handler("mongo", G_LOG_LEVEL_MESSAGE,
+                               test7_log_handler, &n_timed_out);
+
+   /*
+    * The request stays queued until its deadline, by which time at
+    * least one connection attempt must have timed out.
+    */
+   uri = g_strdup_printf("mongodb://127.0.0.1:%u/"
+                         "?connectTimeoutMS=50"
+                         "&queueTimeoutMS=500", port);
+   connection = mongo_connection_new_from_uri(uri);
+   bson = mongo_bson_new();
+   mongo_connection_insert_async(connection, "dbtest1.dbcollection1",
+                                 MONGO_INSERT_NONE, &bson, 1, NULL,
+                                 test6_insert_cb, &code);
+   mongo_bson_unref(bson);
+
+   g_main_loop_run(gMainLoop);
+   g_assert_cmpint(code, ==, 0);
+   g_assert_cmpint(n_timed_out, >, 0);
+
+   g_log_remove_handler("mongo", handler);
+
+   g_object_unref(connection);
+   for (i = 0; i < G_N_ELEMENTS(fillers); i++) {
+      g_object_unref(fillers[i]);
+   }
+   g_object_unref(listener);
+   g_object_unref(loopback);
+   g_free(uri);
+}
+
+static MongoServer *
+server_new (guint *port)
+{
+   MongoServer *server;
+
+   *port = g_random_int_range(32000, 33000);
+   server = g_object_new(MONGO_TYPE_SERVER,
+                         "listen-backlog", 10,
+                         NULL);
+   g_socket_listener_add_inet_port(G_SOCKET_LISTENER(server),
+                                   *port,
+                                   NULL,
+                                   NULL);
+   g_socket_service_start(G_SOCKET_SERVICE(server));
+
+   return server;
+}
+
+static guint
+server_count_open (MongoServer *server)
+{
+   GHashTableIter iter;
+   GIOStream *key;
+   guint count = 0;
+
+   g_hash_table_iter_init(&iter, server->priv->client_contexts);
+   while (g_hash_table_iter_next(&iter, (gpointer *)&key, NULL)) {
+      if (!g_io_stream_is_closed(key)) {
+         count++;
+      }
+   }
+
+   return count;
+}
+
+static gboolean
+primary_query_cb (MongoServer        *server,
+                  MongoClientContext *client,
+                  MongoMessage       *message,
+                  gpointer            user_data)
+{
+   MongoBson *bson;
+
+   /*
+    * Every query, including the "ismaster" probe, is answered as the
+    * primary would.
+    */
+   bson = mongo_bson_new_empty();
+   mongo_bson_append_boolean(bson, "ok", TRUE);
+   mongo_bson_append_boolean(bson, "ismaster", TRUE);
+   mongo_message_set_reply_bson(message, MONGO_REPLY_NONE, bson);
+   mongo_bson_unref(bson);
+
+   return TRUE;
+}
+
+static void
+test8_query_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   MongoMessageReply *reply;
+   GError *error = NULL;
+   guint *n_completed = user_data;
+
+   reply = mongo_connection_query_finish(connection, result, &error);
+   g_assert_no_error(error);
+   g_assert(reply);
+   g_object_unref(reply);
+
+   /*
+    * The reply was read on the I/O thread, but completes in the context
+    * of the caller.
+    */
+   g_assert(g_thread_self() == gMainThread);
+   g_assert(g_main_context_is_owner(g_main_context_default()));
+
+   (*n_completed)++;
+}
+
+static void
+test8_finalized_cb (gpointer  data,
+                    GObject  *where_the_object_was)
+{
+   GThread **thread = data;
+
+   *thread = g_thread_self();
+}
+
+#define TEST8_N_QUERIES 100
+
+static void
+test8 (void)
+{
+   MongoConnection *connection;
+   MongoServer *server;
+   MongoBson *query;
+   GThread *finalized = NULL;
+   gchar *uri;
+   guint n_completed = 0;
+   guint wakeups;
+   guint port;
+   guint i;
+
+   server = server_new(&port);
+   g_signal_connect(server, "request-query",
+                    G_CALLBACK(primary_query_cb), NULL);
+
+   uri = g_strdup_printf("mongodb://127.0.0.1:%u/"
+                         "?ioThread=true"
+                         "&minPoolSize=3", port);
+   connection = mongo_connection_new_from_uri(uri);
+   g_object_weak_ref(G_OBJECT(connection), test8_finalized_cb, &finalized);
+
+   /*
+    * Connect and fill the pool before submitting the batch.
+    */
+   query = mongo_bson_new_empty();
+   mongo_connection_query_async(connection, "dbtest1.dbcollection1",
+                                MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                test8_query_cb, &n_completed);
+   while ((n_completed < 1) || (server_count_open(server) < 3)) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   /*
+    * Requests submitted back to back share wakeups of the I/O thread.
+    */
+   wakeups = _mongo_connection_get_inbox_wakeups(connection);
+   for (i = 0; i < TEST8_N_QUERIES; i++) {
+      mongo_connection_query_async(connection, "dbtest1.dbcollection1",
+                                   MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                   test8_query_cb, &n_completed);
+   }
+   wakeups = _mongo_connection_get_inbox_wakeups(connection) - wakeups;
+   g_assert_cmpint(wakeups, >, 0);
+   g_assert_cmpint(wakeups, <, TEST8_N_QUERIES);
+   mongo_bson_unref(query);
+
+   while (n_completed < (TEST8_N_QUERIES + 1)) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   /*
+    * Dropping the last reference from the caller joins the I/O thread
+    * and closes every pooled socket.
+    */
+   g_object_unref(connection);
+   g_assert(finalized == gMainThread);
+
+   while (server_count_open(server)) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   g_socket_service_stop(G_SOCKET_SERVICE(server));
+   g_object_unref(server);
+   g_free(uri);
+}
+
+#define TEST9_N_WORKERS 4
+#define TEST9_N_QUERIES 100
+
+typedef struct
+{
+   MongoConnection *connection;
+   GMainContext    *context;
+   guint            n_completed;
+} Test9Worker;
+
+static volatile gint gTest9Finished;
+
+static void
+test9_query_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   MongoMessageReply *reply;
+   Test9Worker *worker = user_data;
+   GError *error = NULL;
+
+   reply = mongo_connection_query_finish(connection, result, &error);
+   g_assert_no_error(error);
+   g_assert(reply);
+   g_object_unref(reply);
+
+   /*
+    * Each request completes in the context of the thread that made it.
+    */
+   g_assert(g_main_context_get_thread_default() == worker->context);
+   g_assert(g_main_context_is_owner(worker->context));
+
+   worker->n_completed++;
+}
+
+static gpointer
+test9_worker (gpointer data)
+{
+   Test9Worker *worker = data;
+   MongoSource *source;
+   MongoBson *query;
+   guint i;
+
+   g_main_context_push_thread_default(worker->context);
+
+   /*
+    * Every result made in this context shares one source.
+    */
+   source = mongo_source_get_for_context(worker->context);
+   g_assert(source);
+   g_assert(mongo_source_get_for_context(worker->context) == source);
+   g_assert(mongo_source_get_thread_default() == source);
+
+   query = mongo_bson_new_empty();
+   for (i = 0; i < TEST9_N_QUERIES; i++) {
+      mongo_connection_query_async(worker->connection,
+                                   "dbtest1.dbcollection1",
+                                   MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                   test9_query_cb, worker);
+   }
+   mongo_bson_unref(query);
+
+   while (worker->n_completed < TEST9_N_QUERIES) {
+      g_main_context_iteration(worker->context, TRUE);
+   }
+
+   g_main_context_pop_thread_default(worker->context);
+
+   g_atomic_int_inc(&gTest9Finished);
+   g_main_context_wakeup(g_main_context_default());
+
+   return NULL;
+}
+
+static void
+test9 (void)
+{
+   MongoConnection *connection;
+   GMainContext *context;
+   Test9Worker workers[TEST9_N_WORKERS];
+   MongoServer *server;
+   MongoSource *source;
+   GThread *threads[TEST9_N_WORKERS];
+   gchar *uri;
+   guint port;
+   guint i;
+
+   server = server_new(&port);
+   g_signal_connect(server, "request-query",
+                    G_CALLBACK(primary_query_cb), NULL);
+
+   uri = g_strdup_printf("mongodb://127.0.0.1:%u/", port);
+   connection = mongo_connection_new_from_uri(uri);
+
+   for (i = 0; i < TEST9_N_WORKERS; i++) {
+      workers[i].connection = connection;
+      workers[i].context = g_main_context_new();
+      workers[i].n_completed = 0;
+      threads[i] = g_thread_new("worker", test9_worker, &workers[i]);
+   }
+
+   /*
+    * The server and the connection state live in this thread.
+    */
+   while (g_atomic_int_get(&gTest9Finished) < TEST9_N_WORKERS) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   for (i = 0; i < TEST9_N_WORKERS; i++) {
+      g_thread_join(threads[i]);
+      g_assert_cmpint(workers[i].n_completed, ==, TEST9_N_QUERIES);
+      g_main_context_unref(workers[i].context);
+   }
+
+   /*
+    * The source of a freed context is not handed out again, even if a
+    * new context reuses its address.
+    */
+   context = g_main_context_new();
+   source = mongo_source_get_for_context(context);
+   g_assert(!g_source_is_destroyed((GSource *)source));
+   g_assert(g_source_get_context((GSource *)source) == context);
+   g_main_context_unref(context);
+
+   g_object_unref(connection);
+   g_socket_service_stop(G_SOCKET_SERVICE(server));
+   g_object_unref(server);
+   g_free(uri);
+}
+
+static void
+assert_is_read (const gchar *db_and_collection,
+                const gchar *command,
+                gboolean     expected)
+{
+   MongoBson *query;
+
+   query = mongo_bson_new_empty();
+   if (command) {
+      mongo_bson_append_string(query, command, "dbcollection1");
+   }
+   g_assert_cmpint(_mongo_connection_is_read(db_and_collection, query),
+                   ==,
+                   expected);
+   mongo_bson_unref(query);
+}
+
+static void
+test10 (void)
+{
+   /*
+    * Queries are reads, but commands only if known not to write.
+    */
+   assert_is_read("dbtest1.dbcollection1", NULL, TRUE);
+   assert_is_read("dbtest1.dbcollection1", "findAndModify", TRUE);
+   assert_is_read("dbtest1.$cmd", "count", TRUE);
+   assert_is_read("dbtest1.$cmd", "DISTINCT", TRUE);
+   assert_is_read("dbtest1.$cmd", "group", TRUE);
+   assert_is_read("dbtest1.$cmd", "findAndModify", FALSE);
+   assert_is_read("dbtest1.$cmd", "mapReduce", FALSE);
+   assert_is_read("dbtest1.$cmd", "drop", FALSE);
+   assert_is_read("dbtest1.$cmd", NULL, FALSE);
+}
+
+static void
+test11 (void)
+{
+   MongoConnection *connection;
+   MongoManager *manager;
+   gchar *host;
+   guint n_a = 0;
+   guint n_b = 0;
+   guint i;
+
+   connection = mongo_connection_new_from_uri("mongodb://127.0.0.1:27017/"
+                                              "?readPreference=secondary"
+                                              "&localThresholdMS=15");
+   manager = _mongo_connection_get_manager(connection);
+
+   /*
+    * a and b are within 15 milliseconds of the fastest secondary, c is
+    * not. d has not been checked and e is an arbiter, so neither is
+    * ever picked, however fast.
+    */
+   mongo_manager_add_host(manager, "a:27017");
+   mongo_manager_add_host(manager, "b:27017");
+   mongo_manager_add_host(manager, "c:27017");
+   mongo_manager_add_host(manager, "d:27017");
+   mongo_manager_add_host(manager, "e:27017");
+   mongo_manager_update_host(manager, "a:27017",
+                             MONGO_MANAGER_HOST_SECONDARY, 0, 10000);
+   mongo_manager_update_host(manager, "b:27017",
+                             MONGO_MANAGER_HOST_SECONDARY, 0, 20000);
+   mongo_manager_update_host(manager, "c:27017",
+                             MONGO_MANAGER_HOST_SECONDARY, 0, 40000);
+   mongo_manager_update_host(manager, "e:27017",
+                             MONGO_MANAGER_HOST_OTHER, 0, 1000);
+
+   for (i = 0; i < 200; i++) {
+      host = _mongo_connection_select_member(connection, FALSE);
+      if (!g_strcmp0(host, "a:27017")) {
+         n_a++;
+      } else if (!g_strcmp0(host, "b:27017")) {
+         n_b++;
+      } else {
+         g_assert_not_reached();
+      }
+      g_free(host);
+   }
+
+   g_assert_cmpint(n_a, >, 0);
+   g_assert_cmpint(n_b, >, 0);
+
+   /*
+    * Without a secondary, members that have not been checked are not
+    * used instead.
+    */
+   mongo_manager_update_host(manager, "a:27017",
+                             MONGO_MANAGER_HOST_DOWN, 0, -1);
+   mongo_manager_update_host(manager, "b:27017",
+                             MONGO_MANAGER_HOST_DOWN, 0, -1);
+   mongo_manager_update_host(manager, "c:27017",
+                             MONGO_MANAGER_HOST_DOWN, 0, -1);
+   g_assert(!_mongo_connection_select_member(connection, FALSE));
+
+   g_object_unref(connection);
+}
+
+static void
+test12 (void)
+{
+   GSimpleAsyncResult *simple;
+   MongoConnection *connection;
+   MongoMessage *reply;
+   guint64 cursor_id = 1234;
+   guint64 *key;
+
+   connection = mongo_connection_new_from_uri("mongodb://127.0.0.1:27017/");
+
+   /*
+    * Cursors opened on the primary are not pinned.
+    */
+   simple = g_simple_async_result_new(G_OBJECT(connection), NULL, NULL, test12);
+   reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                        "cursor-id", cursor_id,
+                        NULL);
+   _mongo_connection_pin_cursor(simple, NULL, MONGO_MESSAGE_REPLY(reply));
+   g_assert(!_mongo_connection_get_cursor_host(connection, cursor_id));
+   g_object_unref(simple);
+
+   /*
+    * A cursor opened on a secondary is pinned to it.
+    */
+   simple = g_simple_async_result_new(G_OBJECT(connection), NULL, NULL, test12);
+   g_object_set_data_full(G_OBJECT(simple), "host",
+                          g_strdup("b:27017"), g_free);
+   _mongo_connection_pin_cursor(simple, NULL, MONGO_MESSAGE_REPLY(reply));
+   g_assert_cmpstr(_mongo_connection_get_cursor_host(connection, cursor_id),
+                   ==,
+                   "b:27017");
+   g_object_unref(simple);
+   g_object_unref(reply);
+
+   /*
+    * The getmore that exhausts the cursor unpins it.
+    */
+   simple = g_simple_async_result_new(G_OBJECT(connection), NULL, NULL, test12);
+   g_object_set_data_full(G_OBJECT(simple), "host",
+                          g_strdup("b:27017"), g_free);
+   key = g_new(guint64, 1);
+   *key = cursor_id;
+   g_object_set_data_full(G_OBJECT(simple), "cursor-id", key, g_free);
+   reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                        "cursor-id", G_GUINT64_CONSTANT(0),
+                        NULL);
+   _mongo_connection_pin_cursor(simple, NULL, MONGO_MESSAGE_REPLY(reply));
+   g_assert(!_mongo_connection_get_cursor_host(connection, cursor_id));
+   g_object_unref(simple);
+   g_object_unref(reply);
+
+   g_object_unref(connection);
+}
+
+static gboolean
+test13_warning_cb (const gchar    *log_domain,
+                   GLogLevelFlags  log_level,
+                   const gchar    *message,
+                   gpointer        user_data)
+{
+   return !strstr(message, "Unknown readPreference");
+}
+
+static void
+test13 (void)
+{
+#define TEST_READ_MODE(query, mode) \
+   G_STMT_START { \
+      MongoConnection *c; \
+      c = mongo_connection_new_from_uri("mongodb://127.0.0.1:27017/" query); \
+      g_assert(c); \
+      g_assert_cmpint(mongo_connection_get_read_mode(c), ==, mode); \
+      g_object_unref(c); \
+   } G_STMT_END
+
+   TEST_READ_MODE("", MONGO_READ_PRIMARY);
+   TEST_READ_MODE("?readPreference=primary", MONGO_READ_PRIMARY);
+   TEST_READ_MODE("?readPreference=primaryPreferred",
+                  MONGO_READ_PRIMARY_PREFERRED);
+   TEST_READ_MODE("?readPreference=secondary", MONGO_READ_SECONDARY);
+   TEST_READ_MODE("?readPreference=secondaryPreferred",
+                  MONGO_READ_SECONDARY_PREFERRED);
+   TEST_READ_MODE("?readPreference=nearest", MONGO_READ_NEAREST);
+   TEST_READ_MODE("?READPREFERENCE=NEAREST", MONGO_READ_NEAREST);
+
+   /*
+    * Unknown modes are warned about and fall back to the primary.
+    */
+   g_test_log_set_fatal_handler(test13_warning_cb, NULL);
+   TEST_READ_MODE("?readPreference=tagged", MONGO_READ_PRIMARY);
+   g_test_log_set_fatal_handler(NULL, NULL);
+
+#undef TEST_READ_MODE
+}
+
+typedef struct
+{
+   MongoMessage       *held;
+   MongoClientContext *clients[2];
+   guint               n_queries;
+   GError             *error;
+   gboolean            completed;
+} Test14;
+
+static gboolean
+test14_query_cb (MongoServer        *server,
+                 MongoClientContext *client,
+                 MongoMessage       *message,
+                 gpointer            user_data)
+{
+   Test14 *test = user_data;
+
+   primary_query_cb(server, client, message, NULL);
+
+   if (mongo_message_query_is_command(MONGO_MESSAGE_QUERY(message))) {
+      return TRUE;
+   }
+
+   /*
+    * The first query is never answered.
+    */
+   g_assert_cmpint(test->n_queries, <, 2);
+   test->clients[test->n_queries] = client;
+   if (!test->n_queries++) {
+      mongo_server_pause_message(server, message);
+      test->held = g_object_ref(message);
+   }
+
+   return TRUE;
+}
+
+static void
+test14_query_done_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   MongoMessageReply *reply;
+   Test14 *test = user_data;
+
+   reply = mongo_connection_query_finish(connection, result, &test->error);
+   g_clear_object(&reply);
+   test->completed = TRUE;
+}
+
+static gboolean
+test14_warning_cb (const gchar    *log_domain,
+                   GLogLevelFlags  log_level,
+                   const gchar    *message,
+                   gpointer        user_data)
+{
+   return !strstr(message, "Mongo protocol failure");
+}
+
+static void
+test14_run (gboolean close_on_timeout)
+{
+   MongoConnection *connection;
+   MongoServer *server;
+   MongoBson *query;
+   Test14 test = { 0 };
+   gchar *uri;
+   guint port;
+
+   server = server_new(&port);
+   g_signal_connect(server, "request-query",
+                    G_CALLBACK(test14_query_cb), &test);
+
+   uri = g_strdup_printf("mongodb://127.0.0.1:%u/"
+                         "?socketTimeoutMS=100"
+                         "&maxPoolSize=1"
+                         "%s", port,
+                         close_on_timeout ? "&closeOnTimeout=true" : "");
+   connection = mongo_connection_new_from_uri(uri);
+   g_free(uri);
+
+   query = mongo_bson_new_empty();
+
+   /*
+    * The unanswered query times out.
+    */
+   mongo_connection_query_async(connection, "dbtest1.dbcollection1",
+                                MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                test14_query_done_cb, &test);
+   while (!test.completed) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_assert_error(test.error, MONGO_PROTOCOL_ERROR,
+                  MONGO_PROTOCOL_ERROR_TIMEOUT);
+   g_clear_error(&test.error);
+
+   /*
+    * The next query reuses the socket unless it was closed on timeout.
+    */
+   test.completed = FALSE;
+   mongo_connection_query_async(connection, "dbtest1.dbcollection1",
+                                MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                test14_query_done_cb, &test);
+   while (!test.completed) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_assert_no_error(test.error);
+   g_assert_cmpint(test.n_queries, ==, 2);
+
+   if (close_on_timeout) {
+      g_assert(test.clients[0] != test.clients[1]);
+   } else {
+      g_assert(test.clients[0] == test.clients[1]);
+   }
+
+   mongo_bson_unref(query);
+   g_object_unref(test.held);
+   g_object_unref(connection);
+   g_object_unref(server);
+}
+
+static void
+test14 (void)
+{
+   g_test_log_set_fatal_handler(test14_warning_cb, NULL);
+   test14_run(FALSE);
+   test14_run(TRUE);
+   g_test_log_set_fatal_handler(NULL, NULL);
+}
+
+/*
+ * Counts the queries each pooled socket receives, optionally holding
+ * back the replies until test15_release().
+ */
+typedef struct
+{
+   MongoServer        *server;
+   GHashTable         *clients;
+   GPtrArray          *held;
+   gboolean            hold;
+   MongoClientContext *insert_client;
+   guint               n_received;
+   guint               n_completed;
+} Test15;
+
+static gboolean
+test15_query_cb (MongoServer        *server,
+                 MongoClientContext *client,
+                 MongoMessage       *message,
+                 gpointer            user_data)
+{
+   Test15 *test = user_data;
+   guint count;
+
+   primary_query_cb(server, client, message, NULL);
+
+   if (mongo_message_query_is_command(MONGO_MESSAGE_QUERY(message))) {
+      return TRUE;
+   }
+
+   count = GPOINTER_TO_UINT(g_hash_table_lookup(test->clients, client));
+   g_hash_table_insert(test->clients, client, GUINT_TO_POINTER(count + 1));
+   test->n_received++;
+
+   if (test->hold) {
+      mongo_server_pause_message(server, message);
+      g_ptr_array_add(test->held, g_object_ref(message));
+   }
+
+   return TRUE;
+}
+
+static gboolean
+test15_insert_cb (MongoServer        *server,
+                  MongoClientContext *client,
+                  MongoMessage       *message,
+                  gpointer            user_data)
+{
+   Test15 *test = user_data;
+
+   test->insert_client = client;
+
+   return TRUE;
+}
+
+static void
+test15_query_done_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   MongoMessageReply *reply;
+   GError *error = NULL;
+   Test15 *test = user_data;
+
+   reply = mongo_connection_query_finish(connection, result, &error);
+   g_assert_no_error(error);
+   g_object_unref(reply);
+
+   test->n_completed++;
+}
+
+static void
+test15_insert_done_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   GError *error = NULL;
+
+   g_assert(mongo_connection_insert_finish(connection, result, &error));
+   g_assert_no_error(error);
+}
+
+static void
+test15_query (Test15          *test,
+              MongoConnection *connection,
+              guint            n_queries)
+{
+   MongoBson *query;
+   guint i;
+
+   query = mongo_bson_new_empty();
+   for (i = 0; i < n_queries; i++) {
+      mongo_connection_query_async(connection, "dbtest1.dbcollection1",
+                                   MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                   test15_query_done_cb, test);
+   }
+   mongo_bson_unref(query);
+}
+
+static void
+test15_release (Test15 *test)
+{
+   guint i;
+
+   test->hold = FALSE;
+   for (i = 0; i < test->held->len; i++) {
+      mongo_server_unpause_message(test->server,
+                                   g_ptr_array_index(test->held, i));
+   }
+   g_ptr_array_set_size(test->held, 0);
+   g_hash_table_remove_all(test->clients);
+}
+
+static MongoConnection *
+test15_connect (Test15      *test,
+                guint        port,
+                const gchar *options)
+{
+   MongoConnection *connection;
+   gchar *uri;
+
+   uri = g_strdup_printf("mongodb://127.0.0.1:%u/?%s", port, options);
+   connection = mongo_connection_new_from_uri(uri);
+   g_free(uri);
+
+   test->n_received = 0;
+   test->n_completed = 0;
+   test15_query(test, connection, 1);
+   while (!test->n_completed) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_hash_table_remove_all(test->clients);
+
+   return connection;
+}
+
+static void
+test15 (void)
+{
+   MongoConnection *connection;
+   GHashTableIter iter;
+   gpointer value;
+   MongoBson *doc;
+   Test15 test = { 0 };
+   guint port;
+
+   test.server = server_new(&port);
+   test.clients = g_hash_table_new(g_direct_hash, g_direct_equal);
+   test.held = g_ptr_array_new_with_free_func(g_object_unref);
+   g_signal_connect(test.server, "request-query",
+                    G_CALLBACK(test15_query_cb), &test);
+   g_signal_connect(test.server, "request-insert",
+                    G_CALLBACK(test15_insert_cb), &test);
+
+   /*
+    * The pool is filled up to "minPoolSize" and requests are spread
+    * evenly across it.
+    */
+   connection = test15_connect(&test, port, "minPoolSize=2&maxPoolSize=3");
+   while (_mongo_connection_get_pool_size(connection) < 2) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+
+   test.hold = TRUE;
+   test15_query(&test, connection, 12);
+   while (test.n_received < 13) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_assert_cmpint(g_hash_table_size(test.clients), ==, 2);
+   g_hash_table_iter_init(&iter, test.clients);
+   while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      g_assert_cmpint(GPOINTER_TO_UINT(value), ==, 6);
+   }
+
+   /*
+    * Busy sockets grow the pool, but never beyond "maxPoolSize". The new
+    * socket catches up with the others first.
+    */
+   while (_mongo_connection_get_pool_size(connection) < 3) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   test15_query(&test, connection, 12);
+   while (test.n_received < 25) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_assert_cmpint(g_hash_table_size(test.clients), ==, 3);
+   g_hash_table_iter_init(&iter, test.clients);
+   while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      g_assert_cmpint(GPOINTER_TO_UINT(value), ==, 8);
+   }
+   g_assert_cmpint(_mongo_connection_get_pool_size(connection), ==, 3);
+
+   test15_release(&test);
+   while (test.n_completed < 25) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_object_unref(connection);
+
+   /*
+    * Requests issued after an unacknowledged write follow it on its
+    * socket, even though the other one is idle, until one is answered.
+    */
+   connection = test15_connect(&test, port,
+                               "minPoolSize=2&maxPoolSize=2&safe=false");
+   while (_mongo_connection_get_pool_size(connection) < 2) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+
+   test.hold = TRUE;
+   doc = mongo_bson_new_empty();
+   mongo_bson_append_int(doc, "a", 1);
+   mongo_connection_insert_async(connection, "dbtest1.dbcollection1",
+                                 MONGO_INSERT_NONE, &doc, 1, NULL,
+                                 test15_insert_done_cb, NULL);
+   mongo_bson_unref(doc);
+   test15_query(&test, connection, 4);
+   while (!test.insert_client || (test.n_received < 5)) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_assert_cmpint(g_hash_table_size(test.clients), ==, 1);
+   g_assert_cmpint(GPOINTER_TO_UINT(g_hash_table_lookup(test.clients,
+                                                        test.insert_client)),
+                   ==,
+                   4);
+
+   test15_release(&test);
+   while (test.n_completed < 5) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+
+   test.hold = TRUE;
+   test15_query(&test, connection, 2);
+   while (test.n_received < 7) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_assert_cmpint(g_hash_table_size(test.clients), ==, 2);
+
+   test15_release(&test);
+   while (test.n_completed < 7) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_object_unref(connection);
+
+   g_ptr_array_unref(test.held);
+   g_hash_table_unref(test.clients);
+   g_object_unref(test.server);
+}
+
+typedef struct _Test16 Test16;
+
+/*
+ * A host of the replica set in test16. Its first "ismaster" is the
+ * probe of the connection, which may be held back.
+ */
+typedef struct
+{
+   Test16             *test;
+   MongoServer        *server;
+   gchar              *host;
+   gboolean            ismaster;
+   gboolean            hold;
+   MongoMessage       *held;
+   MongoClientContext *client;
+   guint               n_queries;
+} Test16Server;
+
+enum
+{
+   TEST16_SECONDARY,
+   TEST16_PRIMARY,
+   TEST16_STALE,
+   TEST16_N_SERVERS
+};
+
+struct _Test16
+{
+   Test16Server servers[TEST16_N_SERVERS];
+   guint        n_probed;
+};
+
+static gboolean
+test16_query_cb (MongoServer        *server,
+                 MongoClientContext *client,
+                 MongoMessage       *message,
+                 gpointer            user_data)
+{
+   Test16Server *primary;
+   Test16Server *ts = user_data;
+   MongoBson *bson;
+
+   if (!mongo_message_query_is_command(MONGO_MESSAGE_QUERY(message))) {
+      ts->n_queries++;
+      primary_query_cb(server, client, message, NULL);
+      return TRUE;
+   }
+
+   bson = mongo_bson_new_empty();
+   mongo_bson_append_boolean(bson, "ok", TRUE);
+   mongo_bson_append_boolean(bson, "ismaster", ts->ismaster);
+   mongo_message_set_reply_bson(message, MONGO_REPLY_NONE, bson);
+   mongo_bson_unref(bson);
+
+   if (ts->client) {
+      return TRUE;
+   }
+
+   ts->client = client;
+   ts->test->n_probed++;
+
+   /*
+    * The primary only answers once every host is being probed, which
+    * never happens unless they are probed in parallel.
+    */
+   primary = &ts->test->servers[TEST16_PRIMARY];
+   if (ts->hold &&
+       ((ts != primary) || (ts->test->n_probed < TEST16_N_SERVERS))) {
+      mongo_server_pause_message(server, message);
+      ts->held = g_object_ref(message);
+   }
+
+   if ((ts->test->n_probed == TEST16_N_SERVERS) && primary->held) {
+      mongo_server_unpause_message(primary->server, primary->held);
+      g_clear_object(&primary->held);
+   }
+
+   return TRUE;
+}
+
+static void
+test16_query_done_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   MongoMessageReply *reply;
+   GError *error = NULL;
+   gboolean *done = user_data;
+
+   reply = mongo_connection_query_finish(connection, result, &error);
+   g_assert_no_error(error);
+   g_object_unref(reply);
+
+   *done = TRUE;
+}
+
+static void
+test16 (void)
+{
+   MongoConnection *connection;
+   MongoManager *manager;
+   Test16Server *ts;
+   MongoBson *query;
+   gboolean done = FALSE;
+   Test16 test = { { { 0 } } };
+   gchar *uri;
+   guint port;
+   guint i;
+
+   for (i = 0; i < TEST16_N_SERVERS; i++) {
+      ts = &test.servers[i];
+      ts->test = &test;
+      ts->server = server_new(&port);
+      ts->host = g_strdup_printf("127.0.0.1:%u", port);
+      g_signal_connect(ts->server, "request-query",
+                       G_CALLBACK(test16_query_cb), ts);
+   }
+
+   /*
+    * The secondary answers at once, the primary once every host is being
+    * probed and the other host claiming to be primary never in time.
+    */
+   test.servers[TEST16_PRIMARY].ismaster = TRUE;
+   test.servers[TEST16_PRIMARY].hold = TRUE;
+   test.servers[TEST16_STALE].ismaster = TRUE;
+   test.servers[TEST16_STALE].hold = TRUE;
+
+   uri = g_strdup_printf("mongodb://%s/", test.servers[TEST16_SECONDARY].host);
+   connection = mongo_connection_new_from_uri(uri);
+   g_free(uri);
+
+   manager = _mongo_connection_get_manager(connection);
+   mongo_manager_add_seed(manager, test.servers[TEST16_PRIMARY].host);
+   mongo_manager_add_seed(manager, test.servers[TEST16_STALE].host);
+
+   query = mongo_bson_new_empty();
+   mongo_connection_query_async(connection, "dbtest1.dbcollection1",
+                                MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                test16_query_done_cb, &done);
+   mongo_bson_unref(query);
+
+   /*
+    * The first primary to answer is adopted and serves the request.
+    */
+   while (!done) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_assert_cmpint(test.n_probed, ==, TEST16_N_SERVERS);
+   g_assert_cmpint(test.servers[TEST16_PRIMARY].n_queries, ==, 1);
+   g_assert_cmpint(test.servers[TEST16_SECONDARY].n_queries, ==, 0);
+   g_assert_cmpint(mongo_manager_get_host_state(
+                      manager, test.servers[TEST16_PRIMARY].host),
+                   ==,
+                   MONGO_MANAGER_HOST_PRIMARY);
+
+   /*
+    * The probe still waiting on the other host is cancelled along with
+    * its socket.
+    */
+   ts = &test.servers[TEST16_STALE];
+   while (server_count_open(ts->server)) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+
+   /*
+    * Its answer arrives too late to matter.
+    */
+   mongo_server_unpause_message(ts->server, ts->held);
+   g_clear_object(&ts->held);
+   while (g_main_context_pending(NULL)) {
+      g_main_context_iteration(NULL, FALSE);
+   }
+   g_assert_cmpint(mongo_manager_get_host_state(manager, ts->host),
+                   !=,
+                   MONGO_MANAGER_HOST_PRIMARY);
+   g_assert_cmpint(ts->n_queries, ==, 0);
+
+   g_object_unref(connection);
+
+   for (i = 0; i < TEST16_N_SERVERS; i++) {
+      g_object_unref(test.servers[i].server);
+      g_free(test.servers[i].host);
+   }
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -216,10 +1432,22 @@ main (gint   argc,
    g_test_init(&argc, &argv, NULL);
    g_type_init();
    gMainLoop = g_main_loop_new(NULL, FALSE);
+   gMainThread = g_thread_self();
    g_test_add_func("/MongoConnection/insert_async", test1);
    g_test_add_func("/MongoConnection/query_async", test2);
    g_test_add_func("/MongoConnection/delete_async", test3);
    g_test_add_func("/MongoConnection/command_async", test4);
    g_test_add_func("/MongoConnection/uri", test5);
+   g_test_add_func("/MongoConnection/queue_limits", test6);
+   g_test_add_func("/MongoConnection/connect_timeout", test7);
+   g_test_add_func("/MongoConnection/io_thread", test8);
+   g_test_add_func("/MongoConnection/threads", test9);
+   g_test_add_func("/MongoConnection/is_read", test10);
+   g_test_add_func("/MongoConnection/latency_window", test11);
+   g_test_add_func("/MongoConnection/cursor_pinning", test12);
+   g_test_add_func("/MongoConnection/read_preference", test13);
+   g_test_add_func("/MongoConnection/close_on_timeout", test14);
+   g_test_add_func("/MongoConnection/pool", test15);
+   g_test_add_func("/MongoConnection/probe", test16);
    return g_test_run();
 }
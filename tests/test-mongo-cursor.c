@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "test-helper.h"
 
 #include <mongo-glib/mongo-glib.h>
@@ -120,6 +122,348 @@ test2 (void)
    g_assert_cmpint(count, ==, 1);
 }
 
+#define TEST_BATCH_SIZE 2
+#define TEST_CURSOR_ID  G_GUINT64_CONSTANT(1234)
+
+/*
+ * A MongoServer serving one collection of @n_docs documents { i: n } in
+ * batches of TEST_BATCH_SIZE, with a single cursor.
+ */
+typedef struct
+{
+   MongoServer        *server;
+   guint               port;
+   guint               n_docs;
+   guint               offset;
+   MongoClientContext *client;
+   gboolean            reverse;
+   GQueue              paused;
+   guint               max_paused;
+   guint               flush_handler;
+   guint               n_getmores;
+   guint               n_kill_cursors;
+   guint               delivered;
+   guint               stop_after;
+   gboolean            finished;
+} CursorServer;
+
+static void
+cursor_server_reply (CursorServer *cs,
+                     MongoMessage *message)
+{
+   MongoMessage *reply;
+   MongoBson *bson;
+   GList *list = NULL;
+   guint offset = cs->offset;
+   guint i;
+
+   for (i = 0; (i < TEST_BATCH_SIZE) && (cs->offset < cs->n_docs); i++) {
+      bson = mongo_bson_new_empty();
+      mongo_bson_append_int(bson, "i", cs->offset++);
+      list = g_list_append(list, bson);
+   }
+
+   reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                        "cursor-id", (cs->offset < cs->n_docs) ?
+                                     TEST_CURSOR_ID : G_GUINT64_CONSTANT(0),
+                        "offset", offset,
+                        NULL);
+   mongo_message_reply_set_documents(MONGO_MESSAGE_REPLY(reply), list);
+   mongo_message_set_reply(message, reply);
+
+   g_list_foreach(list, (GFunc)mongo_bson_unref, NULL);
+   g_list_free(list);
+   g_object_unref(reply);
+}
+
+static gboolean
+cursor_server_query_cb (MongoServer        *server,
+                        MongoClientContext *client,
+                        MongoMessage       *message,
+                        gpointer            user_data)
+{
+   CursorServer *cs = user_data;
+   MongoBson *bson;
+
+   if (mongo_message_query_is_command(MONGO_MESSAGE_QUERY(message))) {
+      bson = mongo_bson_new_empty();
+      mongo_bson_append_boolean(bson, "ok", TRUE);
+      mongo_bson_append_boolean(bson, "ismaster", TRUE);
+      mongo_message_set_reply_bson(message, MONGO_REPLY_NONE, bson);
+      mongo_bson_unref(bson);
+      return TRUE;
+   }
+
+   g_assert(!cs->client);
+   cs->client = client;
+   cursor_server_reply(cs, message);
+
+   return TRUE;
+}
+
+static gboolean
+cursor_server_flush (gpointer data)
+{
+   CursorServer *cs = data;
+   MongoMessage *message;
+
+   cs->flush_handler = 0;
+
+   while ((message = g_queue_pop_tail(&cs->paused))) {
+      mongo_server_unpause_message(cs->server, message);
+      g_object_unref(message);
+   }
+
+   return FALSE;
+}
+
+static gboolean
+cursor_server_getmore_cb (MongoServer        *server,
+                          MongoClientContext *client,
+                          MongoMessage       *message,
+                          gpointer            user_data)
+{
+   CursorServer *cs = user_data;
+   MongoMessage *reply;
+
+   /*
+    * Every getmore of the cursor must use the socket it was opened on.
+    */
+   g_assert(client == cs->client);
+
+   cs->n_getmores++;
+
+   if (cs->offset < cs->n_docs) {
+      cursor_server_reply(cs, message);
+   } else {
+      reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                           "cursor-id", G_GUINT64_CONSTANT(0),
+                           "flags", MONGO_REPLY_CURSOR_NOT_FOUND,
+                           NULL);
+      mongo_message_set_reply(message, reply);
+      g_object_unref(reply);
+   }
+
+   /*
+    * Hold back the replies until the getmores sent together have all
+    * arrived, then answer the last one first.
+    */
+   if (cs->reverse) {
+      mongo_server_pause_message(server, message);
+      g_queue_push_tail(&cs->paused, g_object_ref(message));
+      cs->max_paused = MAX(cs->max_paused, cs->paused.length);
+      if (!cs->flush_handler) {
+         cs->flush_handler = g_timeout_add(10, cursor_server_flush, cs);
+      }
+   }
+
+   return TRUE;
+}
+
+static gboolean
+cursor_server_kill_cursors_cb (MongoServer        *server,
+                               MongoClientContext *client,
+                               MongoMessage       *message,
+                               gpointer            user_data)
+{
+   CursorServer *cs = user_data;
+
+   cs->n_kill_cursors++;
+
+   return TRUE;
+}
+
+static void
+cursor_server_init (CursorServer *cs,
+                    guint         n_docs)
+{
+   memset(cs, 0, sizeof *cs);
+
+   cs->n_docs = n_docs;
+   cs->port = g_random_int_range(32000, 33000);
+   cs->server = g_object_new(MONGO_TYPE_SERVER,
+                             "listen-backlog", 10,
+                             NULL);
+   g_socket_listener_add_inet_port(G_SOCKET_LISTENER(cs->server),
+                                   cs->port,
+                                   NULL,
+                                   NULL);
+   g_signal_connect(cs->server, "request-query",
+                    G_CALLBACK(cursor_server_query_cb), cs);
+   g_signal_connect(cs->server, "request-getmore",
+                    G_CALLBACK(cursor_server_getmore_cb), cs);
+   g_signal_connect(cs->server, "request-kill_cursors",
+                    G_CALLBACK(cursor_server_kill_cursors_cb), cs);
+   g_socket_service_start(G_SOCKET_SERVICE(cs->server));
+}
+
+static void
+cursor_server_destroy (CursorServer *cs)
+{
+   g_assert(g_queue_is_empty(&cs->paused));
+   g_assert(!cs->flush_handler);
+
+   g_socket_service_stop(G_SOCKET_SERVICE(cs->server));
+   g_socket_listener_close(G_SOCKET_LISTENER(cs->server));
+   g_object_unref(cs->server);
+}
+
+static gboolean
+test3_foreach_func (MongoCursor *cursor,
+                    MongoBson   *bson,
+                    gpointer     user_data)
+{
+   CursorServer *cs = user_data;
+   MongoBsonIter iter;
+
+   /*
+    * Documents are handed out in order, whatever order the replies
+    * arrived in.
+    */
+   g_assert(mongo_bson_iter_init_find(&iter, bson, "i"));
+   g_assert_cmpint(mongo_bson_iter_get_value_int(&iter), ==, cs->delivered);
+
+   cs->delivered++;
+
+   return (!cs->stop_after || (cs->delivered < cs->stop_after));
+}
+
+static void
+test3_foreach_cb (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+   CursorServer *cs = user_data;
+   gboolean ret;
+   GError *error = NULL;
+
+   ret = mongo_cursor_foreach_finish(MONGO_CURSOR(object), result, &error);
+   g_assert_no_error(error);
+   g_assert(ret);
+
+   cs->finished = TRUE;
+   g_main_loop_quit(gMainLoop);
+}
+
+/*
+ * Iterates a cursor over @cs and waits for the kill_cursors that is
+ * expected if iteration stopped before the end of the result set.
+ */
+static void
+test3_run (CursorServer    *cs,
+           guint            prefetch,
+           guint            limit,
+           MongoQueryFlags  flags)
+{
+   MongoConnection *connection;
+   MongoCollection *col;
+   MongoDatabase *db;
+   MongoCursor *cursor;
+   gchar *uri;
+
+   uri = g_strdup_printf("mongodb://127.0.0.1:%u/", cs->port);
+   connection = mongo_connection_new_from_uri(uri);
+   g_free(uri);
+
+   db = mongo_connection_get_database(connection, "dbtest3");
+   col = mongo_database_get_collection(db, "dbcollection3");
+   cursor = mongo_collection_find(col, NULL, NULL, 0, limit, flags);
+   mongo_cursor_set_batch_size(cursor, TEST_BATCH_SIZE);
+   mongo_cursor_set_prefetch(cursor, prefetch);
+
+   mongo_cursor_foreach_async(cursor,
+                              test3_foreach_func,
+                              cs,
+                              NULL,
+                              NULL,
+                              test3_foreach_cb,
+                              cs);
+
+   g_main_loop_run(gMainLoop);
+   g_assert(cs->finished);
+
+   if (cs->offset < cs->n_docs) {
+      while (!cs->n_kill_cursors) {
+         g_main_context_iteration(NULL, TRUE);
+      }
+   }
+
+   g_object_unref(cursor);
+   g_object_unref(connection);
+}
+
+static void
+test3 (void)
+{
+   CursorServer cs;
+   guint prefetch;
+
+   /*
+    * Without prefetch, the next batch is only requested once the current
+    * one was delivered. With prefetch, the getmores kept in flight are
+    * answered in reverse order and all arrive on one socket.
+    */
+   for (prefetch = 0; prefetch <= 3; prefetch++) {
+      cursor_server_init(&cs, 11);
+      cs.reverse = TRUE;
+      test3_run(&cs, prefetch, 0, MONGO_QUERY_NONE);
+      g_assert_cmpint(cs.delivered, ==, 11);
+      g_assert_cmpint(cs.max_paused, <=, MAX(1, prefetch));
+      g_assert_cmpint(cs.n_kill_cursors, ==, 0);
+      cursor_server_destroy(&cs);
+   }
+}
+
+static void
+test4 (void)
+{
+   CursorServer cs;
+
+   /*
+    * No batches are requested beyond the limit, and the cursor is killed
+    * since the server still has documents for it.
+    */
+   cursor_server_init(&cs, 20);
+   test3_run(&cs, 1, 5, MONGO_QUERY_NONE);
+   g_assert_cmpint(cs.delivered, ==, 5);
+   g_assert_cmpint(cs.n_getmores, ==, 2);
+   g_assert_cmpint(cs.n_kill_cursors, ==, 1);
+   cursor_server_destroy(&cs);
+}
+
+static void
+test5 (void)
+{
+   CursorServer cs;
+
+   /*
+    * Returning FALSE from the foreach callback stops iteration even with
+    * getmores still in flight.
+    */
+   cursor_server_init(&cs, 20);
+   cs.reverse = TRUE;
+   cs.stop_after = 3;
+   test3_run(&cs, 3, 0, MONGO_QUERY_NONE);
+   g_assert_cmpint(cs.delivered, ==, 3);
+   g_assert_cmpint(cs.n_kill_cursors, ==, 1);
+   cursor_server_destroy(&cs);
+}
+
+static void
+test6 (void)
+{
+   CursorServer cs;
+
+   /*
+    * Exhaust queries deliver the first batch and send no getmores.
+    */
+   cursor_server_init(&cs, 20);
+   test3_run(&cs, 3, 0, MONGO_QUERY_EXHAUST);
+   g_assert_cmpint(cs.delivered, ==, TEST_BATCH_SIZE);
+   g_assert_cmpint(cs.n_getmores, ==, 0);
+   cursor_server_destroy(&cs);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -131,6 +475,10 @@ main (gint   argc,
 
    g_test_add_func("/MongoCursor/count", test1);
    g_test_add_func("/MongoCursor/foreach", test2);
+   g_test_add_func("/MongoCursor/foreach/prefetch", test3);
+   g_test_add_func("/MongoCursor/foreach/limit", test4);
+   g_test_add_func("/MongoCursor/foreach/stop", test5);
+   g_test_add_func("/MongoCursor/foreach/exhaust", test6);
 
    return g_test_run();
 }
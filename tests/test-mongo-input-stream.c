@@ -1,7 +1,7 @@
 #include <mongo-glib/mongo-glib.h>
 
 static void
-test_MongoInputStream_read_message (void)
+read_100queries (guint buffer_size)
 {
    MongoInputStream *stream;
    GFileInputStream *input;
@@ -16,7 +16,10 @@ test_MongoInputStream_read_message (void)
    input = g_file_read(file, NULL, &error);
    g_assert(input);
 
-   stream = mongo_input_stream_new(G_INPUT_STREAM(input));
+   stream = g_object_new(MONGO_TYPE_INPUT_STREAM,
+                         "base-stream", input,
+                         "buffer-size", buffer_size,
+                         NULL);
    g_assert(stream);
 
    for (i = 0; i < 100; i++) {
@@ -39,6 +42,27 @@ test_MongoInputStream_read_message (void)
    g_object_unref(file);
 }
 
+static void
+test_MongoInputStream_read_message (void)
+{
+   read_100queries(0);
+}
+
+static void
+test_MongoInputStream_read_message_buffered (void)
+{
+   /*
+    * Large enough to hold many messages per read.
+    */
+   read_100queries(65536);
+
+   /*
+    * Small enough that messages are split across reads and the partial
+    * message must be moved to the front of the buffer.
+    */
+   read_100queries(64);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -47,5 +71,7 @@ main (gint   argc,
    g_test_init(&argc, &argv, NULL);
    g_test_add_func("/MongoInputStream/read_message",
                    test_MongoInputStream_read_message);
+   g_test_add_func("/MongoInputStream/read_message_buffered",
+                   test_MongoInputStream_read_message_buffered);
    return g_test_run();
 }
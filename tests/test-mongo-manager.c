@@ -84,6 +84,127 @@ test2 (void)
    mongo_manager_unref(mgr);
 }
 
+static void
+test3 (void)
+{
+   MongoManager *mgr;
+
+   mgr = mongo_manager_new();
+
+   g_assert_cmpint(mongo_manager_get_host_state(mgr, "a:27017"), ==,
+                   MONGO_MANAGER_HOST_UNKNOWN);
+   g_assert_cmpint(mongo_manager_get_host_rtt(mgr, "a:27017"), ==, -1);
+   g_assert_cmpint(mongo_manager_get_set_version(mgr), ==, 0);
+
+   mongo_manager_update_host(mgr, "a:27017", MONGO_MANAGER_HOST_PRIMARY,
+                             3, 1000);
+   mongo_manager_update_host(mgr, "b:27017", MONGO_MANAGER_HOST_SECONDARY,
+                             4, 2000);
+   g_assert_cmpint(mongo_manager_get_host_state(mgr, "a:27017"), ==,
+                   MONGO_MANAGER_HOST_PRIMARY);
+   g_assert_cmpint(mongo_manager_get_host_rtt(mgr, "a:27017"), ==, 1000);
+   g_assert_cmpint(mongo_manager_get_set_version(mgr), ==, 4);
+
+   /*
+    * A single slow sample only moves the average part of the way.
+    */
+   mongo_manager_update_host(mgr, "a:27017", MONGO_MANAGER_HOST_PRIMARY,
+                             3, 6000);
+   g_assert_cmpint(mongo_manager_get_host_rtt(mgr, "a:27017"), ==, 2000);
+
+   mongo_manager_update_host(mgr, "a:27017", MONGO_MANAGER_HOST_DOWN, 0, -1);
+   g_assert_cmpint(mongo_manager_get_host_state(mgr, "a:27017"), ==,
+                   MONGO_MANAGER_HOST_DOWN);
+   g_assert_cmpint(mongo_manager_get_host_rtt(mgr, "a:27017"), ==, -1);
+
+   /*
+    * Removed hosts are forgotten, unless they are also seeds.
+    */
+   mongo_manager_add_seed(mgr, "a:27017");
+   mongo_manager_add_host(mgr, "a:27017");
+   mongo_manager_add_host(mgr, "b:27017");
+   mongo_manager_remove_host(mgr, "a:27017");
+   mongo_manager_remove_host(mgr, "b:27017");
+   g_assert_cmpint(mongo_manager_get_host_state(mgr, "a:27017"), ==,
+                   MONGO_MANAGER_HOST_DOWN);
+   g_assert_cmpint(mongo_manager_get_host_state(mgr, "b:27017"), ==,
+                   MONGO_MANAGER_HOST_UNKNOWN);
+
+   mongo_manager_update_host(mgr, "c:27017", MONGO_MANAGER_HOST_SECONDARY,
+                             5, 1000);
+   mongo_manager_add_host(mgr, "c:27017");
+   mongo_manager_clear_hosts(mgr);
+   g_assert_cmpint(mongo_manager_get_host_state(mgr, "c:27017"), ==,
+                   MONGO_MANAGER_HOST_UNKNOWN);
+   g_assert_cmpint(mongo_manager_get_set_version(mgr), ==, 3);
+
+   mongo_manager_unref(mgr);
+}
+
+static void
+test4 (void)
+{
+   MongoManager *mgr;
+   const gchar *host;
+   guint delay;
+   guint i;
+
+   mgr = mongo_manager_new();
+
+   mongo_manager_add_seed(mgr, "a:27017");
+   mongo_manager_add_seed(mgr, "b:27017");
+   mongo_manager_add_host(mgr, "c:27017");
+
+   /*
+    * Healthy hosts come first and hosts backing off are skipped.
+    */
+   mongo_manager_update_host(mgr, "a:27017", MONGO_MANAGER_HOST_DOWN, 0, -1);
+   mongo_manager_update_host(mgr, "c:27017", MONGO_MANAGER_HOST_SECONDARY,
+                             1, 1000);
+   g_assert_cmpint(mongo_manager_get_host_failures(mgr, "a:27017"), ==, 1);
+
+   host = mongo_manager_next(mgr, &delay);
+   g_assert_cmpstr(host, ==, "c:27017");
+   host = mongo_manager_next(mgr, &delay);
+   g_assert_cmpstr(host, ==, "b:27017");
+   host = mongo_manager_next(mgr, &delay);
+   g_assert(!host);
+   g_assert_cmpint(delay, >=, 200);
+
+   /*
+    * If every host is backing off, they are all tried, fewest failures
+    * first.
+    */
+   mongo_manager_update_host(mgr, "a:27017", MONGO_MANAGER_HOST_DOWN, 0, -1);
+   mongo_manager_update_host(mgr, "b:27017", MONGO_MANAGER_HOST_DOWN, 0, -1);
+   mongo_manager_update_host(mgr, "c:27017", MONGO_MANAGER_HOST_DOWN, 0, -1);
+   g_assert_cmpint(mongo_manager_get_host_failures(mgr, "a:27017"), ==, 2);
+
+   host = mongo_manager_next(mgr, &delay);
+   g_assert_cmpstr(host, ==, "b:27017");
+   host = mongo_manager_next(mgr, &delay);
+   g_assert_cmpstr(host, ==, "c:27017");
+   host = mongo_manager_next(mgr, &delay);
+   g_assert_cmpstr(host, ==, "a:27017");
+   host = mongo_manager_next(mgr, &delay);
+   g_assert(!host);
+
+   mongo_manager_update_host(mgr, "a:27017", MONGO_MANAGER_HOST_PRIMARY,
+                             1, 1000);
+   g_assert_cmpint(mongo_manager_get_host_failures(mgr, "a:27017"), ==, 0);
+
+   /*
+    * Delays stay within bounds however long the outage.
+    */
+   for (i = 0; i < 32; i++) {
+      while (mongo_manager_next(mgr, &delay)) { }
+      g_assert_cmpint(delay, >=, 200);
+      g_assert_cmpint(delay, <=, 1000 * 60);
+   }
+
+   mongo_manager_unref(mgr);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -92,5 +213,7 @@ main (gint   argc,
    g_type_init();
    g_test_add_func("/MongoManager/basic", test1);
    g_test_add_func("/MongoManager/next", test2);
+   g_test_add_func("/MongoManager/topology", test3);
+   g_test_add_func("/MongoManager/backoff", test4);
    return g_test_run();
 }
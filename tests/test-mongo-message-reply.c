@@ -22,6 +22,55 @@ test1 (void)
    g_list_foreach(list, (GFunc)mongo_bson_unref, NULL);
 }
 
+static void
+test2 (void)
+{
+   MongoMessageReplyIter iter;
+   MongoMessageReply *reply;
+   MongoMessageReply *copy;
+   MongoBsonIter child;
+   MongoBson *bson;
+   guint8 *data;
+   GList *list = NULL;
+   gsize length;
+   guint i;
+
+   for (i = 0; i < 10; i++) {
+      bson = mongo_bson_new_empty();
+      mongo_bson_append_int(bson, "i", i);
+      list = g_list_append(list, bson);
+   }
+
+   reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY, NULL);
+   mongo_message_reply_set_documents(reply, list);
+   data = mongo_message_save_to_data(MONGO_MESSAGE(reply), &length);
+   g_assert(data);
+   g_assert_cmpint(length, >, 16);
+
+   copy = g_object_new(MONGO_TYPE_MESSAGE_REPLY, NULL);
+   g_assert(mongo_message_load_from_data(MONGO_MESSAGE(copy),
+                                         data + 16,
+                                         length - 16));
+   g_assert_cmpint(mongo_message_reply_get_count(copy), ==, 10);
+
+   mongo_message_reply_iter_init(&iter, copy);
+   for (i = 0; mongo_message_reply_iter_next(&iter); i++) {
+      g_assert(mongo_message_reply_iter_recurse(&iter, &child));
+      g_assert(mongo_bson_iter_find(&child, "i"));
+      g_assert_cmpint(mongo_bson_iter_get_value_int(&child), ==, i);
+   }
+   g_assert_cmpint(i, ==, 10);
+
+   g_assert_cmpint(g_list_length(mongo_message_reply_get_documents(copy)),
+                   ==, 10);
+
+   g_object_unref(copy);
+   g_object_unref(reply);
+   g_free(data);
+   g_list_foreach(list, (GFunc)mongo_bson_unref, NULL);
+   g_list_free(list);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -29,5 +78,6 @@ main (gint   argc,
    g_type_init();
    g_test_init(&argc, &argv, NULL);
    g_test_add_func("/MongoMessageReply/new", test1);
+   g_test_add_func("/MongoMessageReply/iter", test2);
    return g_test_run();
 }
@@ -78,6 +78,86 @@ test_MongoOutputStream_write_message (void)
    mongo_write_concern_free(concern);
 }
 
+static void
+test_MongoOutputStream_coalesce_cb (GObject      *object,
+                                    GAsyncResult *result,
+                                    gpointer      user_data)
+{
+   gboolean ret;
+   GError *error = NULL;
+
+   ret = mongo_output_stream_write_message_finish(MONGO_OUTPUT_STREAM(object),
+                                                  result,
+                                                  &error);
+   g_assert_no_error(error);
+   g_assert(ret);
+
+   (*(guint *)user_data)++;
+}
+
+static void
+test_MongoOutputStream_coalesce (void)
+{
+   MongoOutputStream *output;
+   MongoWriteConcern *concern;
+   GOutputStream *memory;
+   MongoMessage *message;
+   MongoBson *q;
+   gboolean r;
+   gchar *capture;
+   gsize length;
+   gchar *capture2;
+   gsize length2;
+   guint count = 0;
+   guint i;
+
+   r = g_file_get_contents("tests/capture/100queries.dat", &capture, &length, NULL);
+   g_assert(r);
+
+   concern = mongo_write_concern_new_unsafe();
+
+   memory = g_memory_output_stream_new(NULL, 0, g_realloc, g_free);
+   output = g_object_new(MONGO_TYPE_OUTPUT_STREAM,
+                         "base-stream", memory,
+                         "next-request-id", 0,
+                         NULL);
+   q = mongo_bson_new_empty();
+
+   /*
+    * Queue all of the messages before iterating the main loop so that
+    * they are coalesced into as few writes as possible.
+    */
+   for (i = 0; i < 100; i++) {
+      message = g_object_new(MONGO_TYPE_MESSAGE_QUERY,
+                             "collection", "test.documents",
+                             "query", q,
+                             NULL);
+      mongo_output_stream_write_message_async(output,
+                                              message,
+                                              concern,
+                                              NULL,
+                                              test_MongoOutputStream_coalesce_cb,
+                                              &count);
+      g_object_unref(message);
+   }
+
+   while (count < 100) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   capture2 = g_memory_output_stream_get_data(G_MEMORY_OUTPUT_STREAM(memory));
+   length2 = g_memory_output_stream_get_data_size(G_MEMORY_OUTPUT_STREAM(memory));
+
+   g_assert_cmpint(length, ==, length2);
+   g_assert(compare_buffers(capture, capture2, length));
+
+   g_object_unref(memory);
+   g_object_unref(output);
+   mongo_bson_unref(q);
+   g_free(capture);
+   mongo_write_concern_free(concern);
+}
+
 static void
 test_MongoOutputStream_cancel_cb (GObject      *object,
                                   GAsyncResult *result,
@@ -135,6 +215,8 @@ main (gint   argc,
    g_test_init(&argc, &argv, NULL);
    g_test_add_func("/MongoOutputStream/write_message",
                    test_MongoOutputStream_write_message);
+   g_test_add_func("/MongoOutputStream/coalesce",
+                   test_MongoOutputStream_coalesce);
    g_test_add_func("/MongoOutputStream/cancel",
                    test_MongoOutputStream_cancel);
    return g_test_run();
@@ -1,8 +1,9 @@
-#include <mongo-glib/mongo-glib.h>
+#include <string.h>
 
-#ifdef G_DISABLE_ASSERT
-#undef G_DISABLE_ASSERT
-#endif
+#include "test-helper.h"
+
+#include <mongo-glib/mongo-glib.h>
+#include <gobject/gvaluecollector.h>
 
 #define PUMP_MAIN_LOOP \
    G_STMT_START { \
@@ -13,13 +14,10 @@
 
 static GMainLoop *gMainLoop;
 
-/*
- * TODO: Move this to shared private header.
- */
-struct _MongoServerPrivate
-{
-   GHashTable *client_contexts;
-};
+extern void _mongo_message_set_paused           (MongoMessage  *message,
+                                                 gboolean       _paused);
+extern void _mongo_protocol_set_last_request_id (MongoProtocol *protocol,
+                                                 guint32        last_request_id);
 
 static void
 failed_cb (MongoProtocol *protocol,
@@ -38,6 +36,113 @@ message_cb (MongoProtocol *protocol,
    (*count)++;
 }
 
+/*
+ * A MongoProtocol connected to a MongoServer on a random port.
+ */
+typedef struct
+{
+   MongoServer        *server;
+   GSocketClient      *client;
+   GSocketConnectable *connectable;
+   GSocketConnection  *connection;
+   MongoProtocol      *protocol;
+} ProtocolTest;
+
+static void
+setup_protocol (ProtocolTest *test,
+                const gchar  *first_property_name,
+                ...)
+{
+   GObjectClass *klass;
+   const gchar *names[16];
+   GValue values[16] = { G_VALUE_INIT };
+   const gchar *name;
+   GParamSpec *pspec;
+   va_list args;
+   gchar *error = NULL;
+   guint n_params = 1;
+   guint port;
+   guint i;
+
+   port = g_random_int_range(31000, 32000);
+   test->server = g_object_new(MONGO_TYPE_SERVER,
+                               "listen-backlog", 10,
+                               NULL);
+   g_socket_listener_add_inet_port(G_SOCKET_LISTENER(test->server),
+                                   port,
+                                   NULL,
+                                   NULL);
+   g_socket_service_start(G_SOCKET_SERVICE(test->server));
+
+   test->client = g_socket_client_new();
+   test->connectable = g_network_address_new("localhost", port);
+   test->connection = g_socket_client_connect(test->client,
+                                              test->connectable,
+                                              NULL,
+                                              NULL);
+   g_assert(test->connection);
+
+   /*
+    * Many of the properties are construct-only, so collect them all
+    * to be passed at construction.
+    */
+   klass = g_type_class_ref(MONGO_TYPE_PROTOCOL);
+
+   names[0] = "io-stream";
+   g_value_init(&values[0], G_TYPE_IO_STREAM);
+   g_value_set_object(&values[0], test->connection);
+
+   va_start(args, first_property_name);
+   for (name = first_property_name; name; name = va_arg(args, const gchar *)) {
+      g_assert_cmpint(n_params, <, G_N_ELEMENTS(values));
+      pspec = g_object_class_find_property(klass, name);
+      g_assert(pspec);
+      names[n_params] = name;
+      G_VALUE_COLLECT_INIT(&values[n_params], pspec->value_type,
+                           args, 0, &error);
+      g_assert_cmpstr(error, ==, NULL);
+      n_params++;
+   }
+   va_end(args);
+
+#if GLIB_CHECK_VERSION(2, 54, 0)
+   test->protocol = (MongoProtocol *)
+      g_object_new_with_properties(MONGO_TYPE_PROTOCOL, n_params,
+                                   names, values);
+#else
+   {
+      GParameter params[G_N_ELEMENTS(values)];
+
+      for (i = 0; i < n_params; i++) {
+         params[i].name = names[i];
+         params[i].value = values[i];
+      }
+
+      test->protocol = g_object_newv(MONGO_TYPE_PROTOCOL, n_params, params);
+   }
+#endif
+
+   for (i = 0; i < n_params; i++) {
+      g_value_unset(&values[i]);
+   }
+
+   g_type_class_unref(klass);
+}
+
+static void
+teardown_protocol (ProtocolTest *test)
+{
+   g_socket_service_stop(G_SOCKET_SERVICE(test->server));
+
+   g_object_unref(test->protocol);
+   g_object_unref(test->connection);
+   g_object_unref(test->connectable);
+   g_object_unref(test->client);
+   g_object_unref(test->server);
+
+   PUMP_MAIN_LOOP;
+}
+
 static void
 test_MongoProtocol_replies (void)
 {
@@ -238,6 +343,764 @@ test_MongoProtocol_replies (void)
    g_assert(!server);
 }
 
+static void
+unsafe_insert_cb (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+   gboolean *done = user_data;
+   GError *error = NULL;
+   gboolean r;
+
+   r = mongo_protocol_insert_finish(MONGO_PROTOCOL(object), result, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+
+   *done = TRUE;
+}
+
+static void
+test_MongoProtocol_unsafe_insert (void)
+{
+   ProtocolTest test;
+   MongoBson *doc;
+   gboolean done = FALSE;
+
+   setup_protocol(&test,
+                  "safe", FALSE,
+                  NULL);
+
+   /*
+    * Nobody will reply, so this only completes if no getlasterror
+    * is waited on.
+    */
+   doc = mongo_bson_new();
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, &doc, 1, NULL,
+                               unsafe_insert_cb, &done);
+   mongo_bson_unref(doc);
+
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 0);
+
+   while (!done) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   teardown_protocol(&test);
+}
+
+static gboolean
+large_insert_cb (MongoServer        *server,
+                 MongoClientContext *client,
+                 MongoMessage       *message,
+                 gpointer            user_data)
+{
+   MongoBson **received = user_data;
+   GList *docs;
+
+   docs = mongo_message_insert_get_documents(MONGO_MESSAGE_INSERT(message));
+   g_assert_cmpint(g_list_length(docs), ==, 1);
+   *received = mongo_bson_dup(docs->data);
+
+   return TRUE;
+}
+
+static void
+test_MongoProtocol_large_insert (void)
+{
+   ProtocolTest test;
+   MongoBson *received = NULL;
+   MongoBson *expected;
+   MongoBson *doc;
+   gboolean done = FALSE;
+   gchar *str;
+
+   setup_protocol(&test,
+                  "safe", FALSE,
+                  NULL);
+   g_signal_connect(test.server, "request-insert",
+                    G_CALLBACK(large_insert_cb), &received);
+
+   /*
+    * Large documents are sent without being copied, so changing the
+    * document after submitting it must not change what goes out.
+    */
+   str = g_strnfill(4096, 'a');
+   doc = mongo_bson_new_empty();
+   mongo_bson_append_string(doc, "key", str);
+   expected = mongo_bson_dup(doc);
+
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, &doc, 1, NULL,
+                               unsafe_insert_cb, &done);
+   mongo_bson_append_string(doc, "more", str);
+   mongo_bson_unref(doc);
+   g_free(str);
+
+   while (!done || !received) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   g_assert_cmpint(received->len, ==, expected->len);
+   g_assert(!memcmp(received->data, expected->data, expected->len));
+
+   mongo_bson_unref(expected);
+   mongo_bson_unref(received);
+
+   teardown_protocol(&test);
+}
+
+static void
+batched_insert_cb (GObject      *object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+   guint *n_failed = user_data;
+   GError *error = NULL;
+   gboolean r;
+
+   r = mongo_protocol_insert_finish(MONGO_PROTOCOL(object), result, &error);
+   g_assert_error(error, MONGO_PROTOCOL_ERROR, MONGO_PROTOCOL_ERROR_UNEXPECTED);
+   g_assert(!r);
+   g_error_free(error);
+
+   (*n_failed)++;
+}
+
+static void
+test_MongoProtocol_write_batch (void)
+{
+   ProtocolTest test;
+   MongoBson *doc;
+   guint n_failed = 0;
+   guint i;
+
+   setup_protocol(&test,
+                  "write-batch-size", 3,
+                  NULL);
+
+   doc = mongo_bson_new();
+   for (i = 0; i < 3; i++) {
+      mongo_protocol_insert_async(test.protocol, "db.collection",
+                                  MONGO_INSERT_NONE, &doc, 1, NULL,
+                                  batched_insert_cb, &n_failed);
+   }
+   mongo_bson_unref(doc);
+
+   /*
+    * A full batch is acknowledged by a single getlasterror.
+    */
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 1);
+
+   /*
+    * Nobody will reply, so fail the protocol and make sure the error
+    * reaches every write in the batch.
+    */
+   mongo_protocol_fail(test.protocol, NULL);
+   while (n_failed < 3) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   teardown_protocol(&test);
+}
+
+static void
+split_insert_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+   guint *n_completed = user_data;
+   GError *error = NULL;
+   gboolean r;
+
+   r = mongo_protocol_insert_finish(MONGO_PROTOCOL(object), result, &error);
+   g_assert_error(error, MONGO_PROTOCOL_ERROR, MONGO_PROTOCOL_ERROR_UNEXPECTED);
+   g_assert(!r);
+   g_error_free(error);
+
+   (*n_completed)++;
+}
+
+static void
+too_large_insert_cb (GObject      *object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+   gboolean *done = user_data;
+   GError *error = NULL;
+   gboolean r;
+
+   r = mongo_protocol_insert_finish(MONGO_PROTOCOL(object), result, &error);
+   g_assert_error(error, MONGO_PROTOCOL_ERROR, MONGO_PROTOCOL_ERROR_TOO_LARGE);
+   g_assert(!r);
+   g_error_free(error);
+
+   *done = TRUE;
+}
+
+static void
+test_MongoProtocol_split_insert (void)
+{
+   ProtocolTest test;
+   MongoBson *docs[3];
+   gboolean done = FALSE;
+   guint n_completed = 0;
+   guint i;
+
+   setup_protocol(&test,
+                  "max-bson-size", 64,
+                  "max-message-size", 100,
+                  NULL);
+
+   for (i = 0; i < G_N_ELEMENTS(docs); i++) {
+      docs[i] = mongo_bson_new_empty();
+      mongo_bson_append_string(docs[i], "key", "0123456789012345678901234");
+   }
+
+   /*
+    * Only one document fits in each message, so each gets its own
+    * getlasterror.
+    */
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, docs, G_N_ELEMENTS(docs), NULL,
+                               split_insert_cb, &n_completed);
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 3);
+
+   mongo_bson_append_string(docs[0], "more", "0123456789012345678901234");
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, docs, 1, NULL,
+                               too_large_insert_cb, &done);
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 3);
+
+   for (i = 0; i < G_N_ELEMENTS(docs); i++) {
+      mongo_bson_unref(docs[i]);
+   }
+
+   while (!done) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   /*
+    * Nobody will reply, so fail the protocol and make sure the split
+    * insert completes exactly once.
+    */
+   mongo_protocol_fail(test.protocol, NULL);
+   PUMP_MAIN_LOOP;
+   g_assert_cmpint(n_completed, ==, 1);
+
+   teardown_protocol(&test);
+}
+
+static void
+wait_writable_cb (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+   gboolean *done = user_data;
+   GError *error = NULL;
+   gboolean r;
+
+   r = mongo_protocol_wait_writable_finish(MONGO_PROTOCOL(object),
+                                           result, &error);
+   g_assert_error(error, MONGO_PROTOCOL_ERROR, MONGO_PROTOCOL_ERROR_UNEXPECTED);
+   g_assert(!r);
+   g_error_free(error);
+
+   *done = TRUE;
+}
+
+static void
+test_MongoProtocol_congested (void)
+{
+   ProtocolTest test;
+   MongoBson *doc;
+   gboolean done = FALSE;
+   guint n_failed = 0;
+
+   setup_protocol(&test,
+                  "pending-high-watermark", 2,
+                  "pending-low-watermark", 1,
+                  NULL);
+
+   doc = mongo_bson_new();
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, &doc, 1, NULL,
+                               batched_insert_cb, &n_failed);
+   g_assert(!mongo_protocol_get_congested(test.protocol));
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, &doc, 1, NULL,
+                               batched_insert_cb, &n_failed);
+   g_assert(mongo_protocol_get_congested(test.protocol));
+   mongo_bson_unref(doc);
+
+   /*
+    * Nobody will reply, so the waiter only completes once the protocol
+    * fails.
+    */
+   mongo_protocol_wait_writable_async(test.protocol, NULL,
+                                      wait_writable_cb, &done);
+   PUMP_MAIN_LOOP;
+   g_assert(!done);
+
+   mongo_protocol_fail(test.protocol, NULL);
+   while (!done || n_failed < 2) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   teardown_protocol(&test);
+}
+
+static void
+timeout_insert_cb (GObject      *object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+   gboolean *done = user_data;
+   GError *error = NULL;
+   gboolean r;
+
+   r = mongo_protocol_insert_finish(MONGO_PROTOCOL(object), result, &error);
+   g_assert_error(error, MONGO_PROTOCOL_ERROR, MONGO_PROTOCOL_ERROR_TIMEOUT);
+   g_assert(!r);
+   g_error_free(error);
+
+   *done = TRUE;
+}
+
+static void
+test_MongoProtocol_request_timeout (void)
+{
+   ProtocolTest test;
+   MongoBson *doc;
+   gboolean done = FALSE;
+
+   setup_protocol(&test,
+                  "request-timeout", 50,
+                  NULL);
+
+   /*
+    * Nobody will reply, so the insert must fail once its deadline passes.
+    */
+   doc = mongo_bson_new();
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, &doc, 1, NULL,
+                               timeout_insert_cb, &done);
+   mongo_bson_unref(doc);
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 1);
+
+   while (!done) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 0);
+
+   teardown_protocol(&test);
+}
+
+static void
+query_cb (GObject      *object,
+          GAsyncResult *result,
+          gpointer      user_data)
+{
+   MongoMessageReply *reply;
+   guint *n_completed = user_data;
+   GError *error = NULL;
+
+   reply = mongo_protocol_query_finish(MONGO_PROTOCOL(object), result, &error);
+   g_assert_no_error(error);
+   g_assert(reply);
+   g_object_unref(reply);
+
+   (*n_completed)++;
+}
+
+static gboolean
+reply_query_cb (MongoServer        *server,
+                MongoClientContext *client,
+                MongoMessage       *message,
+                GArray             *request_ids)
+{
+   MongoBson *bson;
+   gint32 request_id;
+
+   request_id = mongo_message_get_request_id(message);
+   g_array_append_val(request_ids, request_id);
+
+   bson = mongo_bson_new_empty();
+   mongo_message_set_reply_bson(message, MONGO_REPLY_NONE, bson);
+   mongo_bson_unref(bson);
+
+   return TRUE;
+}
+
+static void
+test_MongoProtocol_request_id_wrap (void)
+{
+   ProtocolTest test;
+   MongoBson *query;
+   GArray *request_ids;
+   guint n_completed = 0;
+   guint i;
+
+   setup_protocol(&test, NULL);
+   request_ids = g_array_new(FALSE, FALSE, sizeof(gint32));
+   g_signal_connect(test.server, "request-query",
+                    G_CALLBACK(reply_query_cb), request_ids);
+
+   /*
+    * Request ids wrap from G_MAXINT32 back to 1 while requests on
+    * either side of the wrap are pending.
+    */
+   _mongo_protocol_set_last_request_id(test.protocol, G_MAXINT32 - 2);
+
+   query = mongo_bson_new_empty();
+   for (i = 0; i < 5; i++) {
+      mongo_protocol_query_async(test.protocol, "db.collection",
+                                 MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                 query_cb, &n_completed);
+   }
+   mongo_bson_unref(query);
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 5);
+
+   while (n_completed < 5) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 0);
+   g_assert_cmpint(request_ids->len, ==, 5);
+   g_assert_cmpint(g_array_index(request_ids, gint32, 0), ==, G_MAXINT32 - 1);
+   g_assert_cmpint(g_array_index(request_ids, gint32, 1), ==, G_MAXINT32);
+   g_assert_cmpint(g_array_index(request_ids, gint32, 2), ==, 1);
+   g_assert_cmpint(g_array_index(request_ids, gint32, 3), ==, 2);
+   g_assert_cmpint(g_array_index(request_ids, gint32, 4), ==, 3);
+
+   g_array_unref(request_ids);
+
+   teardown_protocol(&test);
+}
+
+static gboolean
+hold_query_cb (MongoServer        *server,
+               MongoClientContext *client,
+               MongoMessage       *message,
+               gint32             *held_request_id)
+{
+   MongoBson *bson;
+
+   /*
+    * Leave the first query unanswered and reply to the rest.
+    */
+   if (!*held_request_id) {
+      *held_request_id = mongo_message_get_request_id(message);
+      _mongo_message_set_paused(message, TRUE);
+      return TRUE;
+   }
+
+   bson = mongo_bson_new_empty();
+   mongo_message_set_reply_bson(message, MONGO_REPLY_NONE, bson);
+   mongo_bson_unref(bson);
+
+   return TRUE;
+}
+
+static void
+test_MongoProtocol_straggler (void)
+{
+   GHashTableIter iter;
+   MongoMessage *reply;
+   ProtocolTest test;
+   MongoBson *query;
+   GIOStream *key;
+   GError *error = NULL;
+   gboolean r;
+   guint8 *buf;
+   gint32 held_request_id = 0;
+   gsize buflen;
+   gsize written;
+   guint n_completed = 0;
+   guint i;
+
+   setup_protocol(&test, NULL);
+   g_signal_connect(test.server, "request-query",
+                    G_CALLBACK(hold_query_cb), &held_request_id);
+
+   /*
+    * The replies to the later queries span far more request ids than
+    * the pending ring holds while the first one is still outstanding.
+    */
+   query = mongo_bson_new_empty();
+   for (i = 0; i < 5001; i++) {
+      mongo_protocol_query_async(test.protocol, "db.collection",
+                                 MONGO_QUERY_NONE, 0, 1, query, NULL, NULL,
+                                 query_cb, &n_completed);
+   }
+   mongo_bson_unref(query);
+
+   while (n_completed < 5000) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   g_assert(held_request_id);
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 1);
+
+   /*
+    * A late reply must still find the first query.
+    */
+   g_hash_table_iter_init(&iter, test.server->priv->client_contexts);
+   g_assert(g_hash_table_iter_next(&iter, (gpointer *)&key, NULL));
+
+   reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                        "cursor-id", G_GUINT64_CONSTANT(0),
+                        "flags", MONGO_REPLY_NONE,
+                        "offset", 0,
+                        "request-id", 1,
+                        "response-to", held_request_id,
+                        NULL);
+   buf = mongo_message_save_to_data(reply, &buflen);
+   r = g_output_stream_write_all(g_io_stream_get_output_stream(key),
+                                 buf,
+                                 buflen,
+                                 &written,
+                                 NULL,
+                                 &error);
+   g_assert_no_error(error);
+   g_assert(r);
+   g_output_stream_flush(g_io_stream_get_output_stream(key), NULL, NULL);
+   g_free(buf);
+   g_object_unref(reply);
+
+   while (n_completed < 5001) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 0);
+
+   teardown_protocol(&test);
+}
+
+static void
+timeout_failed_cb (MongoProtocol *protocol,
+                   const GError  *error,
+                   gboolean      *failed)
+{
+   g_assert_error(error, MONGO_PROTOCOL_ERROR, MONGO_PROTOCOL_ERROR_TIMEOUT);
+   *failed = TRUE;
+}
+
+static gboolean
+timeout_warning_cb (const gchar    *log_domain,
+                    GLogLevelFlags  log_level,
+                    const gchar    *message,
+                    gpointer        user_data)
+{
+   /*
+    * Failing the protocol warns, which is expected here.
+    */
+   return !strstr(message, "No reply was received");
+}
+
+static void
+test_MongoProtocol_close_on_timeout (void)
+{
+   ProtocolTest test;
+   MongoBson *doc;
+   gboolean done1 = FALSE;
+   gboolean done2 = FALSE;
+   gboolean failed = FALSE;
+
+   setup_protocol(&test,
+                  "close-on-timeout", TRUE,
+                  "request-timeout", 50,
+                  NULL);
+   g_signal_connect(test.protocol, "failed",
+                    G_CALLBACK(timeout_failed_cb), &failed);
+   g_test_log_set_fatal_handler(timeout_warning_cb, NULL);
+
+   /*
+    * Nobody will reply, so the first deadline fails the whole protocol
+    * and every request with it.
+    */
+   doc = mongo_bson_new();
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, &doc, 1, NULL,
+                               timeout_insert_cb, &done1);
+   mongo_protocol_insert_async(test.protocol, "db.collection",
+                               MONGO_INSERT_NONE, &doc, 1, NULL,
+                               timeout_insert_cb, &done2);
+   mongo_bson_unref(doc);
+
+   while (!done1 || !done2) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   g_assert(failed);
+   g_assert_cmpint(mongo_protocol_get_n_pending(test.protocol), ==, 0);
+
+   g_test_log_set_fatal_handler(NULL, NULL);
+
+   teardown_protocol(&test);
+}
+
+static void
+saturated_insert_cb (GObject      *object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+   guint *n_completed = user_data;
+   GError *error = NULL;
+   gboolean r;
+
+   r = mongo_protocol_insert_finish(MONGO_PROTOCOL(object), result, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+
+   (*n_completed)++;
+}
+
+static void
+saturated_writable_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+   gboolean *done = user_data;
+   GError *error = NULL;
+   gboolean r;
+
+   r = mongo_protocol_wait_writable_finish(MONGO_PROTOCOL(object),
+                                           result, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+
+   *done = TRUE;
+}
+
+static void saturated_read_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data);
+
+static void
+saturated_read (GInputStream *input,
+                GCancellable *cancellable)
+{
+   static guint8 buffer[65536];
+
+   g_input_stream_read_async(input, buffer, sizeof buffer,
+                             G_PRIORITY_DEFAULT, cancellable,
+                             saturated_read_cb, cancellable);
+}
+
+static void
+saturated_read_cb (GObject      *object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+   GInputStream *input = (GInputStream *)object;
+
+   if (g_input_stream_read_finish(input, result, NULL) > 0) {
+      saturated_read(input, user_data);
+   }
+}
+
+static void
+test_MongoProtocol_saturated (void)
+{
+   GSocketConnectable *connectable;
+   GSocketConnection *connection;
+   GSocketConnection *peer;
+   GSocketListener *listener;
+   MongoProtocol *protocol;
+   GSocketClient *client;
+   GCancellable *cancellable;
+   GInputStream *input;
+   MongoBson *doc;
+   GError *error = NULL;
+   gboolean done = FALSE;
+   guint n_completed = 0;
+   gint64 begin;
+   gchar *str;
+   guint port;
+   guint i;
+
+   /*
+    * The listener never accepts, so nothing reads what is sent until the
+    * kernel buffers are full.
+    */
+   port = g_random_int_range(32000, 33000);
+   listener = g_socket_listener_new();
+   g_assert(g_socket_listener_add_inet_port(listener, port, NULL, NULL));
+
+   client = g_socket_client_new();
+   connectable = g_network_address_new("localhost", port);
+   connection = g_socket_client_connect(client, connectable, NULL, NULL);
+   g_assert(connection);
+
+   protocol = g_object_new(MONGO_TYPE_PROTOCOL,
+                           "io-stream", connection,
+                           "safe", FALSE,
+                           "send-high-watermark", (guint64)(1024 * 1024),
+                           "send-low-watermark", (guint64)0,
+                           NULL);
+
+   str = g_strnfill(256 * 1024, 'a');
+   doc = mongo_bson_new_empty();
+   mongo_bson_append_string(doc, "key", str);
+   g_free(str);
+
+   /*
+    * Submitting far more than the socket can hold must not block.
+    */
+   begin = g_get_monotonic_time();
+   for (i = 0; i < 128; i++) {
+      mongo_protocol_insert_async(protocol, "db.collection",
+                                  MONGO_INSERT_NONE, &doc, 1, NULL,
+                                  saturated_insert_cb, &n_completed);
+   }
+   g_assert_cmpint(g_get_monotonic_time() - begin, <, G_USEC_PER_SEC);
+   mongo_bson_unref(doc);
+
+   PUMP_MAIN_LOOP;
+
+   g_assert_cmpint(n_completed, ==, 128);
+   g_assert_cmpint(mongo_protocol_get_send_queued(protocol), >, 0);
+   g_assert(mongo_protocol_get_congested(protocol));
+
+   mongo_protocol_wait_writable_async(protocol, NULL,
+                                      saturated_writable_cb, &done);
+   PUMP_MAIN_LOOP;
+   g_assert(!done);
+
+   /*
+    * Once the peer starts reading, the queue drains on its own.
+    */
+   peer = g_socket_listener_accept(listener, NULL, NULL, &error);
+   g_assert_no_error(error);
+   g_assert(peer);
+
+   cancellable = g_cancellable_new();
+   input = g_io_stream_get_input_stream(G_IO_STREAM(peer));
+   saturated_read(input, cancellable);
+
+   while (!done || mongo_protocol_get_send_queued(protocol)) {
+      g_main_context_iteration(g_main_context_default(), TRUE);
+   }
+
+   g_assert(!mongo_protocol_get_congested(protocol));
+
+   g_cancellable_cancel(cancellable);
+   PUMP_MAIN_LOOP;
+
+   g_object_unref(protocol);
+   g_object_unref(cancellable);
+   g_object_unref(peer);
+   g_object_unref(connection);
+   g_object_unref(connectable);
+   g_object_unref(client);
+   g_socket_listener_close(listener);
+   g_object_unref(listener);
+
+   PUMP_MAIN_LOOP;
+}
+
 gint
 main (gint argc,
       gchar *argv[])
@@ -246,5 +1109,25 @@ main (gint argc,
    g_test_init(&argc, &argv, NULL);
    gMainLoop = g_main_loop_new(NULL, FALSE);
    g_test_add_func("/MongoProtocol/replies", test_MongoProtocol_replies);
+   g_test_add_func("/MongoProtocol/unsafe_insert",
+                   test_MongoProtocol_unsafe_insert);
+   g_test_add_func("/MongoProtocol/large_insert",
+                   test_MongoProtocol_large_insert);
+   g_test_add_func("/MongoProtocol/write_batch",
+                   test_MongoProtocol_write_batch);
+   g_test_add_func("/MongoProtocol/split_insert",
+                   test_MongoProtocol_split_insert);
+   g_test_add_func("/MongoProtocol/congested",
+                   test_MongoProtocol_congested);
+   g_test_add_func("/MongoProtocol/request_timeout",
+                   test_MongoProtocol_request_timeout);
+   g_test_add_func("/MongoProtocol/close_on_timeout",
+                   test_MongoProtocol_close_on_timeout);
+   g_test_add_func("/MongoProtocol/request_id_wrap",
+                   test_MongoProtocol_request_id_wrap);
+   g_test_add_func("/MongoProtocol/straggler",
+                   test_MongoProtocol_straggler);
+   g_test_add_func("/MongoProtocol/saturated",
+                   test_MongoProtocol_saturated);
    return g_test_run();
 }
@@ -0,0 +1,142 @@
+#include "test-helper.h"
+
+#include <mongo-glib/mongo-glib.h>
+#include <mongo-glib/mongo-source.h>
+
+#define N_THREADS 4
+#define N_RESULTS 1000
+
+extern guint _mongo_source_get_n_context_sources (void);
+
+typedef struct
+{
+   MongoSource        *source;
+   GSimpleAsyncResult *results[N_RESULTS];
+} Producer;
+
+static guint gCompleted[N_THREADS];
+
+static void
+complete_cb (GObject      *object,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+   guint thread = GPOINTER_TO_UINT(user_data) / N_RESULTS;
+   guint seq = GPOINTER_TO_UINT(user_data) % N_RESULTS;
+
+   /*
+    * Results queued by one thread complete in the order they were
+    * queued.
+    */
+   g_assert_cmpint(seq, ==, gCompleted[thread]);
+   gCompleted[thread]++;
+}
+
+static gpointer
+producer_thread (gpointer data)
+{
+   Producer *producer = data;
+   guint i;
+
+   for (i = 0; i < N_RESULTS; i++) {
+      mongo_source_complete_in_idle(producer->source, producer->results[i]);
+      g_object_unref(producer->results[i]);
+   }
+
+   return NULL;
+}
+
+static void
+test_MongoSource_threads (void)
+{
+   GMainContext *context;
+   MongoSource *source;
+   Producer producers[N_THREADS];
+   GThread *threads[N_THREADS];
+   guint i;
+   guint j;
+
+   context = g_main_context_new();
+   source = mongo_source_new();
+   g_source_attach((GSource *)source, context);
+
+   /*
+    * Results must be created in the context they complete in.
+    */
+   g_main_context_push_thread_default(context);
+
+   for (i = 0; i < N_THREADS; i++) {
+      producers[i].source = source;
+      for (j = 0; j < N_RESULTS; j++) {
+         producers[i].results[j] =
+            g_simple_async_result_new(NULL, complete_cb,
+                                      GUINT_TO_POINTER(i * N_RESULTS + j),
+                                      test_MongoSource_threads);
+      }
+   }
+
+   for (i = 0; i < N_THREADS; i++) {
+      threads[i] = g_thread_new("producer", producer_thread, &producers[i]);
+   }
+
+   for (i = 0; i < N_THREADS; i++) {
+      g_thread_join(threads[i]);
+   }
+
+   /*
+    * A single dispatch completes everything queued so far.
+    */
+   g_assert(g_main_context_iteration(context, FALSE));
+   for (i = 0; i < N_THREADS; i++) {
+      g_assert_cmpint(gCompleted[i], ==, N_RESULTS);
+   }
+   g_assert(!g_main_context_pending(context));
+
+   g_main_context_pop_thread_default(context);
+
+   g_source_destroy((GSource *)source);
+   g_source_unref((GSource *)source);
+   g_main_context_unref(context);
+}
+
+static void
+test_MongoSource_context (void)
+{
+   GMainContext *context;
+   MongoSource *source;
+   guint n_sources;
+
+   n_sources = _mongo_source_get_n_context_sources();
+
+   /*
+    * A context gets one shared source, which is forgotten when the
+    * context is freed.
+    */
+   context = g_main_context_new();
+   source = mongo_source_get_for_context(context);
+   g_assert(source);
+   g_assert(g_source_get_context((GSource *)source) == context);
+   g_assert(mongo_source_get_for_context(context) == source);
+   g_assert_cmpint(_mongo_source_get_n_context_sources(), ==, n_sources + 1);
+
+   g_main_context_unref(context);
+   g_assert_cmpint(_mongo_source_get_n_context_sources(), ==, n_sources);
+
+   /*
+    * The default context uses the global source.
+    */
+   g_assert(mongo_source_get_for_context(NULL) ==
+            mongo_source_get_for_context(g_main_context_default()));
+   g_assert_cmpint(_mongo_source_get_n_context_sources(), ==, n_sources);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/MongoSource/threads", test_MongoSource_threads);
+   g_test_add_func("/MongoSource/context", test_MongoSource_context);
+   return g_test_run();
+}